@@ -1,6 +1,30 @@
 import os
 import csv
 
+# merge two log-linear histograms by adding their counts bucket by bucket
+def mergeHistograms(a, b):
+    for i in range(len(a), len(b)):
+        a += [0]
+    for i in range(len(b)):
+        a[i] += b[i]
+    return a
+
+# read an optional line of numbers, each converted with parse; files
+# published by older versions only have the first three lines
+def readOptionalLine(reader, parse):
+    try:
+        return [parse(x) for x in next(reader)]
+    except StopIteration:
+        return []
+
+# histograms hold integer counts per bucket
+def readHistogram(reader):
+    return readOptionalLine(reader, int)
+
+# inbound and outbound counts are bucket means, published as floats
+def readCounts(reader):
+    return readOptionalLine(reader, float)
+
 directory = os.path.dirname(os.path.realpath(__file__)) + '/..'
 
 for filename in os.listdir(directory + '/published/'):
@@ -15,10 +39,18 @@ for filename in os.listdir(directory + '/published/'):
             aggregateTimeProfiles = [int(x) for x in next(reader)];
             aggregateTotalCounts = [float(x) for x in next(reader)];
             aggregateTimeStdevs = [float(x) for x in next(reader)];
+            aggregateRateHist = readHistogram(reader);
+            aggregateBurstHist = readHistogram(reader);
+            aggregateInboundCounts = readCounts(reader);
+            aggregateOutboundCounts = readCounts(reader);
     except IOError:
         aggregateTimeProfiles = []
         aggregateTotalCounts = []
         aggregateTimeStdevs = []
+        aggregateRateHist = []
+        aggregateBurstHist = []
+        aggregateInboundCounts = []
+        aggregateOutboundCounts = []
 
     # open each new published file
     with open(directory + '/published/' + filename, 'rb') as csvfile:
@@ -26,6 +58,10 @@ for filename in os.listdir(directory + '/published/'):
         timeProfiles = [int(x) for x in next(reader)];
         totalCounts = [float(x) for x in next(reader)];
         timeStdevs = [float(x) for x in next(reader)];
+        rateHist = readHistogram(reader);
+        burstHist = readHistogram(reader);
+        inboundCounts = readCounts(reader);
+        outboundCounts = readCounts(reader);
 
     # add new published results to the aggregate
     for i in range(len(aggregateTimeProfiles), len(timeProfiles)):
@@ -34,9 +70,15 @@ for filename in os.listdir(directory + '/published/'):
         aggregateTimeProfiles[i] += timeProfiles[i]
     aggregateTotalCounts += totalCounts
     aggregateTimeStdevs += timeStdevs
+    aggregateRateHist = mergeHistograms(aggregateRateHist, rateHist)
+    aggregateBurstHist = mergeHistograms(aggregateBurstHist, burstHist)
+    aggregateInboundCounts += inboundCounts
+    aggregateOutboundCounts += outboundCounts
 
     list.sort(aggregateTotalCounts)
     list.sort(aggregateTimeStdevs)
+    list.sort(aggregateInboundCounts)
+    list.sort(aggregateOutboundCounts)
 
     # overwrite aggregate data
     with open(directory + '/aggregate/' + group, 'wb') as csvfile:
@@ -44,3 +86,7 @@ for filename in os.listdir(directory + '/published/'):
         writer.writerow(aggregateTimeProfiles);
         writer.writerow(aggregateTotalCounts);
         writer.writerow(aggregateTimeStdevs);
+        writer.writerow(aggregateRateHist);
+        writer.writerow(aggregateBurstHist);
+        writer.writerow(aggregateInboundCounts);
+        writer.writerow(aggregateOutboundCounts);
@@ -77,6 +77,7 @@ ENABLE_GCC_WARNING(redundant-decls)
 #include "util.h"
 #include "container.h"
 #include "compat.h"
+#include "ctassert.h"
 #include "sandbox.h"
 #include "util_format.h"
 
@@ -103,12 +104,21 @@ ENABLE_GCC_WARNING(redundant-decls)
 #define NEW_THREAD_API
 #endif /* OPENSSL_VERSION_NUMBER >= OPENSSL_VER(1,1,0,0,5) && ... */
 
+#if OPENSSL_VERSION_NUMBER >= OPENSSL_V_SERIES(1,1,1) && \
+  !defined(LIBRESSL_VERSION_NUMBER)
+/* OpenSSL 1.1.1 and later implement SHA3, with assembly Keccak backends that
+ * it chooses between at runtime based on the CPU. */
+#define HAVE_EVP_SHA3
+#endif
+
 /** Longest recognized */
 #define MAX_DNS_LABEL_SIZE 63
 
 /** Largest strong entropy request */
 #define MAX_STRONGEST_RAND_SIZE 256
 
+static void evaluate_evp_for_sha3(void);
+
 #ifndef NEW_THREAD_API
 /** A number of preallocated mutexes for use by OpenSSL. */
 static tor_mutex_t **openssl_mutexes_ = NULL;
@@ -424,6 +434,9 @@ crypto_global_init(int useAccel, const char *accelName, const char *accelDir)
 
     evaluate_evp_for_aes(-1);
     evaluate_ctr_for_aes();
+    evaluate_evp_for_sha3();
+
+    crypto_fast_rng_global_init();
   }
   return 0;
 }
@@ -435,6 +448,7 @@ crypto_thread_cleanup(void)
 #ifndef NEW_THREAD_API
   ERR_remove_thread_state(NULL);
 #endif
+  destroy_thread_fast_rng();
 }
 
 /** used internally: quicly validate a crypto_pk_t object as a private key.
@@ -1706,6 +1720,10 @@ crypto_cipher_decrypt_with_iv(const char *key,
 
 /* SHA-1 */
 
+/* Note that OpenSSL's SHA1 and SHA2 functions already pick the fastest
+ * implementation (SHA-NI, AVX2, ...) for the running CPU, so we call them
+ * directly. */
+
 /** Compute the SHA1 digest of the <b>len</b> bytes on data stored in
  * <b>m</b>.  Write the DIGEST_LEN byte result into <b>digest</b>.
  * Return 0 on success, -1 on failure.
@@ -1720,6 +1738,101 @@ crypto_digest(char *digest, const char *m, size_t len)
   return 0;
 }
 
+/** One-shot SHA3 inputs at least this long go to OpenSSL when we can use it.
+ * Below this, keccak-tiny is about as fast, and doesn't pay for setting up
+ * an EVP context. */
+#define SHA3_EVP_MIN_LEN 512
+
+#ifdef HAVE_EVP_SHA3
+/** OpenSSL's SHA3-256 and SHA3-512, or NULL if we aren't using them. */
+static EVP_MD *sha3_256_evp = NULL;
+static EVP_MD *sha3_512_evp = NULL;
+
+/** Release our references to OpenSSL's SHA3 implementations. */
+static void
+sha3_evp_free(void)
+{
+#if OPENSSL_VERSION_NUMBER >= OPENSSL_V_SERIES(3,0,0)
+  EVP_MD_free(sha3_256_evp);
+  EVP_MD_free(sha3_512_evp);
+#endif
+  sha3_256_evp = sha3_512_evp = NULL;
+}
+
+/** Return OpenSSL's implementation of the digest called <b>name</b>, or
+ * NULL if it has none. */
+static EVP_MD *
+sha3_evp_fetch(const char *name)
+{
+#if OPENSSL_VERSION_NUMBER >= OPENSSL_V_SERIES(3,0,0)
+  /* Fetch once, so that we don't repeat the provider lookup per digest. */
+  return EVP_MD_fetch(NULL, name, NULL);
+#else
+  return (EVP_MD *) EVP_get_digestbyname(name);
+#endif
+}
+#endif /* defined(HAVE_EVP_SHA3) */
+
+/** Decide whether to hand long SHA3 inputs to OpenSSL instead of
+ * keccak-tiny.  We only do so if OpenSSL has SHA3 and agrees with
+ * keccak-tiny on a test input that spans several blocks. */
+static void
+evaluate_evp_for_sha3(void)
+{
+#ifdef HAVE_EVP_SHA3
+  uint8_t msg[SHA3_EVP_MIN_LEN * 2 + 7];
+  uint8_t expected[DIGEST512_LEN], actual[DIGEST512_LEN];
+  unsigned i;
+
+  sha3_evp_free();
+  sha3_256_evp = sha3_evp_fetch("SHA3-256");
+  sha3_512_evp = sha3_evp_fetch("SHA3-512");
+  if (!sha3_256_evp || !sha3_512_evp)
+    goto fail;
+
+  for (i = 0; i < sizeof(msg); ++i)
+    msg[i] = (uint8_t)(i * 131 + 7);
+
+  sha3_256(expected, DIGEST256_LEN, msg, sizeof(msg));
+  if (!EVP_Digest(msg, sizeof(msg), actual, NULL, sha3_256_evp, NULL) ||
+      fast_memneq(expected, actual, DIGEST256_LEN))
+    goto fail;
+  sha3_512(expected, DIGEST512_LEN, msg, sizeof(msg));
+  if (!EVP_Digest(msg, sizeof(msg), actual, NULL, sha3_512_evp, NULL) ||
+      fast_memneq(expected, actual, DIGEST512_LEN))
+    goto fail;
+
+  log_info(LD_CRYPTO, "This OpenSSL has SHA3; using it for long inputs.");
+  return;
+ fail:
+  log_info(LD_CRYPTO, "Not using OpenSSL's SHA3 implementation.");
+  sha3_evp_free();
+#endif /* defined(HAVE_EVP_SHA3) */
+}
+
+/** Compute the SHA3 digest of <b>len</b> bytes at <b>m</b> into the
+ * <b>out_len</b> bytes at <b>out</b>, where <b>out_len</b> is
+ * DIGEST256_LEN or DIGEST512_LEN.  Use OpenSSL for long inputs if
+ * evaluate_evp_for_sha3() decided we should.  Return 0 on success, -1 on
+ * failure. */
+static int
+sha3_digest_oneshot(uint8_t *out, size_t out_len,
+                    const uint8_t *m, size_t len)
+{
+#ifdef HAVE_EVP_SHA3
+  if (len >= SHA3_EVP_MIN_LEN) {
+    const EVP_MD *md = (out_len == DIGEST256_LEN) ? sha3_256_evp
+                                                  : sha3_512_evp;
+    if (md && EVP_Digest(m, len, out, NULL, md, NULL))
+      return 0;
+  }
+#endif /* defined(HAVE_EVP_SHA3) */
+  if (out_len == DIGEST256_LEN)
+    return sha3_256(out, out_len, m, len) < 0 ? -1 : 0;
+  else
+    return sha3_512(out, out_len, m, len) < 0 ? -1 : 0;
+}
+
 /** Compute a 256-bit digest of <b>len</b> bytes in data stored in <b>m</b>,
  * using the algorithm <b>algorithm</b>.  Write the DIGEST_LEN256-byte result
  * into <b>digest</b>.  Return 0 on success, -1 on failure. */
@@ -1735,8 +1848,8 @@ crypto_digest256(char *digest, const char *m, size_t len,
   if (algorithm == DIGEST_SHA256)
     ret = (SHA256((const uint8_t*)m,len,(uint8_t*)digest) != NULL);
   else
-    ret = (sha3_256((uint8_t *)digest, DIGEST256_LEN,(const uint8_t *)m, len)
-           > -1);
+    ret = (sha3_digest_oneshot((uint8_t *)digest, DIGEST256_LEN,
+                               (const uint8_t *)m, len) == 0);
 
   if (!ret)
     return -1;
@@ -1759,8 +1872,8 @@ crypto_digest512(char *digest, const char *m, size_t len,
     ret = (SHA512((const unsigned char*)m,len,(unsigned char*)digest)
            != NULL);
   else
-    ret = (sha3_512((uint8_t*)digest, DIGEST512_LEN, (const uint8_t*)m, len)
-           > -1);
+    ret = (sha3_digest_oneshot((uint8_t*)digest, DIGEST512_LEN,
+                               (const uint8_t*)m, len) == 0);
 
   if (!ret)
     return -1;
@@ -1861,6 +1974,10 @@ struct crypto_digest_t {
   } d;
 };
 
+/* crypto_digest_checkpoint() copies a whole crypto_digest_t into a
+ * crypto_digest_checkpoint_t. */
+CTASSERT(sizeof(crypto_digest_t) <= DIGEST_CHECKPOINT_BYTES);
+
 #ifdef TOR_UNIT_TESTS
 
 digest_algorithm_t
@@ -2086,6 +2203,35 @@ crypto_digest_assign(crypto_digest_t *into,
   memcpy(into,from,alloc_bytes);
 }
 
+/** Save the state of <b>digest</b> into <b>checkpoint</b>, so that we can
+ * later roll back to it with crypto_digest_restore().  Unlike
+ * crypto_digest_dup(), this doesn't allocate, and copies only the part of
+ * the state that the digest's algorithm uses. */
+void
+crypto_digest_checkpoint(crypto_digest_checkpoint_t *checkpoint,
+                         const crypto_digest_t *digest)
+{
+  tor_assert(digest);
+  const size_t bytes = crypto_digest_alloc_bytes(digest->algorithm);
+  memcpy(checkpoint->mem, digest, bytes);
+}
+
+/** Restore <b>digest</b> to the state it had when we saved it in
+ * <b>checkpoint</b>.  Everything added to <b>digest</b> since then is
+ * forgotten. */
+void
+crypto_digest_restore(crypto_digest_t *digest,
+                      const crypto_digest_checkpoint_t *checkpoint)
+{
+  digest_algorithm_t saved_alg;
+  tor_assert(digest);
+  memcpy(&saved_alg, checkpoint->mem + offsetof(crypto_digest_t, algorithm),
+         sizeof(saved_alg));
+  tor_assert(saved_alg == digest->algorithm);
+  const size_t bytes = crypto_digest_alloc_bytes(digest->algorithm);
+  memcpy(digest, checkpoint->mem, bytes);
+}
+
 /** Given a list of strings in <b>lst</b>, set the <b>len_out</b>-byte digest
  * at <b>digest_out</b> to the hash of the concatenation of those strings,
  * plus the optional string <b>append</b>, computed with the algorithm
@@ -3108,7 +3254,8 @@ crypto_rand_int(unsigned int max)
    */
   cutoff = UINT_MAX - (UINT_MAX%max);
   while (1) {
-    crypto_rand((char*)&val, sizeof(val));
+    crypto_fast_rng_getbytes(get_thread_fast_rng(),
+                             (uint8_t*)&val, sizeof(val));
     if (val < cutoff)
       return val % max;
   }
@@ -3163,7 +3310,8 @@ crypto_rand_uint64(uint64_t max)
    */
   cutoff = UINT64_MAX - (UINT64_MAX%max);
   while (1) {
-    crypto_rand((char*)&val, sizeof(val));
+    crypto_fast_rng_getbytes(get_thread_fast_rng(),
+                             (uint8_t*)&val, sizeof(val));
     if (val < cutoff)
       return val % max;
   }
@@ -3178,7 +3326,7 @@ crypto_rand_double(void)
   /* We just use an unsigned int here; we don't really care about getting
    * more than 32 bits of resolution */
   unsigned int u;
-  crypto_rand((char*)&u, sizeof(u));
+  crypto_fast_rng_getbytes(get_thread_fast_rng(), (uint8_t*)&u, sizeof(u));
 #if SIZEOF_INT == 4
 #define UINT_MAX_AS_DOUBLE 4294967296.0
 #elif SIZEOF_INT == 8
@@ -3438,6 +3586,9 @@ setup_openssl_threading(void)
 int
 crypto_global_cleanup(void)
 {
+#ifdef HAVE_EVP_SHA3
+  sha3_evp_free();
+#endif
   EVP_cleanup();
 #ifndef NEW_THREAD_API
   ERR_remove_thread_state(NULL);
@@ -3472,6 +3623,8 @@ crypto_global_cleanup(void)
   }
 #endif /* !defined(NEW_THREAD_API) */
 
+  crypto_fast_rng_global_cleanup();
+
   tor_free(crypto_openssl_version_str);
   tor_free(crypto_openssl_header_version_str);
   return 0;
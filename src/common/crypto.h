@@ -127,6 +127,13 @@ typedef struct {
 typedef struct crypto_pk_t crypto_pk_t;
 typedef struct aes_cnt_cipher crypto_cipher_t;
 typedef struct crypto_digest_t crypto_digest_t;
+
+/** Number of bytes we need to save the state of any crypto_digest_t. */
+#define DIGEST_CHECKPOINT_BYTES (SIZEOF_VOID_P + 512)
+/** Saved state of a crypto_digest_t; see crypto_digest_checkpoint(). */
+typedef struct crypto_digest_checkpoint_t {
+  uint8_t mem[DIGEST_CHECKPOINT_BYTES];
+} crypto_digest_checkpoint_t;
 typedef struct crypto_xof_t crypto_xof_t;
 typedef struct crypto_dh_t crypto_dh_t;
 
@@ -264,6 +271,10 @@ void crypto_digest_add_bytes(crypto_digest_t *digest, const char *data,
 void crypto_digest_get_digest(crypto_digest_t *digest,
                               char *out, size_t out_len);
 crypto_digest_t *crypto_digest_dup(const crypto_digest_t *digest);
+void crypto_digest_checkpoint(crypto_digest_checkpoint_t *checkpoint,
+                              const crypto_digest_t *digest);
+void crypto_digest_restore(crypto_digest_t *digest,
+                           const crypto_digest_checkpoint_t *checkpoint);
 void crypto_digest_assign(crypto_digest_t *into,
                           const crypto_digest_t *from);
 void crypto_hmac_sha256(char *hmac_out,
@@ -313,6 +324,16 @@ uint64_t crypto_rand_uint64_range(uint64_t min, uint64_t max);
 time_t crypto_rand_time_range(time_t min, time_t max);
 uint64_t crypto_rand_uint64(uint64_t max);
 double crypto_rand_double(void);
+
+/** A fast, buffered userspace CSPRNG; see crypto_rand_fast.c. */
+typedef struct crypto_fast_rng_t crypto_fast_rng_t;
+crypto_fast_rng_t *crypto_fast_rng_new(void);
+void crypto_fast_rng_free(crypto_fast_rng_t *rng);
+void crypto_fast_rng_getbytes(crypto_fast_rng_t *rng, uint8_t *out, size_t n);
+crypto_fast_rng_t *get_thread_fast_rng(void);
+void destroy_thread_fast_rng(void);
+void crypto_fast_rng_global_init(void);
+void crypto_fast_rng_global_cleanup(void);
 struct tor_weak_rng_t;
 void crypto_seed_weak_rng(struct tor_weak_rng_t *rng);
 int crypto_init_siphash_key(void);
@@ -340,6 +361,11 @@ struct dh_st *crypto_dh_get_dh_(crypto_dh_t *dh);
 
 void crypto_add_spaces_to_fp(char *out, size_t outlen, const char *in);
 
+#if defined(CRYPTO_RAND_FAST_PRIVATE) && defined(TOR_UNIT_TESTS)
+size_t crypto_fast_rng_get_bytes_left_(const crypto_fast_rng_t *rng);
+int crypto_fast_rng_get_n_till_reseed_(const crypto_fast_rng_t *rng);
+#endif
+
 #ifdef CRYPTO_PRIVATE
 
 STATIC int crypto_force_rand_ssleay(void);
@@ -0,0 +1,252 @@
+/* Copyright (c) 2017, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file crypto_rand_fast.c
+ *
+ * \brief A fast, buffered, per-thread userspace CSPRNG.
+ *
+ * Many of our random draws are tiny: a circuit ID, a padding delay, a
+ * choice from a smartlist.  Going through the OpenSSL RNG for each of those
+ * costs a lock and a DRBG invocation per call.  Instead, each thread keeps a
+ * crypto_fast_rng_t: an AES-256-CTR keystream generator, seeded from
+ * crypto_strongest_rand(), that produces a few kilobytes at a time and serves
+ * small requests from that buffer.
+ *
+ * We use the "fast key erasure" construction: every time we refill the
+ * buffer, the first SEED_LEN bytes of new keystream become the key and IV for
+ * the next refill, and the old key is overwritten.  Bytes are erased from the
+ * buffer as soon as they are handed out.  So an attacker who compromises the
+ * RNG state can't recover any output we have already returned.
+ *
+ * Every RESEED_AFTER refills we throw the state away and reseed from the
+ * strongest RNG we have.  After a fork(), the child process discards its
+ * inherited state before producing any output, so that parent and child never
+ * return the same bytes.
+ *
+ * Key material should keep coming from crypto_rand() or
+ * crypto_strongest_rand(); this generator is for the many small,
+ * non-long-term values we draw on hot paths.
+ **/
+
+#define CRYPTO_RAND_FAST_PRIVATE
+
+#include "orconfig.h"
+#include "crypto.h"
+#include "aes.h"
+#include "compat_threads.h"
+#include "util.h"
+#include "torlog.h"
+
+#if defined(HAVE_PTHREAD_H) && !defined(_WIN32)
+#include <pthread.h>
+#endif
+
+/** How many bytes of keystream do we use to key the next refill? */
+#define SEED_LEN (CIPHER256_KEY_LEN + CIPHER_IV_LEN)
+/** How many bytes of output does each refill give us? We pick this so that
+ * the whole structure fits in a single 4K page. */
+#define BUFLEN (4096 - SEED_LEN - 16)
+/** How many refills do we do before reseeding from crypto_strongest_rand? */
+#define RESEED_AFTER 16
+
+/** Internal state for a fast userspace CSPRNG. */
+struct crypto_fast_rng_t {
+  /** How many more refills before we reseed from the strong RNG? */
+  int16_t n_till_reseed;
+  /** How many unused bytes remain at the end of buf.bytes? */
+  uint16_t bytes_left;
+  /** Value of fast_rng_fork_generation when we were last seeded. If it
+   * changes, we're in a child process and must not reuse our state. */
+  uint32_t fork_generation;
+  /** Key, IV, and output for this RNG. We keep them together so that we can
+   * regenerate all of them with a single keystream pass. */
+  struct cbuf {
+    /** Key and IV for the next refill. */
+    uint8_t seed[SEED_LEN];
+    /** Output bytes; the unused ones are the last <b>bytes_left</b>. */
+    uint8_t bytes[BUFLEN];
+  } buf;
+};
+
+/** Incremented in the child process every time we fork. */
+static volatile uint32_t fast_rng_fork_generation = 0;
+
+/** Thread-local pointer to this thread's crypto_fast_rng_t. */
+static tor_threadlocal_t thread_rng;
+/** True iff thread_rng has been initialized. */
+static int thread_rng_initialized = 0;
+
+static void crypto_fast_rng_refill(crypto_fast_rng_t *rng);
+
+/** Reseed <b>rng</b> from the strongest RNG we have, and refill its
+ * buffer. */
+static void
+crypto_fast_rng_reseed(crypto_fast_rng_t *rng)
+{
+  memwipe(&rng->buf, 0, sizeof(rng->buf));
+  crypto_strongest_rand(rng->buf.seed, SEED_LEN);
+  rng->n_till_reseed = RESEED_AFTER;
+  rng->fork_generation = fast_rng_fork_generation;
+  crypto_fast_rng_refill(rng);
+}
+
+/** Allocate and return a new crypto_fast_rng_t, seeded from
+ * crypto_strongest_rand(). */
+crypto_fast_rng_t *
+crypto_fast_rng_new(void)
+{
+  crypto_fast_rng_t *rng = tor_malloc_zero(sizeof(crypto_fast_rng_t));
+  crypto_fast_rng_reseed(rng);
+  return rng;
+}
+
+/** Release all storage held by <b>rng</b>, wiping its state first. */
+void
+crypto_fast_rng_free(crypto_fast_rng_t *rng)
+{
+  if (!rng)
+    return;
+  memwipe(rng, 0, sizeof(*rng));
+  tor_free(rng);
+}
+
+/** Regenerate the key, IV, and output bytes of <b>rng</b> by running its
+ * current key over a zeroed buffer, reseeding first if we've done too many
+ * refills since the last reseed. */
+static void
+crypto_fast_rng_refill(crypto_fast_rng_t *rng)
+{
+  if (rng->n_till_reseed-- <= 0) {
+    crypto_fast_rng_reseed(rng);
+    return;
+  }
+
+  aes_cnt_cipher_t *c = aes_new_cipher(rng->buf.seed,
+                                       rng->buf.seed + CIPHER256_KEY_LEN,
+                                       CIPHER256_KEY_LEN * 8);
+  memset(&rng->buf, 0, sizeof(rng->buf));
+  aes_crypt_inplace(c, (char*)&rng->buf, sizeof(rng->buf));
+  aes_cipher_free(c);
+
+  rng->bytes_left = BUFLEN;
+}
+
+/** Fill <b>out</b> with <b>n</b> bytes of output from <b>rng</b>.
+ *
+ * Small requests are served from the buffer; large ones are handled by
+ * refilling as many times as necessary. */
+void
+crypto_fast_rng_getbytes(crypto_fast_rng_t *rng, uint8_t *out, size_t n)
+{
+  if (PREDICT_UNLIKELY(rng->fork_generation != fast_rng_fork_generation))
+    crypto_fast_rng_reseed(rng);
+
+  while (n) {
+    if (rng->bytes_left == 0)
+      crypto_fast_rng_refill(rng);
+    const size_t take = MIN(n, (size_t)rng->bytes_left);
+    uint8_t *src = rng->buf.bytes + BUFLEN - rng->bytes_left;
+    memcpy(out, src, take);
+    memwipe(src, 0, take);
+    rng->bytes_left -= take;
+    out += take;
+    n -= take;
+  }
+}
+
+#if defined(HAVE_PTHREAD_H) && !defined(_WIN32)
+/** Called in the child process after every fork(): make every fast RNG
+ * reseed before it next produces output, and wipe the state of the one
+ * belonging to the forking thread (the only thread that survives). */
+static void
+crypto_fast_rng_postfork_child(void)
+{
+  ++fast_rng_fork_generation;
+  if (thread_rng_initialized) {
+    crypto_fast_rng_t *rng = tor_threadlocal_get(&thread_rng);
+    if (rng) {
+      memwipe(&rng->buf, 0, sizeof(rng->buf));
+      rng->bytes_left = 0;
+    }
+  }
+}
+#endif /* defined(HAVE_PTHREAD_H) && !defined(_WIN32) */
+
+/** Set up the thread-local storage for per-thread fast RNGs. Idempotent;
+ * must be called before any other threads are launched. */
+void
+crypto_fast_rng_global_init(void)
+{
+  if (thread_rng_initialized)
+    return;
+  tor_threadlocal_init(&thread_rng);
+  thread_rng_initialized = 1;
+#if defined(HAVE_PTHREAD_H) && !defined(_WIN32)
+  {
+    static int atfork_registered = 0;
+    if (!atfork_registered) {
+      pthread_atfork(NULL, NULL, crypto_fast_rng_postfork_child);
+      atfork_registered = 1;
+    }
+  }
+#endif /* defined(HAVE_PTHREAD_H) && !defined(_WIN32) */
+}
+
+/** Return the fast RNG for the current thread, creating it if needed. The
+ * returned object must not be freed or shared with other threads. */
+crypto_fast_rng_t *
+get_thread_fast_rng(void)
+{
+  if (PREDICT_UNLIKELY(!thread_rng_initialized))
+    crypto_fast_rng_global_init();
+
+  crypto_fast_rng_t *rng = tor_threadlocal_get(&thread_rng);
+  if (PREDICT_UNLIKELY(rng == NULL)) {
+    rng = crypto_fast_rng_new();
+    tor_threadlocal_set(&thread_rng, rng);
+  }
+  return rng;
+}
+
+/** Release the fast RNG (if any) belonging to the current thread. */
+void
+destroy_thread_fast_rng(void)
+{
+  if (!thread_rng_initialized)
+    return;
+  crypto_fast_rng_t *rng = tor_threadlocal_get(&thread_rng);
+  if (!rng)
+    return;
+  crypto_fast_rng_free(rng);
+  tor_threadlocal_set(&thread_rng, NULL);
+}
+
+/** Release the current thread's fast RNG and the thread-local storage that
+ * tracks per-thread RNGs.  Other threads must already have called
+ * destroy_thread_fast_rng(). */
+void
+crypto_fast_rng_global_cleanup(void)
+{
+  if (!thread_rng_initialized)
+    return;
+  destroy_thread_fast_rng();
+  tor_threadlocal_destroy(&thread_rng);
+  thread_rng_initialized = 0;
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the number of unused bytes buffered in <b>rng</b>. */
+size_t
+crypto_fast_rng_get_bytes_left_(const crypto_fast_rng_t *rng)
+{
+  return rng->bytes_left;
+}
+
+/** Return the number of refills <b>rng</b> will do before reseeding. */
+int
+crypto_fast_rng_get_n_till_reseed_(const crypto_fast_rng_t *rng)
+{
+  return rng->n_till_reseed;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
@@ -0,0 +1,41 @@
+/* Copyright (c) 2017, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file ctassert.h
+ *
+ * \brief Compile-time assertions: CTASSERT(expression).
+ */
+
+#ifndef TOR_CTASSERT_H
+#define TOR_CTASSERT_H
+
+#include "compat.h"
+
+/**
+ * CTASSERT(expression)
+ *
+ *       Trigger a compiler error if expression is false.  Use this at file
+ *       scope, to check properties of types and constants that the code
+ *       would otherwise have to check at runtime.
+ */
+#if __STDC_VERSION__ >= 201112L
+
+/* If we have C11, _Static_assert is the way to go. */
+#define CTASSERT(x) _Static_assert((x), #x)
+
+#else
+
+/*
+ * Otherwise, declare an array type whose size is negative when the
+ * expression is false.  The line number keeps the type names of several
+ * assertions in one file apart.
+ */
+#define CTASSERT(x) CTASSERT_EXPN((x), c, __LINE__)
+#define CTASSERT_EXPN(x, a, b) CTASSERT_DECL(x, a, b)
+#define CTASSERT_DECL(x, a, b) \
+  typedef char tor_ctassert_##a##_##b[(x) ? 1 : -1] ATTR_UNUSED
+
+#endif /* __STDC_VERSION__ >= 201112L */
+
+#endif /* !defined(TOR_CTASSERT_H) */
@@ -61,6 +61,9 @@ typedef struct logfile_t {
   log_callback callback; /**< If not NULL, send messages to this function. */
   log_severity_list_t *severities; /**< Which severity of messages should we
                                     * log for each log domain? */
+  uint64_t n_async_dropped; /**< How many messages for this log have we
+                             * dropped because the writer thread's queue was
+                             * full, since we last said so in the log? */
 } logfile_t;
 
 static void log_free(logfile_t *victim);
@@ -160,6 +163,48 @@ static int pretty_fn_has_parens = 0;
   tor_mutex_release(&log_mutex);                                        \
   STMT_END
 
+/** Largest number of messages that may wait for the log writer thread. */
+#define LOG_ASYNC_QUEUE_LEN 4096
+
+/** A formatted log message waiting for the log writer thread. */
+typedef struct log_async_record_t {
+  logfile_t *lf; /**< The log to write the message to. */
+  char *msg; /**< The message, with all decorations. */
+  size_t msg_len; /**< The length of msg. */
+} log_async_record_t;
+
+/** True iff messages for file and stream logs are handed to the writer
+ * thread, rather than written by the thread that logs them.  Only changed
+ * with log_mutex held. */
+static int log_async_enabled = 0;
+/** What to do when the writer thread's queue is full: one of
+ * LOG_ASYNC_OVERFLOW_*.  Only changed with log_mutex held. */
+static int log_async_overflow = LOG_ASYNC_OVERFLOW_DROP;
+
+/** A mutex to guard the writer thread's queue and the fields below.  We
+ * take it while holding log_mutex, but never the other way around; the
+ * writer thread never takes log_mutex, and never logs. */
+static tor_mutex_t log_async_mutex;
+/** True iff we have initialized log_async_mutex and its conditions. */
+static int log_async_mutex_initialized = 0;
+/** Signaled when there are new messages to write, or when the writer thread
+ * should exit. */
+static tor_cond_t log_async_work_cond;
+/** Signaled when the writer thread has written some messages, or has
+ * exited. */
+static tor_cond_t log_async_done_cond;
+/** Ring of LOG_ASYNC_QUEUE_LEN records for the writer thread. */
+static log_async_record_t *log_async_queue = NULL;
+/** Index of the oldest record in log_async_queue. */
+static int log_async_head = 0;
+/** Number of records in log_async_queue, including any that the writer
+ * thread is writing right now. */
+static int log_async_len = 0;
+/** True iff the writer thread is running. */
+static int log_async_writer_running = 0;
+/** True iff the writer thread should exit once the queue is empty. */
+static int log_async_writer_stop = 0;
+
 /** What's the lowest log level anybody cares about?  Checking this lets us
  * bail out early from log_debug if we aren't debugging.  */
 int log_global_min_severity_ = LOG_NOTICE;
@@ -416,6 +461,173 @@ logfile_wants_message(const logfile_t *lf, int severity,
   return 1;
 }
 
+/** Main function for the log writer thread: write queued messages to their
+ * logs until we are asked to stop and the queue is empty.  Messages are
+ * taken off the queue in batches, and written without holding any lock. */
+static void
+log_async_writer_main(void *arg)
+{
+  (void) arg;
+
+  tor_mutex_acquire(&log_async_mutex);
+  while (1) {
+    int start, n, i;
+    while (!log_async_len && !log_async_writer_stop)
+      tor_cond_wait(&log_async_work_cond, &log_async_mutex, NULL);
+    if (!log_async_len)
+      break;
+
+    start = log_async_head;
+    n = log_async_len;
+    tor_mutex_release(&log_async_mutex);
+
+    /* Producers only touch the slots after these n, so we can use them
+     * without the lock. */
+    for (i = 0; i < n; ++i) {
+      log_async_record_t *rec =
+        &log_async_queue[(start + i) % LOG_ASYNC_QUEUE_LEN];
+      if (write_all(rec->lf->fd, rec->msg, rec->msg_len, 0) < 0)
+        rec->lf->seems_dead = 1;
+      tor_free(rec->msg);
+    }
+
+    tor_mutex_acquire(&log_async_mutex);
+    log_async_head = (start + n) % LOG_ASYNC_QUEUE_LEN;
+    log_async_len -= n;
+    tor_cond_signal_all(&log_async_done_cond);
+  }
+  log_async_writer_running = 0;
+  tor_cond_signal_all(&log_async_done_cond);
+  tor_mutex_release(&log_async_mutex);
+}
+
+/** Helper: add a copy of the <b>msg_len</b>-byte message in <b>msg</b> to
+ * the writer thread's queue, for <b>lf</b>.  Requires that
+ * log_async_mutex is held and the queue is not full. */
+static void
+log_async_push(logfile_t *lf, const char *msg, size_t msg_len)
+{
+  log_async_record_t *rec =
+    &log_async_queue[(log_async_head + log_async_len) % LOG_ASYNC_QUEUE_LEN];
+  rec->lf = lf;
+  rec->msg = tor_memdup(msg, msg_len);
+  rec->msg_len = msg_len;
+  ++log_async_len;
+}
+
+/** Hand the <b>msg_len</b>-byte message in <b>buf</b> to the writer thread
+ * to be written to <b>lf</b>.  If the queue is full, drop the message or
+ * wait for room, depending on log_async_overflow.  The next message that
+ * makes it into the queue for <b>lf</b> is preceded by a note of how many
+ * were dropped.  Requires that log_mutex is held. */
+static void
+log_async_enqueue(logfile_t *lf, const char *buf, size_t msg_len)
+{
+  tor_mutex_acquire(&log_async_mutex);
+  if (log_async_overflow == LOG_ASYNC_OVERFLOW_BLOCK) {
+    while (log_async_len == LOG_ASYNC_QUEUE_LEN && log_async_writer_running)
+      tor_cond_wait(&log_async_done_cond, &log_async_mutex, NULL);
+  }
+  if (log_async_len + (lf->n_async_dropped ? 2 : 1) > LOG_ASYNC_QUEUE_LEN) {
+    ++lf->n_async_dropped;
+    tor_mutex_release(&log_async_mutex);
+    return;
+  }
+
+  if (lf->n_async_dropped) {
+    char note[256];
+    size_t n = log_prefix_(note, sizeof(note), LOG_WARN);
+    int r = tor_snprintf(note+n, sizeof(note)-n,
+                         "Dropped "U64_FORMAT" log messages because the log "
+                         "writer thread fell behind.\n",
+                         U64_PRINTF_ARG(lf->n_async_dropped));
+    if (r > 0)
+      log_async_push(lf, note, n + r);
+    lf->n_async_dropped = 0;
+  }
+  log_async_push(lf, buf, msg_len);
+  tor_cond_signal_one(&log_async_work_cond);
+  tor_mutex_release(&log_async_mutex);
+}
+
+/** Wait until the log writer thread, if any, has written every message in
+ * its queue. */
+void
+log_async_flush(void)
+{
+  if (!log_async_mutex_initialized)
+    return;
+  tor_mutex_acquire(&log_async_mutex);
+  while (log_async_len && log_async_writer_running)
+    tor_cond_wait(&log_async_done_cond, &log_async_mutex, NULL);
+  tor_mutex_release(&log_async_mutex);
+}
+
+/** Helper: tell the log writer thread to exit once it has written
+ * everything in its queue, and wait for it to do so. */
+static void
+log_async_stop_writer(void)
+{
+  tor_mutex_acquire(&log_async_mutex);
+  log_async_writer_stop = 1;
+  tor_cond_signal_all(&log_async_work_cond);
+  while (log_async_writer_running)
+    tor_cond_wait(&log_async_done_cond, &log_async_mutex, NULL);
+  tor_mutex_release(&log_async_mutex);
+}
+
+/** If <b>enabled</b>, hand messages for file and stream logs to a writer
+ * thread, so that the threads which log them need not wait for the
+ * write() calls; otherwise, write messages from the thread that logs them.
+ * When the writer thread's queue is full, <b>overflow_policy</b> (one of
+ * LOG_ASYNC_OVERFLOW_*) says whether to drop messages or wait for room.
+ *
+ * Messages of severity LOG_ERR are always written before tor_log()
+ * returns, and tor_log_err_sigsafe() does not use the writer thread.
+ *
+ * Return 0 on success, or -1 if we couldn't start the writer thread, in
+ * which case logging stays synchronous. */
+int
+log_set_async(int enabled, int overflow_policy)
+{
+  int r = 0;
+  raw_assert(log_mutex_initialized);
+  raw_assert(overflow_policy == LOG_ASYNC_OVERFLOW_DROP ||
+             overflow_policy == LOG_ASYNC_OVERFLOW_BLOCK);
+
+  if (!log_async_mutex_initialized) {
+    tor_mutex_init(&log_async_mutex);
+    tor_cond_init(&log_async_work_cond);
+    tor_cond_init(&log_async_done_cond);
+    log_async_mutex_initialized = 1;
+  }
+
+  LOCK_LOGS();
+  log_async_overflow = overflow_policy;
+  if (enabled && !log_async_enabled) {
+    if (!log_async_queue)
+      log_async_queue = tor_calloc(LOG_ASYNC_QUEUE_LEN,
+                                   sizeof(log_async_record_t));
+    tor_mutex_acquire(&log_async_mutex);
+    log_async_writer_stop = 0;
+    log_async_writer_running = 1;
+    tor_mutex_release(&log_async_mutex);
+    if (spawn_func(log_async_writer_main, NULL) < 0) {
+      tor_mutex_acquire(&log_async_mutex);
+      log_async_writer_running = 0;
+      tor_mutex_release(&log_async_mutex);
+      r = -1;
+    } else {
+      log_async_enabled = 1;
+    }
+  } else if (!enabled && log_async_enabled) {
+    log_async_enabled = 0;
+    log_async_stop_writer();
+  }
+  UNLOCK_LOGS();
+  return r;
+}
+
 /** Send a message to <b>lf</b>.  The full message, with time prefix and
  * severity, is in <b>buf</b>.  The message itself is in
  * <b>msg_after_prefix</b>.  If <b>callbacks_deferred</b> points to true, then
@@ -460,6 +672,14 @@ logfile_deliver(logfile_t *lf, const char *buf, size_t msg_len,
       lf->callback(severity, domain, msg_after_prefix);
     }
   } else {
+    if (log_async_enabled) {
+      if (severity != LOG_ERR) {
+        log_async_enqueue(lf, buf, msg_len);
+        return;
+      }
+      /* We may be about to die: write everything out now, in order. */
+      log_async_flush();
+    }
     if (write_all(lf->fd, buf, msg_len, 0) < 0) { /* error */
       /* don't log the error! mark this log entry to be blown away, and
        * continue. */
@@ -736,6 +956,9 @@ logs_free_all(void)
 {
   logfile_t *victim, *next;
   smartlist_t *messages, *messages2;
+  if (log_async_enabled)
+    log_set_async(0, log_async_overflow);
+  tor_free(log_async_queue);
   LOCK_LOGS();
   next = logfiles;
   logfiles = NULL;
@@ -780,6 +1003,7 @@ static void
 delete_log(logfile_t *victim)
 {
   logfile_t *tmpl;
+  log_async_flush();
   if (victim == logfiles)
     logfiles = victim->next;
   else {
@@ -1032,6 +1256,8 @@ close_temp_logs(void)
   logfile_t *lf, **p;
 
   LOCK_LOGS();
+  /* Don't close or free any log with messages still on their way to it. */
+  log_async_flush();
   for (p = &logfiles; *p; ) {
     if ((*p)->is_temporary) {
       lf = *p;
@@ -1384,6 +1610,7 @@ void
 truncate_logs(void)
 {
   logfile_t *lf;
+  log_async_flush();
   for (lf = logfiles; lf; lf = lf->next) {
     if (lf->fd >= 0) {
       tor_ftruncate(lf->fd);
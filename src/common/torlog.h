@@ -164,6 +164,14 @@ void log_set_application_name(const char *name);
 void set_log_time_granularity(int granularity_msec);
 void truncate_logs(void);
 
+/** Possible values for the overflow_policy argument of log_set_async(). */
+/** Drop messages when the log writer thread's queue is full. */
+#define LOG_ASYNC_OVERFLOW_DROP 0
+/** Wait for room when the log writer thread's queue is full. */
+#define LOG_ASYNC_OVERFLOW_BLOCK 1
+int log_set_async(int enabled, int overflow_policy);
+void log_async_flush(void);
+
 void tor_log(int severity, log_domain_mask_t domain, const char *format, ...)
   CHECK_PRINTF(3,4);
 
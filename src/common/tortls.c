@@ -151,6 +151,32 @@ STATIC tor_tls_context_t *client_tls_context = NULL;
 /** True iff tor_tls_init() has been called. */
 static int tls_library_is_initialized = 0;
 
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+/** Defined iff our OpenSSL can hand record encryption to the kernel. */
+#define TOR_TLS_HAVE_KTLS
+#endif
+
+/** True iff we should ask OpenSSL to use kernel TLS on new connections. */
+static int ktls_enabled = 0;
+
+/** Roughly how much memory OpenSSL's read and write buffers take for one
+ * connection. */
+#define TLS_BUFFER_MEM_COST (2 * SSL3_RT_MAX_PACKET_SIZE)
+
+/** How many tor_tls_t objects have holds_buffers set? */
+static size_t n_tls_holding_buffers = 0;
+
+/** Note that OpenSSL is about to use the buffers of <b>tls</b>, and has
+ * allocated them if they weren't there already. */
+static inline void
+tor_tls_note_buffers_used(tor_tls_t *tls)
+{
+  if (!tls->holds_buffers) {
+    tls->holds_buffers = 1;
+    ++n_tls_holding_buffers;
+  }
+}
+
 /* Module-internal error codes. */
 #define TOR_TLS_SYSCALL_    (MIN_TOR_TLS_ERROR_VAL_ - 2)
 #define TOR_TLS_ZERORETURN_ (MIN_TOR_TLS_ERROR_VAL_ - 1)
@@ -1196,7 +1222,11 @@ tor_tls_context_new(crypto_pk_t *identity, unsigned int key_lifetime,
 #endif
 #endif /* OPENSSL_VERSION_NUMBER < OPENSSL_V_SERIES(1,1,0) */
 
-#ifdef SSL_MODE_RELEASE_BUFFERS
+  /* If we can release a connection's buffers ourselves, we keep them for as
+   * long as it's active: otherwise OpenSSL would free and reallocate them
+   * every time a bursty connection runs dry. See tor_tls_release_buffers().
+   */
+#if defined(SSL_MODE_RELEASE_BUFFERS) && !defined(HAVE_SSL_FREE_BUFFERS)
   SSL_CTX_set_mode(result->ctx, SSL_MODE_RELEASE_BUFFERS);
 #endif
   if (! is_client) {
@@ -1580,6 +1610,13 @@ tor_tls_server_info_callback(const SSL *ssl, int type, int val)
       log_warn(LD_BUG, "Couldn't look up the tls for an SSL*. How odd!");
       /* LCOV_EXCL_STOP */
     }
+  } else if (ktls_enabled && tls->server_handshake_count == 1) {
+#ifdef TOR_TLS_HAVE_KTLS
+    /* The v2 handshake renegotiates, which the kernel can't do for us; but
+     * a v3 client never will, so the kernel can take over once the keys are
+     * set up. */
+    SSL_set_options((SSL*) ssl, SSL_OP_ENABLE_KTLS);
+#endif
   }
 }
 
@@ -1700,6 +1737,12 @@ tor_tls_new(int sock, int isServer)
 
   if (isServer)
     tor_tls_setup_session_secret_cb(result);
+#ifdef TOR_TLS_HAVE_KTLS
+  /* Servers wait until they have seen the client's cipher list: see
+   * tor_tls_server_info_callback(). */
+  else if (ktls_enabled)
+    SSL_set_options(result->ssl, SSL_OP_ENABLE_KTLS);
+#endif
 
   goto done;
  err:
@@ -1806,6 +1849,10 @@ tor_tls_free(tor_tls_t *tls)
 #endif
   SSL_free(tls->ssl);
   tls->ssl = NULL;
+  if (tls->holds_buffers) {
+    tls->holds_buffers = 0;
+    --n_tls_holding_buffers;
+  }
   tls->negotiated_callback = NULL;
   if (tls->context)
     tor_tls_context_decref(tls->context);
@@ -1827,6 +1874,7 @@ tor_tls_read,(tor_tls_t *tls, char *cp, size_t len))
   tor_assert(tls->ssl);
   tor_assert(tls->state == TOR_TLS_ST_OPEN);
   tor_assert(len<INT_MAX);
+  tor_tls_note_buffers_used(tls);
   r = SSL_read(tls->ssl, cp, (int)len);
   if (r > 0) {
     if (tls->got_renegotiate) {
@@ -1880,6 +1928,22 @@ tor_tls_write(tor_tls_t *tls, const char *cp, size_t n)
     n = tls->wantwrite_n;
     tls->wantwrite_n = 0;
   }
+  if (tls->ktls_send) {
+    /* The kernel builds and encrypts the records: give it the plaintext. */
+    r = (int) tor_socket_send(tls->socket, cp, n, 0);
+    if (r < 0) {
+      int e = tor_socket_errno(tls->socket);
+      if (ERRNO_IS_EAGAIN(e))
+        return TOR_TLS_WANTWRITE;
+      log_info(LD_NET, "TLS error: <syscall error while writing> (%s)",
+               tor_socket_strerror(e));
+      return tor_errno_to_tls_error(e);
+    }
+    tls->ktls_write_count += r;
+    total_bytes_written_over_tls += r;
+    return r;
+  }
+  tor_tls_note_buffers_used(tls);
   r = SSL_write(tls->ssl, cp, (int)n);
   err = tor_tls_get_error(tls, r, 0, "writing", LOG_INFO, LD_NET);
   if (err == TOR_TLS_DONE) {
@@ -1907,6 +1971,7 @@ tor_tls_handshake(tor_tls_t *tls)
   check_no_tls_errors();
 
   OSSL_HANDSHAKE_STATE oldstate = SSL_get_state(tls->ssl);
+  tor_tls_note_buffers_used(tls);
 
   if (tls->isServer) {
     log_debug(LD_HANDSHAKE, "About to call SSL_accept on %p (%s)", tls,
@@ -1979,10 +2044,91 @@ tor_tls_finish_handshake(tor_tls_t *tls)
       r = TOR_TLS_ERROR_MISC;
     }
   }
+#ifdef TOR_TLS_HAVE_KTLS
+  /* OpenSSL quietly stays in userspace if the kernel or the negotiated
+   * cipher doesn't support kTLS, so ask what we actually got. */
+  tls->ktls_send = BIO_get_ktls_send(SSL_get_wbio(tls->ssl)) ? 1 : 0;
+  tls->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(tls->ssl)) ? 1 : 0;
+  if (ktls_enabled) {
+    log_debug(LD_NET, "Kernel TLS for %s: send %s, receive %s.",
+              ADDR(tls), tls->ktls_send ? "on" : "off",
+              tls->ktls_recv ? "on" : "off");
+  }
+#endif /* defined(TOR_TLS_HAVE_KTLS) */
   tls_log_errors(NULL, LOG_WARN, LD_NET, "finishing the handshake");
   return r;
 }
 
+/** Ask OpenSSL to free the read and write buffers of <b>tls</b>; it will
+ * allocate them again the next time we use the connection. Return roughly
+ * how many bytes that freed, which is 0 if we weren't holding any, or if
+ * OpenSSL still has data in them. */
+size_t
+tor_tls_release_buffers(tor_tls_t *tls)
+{
+  tor_assert(tls);
+  if (!tls->holds_buffers)
+    return 0;
+#ifdef HAVE_SSL_FREE_BUFFERS
+  if (!SSL_free_buffers(tls->ssl))
+    return 0;
+  tls->holds_buffers = 0;
+  --n_tls_holding_buffers;
+  return TLS_BUFFER_MEM_COST;
+#else
+  /* OpenSSL releases them on its own whenever they run empty. */
+  return 0;
+#endif /* defined(HAVE_SSL_FREE_BUFFERS) */
+}
+
+/** Return roughly how many bytes OpenSSL is using for the read and write
+ * buffers of all our TLS connections. */
+size_t
+tor_tls_get_buffer_allocation(void)
+{
+#ifdef HAVE_SSL_FREE_BUFFERS
+  return n_tls_holding_buffers * TLS_BUFFER_MEM_COST;
+#else
+  /* With SSL_MODE_RELEASE_BUFFERS, we can't tell: only busy connections
+   * have any. */
+  return 0;
+#endif
+}
+
+/** Return true iff this build of Tor can use kernel TLS offload. */
+int
+tor_tls_ktls_supported(void)
+{
+#ifdef TOR_TLS_HAVE_KTLS
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/** If <b>enabled</b>, ask OpenSSL to hand record encryption and decryption
+ * to the kernel on TLS connections that we create from now on, once their
+ * handshake is done. Has no effect if tor_tls_ktls_supported() is false. */
+void
+tor_tls_set_ktls_enabled(int enabled)
+{
+  ktls_enabled = enabled ? 1 : 0;
+}
+
+/** Return a mask of TOR_TLS_KTLS_SEND and TOR_TLS_KTLS_RECV describing
+ * which directions of <b>tls</b> the kernel handles. */
+unsigned int
+tor_tls_get_ktls_flags(const tor_tls_t *tls)
+{
+  unsigned int flags = 0;
+  tor_assert(tls);
+  if (tls->ktls_send)
+    flags |= TOR_TLS_KTLS_SEND;
+  if (tls->ktls_recv)
+    flags |= TOR_TLS_KTLS_RECV;
+  return flags;
+}
+
 /** Shut down an open tls connection <b>tls</b>.  When finished, returns
  * TOR_TLS_DONE.  On failure, returns TOR_TLS_ERROR, TOR_TLS_WANTREAD,
  * or TOR_TLS_WANTWRITE.
@@ -2361,6 +2507,8 @@ tor_tls_get_n_raw_bytes(tor_tls_t *tls, size_t *n_read, size_t *n_written)
     wbio = tmpbio;
 #endif /* OPENSSL_VERSION_NUMBER >= OPENSSL_VER(1,1,0,0,5) */
   w = (unsigned long) BIO_number_written(wbio);
+  /* Plus whatever we sent on the socket ourselves with kernel TLS. */
+  w += tls->ktls_write_count;
 
   /* We are ok with letting these unsigned ints go "negative" here:
    * If we wrapped around, this should still give us the right answer, unless
@@ -53,6 +53,11 @@ typedef struct tor_x509_cert_t tor_x509_cert_t;
 
 #define TOR_TLS_IS_ERROR(rv) ((rv) < TOR_TLS_CLOSE)
 
+/** Flags for tor_tls_get_ktls_flags(): the kernel encrypts what we send. */
+#define TOR_TLS_KTLS_SEND (1u<<0)
+/** Flags for tor_tls_get_ktls_flags(): the kernel decrypts what we get. */
+#define TOR_TLS_KTLS_RECV (1u<<1)
+
 #ifdef TORTLS_PRIVATE
 #define TOR_TLS_MAGIC 0x71571571
 
@@ -111,6 +116,9 @@ struct tor_tls_t {
                                   * one certificate). */
   /** True iff we should call negotiated_callback when we're done reading. */
   unsigned int got_renegotiate:1;
+  /** True iff OpenSSL has (probably) allocated read and write buffers for
+   * this connection, and we haven't released them since. */
+  unsigned int holds_buffers:1;
   /** Return value from tor_tls_classify_client_ciphers, or 0 if we haven't
    * called that function yet. */
   int8_t client_cipher_list_type;
@@ -118,11 +126,20 @@ struct tor_tls_t {
   uint8_t server_handshake_count;
   size_t wantwrite_n; /**< 0 normally, >0 if we returned wantwrite last
                        * time. */
+  /** True iff the kernel encrypts the records we send on this connection,
+   * so that tor_tls_write() can hand it plaintext directly. */
+  unsigned int ktls_send:1;
+  /** True iff the kernel decrypts the records we receive on this
+   * connection. */
+  unsigned int ktls_recv:1;
   /** Last values retrieved from BIO_number_read()/write(); see
    * tor_tls_get_n_raw_bytes() for usage.
    */
   unsigned long last_write_count;
   unsigned long last_read_count;
+  /** Number of bytes that tor_tls_write() has sent on the socket itself,
+   * bypassing the BIO, because the kernel does the encryption. */
+  unsigned long ktls_write_count;
   /** If set, a callback to invoke whenever the client tries to renegotiate
    * the handshake. */
   void (*negotiated_callback)(tor_tls_t *tls, void *arg);
@@ -234,6 +251,11 @@ void tor_tls_block_renegotiation(tor_tls_t *tls);
 void tor_tls_assert_renegotiation_unblocked(tor_tls_t *tls);
 int tor_tls_shutdown(tor_tls_t *tls);
 int tor_tls_get_pending_bytes(tor_tls_t *tls);
+size_t tor_tls_release_buffers(tor_tls_t *tls);
+size_t tor_tls_get_buffer_allocation(void);
+int tor_tls_ktls_supported(void);
+void tor_tls_set_ktls_enabled(int enabled);
+unsigned int tor_tls_get_ktls_flags(const tor_tls_t *tls);
 size_t tor_tls_get_forced_write_size(tor_tls_t *tls);
 
 void tor_tls_get_n_raw_bytes(tor_tls_t *tls,
@@ -131,6 +131,390 @@ base32_decode(char *dest, size_t destlen, const char *src, size_t srclen)
   return 0;
 }
 
+/* Our base64 and base16 codecs can use SSSE3 or AVX2 on x86 when the CPU
+ * supports them.  We compile those versions with per-function target
+ * attributes, so the binary still runs on CPUs without those features, and
+ * pick one at runtime.  The scalar loops below remain the fallback for
+ * other platforms, for the odd bytes at the end of each input, and for
+ * anything the vector code doesn't handle (whitespace, padding, errors). */
+#if (defined(__x86_64__) || defined(__i386__)) &&                     \
+  ((defined(__clang__) &&                                             \
+    (__clang_major__ > 3 ||                                           \
+     (__clang_major__ == 3 && __clang_minor__ >= 8))) ||              \
+   (!defined(__clang__) && defined(__GNUC__) &&                       \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define HAVE_X86_SIMD_CODECS
+#include <immintrin.h>
+#define ATTR_TARGET(t) __attribute__((target(t)))
+#endif
+
+/** Which codec implementation are we using? One of BASE_CODEC_*, or -1 if
+ * we haven't decided yet. */
+static int codec_level = -1;
+
+/** Choose the fastest base64/base16 implementation that this CPU supports,
+ * but no faster than <b>max_level</b> (one of BASE_CODEC_*, or -1 for no
+ * limit).  Return the level we chose.  All levels give identical results;
+ * limiting the level is only useful for tests and benchmarks. */
+int
+base_codec_set_max_level(int max_level)
+{
+  int level = BASE_CODEC_SCALAR;
+#ifdef HAVE_X86_SIMD_CODECS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    level = BASE_CODEC_AVX2;
+  else if (__builtin_cpu_supports("ssse3"))
+    level = BASE_CODEC_SSSE3;
+#endif /* defined(HAVE_X86_SIMD_CODECS) */
+  if (max_level >= 0 && level > max_level)
+    level = max_level;
+  codec_level = level;
+  return level;
+}
+
+/** Return the codec implementation level to use, choosing one if we haven't
+ * yet. */
+static inline int
+codec_level_get(void)
+{
+  if (PREDICT_UNLIKELY(codec_level < 0))
+    base_codec_set_max_level(-1);
+  return codec_level;
+}
+
+#ifdef HAVE_X86_SIMD_CODECS
+/* The base64 routines here follow Wojciech Muła's and Alfred Klomp's
+ * published SSSE3/AVX2 base64 algorithms. */
+
+/** Given 12 input bytes in the low 12 bytes of <b>in</b>, spread them into
+ * 16 bytes each holding one 6-bit base64 index. */
+ATTR_TARGET("ssse3")
+static inline __m128i
+b64_enc_reshuffle_ssse3(__m128i in)
+{
+  in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                         4, 5, 3, 4, 1, 2, 0, 1));
+  const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  return _mm_or_si128(t1, t3);
+}
+
+/** Map sixteen 6-bit indices in <b>in</b> to the base64 alphabet. */
+ATTR_TARGET("ssse3")
+static inline __m128i
+b64_enc_translate_ssse3(__m128i in)
+{
+  const __m128i shift_lut = _mm_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+      '/' - 63, 'A', 0, 0);
+  __m128i r = _mm_subs_epu8(in, _mm_set1_epi8(51));
+  const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), in);
+  r = _mm_or_si128(r, _mm_and_si128(less, _mm_set1_epi8(13)));
+  r = _mm_shuffle_epi8(shift_lut, r);
+  return _mm_add_epi8(r, in);
+}
+
+/** Map the base64 characters in <b>in</b> to their 6-bit values, and store
+ * them in *<b>out</b>.  Return 0 if any byte of <b>in</b> is not in the
+ * base64 alphabet (including whitespace and padding), else 1. */
+ATTR_TARGET("ssse3")
+static inline int
+b64_dec_translate_ssse3(__m128i in, __m128i *out)
+{
+  const __m128i lut_lo = _mm_setr_epi8(
+      0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+      0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+  const __m128i lut_hi = _mm_setr_epi8(
+      0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+      0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m128i lut_roll = _mm_setr_epi8(
+      0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), nibble);
+  const __m128i lo_nibbles = _mm_and_si128(in, nibble);
+  const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+  const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+  const __m128i bad = _mm_and_si128(lo, hi);
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(bad, _mm_setzero_si128())) != 0xffff)
+    return 0;
+  const __m128i eq_2f = _mm_cmpeq_epi8(in, _mm_set1_epi8(0x2f));
+  const __m128i roll = _mm_shuffle_epi8(lut_roll,
+                                        _mm_add_epi8(eq_2f, hi_nibbles));
+  *out = _mm_add_epi8(in, roll);
+  return 1;
+}
+
+/** Pack sixteen 6-bit values in <b>in</b> into 12 bytes at the bottom of
+ * the return value. */
+ATTR_TARGET("ssse3")
+static inline __m128i
+b64_dec_pack_ssse3(__m128i in)
+{
+  const __m128i ab_bc = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+  const __m128i abcd = _mm_madd_epi16(ab_bc, _mm_set1_epi32(0x00011000));
+  return _mm_shuffle_epi8(abcd, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                              14, 13, 12, -1, -1, -1, -1));
+}
+
+/** Base64-encode 12-byte groups from <b>in</b> into <b>out</b> while we
+ * can read 16 bytes, without going past <b>n</b> input bytes or reading
+ * past <b>readable</b> bytes.  Return the number of input bytes used. */
+ATTR_TARGET("ssse3")
+static size_t
+base64_encode_ssse3(char *out, const uint8_t *in, size_t n, size_t readable)
+{
+  size_t done = 0;
+  while (done + 12 <= n && done + 16 <= readable) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in + done));
+    v = b64_enc_translate_ssse3(b64_enc_reshuffle_ssse3(v));
+    _mm_storeu_si128((__m128i *)out, v);
+    out += 16;
+    done += 12;
+  }
+  return done;
+}
+
+/** As base64_encode_ssse3, but 24 bytes at a time with AVX2. */
+ATTR_TARGET("avx2")
+static size_t
+base64_encode_avx2(char *out, const uint8_t *in, size_t n, size_t readable)
+{
+  size_t done = 0;
+  while (done + 24 <= n && done + 28 <= readable) {
+    const __m128i lo = _mm_loadu_si128((const __m128i *)(in + done));
+    const __m128i hi = _mm_loadu_si128((const __m128i *)(in + done + 12));
+    __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+    v = _mm256_shuffle_epi8(v, _mm256_broadcastsi128_si256(
+             _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1)));
+    const __m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+    const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    const __m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+    const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    const __m256i idx = _mm256_or_si256(t1, t3);
+
+    const __m256i shift_lut = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+        '/' - 63, 'A', 0, 0));
+    __m256i r = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+    const __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx);
+    r = _mm256_or_si256(r, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+    r = _mm256_shuffle_epi8(shift_lut, r);
+    _mm256_storeu_si256((__m256i *)out, _mm256_add_epi8(r, idx));
+    out += 32;
+    done += 24;
+  }
+  return done;
+}
+
+/** Decode 16-character blocks of pure base64 alphabet from <b>in</b>
+ * (which has <b>n</b> bytes) into <b>out</b> (which has room for
+ * <b>outlen</b> bytes).  Stop at the first block containing anything else.
+ * Return the number of characters consumed; we wrote 3/4 that many bytes. */
+ATTR_TARGET("ssse3")
+static size_t
+base64_decode_ssse3(uint8_t *out, size_t outlen, const char *in, size_t n)
+{
+  size_t done = 0, written = 0;
+  uint8_t tmp[16];
+  while (done + 16 <= n && written + 12 <= outlen) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(in + done));
+    if (!b64_dec_translate_ssse3(v, &v))
+      break;
+    _mm_storeu_si128((__m128i *)tmp, b64_dec_pack_ssse3(v));
+    memcpy(out + written, tmp, 12);
+    done += 16;
+    written += 12;
+  }
+  return done;
+}
+
+/** As base64_decode_ssse3, but 32 characters at a time with AVX2. */
+ATTR_TARGET("avx2")
+static size_t
+base64_decode_avx2(uint8_t *out, size_t outlen, const char *in, size_t n)
+{
+  const __m256i lut_lo = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+      0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+      0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A));
+  const __m256i lut_hi = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+      0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+      0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10));
+  const __m256i lut_roll = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+      0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0));
+  const __m256i pack_shuf = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  size_t done = 0, written = 0;
+  uint8_t tmp[32];
+
+  while (done + 32 <= n && written + 24 <= outlen) {
+    const __m256i in_v = _mm256_loadu_si256((const __m256i *)(in + done));
+    const __m256i hi_nibbles =
+      _mm256_and_si256(_mm256_srli_epi32(in_v, 4), nibble);
+    const __m256i lo_nibbles = _mm256_and_si256(in_v, nibble);
+    const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+    if (!_mm256_testz_si256(lo, hi))
+      break;
+    const __m256i eq_2f = _mm256_cmpeq_epi8(in_v, _mm256_set1_epi8(0x2f));
+    const __m256i roll = _mm256_shuffle_epi8(lut_roll,
+                                       _mm256_add_epi8(eq_2f, hi_nibbles));
+    const __m256i vals = _mm256_add_epi8(in_v, roll);
+    const __m256i ab_bc =
+      _mm256_maddubs_epi16(vals, _mm256_set1_epi32(0x01400140));
+    const __m256i abcd =
+      _mm256_madd_epi16(ab_bc, _mm256_set1_epi32(0x00011000));
+    _mm256_storeu_si256((__m256i *)tmp, _mm256_shuffle_epi8(abcd, pack_shuf));
+    memcpy(out + written, tmp, 12);
+    memcpy(out + written + 12, tmp + 16, 12);
+    done += 32;
+    written += 24;
+  }
+  return done;
+}
+
+/** Hex-encode 16-byte blocks of <b>in</b> (which has <b>n</b> bytes) into
+ * <b>out</b>.  Return the number of input bytes used. */
+ATTR_TARGET("ssse3")
+static size_t
+base16_encode_ssse3(char *out, const uint8_t *in, size_t n)
+{
+  const __m128i lut = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                                    '8', '9', 'A', 'B', 'C', 'D', 'E', 'F');
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  size_t done = 0;
+  while (done + 16 <= n) {
+    const __m128i v = _mm_loadu_si128((const __m128i *)(in + done));
+    const __m128i hi = _mm_shuffle_epi8(lut,
+                          _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+    const __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, nibble));
+    _mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(out + 16), _mm_unpackhi_epi8(hi, lo));
+    out += 32;
+    done += 16;
+  }
+  return done;
+}
+
+/** As base16_encode_ssse3, but 32 bytes at a time with AVX2. */
+ATTR_TARGET("avx2")
+static size_t
+base16_encode_avx2(char *out, const uint8_t *in, size_t n)
+{
+  const __m256i lut = _mm256_broadcastsi128_si256(
+      _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+                    '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'));
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  size_t done = 0;
+  while (done + 32 <= n) {
+    const __m256i v = _mm256_loadu_si256((const __m256i *)(in + done));
+    const __m256i hi = _mm256_shuffle_epi8(lut,
+                          _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    const __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, nibble));
+    /* unpack works within 128-bit lanes, so put the lanes back in order. */
+    const __m256i a = _mm256_unpacklo_epi8(hi, lo);
+    const __m256i b = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256((__m256i *)out, _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256((__m256i *)(out + 32),
+                        _mm256_permute2x128_si256(a, b, 0x31));
+    out += 64;
+    done += 32;
+  }
+  return done;
+}
+
+/** Convert 16 hex digits in <b>c</b> to their values in *<b>out</b>.
+ * Return 0 if any of them isn't a hex digit, else 1. */
+ATTR_TARGET("ssse3")
+static inline int
+b16_dec_translate_ssse3(__m128i c, __m128i *out)
+{
+  const __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+  const __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)),
+                                          d);
+  const __m128i l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)),
+                                 _mm_set1_epi8('a'));
+  const __m128i is_alpha = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(5)),
+                                          l);
+  if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xffff)
+    return 0;
+  *out = _mm_or_si128(_mm_and_si128(is_digit, d),
+                      _mm_and_si128(is_alpha,
+                                    _mm_add_epi8(l, _mm_set1_epi8(10))));
+  return 1;
+}
+
+/** Decode 32-digit blocks of hex from <b>in</b> (which has <b>n</b>
+ * characters) into <b>out</b>.  Stop at the first block containing a
+ * non-hex character.  Return the number of characters consumed. */
+ATTR_TARGET("ssse3")
+static size_t
+base16_decode_ssse3(uint8_t *out, const char *in, size_t n)
+{
+  const __m128i weights = _mm_set1_epi16(0x0110);
+  size_t done = 0;
+  while (done + 32 <= n) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(in + done));
+    __m128i b = _mm_loadu_si128((const __m128i *)(in + done + 16));
+    if (!b16_dec_translate_ssse3(a, &a) || !b16_dec_translate_ssse3(b, &b))
+      break;
+    a = _mm_maddubs_epi16(a, weights);
+    b = _mm_maddubs_epi16(b, weights);
+    _mm_storeu_si128((__m128i *)out, _mm_packus_epi16(a, b));
+    out += 16;
+    done += 32;
+  }
+  return done;
+}
+
+/** As base16_decode_ssse3, but 64 digits at a time with AVX2. */
+ATTR_TARGET("avx2")
+static size_t
+base16_decode_avx2(uint8_t *out, const char *in, size_t n)
+{
+  const __m256i weights = _mm256_set1_epi16(0x0110);
+  const __m256i zero_ch = _mm256_set1_epi8('0');
+  const __m256i nine = _mm256_set1_epi8(9);
+  const __m256i five = _mm256_set1_epi8(5);
+  const __m256i lower = _mm256_set1_epi8(0x20);
+  const __m256i a_ch = _mm256_set1_epi8('a');
+  const __m256i ten = _mm256_set1_epi8(10);
+  size_t done = 0;
+  while (done + 64 <= n) {
+    __m256i v[2];
+    int i, ok = 1;
+    for (i = 0; i < 2; ++i) {
+      const __m256i c =
+        _mm256_loadu_si256((const __m256i *)(in + done + 32*i));
+      const __m256i d = _mm256_sub_epi8(c, zero_ch);
+      const __m256i is_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(d, nine), d);
+      const __m256i l = _mm256_sub_epi8(_mm256_or_si256(c, lower), a_ch);
+      const __m256i is_alpha = _mm256_cmpeq_epi8(_mm256_min_epu8(l, five), l);
+      if (_mm256_movemask_epi8(_mm256_or_si256(is_digit, is_alpha)) != -1)
+        ok = 0;
+      v[i] = _mm256_or_si256(_mm256_and_si256(is_digit, d),
+                             _mm256_and_si256(is_alpha,
+                                              _mm256_add_epi8(l, ten)));
+      v[i] = _mm256_maddubs_epi16(v[i], weights);
+    }
+    if (!ok)
+      break;
+    /* packus works within 128-bit lanes, so put the lanes back in order. */
+    const __m256i packed = _mm256_packus_epi16(v[0], v[1]);
+    _mm256_storeu_si256((__m256i *)out,
+                        _mm256_permute4x64_epi64(packed, 0xd8));
+    out += 32;
+    done += 64;
+  }
+  return done;
+}
+#endif /* defined(HAVE_X86_SIMD_CODECS) */
+
 #define BASE64_OPENSSL_LINELEN 64
 
 /** Return the Base64 encoded size of <b>srclen</b> bytes of data in
@@ -172,6 +556,41 @@ static const char base64_encode_table[64] = {
   '4', '5', '6', '7', '8', '9', '+', '/'
 };
 
+/** Base64-encode the <b>n</b> bytes at <b>in</b>, where <b>n</b> is a
+ * multiple of 3, into the 4*<b>n</b>/3 characters at <b>out</b>, without
+ * padding, newlines, or a NUL.  We may read up to <b>readable</b> bytes
+ * (at least <b>n</b>) from <b>in</b>. */
+static void
+base64_encode_groups(char *out, const uint8_t *in, size_t n, size_t readable)
+{
+  size_t done = 0;
+
+#ifdef HAVE_X86_SIMD_CODECS
+  const int level = codec_level_get();
+  if (level >= BASE_CODEC_AVX2) {
+    done = base64_encode_avx2(out, in, n, readable);
+    out += done / 3 * 4;
+  }
+  if (level >= BASE_CODEC_SSSE3) {
+    const size_t k = base64_encode_ssse3(out, in + done, n - done,
+                                         readable - done);
+    out += k / 3 * 4;
+    done += k;
+  }
+#else
+  (void) readable;
+#endif /* defined(HAVE_X86_SIMD_CODECS) */
+
+  for ( ; done + 3 <= n; done += 3) {
+    const uint32_t v = (((uint32_t)in[done]) << 16) |
+                       (((uint32_t)in[done+1]) << 8) | in[done+2];
+    *out++ = base64_encode_table[(v >> 18) & 0x3f];
+    *out++ = base64_encode_table[(v >> 12) & 0x3f];
+    *out++ = base64_encode_table[(v >> 6) & 0x3f];
+    *out++ = base64_encode_table[v & 0x3f];
+  }
+}
+
 /** Base64 encode <b>srclen</b> bytes of data from <b>src</b>.  Write
  * the result into <b>dest</b>, if it will fit within <b>destlen</b>
  * bytes. Return the number of bytes written on success; -1 if
@@ -207,10 +626,23 @@ base64_encode(char *dest, size_t destlen, const char *src, size_t srclen,
   /* Make sure we leave no uninitialized data in the destination buffer. */
   memset(dest, 0, destlen);
 
-  /* XXX/Yawning: If this ends up being too slow, this can be sped up
-   * by separating the multiline format case and the normal case, and
-   * processing 48 bytes of input at a time when newlines are desired.
-   */
+  /* Encode whole lines (in the multiline format) or whole 3-byte groups
+   * (otherwise) in bulk; the loop below handles whatever is left over. */
+  if (flags & BASE64_ENCODE_MULTILINE) {
+    const size_t line_bytes = BASE64_OPENSSL_LINELEN / 4 * 3;
+    while ((size_t)(eous - usrc) >= line_bytes) {
+      base64_encode_groups(d, usrc, line_bytes, eous - usrc);
+      d += BASE64_OPENSSL_LINELEN;
+      *d++ = '\n';
+      usrc += line_bytes;
+    }
+  } else {
+    const size_t n_bulk = srclen / 3 * 3;
+    base64_encode_groups(d, usrc, n_bulk, srclen);
+    d += n_bulk / 3 * 4;
+    usrc += n_bulk;
+  }
+
 #define ENCODE_CHAR(ch) \
   STMT_BEGIN                                                    \
     *d++ = ch;                                                  \
@@ -227,8 +659,8 @@ base64_encode(char *dest, size_t destlen, const char *src, size_t srclen,
 
 #define ENCODE_PAD() ENCODE_CHAR('=')
 
-  /* Iterate over all the bytes in src.  Each one will add 8 bits to the
-   * value we're encoding.  Accumulate bits in <b>n</b>, and whenever we
+  /* Iterate over the remaining bytes in src.  Each one will add 8 bits to
+   * the value we're encoding.  Accumulate bits in <b>n</b>, and whenever we
    * have 24 bits, batch them into 4 bytes and flush those bytes to dest.
    */
   for ( ; usrc < eous; ++usrc) {
@@ -378,6 +810,24 @@ base64_decode(char *dest, size_t destlen, const char *src, size_t srclen)
    * 24 bits, batch them into 3 bytes and flush those bytes to dest.
    */
   for ( ; src < eos; ++src) {
+#ifdef HAVE_X86_SIMD_CODECS
+    /* At a group boundary, decode as many blocks of plain base64 characters
+     * as we can in bulk. */
+    if (n_idx == 0 && eos - src >= 16 &&
+        codec_level_get() > BASE_CODEC_SCALAR) {
+      size_t used = 0;
+      if (codec_level_get() >= BASE_CODEC_AVX2)
+        used = base64_decode_avx2((uint8_t*)dest + di, destlen - di,
+                                  src, eos - src);
+      used += base64_decode_ssse3((uint8_t*)dest + di + used / 4 * 3,
+                                  destlen - di - used / 4 * 3,
+                                  src + used, eos - src - used);
+      src += used;
+      di += used / 4 * 3;
+      if (src == eos)
+        break;
+    }
+#endif /* defined(HAVE_X86_SIMD_CODECS) */
     unsigned char c = (unsigned char) *src;
     uint8_t v = base64_decode_table[c];
     switch (v) {
@@ -456,6 +906,19 @@ base16_encode(char *dest, size_t destlen, const char *src, size_t srclen)
 
   cp = dest;
   end = src+srclen;
+#ifdef HAVE_X86_SIMD_CODECS
+  {
+    const int level = codec_level_get();
+    size_t done = 0;
+    if (level >= BASE_CODEC_AVX2)
+      done = base16_encode_avx2(cp, (const uint8_t*)src, srclen);
+    if (level >= BASE_CODEC_SSSE3)
+      done += base16_encode_ssse3(cp + 2*done, (const uint8_t*)src + done,
+                                  srclen - done);
+    src += done;
+    cp += 2*done;
+  }
+#endif /* defined(HAVE_X86_SIMD_CODECS) */
   while (src<end) {
     *cp++ = "0123456789ABCDEF"[ (*(const uint8_t*)src) >> 4 ];
     *cp++ = "0123456789ABCDEF"[ (*(const uint8_t*)src) & 0xf ];
@@ -518,6 +981,19 @@ base16_decode(char *dest, size_t destlen, const char *src, size_t srclen)
   memset(dest, 0, destlen);
 
   end = src+srclen;
+#ifdef HAVE_X86_SIMD_CODECS
+  {
+    const int level = codec_level_get();
+    size_t done = 0;
+    if (level >= BASE_CODEC_AVX2)
+      done = base16_decode_avx2((uint8_t*)dest, src, srclen);
+    if (level >= BASE_CODEC_SSSE3)
+      done += base16_decode_ssse3((uint8_t*)dest + done/2, src + done,
+                                  srclen - done);
+    src += done;
+    dest += done/2;
+  }
+#endif /* defined(HAVE_X86_SIMD_CODECS) */
   while (src<end) {
     v1 = hex_decode_digit_(*src);
     v2 = hex_decode_digit_(*(src+1));
@@ -44,6 +44,15 @@ void base32_encode(char *dest, size_t destlen, const char *src, size_t srclen);
 int base32_decode(char *dest, size_t destlen, const char *src, size_t srclen);
 size_t base32_encoded_size(size_t srclen);
 
+/** @{ */
+/** Implementations of our base64 and base16 codecs, slowest to fastest.
+ * See base_codec_set_max_level(). */
+#define BASE_CODEC_SCALAR 0
+#define BASE_CODEC_SSSE3 1
+#define BASE_CODEC_AVX2 2
+/** @} */
+int base_codec_set_max_level(int max_level);
+
 int hex_decode_digit(char c);
 void base16_encode(char *dest, size_t destlen, const char *src, size_t srclen);
 int base16_decode(char *dest, size_t destlen, const char *src, size_t srclen);
@@ -594,6 +594,25 @@ replyqueue_new(uint32_t alertsocks_flags)
   return rq;
 }
 
+/** Release all storage held by the reply queue <b>rq</b>. Any answers still
+ * waiting on it are dropped without running their reply functions. The
+ * caller must make sure that no thread pool will post to <b>rq</b> again. */
+void
+replyqueue_free(replyqueue_t *rq)
+{
+  if (!rq)
+    return;
+
+  while (!TOR_TAILQ_EMPTY(&rq->answers)) {
+    workqueue_entry_t *work = TOR_TAILQ_FIRST(&rq->answers);
+    TOR_TAILQ_REMOVE(&rq->answers, work, next_work);
+    workqueue_entry_free(work);
+  }
+  alert_sockets_close(&rq->alert);
+  tor_mutex_uninit(&rq->lock);
+  tor_free(rq);
+}
+
 /**
  * Return the "read socket" for a given reply queue.  The main thread should
  * listen for read events on this socket, and call replyqueue_process() every
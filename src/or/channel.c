@@ -169,39 +169,156 @@ STATIC uint64_t estimated_total_queue_size = 0;
 /* Digest->channel map
  *
  * Similar to the one used in connection_or.c, this maps from the identity
- * digest of a remote endpoint to a channel_t to that endpoint.  Channels
+ * digest of a remote endpoint to the channel_ts to that endpoint.  Channels
  * should be placed here when registered and removed when they close or error.
- * If more than one channel exists, follow the next_with_same_id pointer
- * as a linked list.
- */
-static HT_HEAD(channel_idmap, channel_idmap_entry_s) channel_identity_map =
-  HT_INITIALIZER();
-
-typedef struct channel_idmap_entry_s {
-  HT_ENTRY(channel_idmap_entry_s) node;
+ *
+ * Relays look up this map on every EXTEND, so it is a flat open-addressing
+ * table with linear probing rather than an HT_ of separately allocated
+ * entries: a lookup is a single probe sequence over contiguous slots.  The
+ * first CHANNEL_IDMAP_N_INLINE channels for an identity live in the slot
+ * itself, and the rare extra ones in a smartlist.  Each slot also caches
+ * the last channel that channel_get_for_extend() picked for its identity.
+ */
+
+/** Number of channels per identity that fit in a map slot */
+#define CHANNEL_IDMAP_N_INLINE 2
+/** Smallest number of slots in the map; must be a power of two */
+#define CHANNEL_IDMAP_MIN_SLOTS 64
+
+typedef struct channel_idmap_entry_t {
+  /** Hash of digest */
+  unsigned hash;
+  /** Number of channels with this identity; zero iff the slot is empty */
+  int n_chans;
+  /** RSA identity digest of the remote endpoint */
   uint8_t digest[DIGEST_LEN];
-  TOR_LIST_HEAD(channel_list_s, channel_s) channel_list;
+  /** The first CHANNEL_IDMAP_N_INLINE channels with this identity */
+  channel_t *chans[CHANNEL_IDMAP_N_INLINE];
+  /** Any further channels with this identity, or NULL */
+  smartlist_t *more_chans;
+  /** The channel channel_get_for_extend() last chose for this identity, or
+   * NULL if anything that could change its choice has happened since. */
+  channel_t *best;
+  /** True iff best was chosen without an Ed25519 identity to match */
+  unsigned int best_for_any_ed:1;
 } channel_idmap_entry_t;
 
-static inline unsigned
-channel_idmap_hash(const channel_idmap_entry_t *ent)
+/** Slots of the identity map */
+static channel_idmap_entry_t *channel_idmap_slots = NULL;
+/** Number of slots in channel_idmap_slots; zero or a power of two */
+static unsigned channel_idmap_n_slots = 0;
+/** Number of nonempty slots in channel_idmap_slots */
+static unsigned channel_idmap_n_used = 0;
+
+/** Return the <b>idx</b>th channel in identity map entry <b>ent</b>. */
+static inline channel_t *
+channel_idmap_entry_get(const channel_idmap_entry_t *ent, int idx)
 {
-  return (unsigned) siphash24g(ent->digest, DIGEST_LEN);
+  if (idx < CHANNEL_IDMAP_N_INLINE)
+    return ent->chans[idx];
+  return smartlist_get(ent->more_chans, idx - CHANNEL_IDMAP_N_INLINE);
 }
 
-static inline int
-channel_idmap_eq(const channel_idmap_entry_t *a,
-                  const channel_idmap_entry_t *b)
+/** Return the identity map entry for <b>digest</b>, or NULL if there is no
+ * channel with that identity. */
+static channel_idmap_entry_t *
+channel_idmap_find(const char *digest)
 {
-  return tor_memeq(a->digest, b->digest, DIGEST_LEN);
+  unsigned hash, mask, i;
+
+  if (!channel_idmap_n_slots)
+    return NULL;
+
+  hash = (unsigned) siphash24g(digest, DIGEST_LEN);
+  mask = channel_idmap_n_slots - 1;
+  for (i = hash & mask; channel_idmap_slots[i].n_chans; i = (i + 1) & mask) {
+    if (channel_idmap_slots[i].hash == hash &&
+        tor_memeq(channel_idmap_slots[i].digest, digest, DIGEST_LEN))
+      return &channel_idmap_slots[i];
+  }
+
+  return NULL;
 }
 
-HT_PROTOTYPE(channel_idmap, channel_idmap_entry_s, node, channel_idmap_hash,
-             channel_idmap_eq)
-HT_GENERATE2(channel_idmap, channel_idmap_entry_s, node, channel_idmap_hash,
-             channel_idmap_eq, 0.5,  tor_reallocarray_, tor_free_)
+/** Return the first empty slot in the probe sequence for <b>hash</b>. */
+static channel_idmap_entry_t *
+channel_idmap_free_slot(unsigned hash)
+{
+  unsigned mask = channel_idmap_n_slots - 1, i;
 
-static cell_queue_entry_t * cell_queue_entry_dup(cell_queue_entry_t *q);
+  for (i = hash & mask; channel_idmap_slots[i].n_chans; i = (i + 1) & mask)
+    ;
+
+  return &channel_idmap_slots[i];
+}
+
+/** Make sure the identity map has room for one more entry while staying at
+ * most half full. */
+static void
+channel_idmap_reserve_one(void)
+{
+  channel_idmap_entry_t *old_slots = channel_idmap_slots;
+  unsigned old_n_slots = channel_idmap_n_slots, i;
+
+  if ((channel_idmap_n_used + 1) * 2 <= channel_idmap_n_slots)
+    return;
+
+  channel_idmap_n_slots = old_n_slots ? old_n_slots * 2 :
+    CHANNEL_IDMAP_MIN_SLOTS;
+  channel_idmap_slots = tor_calloc(channel_idmap_n_slots,
+                                   sizeof(channel_idmap_entry_t));
+  for (i = 0; i < old_n_slots; ++i) {
+    if (old_slots[i].n_chans) {
+      memcpy(channel_idmap_free_slot(old_slots[i].hash), &old_slots[i],
+             sizeof(channel_idmap_entry_t));
+    }
+  }
+  tor_free(old_slots);
+}
+
+/** Remove the (now empty) identity map entry <b>ent</b>, moving later
+ * entries back so that no probe sequence is broken. */
+static void
+channel_idmap_remove_slot(channel_idmap_entry_t *ent)
+{
+  unsigned mask = channel_idmap_n_slots - 1;
+  unsigned hole = (unsigned) (ent - channel_idmap_slots), i, home;
+
+  smartlist_free(ent->more_chans);
+  for (i = (hole + 1) & mask; channel_idmap_slots[i].n_chans;
+       i = (i + 1) & mask) {
+    home = channel_idmap_slots[i].hash & mask;
+    /* Leave this entry where it is if its home slot lies cyclically in
+     * (hole, i]: moving it to the hole would put it before its home. */
+    if (hole <= i ? (hole < home && home <= i) : (hole < home || home <= i))
+      continue;
+    memcpy(&channel_idmap_slots[hole], &channel_idmap_slots[i],
+           sizeof(channel_idmap_entry_t));
+    hole = i;
+  }
+  memset(&channel_idmap_slots[hole], 0, sizeof(channel_idmap_entry_t));
+  --channel_idmap_n_used;
+}
+
+/** Forget which channel channel_get_for_extend() last chose for the
+ * identity of <b>chan</b>. */
+static void
+channel_idmap_forget_best(const channel_t *chan)
+{
+  channel_idmap_entry_t *ent;
+
+  if (tor_digest_is_zero(chan->identity_digest))
+    return;
+
+  ent = channel_idmap_find(chan->identity_digest);
+  if (ent)
+    ent->best = NULL;
+}
+
+static cell_queue_entry_t *
+cell_queue_entry_dup(const cell_queue_entry_t *q);
+static void cell_queue_entry_free_contents(cell_queue_entry_t *q,
+                                           int handed_off);
 #if 0
 static int cell_queue_entry_is_padding(cell_queue_entry_t *q);
 #endif
@@ -235,6 +352,11 @@ static size_t channel_get_cell_queue_entry_size(channel_t *chan,
                                                 cell_queue_entry_t *q);
 static void
 channel_write_cell_queue_entry(channel_t *chan, cell_queue_entry_t *q);
+static int channel_outgoing_queue_is_empty(const channel_t *chan);
+static void channel_outgoing_queue_append(channel_t *chan,
+                                          const cell_queue_entry_t *q);
+static void channel_outgoing_queue_remove_first(channel_t *chan,
+                                                int handed_off);
 
 /***********************************
  * Channel state utility functions *
@@ -631,7 +753,8 @@ channel_listener_unregister(channel_listener_t *chan_l)
 static void
 channel_add_to_digest_map(channel_t *chan)
 {
-  channel_idmap_entry_t *ent, search;
+  channel_idmap_entry_t *ent;
+  unsigned hash;
 
   tor_assert(chan);
 
@@ -641,15 +764,24 @@ channel_add_to_digest_map(channel_t *chan)
   /* Assert that there is a digest */
   tor_assert(!tor_digest_is_zero(chan->identity_digest));
 
-  memcpy(search.digest, chan->identity_digest, DIGEST_LEN);
-  ent = HT_FIND(channel_idmap, &channel_identity_map, &search);
+  ent = channel_idmap_find(chan->identity_digest);
   if (! ent) {
-    ent = tor_malloc(sizeof(channel_idmap_entry_t));
+    channel_idmap_reserve_one();
+    hash = (unsigned) siphash24g(chan->identity_digest, DIGEST_LEN);
+    ent = channel_idmap_free_slot(hash);
+    ent->hash = hash;
     memcpy(ent->digest, chan->identity_digest, DIGEST_LEN);
-    TOR_LIST_INIT(&ent->channel_list);
-    HT_INSERT(channel_idmap, &channel_identity_map, ent);
+    ++channel_idmap_n_used;
   }
-  TOR_LIST_INSERT_HEAD(&ent->channel_list, chan, next_with_same_id);
+  if (ent->n_chans < CHANNEL_IDMAP_N_INLINE) {
+    ent->chans[ent->n_chans] = chan;
+  } else {
+    if (!ent->more_chans)
+      ent->more_chans = smartlist_new();
+    smartlist_add(ent->more_chans, chan);
+  }
+  ++(ent->n_chans);
+  ent->best = NULL;
 
   log_debug(LD_CHANNEL,
             "Added channel %p (global ID " U64_FORMAT ") "
@@ -669,54 +801,41 @@ channel_add_to_digest_map(channel_t *chan)
 static void
 channel_remove_from_digest_map(channel_t *chan)
 {
-  channel_idmap_entry_t *ent, search;
+  channel_idmap_entry_t *ent;
+  channel_t *last;
+  int idx;
 
   tor_assert(chan);
 
   /* Assert that there is a digest */
   tor_assert(!tor_digest_is_zero(chan->identity_digest));
 
-#if 0
-  /* Make sure we have a map */
-  if (!channel_identity_map) {
-    /*
-     * No identity map, so we can't find it by definition.  This
-     * case is similar to digestmap_get() failing below.
-     */
-    log_warn(LD_BUG,
-             "Trying to remove channel %p (global ID " U64_FORMAT ") "
-             "with digest %s from identity map, but didn't have any identity "
-             "map",
-             chan, U64_PRINTF_ARG(chan->global_identifier),
-             hex_str(chan->identity_digest, DIGEST_LEN));
-    /* Clear out its next/prev pointers */
-    if (chan->next_with_same_id) {
-      chan->next_with_same_id->prev_with_same_id = chan->prev_with_same_id;
-    }
-    if (chan->prev_with_same_id) {
-      chan->prev_with_same_id->next_with_same_id = chan->next_with_same_id;
-    }
-    chan->next_with_same_id = NULL;
-    chan->prev_with_same_id = NULL;
-
-    return;
+  ent = channel_idmap_find(chan->identity_digest);
+  for (idx = 0; ent && idx < ent->n_chans; ++idx) {
+    if (channel_idmap_entry_get(ent, idx) == chan)
+      break;
   }
-#endif /* 0 */
-
-  /* Pull it out of its list, wherever that list is */
-  TOR_LIST_REMOVE(chan, next_with_same_id);
-
-  memcpy(search.digest, chan->identity_digest, DIGEST_LEN);
-  ent = HT_FIND(channel_idmap, &channel_identity_map, &search);
+  if (ent && idx == ent->n_chans)
+    ent = NULL;
 
   /* Look for it in the map */
   if (ent) {
-    /* Okay, it's here */
+    /* Okay, it's here; move the last channel into its place */
+    last = channel_idmap_entry_get(ent, ent->n_chans - 1);
+    if (idx < CHANNEL_IDMAP_N_INLINE)
+      ent->chans[idx] = last;
+    else
+      smartlist_set(ent->more_chans, idx - CHANNEL_IDMAP_N_INLINE, last);
+    if (ent->n_chans > CHANNEL_IDMAP_N_INLINE)
+      smartlist_del_keeporder(ent->more_chans,
+                              ent->n_chans - CHANNEL_IDMAP_N_INLINE - 1);
+    else
+      ent->chans[ent->n_chans - 1] = NULL;
+    --(ent->n_chans);
+    ent->best = NULL;
 
-    if (TOR_LIST_EMPTY(&ent->channel_list)) {
-      HT_REMOVE(channel_idmap, &channel_identity_map, ent);
-      tor_free(ent);
-    }
+    if (ent->n_chans == 0)
+      channel_idmap_remove_slot(ent);
 
     log_debug(LD_CHANNEL,
               "Removed channel %p (global ID " U64_FORMAT ") from "
@@ -798,8 +917,8 @@ channel_t *
 channel_find_by_remote_identity(const char *rsa_id_digest,
                                 const ed25519_public_key_t *ed_id)
 {
-  channel_t *rv = NULL;
-  channel_idmap_entry_t *ent, search;
+  channel_idmap_entry_t *ent;
+  int i;
 
   tor_assert(rsa_id_digest); /* For now, we require that every channel have
                               * an RSA identity, and that every lookup
@@ -810,16 +929,14 @@ channel_find_by_remote_identity(const char *rsa_id_digest,
     ed_id = NULL;
   }
 
-  memcpy(search.digest, rsa_id_digest, DIGEST_LEN);
-  ent = HT_FIND(channel_idmap, &channel_identity_map, &search);
-  if (ent) {
-    rv = TOR_LIST_FIRST(&ent->channel_list);
-  }
-  while (rv && ! channel_remote_identity_matches(rv, rsa_id_digest, ed_id)) {
-    rv = channel_next_with_rsa_identity(rv);
+  ent = channel_idmap_find(rsa_id_digest);
+  for (i = 0; ent && i < ent->n_chans; ++i) {
+    channel_t *chan = channel_idmap_entry_get(ent, i);
+    if (channel_remote_identity_matches(chan, rsa_id_digest, ed_id))
+      return chan;
   }
 
-  return rv;
+  return NULL;
 }
 
 /**
@@ -832,9 +949,18 @@ channel_find_by_remote_identity(const char *rsa_id_digest,
 channel_t *
 channel_next_with_rsa_identity(channel_t *chan)
 {
+  channel_idmap_entry_t *ent;
+  int i;
+
   tor_assert(chan);
 
-  return TOR_LIST_NEXT(chan, next_with_same_id);
+  ent = channel_idmap_find(chan->identity_digest);
+  for (i = 0; ent && i + 1 < ent->n_chans; ++i) {
+    if (channel_idmap_entry_get(ent, i) == chan)
+      return channel_idmap_entry_get(ent, i + 1);
+  }
+
+  return NULL;
 }
 
 /**
@@ -849,24 +975,30 @@ channel_next_with_rsa_identity(channel_t *chan)
 void
 channel_check_for_duplicates(void)
 {
-  channel_idmap_entry_t **iter;
+  channel_idmap_entry_t *ent;
   channel_t *chan;
+  unsigned slot;
+  int i;
   int total_relay_connections = 0, total_relays = 0, total_canonical = 0;
   int total_half_canonical = 0;
   int total_gt_one_connection = 0, total_gt_two_connections = 0;
   int total_gt_four_connections = 0;
 
-  HT_FOREACH(iter, channel_idmap, &channel_identity_map) {
+  for (slot = 0; slot < channel_idmap_n_slots; ++slot) {
     int connections_to_relay = 0;
+    ent = &channel_idmap_slots[slot];
+
+    if (!ent->n_chans)
+      continue;
 
     /* Only consider relay connections */
-    if (!connection_or_digest_is_known_relay((char*)(*iter)->digest))
+    if (!connection_or_digest_is_known_relay((char*)ent->digest))
       continue;
 
     total_relays++;
 
-    for (chan = TOR_LIST_FIRST(&(*iter)->channel_list); chan;
-        chan = channel_next_with_rsa_identity(chan)) {
+    for (i = 0; i < ent->n_chans; ++i) {
+      chan = channel_idmap_entry_get(ent, i);
 
       if (CHANNEL_CONDEMNED(chan) || !CHANNEL_IS_OPEN(chan))
         continue;
@@ -940,9 +1072,6 @@ channel_init(channel_t *chan)
   TOR_SIMPLEQ_INIT(&chan->incoming_queue);
   TOR_SIMPLEQ_INIT(&chan->outgoing_queue);
 
-  /* Initialize list entries. */
-  memset(&chan->next_with_same_id, 0, sizeof(chan->next_with_same_id));
-
   /* Timestamp it */
   channel_timestamp_created(chan);
 
@@ -1004,9 +1133,8 @@ channel_free(channel_t *chan)
     circuitmux_set_policy(chan->cmux, NULL);
   }
 
-  /* Remove all timers and associated handle entries now */
-  timer_free(chan->padding_timer);
-  channel_handle_free(chan->timer_handle);
+  /* Take it off the padding wheel and remove handle entries now */
+  channelpadding_release_channel(chan);
   channel_handles_clear(chan);
 
   /* Call a free method if there is one */
@@ -1023,6 +1151,7 @@ channel_free(channel_t *chan)
   }
 
   /* We're in CLOSED or ERROR, so the cell queue is already empty */
+  tor_free(chan->outgoing_ring);
 
   tor_free(chan);
 }
@@ -1087,9 +1216,8 @@ channel_force_free(channel_t *chan)
     circuitmux_set_policy(chan->cmux, NULL);
   }
 
-  /* Remove all timers and associated handle entries now */
-  timer_free(chan->padding_timer);
-  channel_handle_free(chan->timer_handle);
+  /* Take it off the padding wheel and remove handle entries now */
+  channelpadding_release_channel(chan);
   channel_handles_clear(chan);
 
   /* Call a free method if there is one */
@@ -1110,10 +1238,8 @@ channel_force_free(channel_t *chan)
   TOR_SIMPLEQ_INIT(&chan->incoming_queue);
 
   /* Outgoing cell queue is similar, but we can have to free packed cells */
-  TOR_SIMPLEQ_FOREACH_SAFE(cell, &chan->outgoing_queue, next, cell_tmp) {
-    cell_queue_entry_free(cell, 0);
-  }
-  TOR_SIMPLEQ_INIT(&chan->outgoing_queue);
+  channel_outgoing_queue_clear(chan);
+  tor_free(chan->outgoing_ring);
 
   tor_free(chan);
 }
@@ -1735,7 +1861,7 @@ channel_set_remote_end(channel_t *chan,
  */
 
 static cell_queue_entry_t *
-cell_queue_entry_dup(cell_queue_entry_t *q)
+cell_queue_entry_dup(const cell_queue_entry_t *q)
 {
   cell_queue_entry_t *rv = NULL;
 
@@ -1758,6 +1884,18 @@ cell_queue_entry_free(cell_queue_entry_t *q, int handed_off)
 {
   if (!q) return;
 
+  cell_queue_entry_free_contents(q, handed_off);
+  tor_free(q);
+}
+
+/**
+ * Free the cell held by a cell_queue_entry_t, but not the entry itself;
+ * the handed_off parameter is as for cell_queue_entry_free().
+ */
+
+static void
+cell_queue_entry_free_contents(cell_queue_entry_t *q, int handed_off)
+{
   if (!handed_off) {
     /*
      * If we handed it off, the recipient becomes responsible (or
@@ -1800,7 +1938,6 @@ cell_queue_entry_free(cell_queue_entry_t *q, int handed_off)
         break;
     }
   }
-  tor_free(q);
 }
 
 #if 0
@@ -1870,6 +2007,112 @@ cell_queue_entry_new_var(var_cell_t *var_cell)
   return q;
 }
 
+/**
+ * Return true iff <b>chan</b> has no queued outgoing cells, in either its
+ * ring or its overflow queue.
+ */
+
+static int
+channel_outgoing_queue_is_empty(const channel_t *chan)
+{
+  return chan->outgoing_ring_len == 0 &&
+    TOR_SIMPLEQ_EMPTY(&chan->outgoing_queue);
+}
+
+/**
+ * Return the number of queued outgoing cells on <b>chan</b>.
+ */
+
+STATIC int
+channel_outgoing_queue_len(const channel_t *chan)
+{
+  return chan->outgoing_ring_len +
+    chan_cell_queue_len(&chan->outgoing_queue);
+}
+
+/**
+ * Return the oldest queued outgoing cell on <b>chan</b>, or NULL if there
+ * is none.  The entry stays owned by the channel.
+ */
+
+STATIC cell_queue_entry_t *
+channel_outgoing_queue_first(channel_t *chan)
+{
+  if (chan->outgoing_ring_len > 0)
+    return &chan->outgoing_ring[chan->outgoing_ring_head];
+
+  return TOR_SIMPLEQ_FIRST(&chan->outgoing_queue);
+}
+
+/**
+ * Queue a shallow copy of <b>q</b> at the tail of <b>chan</b>'s outgoing
+ * queue.  This uses the channel's ring when it has room, and only
+ * allocates once the ring is full, so a channel that keeps up with its
+ * lower layer never allocates here after its first queued cell.
+ */
+
+static void
+channel_outgoing_queue_append(channel_t *chan, const cell_queue_entry_t *q)
+{
+  int idx;
+
+  /* Once we've spilled over, keep spilling so cells stay in order */
+  if (chan->outgoing_ring_len == CHANNEL_OUTGOING_RING_LEN ||
+      !TOR_SIMPLEQ_EMPTY(&chan->outgoing_queue)) {
+    cell_queue_entry_t *tmp = cell_queue_entry_dup(q);
+    TOR_SIMPLEQ_INSERT_TAIL(&chan->outgoing_queue, tmp, next);
+    return;
+  }
+
+  if (!chan->outgoing_ring) {
+    chan->outgoing_ring = tor_calloc(CHANNEL_OUTGOING_RING_LEN,
+                                     sizeof(cell_queue_entry_t));
+  }
+
+  idx = (chan->outgoing_ring_head + chan->outgoing_ring_len) %
+    CHANNEL_OUTGOING_RING_LEN;
+  memcpy(&chan->outgoing_ring[idx], q, sizeof(*q));
+  ++(chan->outgoing_ring_len);
+}
+
+/**
+ * Remove the oldest queued outgoing cell from <b>chan</b>, freeing its
+ * contents unless <b>handed_off</b> is set.
+ */
+
+static void
+channel_outgoing_queue_remove_first(channel_t *chan, int handed_off)
+{
+  cell_queue_entry_t *q;
+
+  if (chan->outgoing_ring_len > 0) {
+    q = &chan->outgoing_ring[chan->outgoing_ring_head];
+    cell_queue_entry_free_contents(q, handed_off);
+    memset(q, 0, sizeof(*q));
+    chan->outgoing_ring_head = (chan->outgoing_ring_head + 1) %
+      CHANNEL_OUTGOING_RING_LEN;
+    --(chan->outgoing_ring_len);
+    if (chan->outgoing_ring_len == 0)
+      chan->outgoing_ring_head = 0;
+  } else {
+    q = TOR_SIMPLEQ_FIRST(&chan->outgoing_queue);
+    tor_assert(q);
+    TOR_SIMPLEQ_REMOVE_HEAD(&chan->outgoing_queue, next);
+    cell_queue_entry_free(q, handed_off);
+  }
+}
+
+/**
+ * Free every queued outgoing cell on <b>chan</b>; the ring itself is kept.
+ */
+
+STATIC void
+channel_outgoing_queue_clear(channel_t *chan)
+{
+  while (!channel_outgoing_queue_is_empty(chan))
+    channel_outgoing_queue_remove_first(chan, 0);
+}
+
 /**
  * Ask how big the cell contained in a cell_queue_entry_t is
  */
@@ -1911,7 +2154,6 @@ static void
 channel_write_cell_queue_entry(channel_t *chan, cell_queue_entry_t *q)
 {
   int result = 0, sent = 0;
-  cell_queue_entry_t *tmp = NULL;
   size_t cell_bytes;
 
   tor_assert(chan);
@@ -1931,7 +2173,7 @@ channel_write_cell_queue_entry(channel_t *chan, cell_queue_entry_t *q)
   cell_bytes = channel_get_cell_queue_entry_size(chan, q);
 
   /* Can we send it right out?  If so, try */
-  if (TOR_SIMPLEQ_EMPTY(&chan->outgoing_queue) &&
+  if (channel_outgoing_queue_is_empty(chan) &&
       CHANNEL_IS_OPEN(chan)) {
     /* Pick the right write function for this cell type and save the result */
     switch (q->type) {
@@ -1979,8 +2221,7 @@ channel_write_cell_queue_entry(channel_t *chan, cell_queue_entry_t *q)
      * We have to copy the queue entry passed in, since the caller probably
      * used the stack.
      */
-    tmp = cell_queue_entry_dup(q);
-    TOR_SIMPLEQ_INSERT_TAIL(&chan->outgoing_queue, tmp, next);
+    channel_outgoing_queue_append(chan, q);
     /* Update global counters */
     ++n_channel_cells_queued;
     ++n_channel_cells_in_queues;
@@ -2159,6 +2400,9 @@ channel_change_state_(channel_t *chan, channel_state_t to_state)
     }
 
     if (!tor_digest_is_zero(chan->identity_digest)) {
+      /* Any state change can change what channel_get_for_extend() picks */
+      channel_idmap_forget_best(chan);
+
       /* Now we need to handle the identity map */
       was_in_id_map = !(from_state == CHANNEL_STATE_CLOSING ||
                         from_state == CHANNEL_STATE_CLOSED ||
@@ -2212,7 +2456,7 @@ channel_change_state_(channel_t *chan, channel_state_t to_state)
       to_state == CHANNEL_STATE_ERROR) {
     /* Assert that all queues are empty */
     tor_assert(TOR_SIMPLEQ_EMPTY(&chan->incoming_queue));
-    tor_assert(TOR_SIMPLEQ_EMPTY(&chan->outgoing_queue));
+    tor_assert(channel_outgoing_queue_is_empty(chan));
   }
 }
 
@@ -2241,7 +2485,7 @@ channel_change_state_open(channel_t *chan)
   /* Check for queued cells to process */
   if (! TOR_SIMPLEQ_EMPTY(&chan->incoming_queue))
     channel_process_cells(chan);
-  if (! TOR_SIMPLEQ_EMPTY(&chan->outgoing_queue))
+  if (! channel_outgoing_queue_is_empty(chan))
     channel_flush_cells(chan);
 }
 
@@ -2381,13 +2625,13 @@ channel_flush_some_cells, (channel_t *chan, ssize_t num_cells))
        * but not double-count ones we might get later in
        * channel_flush_some_cells_from_outgoing_queue()
        */
-      q_len_before = chan_cell_queue_len(&(chan->outgoing_queue));
+      q_len_before = channel_outgoing_queue_len(chan);
 
       /* Try to get more cells from any active circuits */
       num_cells_from_circs = channel_flush_from_first_active_circuit(
           chan, clamped_num_cells);
 
-      q_len_after = chan_cell_queue_len(&(chan->outgoing_queue));
+      q_len_after = channel_outgoing_queue_len(chan);
 
       /*
        * If it claims we got some, adjust the flushed counter and consider
@@ -2449,7 +2693,7 @@ channel_flush_some_cells_from_outgoing_queue(channel_t *chan,
   /* If we aren't in CHANNEL_STATE_OPEN, nothing goes through */
   if (CHANNEL_IS_OPEN(chan)) {
     while ((unlimited || num_cells > flushed) &&
-           NULL != (q = TOR_SIMPLEQ_FIRST(&chan->outgoing_queue))) {
+           NULL != (q = channel_outgoing_queue_first(chan))) {
       free_q = 0;
       handed_off = 0;
 
@@ -2544,12 +2788,9 @@ channel_flush_some_cells_from_outgoing_queue(channel_t *chan,
       }
 
       /*
-       * if free_q is set, we used it and should remove the queue entry;
-       * we have to do the free down here so TOR_SIMPLEQ_REMOVE_HEAD isn't
-       * accessing freed memory
+       * if free_q is set, we used it and should remove the queue entry
        */
       if (free_q) {
-        TOR_SIMPLEQ_REMOVE_HEAD(&chan->outgoing_queue, next);
         /*
          * ...and we handed a cell off to the lower layer, so we should
          * update the counters.
@@ -2561,8 +2802,8 @@ channel_flush_some_cells_from_outgoing_queue(channel_t *chan,
         channel_assert_counter_consistency();
         /* Update the channel's queue size too */
         chan->bytes_in_queue -= cell_size;
-        /* Finally, free q */
-        cell_queue_entry_free(q, handed_off);
+        /* Finally, remove q from the queue and free it */
+        channel_outgoing_queue_remove_first(chan, handed_off);
         q = NULL;
       } else {
         /* No cell removed from list, so we can't go on any further */
@@ -2572,7 +2813,7 @@ channel_flush_some_cells_from_outgoing_queue(channel_t *chan,
   }
 
   /* Did we drain the queue? */
-  if (TOR_SIMPLEQ_EMPTY(&chan->outgoing_queue)) {
+  if (channel_outgoing_queue_is_empty(chan)) {
     channel_timestamp_drained(chan);
   }
 
@@ -3336,12 +3577,14 @@ channel_listener_free_list(smartlist_t *listeners, int mark_for_close)
  * This gets called from tor_free_all() in main.c to clean up on exit.
  * It will close all registered channels and free associated storage,
  * then free the all_channels, active_channels, listening_channels and
- * finished_channels lists and also channel_identity_map.
+ * finished_channels lists and also the identity map.
  */
 
 void
 channel_free_all(void)
 {
+  unsigned slot;
+
   log_debug(LD_CHANNEL,
             "Shutting down channels...");
 
@@ -3387,11 +3630,14 @@ channel_free_all(void)
     all_listeners = NULL;
   }
 
-  /* Now free channel_identity_map */
+  /* Now free the identity map */
   log_debug(LD_CHANNEL,
-            "Freeing channel_identity_map");
+            "Freeing channel identity map");
   /* Geez, anything still left over just won't die ... let it leak then */
-  HT_CLEAR(channel_idmap, &channel_identity_map);
+  for (slot = 0; slot < channel_idmap_n_slots; ++slot)
+    smartlist_free(channel_idmap_slots[slot].more_chans);
+  tor_free(channel_idmap_slots);
+  channel_idmap_n_slots = channel_idmap_n_used = 0;
 
   /* Same with channel_gid_map */
   log_debug(LD_CHANNEL,
@@ -3482,6 +3728,48 @@ channel_is_better(channel_t *a, channel_t *b)
   else return 0;
 }
 
+/**
+ * Return true iff the channel cached in the identity map entry <b>ent</b>
+ * is still the one channel_get_for_extend() would pick for <b>ed_id</b>.
+ *
+ * We only cache canonical channels: no channel that fails the target
+ * address check can beat a canonical one, so the cached choice holds for
+ * any target address.  Everything else that channel_is_better() looks at
+ * clears the cache when it changes; the one exception is the final
+ * circuit-count tie-break between channels created in the same second,
+ * where we're happy to keep using the channel we already picked.
+ */
+static int
+channel_idmap_best_is_current(const channel_idmap_entry_t *ent,
+                              const ed25519_public_key_t *ed_id)
+{
+  channel_t *chan = ent->best;
+
+  if (!chan)
+    return 0;
+  if (!ed_id && !ent->best_for_any_ed)
+    return 0;
+
+  return channel_remote_identity_matches(chan, NULL, ed_id) &&
+    CHANNEL_IS_OPEN(chan) &&
+    !channel_is_client(chan) &&
+    !channel_is_bad_for_new_circs(chan) &&
+    channel_is_canonical(chan);
+}
+
+/**
+ * Note that something channel_get_for_extend() uses to choose between
+ * channels has changed for <b>chan</b>, so any choice it cached for the
+ * identity of <b>chan</b> must be made again.
+ */
+void
+channel_note_extend_preference_changed(channel_t *chan)
+{
+  tor_assert(chan);
+
+  channel_idmap_forget_best(chan);
+}
+
 /**
  * Get a channel to extend a circuit
  *
@@ -3501,18 +3789,29 @@ channel_get_for_extend(const char *rsa_id_digest,
                        int *launch_out)
 {
   channel_t *chan, *best = NULL;
-  int n_inprogress_goodaddr = 0, n_old = 0;
+  channel_idmap_entry_t *ent;
+  int i, n_inprogress_goodaddr = 0, n_old = 0;
   int n_noncanonical = 0, n_possible = 0;
 
   tor_assert(msg_out);
   tor_assert(launch_out);
+  tor_assert(rsa_id_digest);
 
-  chan = channel_find_by_remote_identity(rsa_id_digest, ed_id);
+  if (ed_id && ed25519_public_key_is_zero(ed_id))
+    ed_id = NULL;
 
-  /* Walk the list, unrefing the old one and refing the new at each
-   * iteration.
-   */
-  for (; chan; chan = channel_next_with_rsa_identity(chan)) {
+  ent = channel_idmap_find(rsa_id_digest);
+
+  /* Usually, we can just reuse the last channel we picked. */
+  if (ent && channel_idmap_best_is_current(ent, ed_id)) {
+    *msg_out = "Connection is fine; using it.";
+    *launch_out = 0;
+    return ent->best;
+  }
+
+  /* Otherwise, walk all the channels with this RSA identity. */
+  for (i = 0; ent && i < ent->n_chans; ++i) {
+    chan = channel_idmap_entry_get(ent, i);
     tor_assert(tor_memeq(chan->identity_digest,
                          rsa_id_digest, DIGEST_LEN));
 
@@ -3577,6 +3876,10 @@ channel_get_for_extend(const char *rsa_id_digest,
   }
 
   if (best) {
+    if (channel_is_canonical(best)) {
+      ent->best = best;
+      ent->best_for_any_ed = (ed_id == NULL);
+    }
     *msg_out = "Connection is fine; using it.";
     *launch_out = 0;
     return best;
@@ -3759,7 +4062,7 @@ channel_dump_statistics, (channel_t *chan, int severity))
       " and %d queued outgoing cells",
       U64_PRINTF_ARG(chan->global_identifier),
       chan_cell_queue_len(&chan->incoming_queue),
-      chan_cell_queue_len(&chan->outgoing_queue));
+      channel_outgoing_queue_len(chan));
 
   /* Describe circuits */
   tor_log(severity, LD_GENERAL,
@@ -4042,7 +4345,7 @@ channel_has_queued_writes(channel_t *chan)
   tor_assert(chan);
   tor_assert(chan->has_queued_writes);
 
-  if (! TOR_SIMPLEQ_EMPTY(&chan->outgoing_queue)) {
+  if (! channel_outgoing_queue_is_empty(chan)) {
     has_writes = 1;
   } else {
     /* Check with the lower layer */
@@ -4079,6 +4382,7 @@ channel_mark_bad_for_new_circs(channel_t *chan)
   tor_assert(chan);
 
   chan->is_bad_for_new_circs = 1;
+  channel_idmap_forget_best(chan);
 }
 
 /**
@@ -4109,6 +4413,7 @@ channel_mark_client(channel_t *chan)
   tor_assert(chan);
 
   chan->is_client = 1;
+  channel_idmap_forget_best(chan);
 }
 
 /**
@@ -4123,6 +4428,7 @@ channel_clear_client(channel_t *chan)
   tor_assert(chan);
 
   chan->is_client = 0;
+  channel_idmap_forget_best(chan);
 }
 
 /**
@@ -4303,7 +4609,7 @@ channel_num_cells_writeable(channel_t *chan)
     /* Query lower layer */
     result = chan->num_cells_writeable(chan);
     /* Subtract cell queue length, if any */
-    result -= chan_cell_queue_len(&chan->outgoing_queue);
+    result -= channel_outgoing_queue_len(chan);
     if (result < 0) result = 0;
   } else {
     /* No cells are writeable in any other state */
@@ -4727,18 +5033,20 @@ channel_set_circid_type,(channel_t *chan,
 }
 
 /** Helper for channel_update_bad_for_new_circs(): Perform the
- * channel_update_bad_for_new_circs operation on all channels in <b>lst</b>,
- * all of which MUST have the same RSA ID.  (They MAY have different
- * Ed25519 IDs.) */
+ * channel_update_bad_for_new_circs operation on all channels in the
+ * identity map entry <b>ent</b>, all of which have the same RSA ID.  (They
+ * MAY have different Ed25519 IDs.) */
 static void
-channel_rsa_id_group_set_badness(struct channel_list_s *lst, int force)
+channel_rsa_id_group_set_badness(channel_idmap_entry_t *ent, int force)
 {
   /*XXXX This function should really be about channels. 15056 */
   channel_t *chan;
+  int i;
 
   /* First, get a minimal list of the ed25519 identites */
   smartlist_t *ed_identities = smartlist_new();
-  TOR_LIST_FOREACH(chan, lst, next_with_same_id) {
+  for (i = 0; i < ent->n_chans; ++i) {
+    chan = channel_idmap_entry_get(ent, i);
     uint8_t *id_copy =
       tor_memdup(&chan->ed25519_identity.pubkey, DIGEST256_LEN);
     smartlist_add(ed_identities, id_copy);
@@ -4750,7 +5058,8 @@ channel_rsa_id_group_set_badness(struct channel_list_s *lst, int force)
    * it.  */
   smartlist_t *or_conns = smartlist_new();
   SMARTLIST_FOREACH_BEGIN(ed_identities, const uint8_t *, ed_id) {
-    TOR_LIST_FOREACH(chan, lst, next_with_same_id) {
+    for (i = 0; i < ent->n_chans; ++i) {
+      chan = channel_idmap_entry_get(ent, i);
       channel_tls_t *chantls = BASE_CHAN_TO_TLS(chan);
       if (tor_memneq(ed_id, &chan->ed25519_identity.pubkey, DIGEST256_LEN))
         continue;
@@ -4783,21 +5092,18 @@ void
 channel_update_bad_for_new_circs(const char *digest, int force)
 {
   if (digest) {
-    channel_idmap_entry_t *ent;
-    channel_idmap_entry_t search;
-    memset(&search, 0, sizeof(search));
-    memcpy(search.digest, digest, DIGEST_LEN);
-    ent = HT_FIND(channel_idmap, &channel_identity_map, &search);
+    channel_idmap_entry_t *ent = channel_idmap_find(digest);
     if (ent) {
-      channel_rsa_id_group_set_badness(&ent->channel_list, force);
+      channel_rsa_id_group_set_badness(ent, force);
     }
     return;
   }
 
   /* no digest; just look at everything. */
-  channel_idmap_entry_t **iter;
-  HT_FOREACH(iter, channel_idmap, &channel_identity_map) {
-    channel_rsa_id_group_set_badness(&(*iter)->channel_list, force);
+  unsigned slot;
+  for (slot = 0; slot < channel_idmap_n_slots; ++slot) {
+    if (channel_idmap_slots[slot].n_chans)
+      channel_rsa_id_group_set_badness(&channel_idmap_slots[slot], force);
   }
 }
 
@@ -97,10 +97,9 @@ struct channel_s {
    *  is scheduled. */
   uint64_t next_padding_time_ms;
 
-  /** The callback pointer for the padding callbacks */
-  tor_timer_t *padding_timer;
-  /** The handle to this channel (to free on canceled timers) */
-  struct channel_handle_t *timer_handle;
+  /** List entry for the channelpadding.c timing wheel slot this channel is
+   * waiting in; only meaningful while pending_padding_callback is set. */
+  TOR_LIST_ENTRY(channel_s) padding_wheel_node;
 
   /**
    * These two fields specify the minimum and maximum negotiated timeout
@@ -262,18 +261,25 @@ struct channel_s {
   /** Nickname of the OR on the other side, or NULL if none. */
   char *nickname;
 
-  /**
-   * Linked list of channels with the same RSA identity digest, for use with
-   * the digest->channel map
-   */
-  TOR_LIST_ENTRY(channel_s) next_with_same_id;
-
   /** List of incoming cells to handle */
   chan_cell_queue_t incoming_queue;
 
-  /** List of queued outgoing cells */
+  /** List of queued outgoing cells that did not fit in outgoing_ring */
   chan_cell_queue_t outgoing_queue;
 
+  /**
+   * Fixed-capacity ring of queued outgoing cells, allocated the first time
+   * this channel has to queue a cell and kept until the channel is freed.
+   * Queued cells go here first, and only spill over into outgoing_queue
+   * when the ring is full; every entry in the ring is older than every
+   * entry in outgoing_queue.
+   */
+  struct cell_queue_entry_s *outgoing_ring;
+  /** Index of the oldest entry in outgoing_ring */
+  uint16_t outgoing_ring_head;
+  /** Number of entries in outgoing_ring */
+  uint16_t outgoing_ring_len;
+
   /** Circuit mux for circuits sending on this channel */
   circuitmux_t *cmux;
 
@@ -480,11 +486,18 @@ struct cell_queue_entry_s {
   } u;
 };
 
+/** Number of outgoing cells a channel can queue without allocating */
+#define CHANNEL_OUTGOING_RING_LEN 32
+
 /* Cell queue functions for benefit of test suite */
 STATIC int chan_cell_queue_len(const chan_cell_queue_t *queue);
 
 STATIC void cell_queue_entry_free(cell_queue_entry_t *q, int handed_off);
 
+STATIC int channel_outgoing_queue_len(const channel_t *chan);
+STATIC cell_queue_entry_t *channel_outgoing_queue_first(channel_t *chan);
+STATIC void channel_outgoing_queue_clear(channel_t *chan);
+
 void channel_write_cell_generic_(channel_t *chan, const char *cell_type,
                                  void *cell, cell_queue_entry_t *q);
 #endif /* defined(CHANNEL_PRIVATE_) */
@@ -616,6 +629,7 @@ channel_t * channel_find_by_remote_identity(const char *rsa_id_digest,
  * The RSA key will match for all returned elements; the Ed25519 key might not.
  */
 channel_t * channel_next_with_rsa_identity(channel_t *chan);
+void channel_note_extend_preference_changed(channel_t *chan);
 
 /*
  * Helper macros to lookup state of given channel.
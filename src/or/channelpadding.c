@@ -27,9 +27,35 @@ STATIC int channelpadding_get_netflow_inactive_timeout_ms(const channel_t *);
 STATIC int channelpadding_send_disable_command(channel_t *);
 STATIC int64_t channelpadding_compute_time_until_pad_for_netflow(channel_t *);
 
-/** The total number of pending channelpadding timers */
+/** The total number of channels waiting on the padding wheel */
 static uint64_t total_timers_pending;
 
+/**
+ * Channels that are about to send padding wait on a single coarse timing
+ * wheel, instead of each getting its own tor_timer_t.  Time is divided into
+ * ticks of CHANNELPADDING_WHEEL_TICK_MSEC, and slot i of the wheel holds
+ * the channels whose padding is due in the tick congruent to i modulo
+ * CHANNELPADDING_WHEEL_SLOTS.  We only schedule padding at most
+ * TOR_HOUSEKEEPING_CALLBACK_MSEC plus slack in the future, so a wheel that
+ * covers more than that never has two ticks' channels in the same slot.
+ *
+ * One tor_timer_t fires for the earliest nonempty tick, and is only
+ * rescheduled when a channel needs padding before that.
+ */
+/** Granularity of the padding wheel, in msec. */
+#define CHANNELPADDING_WHEEL_TICK_MSEC 10
+/** Number of slots in the padding wheel; must be a power of two. */
+#define CHANNELPADDING_WHEEL_SLOTS 256
+/** The slots of the padding wheel. */
+static TOR_LIST_HEAD(padding_wheel_slot_s, channel_s)
+  padding_wheel[CHANNELPADDING_WHEEL_SLOTS];
+/** The earliest tick that may still have channels on the wheel. */
+static uint64_t padding_wheel_tick;
+/** The timer that fires for the earliest nonempty tick of the wheel. */
+static tor_timer_t *padding_wheel_timer;
+/** The tick padding_wheel_timer is scheduled for, or 0 if it isn't. */
+static uint64_t padding_wheel_timer_tick;
+
 /** These are cached consensus parameters for netflow */
 /** The timeout lower bound that is allowed before sending padding */
 static int consensus_nf_ito_low;
@@ -408,21 +434,16 @@ channelpadding_send_padding_cell_for_callback(channel_t *chan)
 }
 
 /**
- * tor_timer callback function for us to send padding on an idle channel.
+ * Padding wheel handler for a channel whose padding time has come.
  *
- * This function just obtains the channel from the callback handle, ensures
- * it is still valid, and then hands it off to
- * channelpadding_send_padding_cell_for_callback(), which checks if
+ * This function ensures the channel is still valid, and then hands it off
+ * to channelpadding_send_padding_cell_for_callback(), which checks if
  * the channel is still idle before sending padding.
  */
 static void
-channelpadding_send_padding_callback(tor_timer_t *timer, void *args,
-                                     const struct monotime_t *when)
+channelpadding_send_padding_callback(channel_t *chan)
 {
-  channel_t *chan = channel_handle_get((struct channel_handle_t*)args);
-  (void)timer; (void)when;
-
-  if (chan && CHANNEL_CAN_HANDLE_CELLS(chan)) {
+  if (CHANNEL_CAN_HANDLE_CELLS(chan)) {
     /* Hrmm.. It might be nice to have an equivalent to assert_connection_ok
      * for channels. Then we could get rid of the channeltls dependency */
     tor_assert(TO_CONN(BASE_CHAN_TO_TLS(chan)->conn)->magic ==
@@ -431,11 +452,82 @@ channelpadding_send_padding_callback(tor_timer_t *timer, void *args,
 
     channelpadding_send_padding_cell_for_callback(chan);
   } else {
-     log_fn(LOG_INFO,LD_OR,
-            "Channel closed while waiting for timer.");
+    chan->pending_padding_callback = 0;
+    log_fn(LOG_INFO,LD_OR,
+           "Channel closed while waiting for timer.");
   }
+}
 
-  total_timers_pending--;
+/**
+ * Send padding on every channel on the wheel whose tick has come by
+ * <b>now_ms</b>, and advance the wheel past it.
+ */
+static void
+channelpadding_run_wheel(uint64_t now_ms)
+{
+  uint64_t due_tick = now_ms / CHANNELPADDING_WHEEL_TICK_MSEC;
+  channel_t *chan;
+
+  while (total_timers_pending && padding_wheel_tick <= due_tick) {
+    struct padding_wheel_slot_s *slot =
+      &padding_wheel[padding_wheel_tick & (CHANNELPADDING_WHEEL_SLOTS-1)];
+
+    while ((chan = TOR_LIST_FIRST(slot)) != NULL) {
+      TOR_LIST_REMOVE(chan, padding_wheel_node);
+      total_timers_pending--;
+      channelpadding_send_padding_callback(chan);
+    }
+    ++padding_wheel_tick;
+  }
+
+  if (padding_wheel_tick <= due_tick)
+    padding_wheel_tick = due_tick + 1;
+}
+
+/**
+ * Make sure padding_wheel_timer will fire no later than the start of
+ * <b>tick</b>.
+ */
+static void
+channelpadding_wheel_timer_schedule(uint64_t tick, uint64_t now_ms)
+{
+  struct timeval timeout;
+  uint64_t in_ms;
+
+  if (padding_wheel_timer_tick && padding_wheel_timer_tick <= tick)
+    return;
+
+  in_ms = tick * CHANNELPADDING_WHEEL_TICK_MSEC - now_ms;
+  timeout.tv_sec = (time_t)(in_ms / TOR_MSEC_PER_SEC);
+  timeout.tv_usec = (int)((in_ms % TOR_MSEC_PER_SEC) * TOR_USEC_PER_MSEC);
+
+  timer_schedule(padding_wheel_timer, &timeout);
+  padding_wheel_timer_tick = tick;
+}
+
+/**
+ * tor_timer callback for the padding wheel: send any padding that is due,
+ * and schedule the timer for the next nonempty tick.
+ */
+static void
+channelpadding_wheel_callback(tor_timer_t *timer, void *args,
+                              const struct monotime_t *when)
+{
+  uint64_t now_ms = monotime_coarse_absolute_msec(), tick;
+  (void)timer; (void)args; (void)when;
+
+  padding_wheel_timer_tick = 0;
+  channelpadding_run_wheel(now_ms);
+
+  for (tick = padding_wheel_tick;
+       total_timers_pending &&
+         tick < padding_wheel_tick + CHANNELPADDING_WHEEL_SLOTS; ++tick) {
+    if (!TOR_LIST_EMPTY(
+          &padding_wheel[tick & (CHANNELPADDING_WHEEL_SLOTS-1)])) {
+      channelpadding_wheel_timer_schedule(tick, now_ms);
+      break;
+    }
+  }
 }
 
 /**
@@ -449,7 +541,7 @@ channelpadding_send_padding_callback(tor_timer_t *timer, void *args,
 static channelpadding_decision_t
 channelpadding_schedule_padding(channel_t *chan, int in_ms)
 {
-  struct timeval timeout;
+  uint64_t now_ms, tick;
   tor_assert(!chan->pending_padding_callback);
 
   if (in_ms <= 0) {
@@ -458,29 +550,60 @@ channelpadding_schedule_padding(channel_t *chan, int in_ms)
     return CHANNELPADDING_PADDING_SENT;
   }
 
-  timeout.tv_sec = in_ms/TOR_MSEC_PER_SEC;
-  timeout.tv_usec = (in_ms%TOR_USEC_PER_MSEC)*TOR_USEC_PER_MSEC;
-
-  if (!chan->timer_handle) {
-    chan->timer_handle = channel_handle_new(chan);
-  }
-
-  if (chan->padding_timer) {
-    timer_set_cb(chan->padding_timer,
-                 channelpadding_send_padding_callback,
-                 chan->timer_handle);
-  } else {
-    chan->padding_timer = timer_new(channelpadding_send_padding_callback,
-                                    chan->timer_handle);
-  }
-  timer_schedule(chan->padding_timer, &timeout);
-
+  /* Catch up on anything that's overdue, so that every tick on the wheel
+   * is within CHANNELPADDING_WHEEL_SLOTS of padding_wheel_tick. */
+  now_ms = monotime_coarse_absolute_msec();
+  channelpadding_run_wheel(now_ms);
+
+  /* Padding times are random over several seconds, so going off up to a
+   * tick early doesn't matter. */
+  tick = (now_ms + in_ms) / CHANNELPADDING_WHEEL_TICK_MSEC;
+  if (tick < padding_wheel_tick)
+    tick = padding_wheel_tick;
+  if (BUG(tick >= padding_wheel_tick + CHANNELPADDING_WHEEL_SLOTS))
+    tick = padding_wheel_tick + CHANNELPADDING_WHEEL_SLOTS - 1;
+
+  TOR_LIST_INSERT_HEAD(&padding_wheel[tick & (CHANNELPADDING_WHEEL_SLOTS-1)],
+                       chan, padding_wheel_node);
   rep_hist_padding_count_timers(++total_timers_pending);
 
+  if (!padding_wheel_timer)
+    padding_wheel_timer = timer_new(channelpadding_wheel_callback, NULL);
+  channelpadding_wheel_timer_schedule(tick, now_ms);
+
   chan->pending_padding_callback = 1;
   return CHANNELPADDING_PADDING_SCHEDULED;
 }
 
+/**
+ * Take <b>chan</b> off the padding wheel, if it is waiting there; call
+ * this before freeing a channel.
+ */
+void
+channelpadding_release_channel(channel_t *chan)
+{
+  tor_assert(chan);
+
+  if (!chan->pending_padding_callback)
+    return;
+
+  TOR_LIST_REMOVE(chan, padding_wheel_node);
+  total_timers_pending--;
+  chan->pending_padding_callback = 0;
+}
+
+/**
+ * Free the padding wheel timer.  All channels must already have been
+ * released.
+ */
+void
+channelpadding_free_all(void)
+{
+  timer_free(padding_wheel_timer);
+  padding_wheel_timer = NULL;
+  padding_wheel_timer_tick = 0;
+}
+
 /**
  * Calculates the number of milliseconds from now to schedule a padding cell.
  *
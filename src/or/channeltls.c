@@ -163,7 +163,7 @@ channel_tls_common_init(channel_tls_t *tlschan)
 
   chan->cmux = circuitmux_alloc();
   if (cell_ewma_enabled()) {
-    circuitmux_set_policy(chan->cmux, &ewma_policy);
+    circuitmux_set_policy(chan->cmux, cell_ewma_get_policy());
   }
 }
 
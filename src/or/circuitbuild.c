@@ -208,7 +208,9 @@ get_unique_circ_id_by_chan(channel_t *chan)
     }
 
     do {
-      crypto_rand((char*) &test_circ_id, sizeof(test_circ_id));
+      crypto_fast_rng_getbytes(get_thread_fast_rng(),
+                               (uint8_t*) &test_circ_id,
+                               sizeof(test_circ_id));
       test_circ_id &= mask;
     } while (test_circ_id == 0);
 
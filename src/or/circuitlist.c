@@ -946,6 +946,7 @@ circuit_free(circuit_t *circ)
     tor_assert(circ->magic == ORIGIN_CIRCUIT_MAGIC);
 
     circuit_remove_from_origin_circuit_list(ocirc);
+    control_forget_circ_bandwidth(ocirc);
 
     if (ocirc->build_state) {
         extend_info_free(ocirc->build_state->chosen_exit);
@@ -2331,6 +2332,7 @@ circuits_handle_oom(size_t current_allocation)
   int conn_idx;
   size_t mem_to_recover;
   size_t mem_recovered=0;
+  size_t tls_mem_recovered=0;
   int n_circuits_killed=0;
   int n_dirconns_killed=0;
   uint32_t now_ms;
@@ -2349,6 +2351,15 @@ circuits_handle_oom(size_t current_allocation)
   now_ms = (uint32_t)monotime_coarse_absolute_msec();
 
   circlist = circuit_get_global_list();
+
+  /* Before killing anything, give back the TLS buffers of connections that
+   * aren't doing anything: they'll get new ones if they wake up. Whatever
+   * that frees, we don't need to recover by killing circuits. */
+  tls_mem_recovered = connection_or_release_idle_tls_buffers(time(NULL));
+  if (tls_mem_recovered >= mem_to_recover)
+    goto done_recovering_mem;
+  mem_to_recover -= tls_mem_recovered;
+
   SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
     circ->age_tmp = circuit_max_queued_item_age(circ, now_ms);
   } SMARTLIST_FOREACH_END(circ);
@@ -2422,11 +2433,13 @@ circuits_handle_oom(size_t current_allocation)
 
   log_notice(LD_GENERAL, "Removed "U64_FORMAT" bytes by killing %d circuits; "
              "%d circuits remain alive. Also killed %d non-linked directory "
-             "connections.",
+             "connections, and released "U64_FORMAT" bytes of idle TLS "
+             "buffers.",
              U64_PRINTF_ARG(mem_recovered),
              n_circuits_killed,
              smartlist_len(circlist) - n_circuits_killed,
-             n_dirconns_killed);
+             n_dirconns_killed,
+             U64_PRINTF_ARG(tls_mem_recovered));
 }
 
 /** Verify that cpath layer <b>cp</b> has all of its invariants
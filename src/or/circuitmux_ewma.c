@@ -23,6 +23,14 @@
  * circuitmux periodically, so that we don't overflow double.
  *
  *
+ * The same machinery also backs a second policy, ewma_prio_policy, which
+ * keeps one heap per circuit priority class (see MT_PRIORITY_CLASS_* in
+ * or.h).  Within a class circuits are ordered by their EWMA as usual; across
+ * classes we compare the heads of the heaps after multiplying each one's
+ * cell count by a per-class weight, so that premium circuits can win against
+ * regular circuits that have sent fewer cells.  Picking a circuit thus costs
+ * one look at each class head, and requeueing it is O(log n).
+ *
  * This module should be used through the interfaces in circuitmux.c, which it
  * implements.
  *
@@ -56,6 +64,11 @@
 /** The natural logarithm of 0.5. */
 #define LOG_ONEHALF -0.69314718055994529
 
+/** The default weight of a premium circuit's cell count relative to a
+ * regular one, in percent, if it hasn't been overridden by a consensus or a
+ * configuration setting.  100 means "no preference". */
+#define EWMA_DEFAULT_PREMIUM_SCALE_PCT 100
+
 /*** EWMA structures ***/
 
 typedef struct cell_ewma_s cell_ewma_t;
@@ -81,6 +94,9 @@ struct cell_ewma_s {
   /** True iff this is the cell count for a circuit's previous
    * channel. */
   unsigned int is_for_p_chan : 1;
+  /** The priority class whose queue this cell_ewma_t is in, or will be in
+   * once the circuit becomes active. */
+  uint8_t priority_class;
   /** The position of the circuit within the OR connection's priority
    * queue. */
   int heap_index;
@@ -90,12 +106,18 @@ struct ewma_policy_data_s {
   circuitmux_policy_data_t base_;
 
   /**
-   * Priority queue of cell_ewma_t for circuits with queued cells waiting
-   * for room to free up on the channel that owns this circuitmux.  Kept
-   * in heap order according to EWMA.  This was formerly in channel_t, and
-   * in or_connection_t before that.
+   * Priority queues of cell_ewma_t for circuits with queued cells waiting
+   * for room to free up on the channel that owns this circuitmux, one per
+   * priority class.  Each is kept in heap order according to EWMA.  This
+   * was formerly in channel_t, and in or_connection_t before that.
+   */
+  smartlist_t *active_circuit_pqueue[MT_NUM_PRIORITY_CLASSES];
+
+  /**
+   * How many of the queues in active_circuit_pqueue are in use: 1 for
+   * ewma_policy, MT_NUM_PRIORITY_CLASSES for ewma_prio_policy.
    */
-  smartlist_t *active_circuit_pqueue;
+  int n_classes;
 
   /**
    * The tick on which the cell_ewma_ts in active_circuit_pqueue last had
@@ -167,13 +189,18 @@ TO_EWMA_POL_CIRC_DATA(circuitmux_policy_circ_data_t *pol)
 
 /*** Static declarations for circuitmux_ewma.c ***/
 
+static ewma_policy_data_t *ewma_policy_data_new(int n_classes);
 static void add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
 static int compare_cell_ewma_counts(const void *p1, const void *p2);
+static int compare_weighted_cell_ewma_counts(const cell_ewma_t *e1,
+                                             const cell_ewma_t *e2);
 static unsigned cell_ewma_tick_from_timeval(const struct timeval *now,
                                             double *remainder_out);
 static circuit_t * cell_ewma_to_circuit(cell_ewma_t *ewma);
 static inline double get_scale_factor(unsigned from_tick, unsigned to_tick);
-static cell_ewma_t * pop_first_cell_ewma(ewma_policy_data_t *pol);
+static cell_ewma_t * first_cell_ewma(ewma_policy_data_t *pol);
+static cell_ewma_t * pop_first_cell_ewma(ewma_policy_data_t *pol,
+                                         int priority_class);
 static void remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
 static void scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick);
 static void scale_active_circuits(ewma_policy_data_t *pol,
@@ -182,6 +209,8 @@ static void scale_active_circuits(ewma_policy_data_t *pol,
 /*** Circuitmux policy methods ***/
 
 static circuitmux_policy_data_t * ewma_alloc_cmux_data(circuitmux_t *cmux);
+static circuitmux_policy_data_t *
+ewma_prio_alloc_cmux_data(circuitmux_t *cmux);
 static void ewma_free_cmux_data(circuitmux_t *cmux,
                                 circuitmux_policy_data_t *pol_data);
 static circuitmux_policy_circ_data_t *
@@ -225,6 +254,10 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
 static double ewma_scale_factor = 0.1;
 /* DOCDOC ewma_enabled */
 static int ewma_enabled = 0;
+/** The weight by which we multiply the cell count of circuits in each
+ * priority class before comparing them against circuits in other classes.
+ * Regular circuits always have weight 1.0. */
+static double ewma_class_weight[MT_NUM_PRIORITY_CLASSES] = { 1.0, 1.0 };
 
 /*** EWMA circuitmux_policy_t method table ***/
 
@@ -241,26 +274,71 @@ circuitmux_policy_t ewma_policy = {
   /*.cmp_cmux =*/ ewma_cmp_cmux
 };
 
+/*** Priority-class EWMA circuitmux_policy_t method table ***/
+
+circuitmux_policy_t ewma_prio_policy = {
+  /*.alloc_cmux_data =*/ ewma_prio_alloc_cmux_data,
+  /*.free_cmux_data =*/ ewma_free_cmux_data,
+  /*.alloc_circ_data =*/ ewma_alloc_circ_data,
+  /*.free_circ_data =*/ ewma_free_circ_data,
+  /*.notify_circ_active =*/ ewma_notify_circ_active,
+  /*.notify_circ_inactive =*/ ewma_notify_circ_inactive,
+  /*.notify_set_n_cells =*/ NULL, /* EWMA doesn't need this */
+  /*.notify_xmit_cells =*/ ewma_notify_xmit_cells,
+  /*.pick_active_circuit =*/ ewma_pick_active_circuit,
+  /*.cmp_cmux =*/ ewma_cmp_cmux
+};
+
 /*** EWMA method implementations using the below EWMA helper functions ***/
 
 /**
- * Allocate an ewma_policy_data_t and upcast it to a circuitmux_policy_data_t;
- * this is called when setting the policy on a circuitmux_t to ewma_policy.
+ * Allocate an ewma_policy_data_t with <b>n_classes</b> priority queues.
  */
 
-static circuitmux_policy_data_t *
-ewma_alloc_cmux_data(circuitmux_t *cmux)
+static ewma_policy_data_t *
+ewma_policy_data_new(int n_classes)
 {
   ewma_policy_data_t *pol = NULL;
+  int i;
 
-  tor_assert(cmux);
+  tor_assert(n_classes >= 1 && n_classes <= MT_NUM_PRIORITY_CLASSES);
 
   pol = tor_malloc_zero(sizeof(*pol));
   pol->base_.magic = EWMA_POL_DATA_MAGIC;
-  pol->active_circuit_pqueue = smartlist_new();
+  pol->n_classes = n_classes;
+  for (i = 0; i < n_classes; ++i) {
+    pol->active_circuit_pqueue[i] = smartlist_new();
+  }
   pol->active_circuit_pqueue_last_recalibrated = cell_ewma_get_tick();
 
-  return TO_CMUX_POL_DATA(pol);
+  return pol;
+}
+
+/**
+ * Allocate an ewma_policy_data_t and upcast it to a circuitmux_policy_data_t;
+ * this is called when setting the policy on a circuitmux_t to ewma_policy.
+ */
+
+static circuitmux_policy_data_t *
+ewma_alloc_cmux_data(circuitmux_t *cmux)
+{
+  tor_assert(cmux);
+
+  return TO_CMUX_POL_DATA(ewma_policy_data_new(1));
+}
+
+/**
+ * Allocate an ewma_policy_data_t with one priority queue per priority class
+ * and upcast it to a circuitmux_policy_data_t; this is called when setting
+ * the policy on a circuitmux_t to ewma_prio_policy.
+ */
+
+static circuitmux_policy_data_t *
+ewma_prio_alloc_cmux_data(circuitmux_t *cmux)
+{
+  tor_assert(cmux);
+
+  return TO_CMUX_POL_DATA(ewma_policy_data_new(MT_NUM_PRIORITY_CLASSES));
 }
 
 /**
@@ -272,13 +350,16 @@ ewma_free_cmux_data(circuitmux_t *cmux,
                     circuitmux_policy_data_t *pol_data)
 {
   ewma_policy_data_t *pol = NULL;
+  int i;
 
   tor_assert(cmux);
   if (!pol_data) return;
 
   pol = TO_EWMA_POL_DATA(pol_data);
 
-  smartlist_free(pol->active_circuit_pqueue);
+  for (i = 0; i < pol->n_classes; ++i) {
+    smartlist_free(pol->active_circuit_pqueue[i]);
+  }
   tor_free(pol);
 }
 
@@ -351,7 +432,9 @@ ewma_free_circ_data(circuitmux_t *cmux,
 
 /**
  * Handle circuit activation; this inserts the circuit's cell_ewma into
- * the active_circuits_pqueue.
+ * the active_circuits_pqueue of its priority class.  The class is read from
+ * the circuit here, so a change to it takes effect the next time the circuit
+ * becomes active.
  */
 
 static void
@@ -371,6 +454,12 @@ ewma_notify_circ_active(circuitmux_t *cmux,
   pol = TO_EWMA_POL_DATA(pol_data);
   cdata = TO_EWMA_POL_CIRC_DATA(pol_circ_data);
 
+  if (circ->mt_priority_class < pol->n_classes) {
+    cdata->cell_ewma.priority_class = circ->mt_priority_class;
+  } else {
+    cdata->cell_ewma.priority_class = pol->n_classes - 1;
+  }
+
   add_cell_ewma(pol, &(cdata->cell_ewma));
 }
 
@@ -447,17 +536,17 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
 
   /*
    * Since we just sent on this circuit, it should be at the head of
-   * the queue.  Pop the head, assert that it matches, then re-add.
+   * its class's queue.  Pop the head, assert that it matches, then re-add.
    */
-  tmp = pop_first_cell_ewma(pol);
+  tmp = pop_first_cell_ewma(pol, cell_ewma->priority_class);
   tor_assert(tmp == cell_ewma);
   add_cell_ewma(pol, cell_ewma);
 }
 
 /**
  * Pick the preferred circuit to send from; this will be the one with
- * the lowest EWMA value in the priority queue.  This used to be done
- * in channel_flush_from_first_active_circuit().
+ * the lowest weighted EWMA value among the heads of the priority queues.
+ * This used to be done in channel_flush_from_first_active_circuit().
  */
 
 static circuit_t *
@@ -473,9 +562,8 @@ ewma_pick_active_circuit(circuitmux_t *cmux,
 
   pol = TO_EWMA_POL_DATA(pol_data);
 
-  if (smartlist_len(pol->active_circuit_pqueue) > 0) {
-    /* Get the head of the queue */
-    cell_ewma = smartlist_get(pol->active_circuit_pqueue, 0);
+  cell_ewma = first_cell_ewma(pol);
+  if (cell_ewma) {
     circ = cell_ewma_to_circuit(cell_ewma);
   }
 
@@ -503,19 +591,14 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
   p2 = TO_EWMA_POL_DATA(pol_data_2);
 
   if (p1 != p2) {
-    /* Get the head cell_ewma_t from each queue */
-    if (smartlist_len(p1->active_circuit_pqueue) > 0) {
-      ce1 = smartlist_get(p1->active_circuit_pqueue, 0);
-    }
-
-    if (smartlist_len(p2->active_circuit_pqueue) > 0) {
-      ce2 = smartlist_get(p2->active_circuit_pqueue, 0);
-    }
+    /* Get the head cell_ewma_t from each cmux */
+    ce1 = first_cell_ewma(p1);
+    ce2 = first_cell_ewma(p2);
 
     /* Got both of them? */
     if (ce1 != NULL && ce2 != NULL) {
       /* Pick whichever one has the better best circuit */
-      return compare_cell_ewma_counts(ce1, ce2);
+      return compare_weighted_cell_ewma_counts(ce1, ce2);
     } else {
       if (ce1 != NULL ) {
         /* We only have a circuit on cmux_1, so prefer it */
@@ -548,6 +631,27 @@ compare_cell_ewma_counts(const void *p1, const void *p2)
     return 0;
 }
 
+/** Helper for comparing cell_ewma_t values that may be in different
+ * priority classes: scale each cell count by its class weight first. */
+static int
+compare_weighted_cell_ewma_counts(const cell_ewma_t *e1,
+                                  const cell_ewma_t *e2)
+{
+  double c1, c2;
+
+  if (e1->priority_class == e2->priority_class)
+    return compare_cell_ewma_counts(e1, e2);
+
+  c1 = e1->cell_count * ewma_class_weight[e1->priority_class];
+  c2 = e2->cell_count * ewma_class_weight[e2->priority_class];
+  if (c1 < c2)
+    return -1;
+  else if (c1 > c2)
+    return 1;
+  else
+    return 0;
+}
+
 /** Given a cell_ewma_t, return a pointer to the circuit containing it. */
 static circuit_t *
 cell_ewma_to_circuit(cell_ewma_t *ewma)
@@ -626,6 +730,49 @@ cell_ewma_get_tick(void)
   return ((unsigned)approx_time() / EWMA_TICK_LEN);
 }
 
+/** Return the circuitmux policy that our current EWMA settings call for:
+ * NULL if EWMA is disabled, ewma_prio_policy if premium circuits are
+ * weighted differently from regular ones, and ewma_policy otherwise. */
+circuitmux_policy_t *
+cell_ewma_get_policy(void)
+{
+  if (!ewma_enabled)
+    return NULL;
+  if (ewma_class_weight[MT_PRIORITY_CLASS_PREMIUM] < 1.0 - EPSILON)
+    return &ewma_prio_policy;
+  return &ewma_policy;
+}
+
+/** Adjust the weight of premium circuits based on <b>options</b> and
+ * <b>consensus</b>. */
+static void
+cell_ewma_set_premium_scale(const or_options_t *options,
+                            const networkstatus_t *consensus)
+{
+  double scale;
+  const char *source;
+
+  if (options && options->CircuitPriorityPremiumScale > 0.0) {
+    scale = options->CircuitPriorityPremiumScale;
+    source = "CircuitPriorityPremiumScale in configuration";
+  } else if (consensus) {
+    scale = networkstatus_get_param(consensus,
+                                    "CircuitPriorityPremiumScalePct",
+                                    EWMA_DEFAULT_PREMIUM_SCALE_PCT,
+                                    1, 100) / 100.0;
+    source = "CircuitPriorityPremiumScalePct in consensus";
+  } else {
+    scale = EWMA_DEFAULT_PREMIUM_SCALE_PCT / 100.0;
+    source = "Default value";
+  }
+
+  if (scale > 1.0)
+    scale = 1.0;
+  ewma_class_weight[MT_PRIORITY_CLASS_PREMIUM] = scale;
+  log_info(LD_OR, "Premium circuit cell counts weighted by %f because of "
+           "value in %s", scale, source);
+}
+
 /** Adjust the global cell scale factor based on <b>options</b> */
 void
 cell_ewma_set_scale_factor(const or_options_t *options,
@@ -665,6 +812,8 @@ cell_ewma_set_scale_factor(const or_options_t *options,
              "scale factor is %f per %d seconds",
              source, ewma_scale_factor, EWMA_TICK_LEN);
   }
+
+  cell_ewma_set_premium_scale(options, consensus);
 }
 
 /** Return the multiplier necessary to convert the value of a cell sent in
@@ -694,42 +843,47 @@ static void
 scale_active_circuits(ewma_policy_data_t *pol, unsigned cur_tick)
 {
   double factor;
+  int i;
 
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
 
   factor =
     get_scale_factor(
       pol->active_circuit_pqueue_last_recalibrated,
       cur_tick);
   /** Ordinarily it isn't okay to change the value of an element in a heap,
-   * but it's okay here, since we are preserving the order. */
-  SMARTLIST_FOREACH_BEGIN(
-      pol->active_circuit_pqueue,
-      cell_ewma_t *, e) {
-    tor_assert(e->last_adjusted_tick ==
-               pol->active_circuit_pqueue_last_recalibrated);
-    e->cell_count *= factor;
-    e->last_adjusted_tick = cur_tick;
-  } SMARTLIST_FOREACH_END(e);
+   * but it's okay here, since we are preserving the order.  Every class is
+   * scaled by the same factor, so the order between classes holds too. */
+  for (i = 0; i < pol->n_classes; ++i) {
+    tor_assert(pol->active_circuit_pqueue[i]);
+    SMARTLIST_FOREACH_BEGIN(
+        pol->active_circuit_pqueue[i],
+        cell_ewma_t *, e) {
+      tor_assert(e->last_adjusted_tick ==
+                 pol->active_circuit_pqueue_last_recalibrated);
+      e->cell_count *= factor;
+      e->last_adjusted_tick = cur_tick;
+    } SMARTLIST_FOREACH_END(e);
+  }
   pol->active_circuit_pqueue_last_recalibrated = cur_tick;
 }
 
 /** Rescale <b>ewma</b> to the same scale as <b>pol</b>, and add it to
- * <b>pol</b>'s priority queue of active circuits */
+ * <b>pol</b>'s priority queue of active circuits for its class */
 static void
 add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
 {
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
   tor_assert(ewma);
+  tor_assert(ewma->priority_class < pol->n_classes);
+  tor_assert(pol->active_circuit_pqueue[ewma->priority_class]);
   tor_assert(ewma->heap_index == -1);
 
   scale_single_cell_ewma(
       ewma,
       pol->active_circuit_pqueue_last_recalibrated);
 
-  smartlist_pqueue_add(pol->active_circuit_pqueue,
+  smartlist_pqueue_add(pol->active_circuit_pqueue[ewma->priority_class],
                        compare_cell_ewma_counts,
                        offsetof(cell_ewma_t, heap_index),
                        ewma);
@@ -740,25 +894,50 @@ static void
 remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
 {
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
   tor_assert(ewma);
+  tor_assert(ewma->priority_class < pol->n_classes);
+  tor_assert(pol->active_circuit_pqueue[ewma->priority_class]);
   tor_assert(ewma->heap_index != -1);
 
-  smartlist_pqueue_remove(pol->active_circuit_pqueue,
+  smartlist_pqueue_remove(pol->active_circuit_pqueue[ewma->priority_class],
                           compare_cell_ewma_counts,
                           offsetof(cell_ewma_t, heap_index),
                           ewma);
 }
 
+/** Return the cell_ewma_t that should send next on <b>pol</b>: the head of
+ * the priority queue of active circuits whose weighted cell count is lowest,
+ * or NULL if there are no active circuits. */
+static cell_ewma_t *
+first_cell_ewma(ewma_policy_data_t *pol)
+{
+  cell_ewma_t *best = NULL, *head;
+  int i;
+
+  tor_assert(pol);
+
+  for (i = 0; i < pol->n_classes; ++i) {
+    if (smartlist_len(pol->active_circuit_pqueue[i]) == 0)
+      continue;
+    head = smartlist_get(pol->active_circuit_pqueue[i], 0);
+    if (!best || compare_weighted_cell_ewma_counts(head, best) < 0)
+      best = head;
+  }
+
+  return best;
+}
+
 /** Remove and return the first cell_ewma_t from pol's priority queue of
- * active circuits.  Requires that the priority queue is nonempty. */
+ * active circuits for <b>priority_class</b>.  Requires that the priority
+ * queue is nonempty. */
 static cell_ewma_t *
-pop_first_cell_ewma(ewma_policy_data_t *pol)
+pop_first_cell_ewma(ewma_policy_data_t *pol, int priority_class)
 {
   tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
+  tor_assert(priority_class >= 0 && priority_class < pol->n_classes);
+  tor_assert(pol->active_circuit_pqueue[priority_class]);
 
-  return smartlist_pqueue_pop(pol->active_circuit_pqueue,
+  return smartlist_pqueue_pop(pol->active_circuit_pqueue[priority_class],
                               compare_cell_ewma_counts,
                               offsetof(cell_ewma_t, heap_index));
 }
@@ -13,9 +13,11 @@
 #include "circuitmux.h"
 
 extern circuitmux_policy_t ewma_policy;
+extern circuitmux_policy_t ewma_prio_policy;
 
 /* Externally visible EWMA functions */
 int cell_ewma_enabled(void);
+circuitmux_policy_t *cell_ewma_get_policy(void);
 unsigned int cell_ewma_get_tick(void);
 void cell_ewma_set_scale_factor(const or_options_t *options,
                                 const networkstatus_t *consensus);
@@ -1757,7 +1757,7 @@ circuit_build_failed(origin_circuit_t *circ)
                "better connection.",
                TO_CIRCUIT(circ)->n_circ_id, circ->global_identifier,
                channel_get_canonical_remote_descr(n_chan));
-      n_chan->is_bad_for_new_circs = 1;
+      channel_mark_bad_for_new_circs(n_chan);
     } else {
       log_info(LD_OR,
                "Our circuit %u (id: %" PRIu32 ") died before the first hop "
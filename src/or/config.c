@@ -223,6 +223,8 @@ static config_var_t option_vars_[] = {
   V(AlternateDirAuthority,       LINELIST, NULL),
   OBSOLETE("AlternateHSAuthority"),
   V(AssumeReachable,             BOOL,     "0"),
+  V(AsyncLogging,                BOOL,     "0"),
+  V(AsyncLogOverflow,            STRING,   "drop"),
   OBSOLETE("AuthDirBadDir"),
   OBSOLETE("AuthDirBadDirCCs"),
   V(AuthDirBadExit,              LINELIST, NULL),
@@ -246,6 +248,7 @@ static config_var_t option_vars_[] = {
   V(AvoidDiskWrites,             BOOL,     "0"),
   V(BandwidthBurst,              MEMUNIT,  "1 GB"),
   V(BandwidthRate,               MEMUNIT,  "1 GB"),
+  V(BatchConnectionIO,           BOOL,     "0"),
   V(BridgeAuthoritativeDir,      BOOL,     "0"),
   VAR("Bridge",                  LINELIST, Bridges,    NULL),
   V(BridgePassword,              STRING,   NULL),
@@ -254,6 +257,7 @@ static config_var_t option_vars_[] = {
   V(BridgeDistribution,          STRING,   NULL),
   V(CellStatistics,              BOOL,     "0"),
   V(MoneTorStatistics,           DOUBLE,   "0.0"),
+  V(MoneTorStatisticsMiddle,     DOUBLE,   "0.0"),
   V(PaddingStatistics,           BOOL,     "1"),
   V(LearnCircuitBuildTimeout,    BOOL,     "1"),
   V(CircuitBuildTimeout,         INTERVAL, "0"),
@@ -261,6 +265,7 @@ static config_var_t option_vars_[] = {
   V(CircuitsAvailableTimeout,    INTERVAL, "0"),
   V(CircuitStreamTimeout,        INTERVAL, "0"),
   V(CircuitPriorityHalflife,     DOUBLE,  "-100.0"), /*negative:'Use default'*/
+  V(CircuitPriorityPremiumScale, DOUBLE,  "-1.0"), /*negative:'Use default'*/
   V(ClientDNSRejectInternalAddresses, BOOL,"1"),
   V(ClientOnly,                  BOOL,     "0"),
   V(ClientPreferIPv6ORPort,      AUTOBOOL, "auto"),
@@ -392,6 +397,7 @@ static config_var_t option_vars_[] = {
   V(Socks5Proxy,                 STRING,   NULL),
   V(Socks5ProxyUsername,         STRING,   NULL),
   V(Socks5ProxyPassword,         STRING,   NULL),
+  V(KernelTLS,                   BOOL,     "0"),
   V(KeepalivePeriod,             INTERVAL, "5 minutes"),
   V(KeepBindCapabilities,            AUTOBOOL, "auto"),
   VAR("Log",                     LINELIST, Logs,             NULL),
@@ -406,6 +412,7 @@ static config_var_t option_vars_[] = {
   V(MaxCircuitDirtiness,         INTERVAL, "10 minutes"),
   V(MaxClientCircuitsPending,    UINT,     "32"),
   V(MaxConsensusAgeForDiffs,     INTERVAL, "0 seconds"),
+  V(MaxHSDirCacheSize,           MEMUNIT,  "0"),
   VAR("MaxMemInQueues",          MEMUNIT,   MaxMemInQueues_raw, "0"),
   OBSOLETE("MaxOnionsPending"),
   V(MaxOnionQueueDelay,          MSEC_INTERVAL, "1750 msec"),
@@ -1646,7 +1653,7 @@ options_act(const or_options_t *old_options)
   char *msg=NULL;
   const int transition_affects_workers =
     old_options && options_transition_affects_workers(old_options, options);
-  int old_ewma_enabled;
+  const circuitmux_policy_t *old_ewma_policy;
   const int transition_affects_guards =
     old_options && options_transition_affects_guards(old_options, options);
 
@@ -1877,6 +1884,14 @@ options_act(const or_options_t *old_options)
    * might be a change of scheduler or parameter. */
   scheduler_conf_changed();
 
+  /* Tell the TLS layer whether new OR connections should use kernel TLS. */
+  if (options->KernelTLS && !tor_tls_ktls_supported() &&
+      (!old_options || !old_options->KernelTLS)) {
+    log_warn(LD_CONFIG, "KernelTLS is set, but this Tor was built with an "
+             "OpenSSL that can't hand TLS to the kernel. Ignoring it.");
+  }
+  tor_tls_set_ktls_enabled(options->KernelTLS);
+
   /* Set up accounting */
   if (accounting_parse_options(options, 0)<0) {
     log_warn(LD_CONFIG,"Error in accounting options");
@@ -1885,15 +1900,13 @@ options_act(const or_options_t *old_options)
   if (accounting_is_enabled(options))
     configure_accounting(time(NULL));
 
-  old_ewma_enabled = cell_ewma_enabled();
+  old_ewma_policy = cell_ewma_get_policy();
   /* Change the cell EWMA settings */
   cell_ewma_set_scale_factor(options, networkstatus_get_latest_consensus());
-  /* If we just enabled ewma, set the cmux policy on all active channels */
-  if (cell_ewma_enabled() && !old_ewma_enabled) {
-    channel_set_cmux_policy_everywhere(&ewma_policy);
-  } else if (!cell_ewma_enabled() && old_ewma_enabled) {
-    /* Turn it off everywhere */
-    channel_set_cmux_policy_everywhere(NULL);
+  /* If we just enabled, disabled or changed the ewma policy, set the cmux
+   * policy on all active channels */
+  if (cell_ewma_get_policy() != old_ewma_policy) {
+    channel_set_cmux_policy_everywhere(cell_ewma_get_policy());
   }
 
   /* Update the BridgePassword's hashed version as needed.  We store this as a
@@ -3696,6 +3709,16 @@ options_validate(or_options_t *old_options, or_options_t *options,
     options->MaxCircuitDirtiness = MAX_MAX_CIRCUIT_DIRTINESS;
   }
 
+  if (options->MoneTorStatistics < 0.0 || options->MoneTorStatistics > 1.0)
+    REJECT("MoneTorStatistics must be between 0 and 1.");
+  if (options->MoneTorStatisticsMiddle < 0.0 ||
+      options->MoneTorStatisticsMiddle > 1.0)
+    REJECT("MoneTorStatisticsMiddle must be between 0 and 1.");
+
+  if (options->CircuitPriorityPremiumScale > 1.0) {
+    REJECT("CircuitPriorityPremiumScale must be at most 1.0.");
+  }
+
   if (options->CircuitStreamTimeout &&
       options->CircuitStreamTimeout < MIN_CIRCUIT_STREAM_TIMEOUT) {
     log_warn(LD_CONFIG, "CircuitStreamTimeout option is too short; "
@@ -5508,6 +5531,19 @@ options_init_logs(const or_options_t *old_options, or_options_t *options,
 #else
                options->RunAsDaemon;
 #endif
+  int async_overflow;
+
+  if (!options->AsyncLogOverflow ||
+      !strcasecmp(options->AsyncLogOverflow, "drop")) {
+    async_overflow = LOG_ASYNC_OVERFLOW_DROP;
+  } else if (!strcasecmp(options->AsyncLogOverflow, "block")) {
+    async_overflow = LOG_ASYNC_OVERFLOW_BLOCK;
+  } else {
+    log_warn(LD_CONFIG, "Unrecognized value '%s' in AsyncLogOverflow; "
+             "expected \"drop\" or \"block\".",
+             escaped(options->AsyncLogOverflow));
+    return -1;
+  }
 
   if (options->LogTimeGranularity <= 0) {
     log_warn(LD_CONFIG, "Log time granularity '%d' has to be positive.",
@@ -5625,8 +5661,13 @@ options_init_logs(const or_options_t *old_options, or_options_t *options,
   }
   smartlist_free(elts);
 
-  if (ok && !validate_only)
+  if (ok && !validate_only) {
     logs_set_domain_logging(options->LogMessageDomains);
+    if (log_set_async(options->AsyncLogging, async_overflow) < 0) {
+      log_warn(LD_CONFIG, "Couldn't start the log writer thread; logging "
+               "synchronously instead.");
+    }
+  }
 
   return ok?0:-1;
 }
@@ -154,6 +154,11 @@ static tor_addr_t *last_interface_ipv6 = NULL;
  * Used to detect IP address changes. */
 static smartlist_t *outgoing_addrs = NULL;
 
+/** List of all connections that have read_blocked_on_bw or
+ * write_blocked_on_bw set. Each token bucket refill only needs to look at
+ * these; every other connection refills its buckets lazily. */
+static smartlist_t *bw_blocked_connections = NULL;
+
 #define CASE_ANY_LISTENER_TYPE \
     case CONN_TYPE_OR_LISTENER: \
     case CONN_TYPE_EXT_OR_LISTENER: \
@@ -452,6 +457,7 @@ connection_init(time_t now, connection_t *conn, int type, int socket_family)
 
   conn->s = TOR_INVALID_SOCKET; /* give it a default of 'not used' */
   conn->conn_array_index = -1; /* also default to 'not used' */
+  conn->bw_blocked_index = -1;
   conn->global_identifier = n_connections_allocated++;
 
   conn->type = type;
@@ -547,6 +553,9 @@ connection_free_(connection_t *conn)
       break;
   }
 
+  if (conn->bw_blocked_index >= 0)
+    connection_bw_blocked_list_remove(conn);
+
   if (conn->linked) {
     log_info(LD_GENERAL, "Freeing linked %s connection [%s] with %d "
              "bytes on inbuf, %d on outbuf.",
@@ -611,11 +620,13 @@ connection_free_(connection_t *conn)
     }
   }
   if (CONN_IS_EDGE(conn)) {
+    control_forget_stream_bandwidth(TO_EDGE_CONN(conn));
     rend_data_free(TO_EDGE_CONN(conn)->rend_data);
     hs_ident_edge_conn_free(TO_EDGE_CONN(conn)->hs_ident);
   }
   if (conn->type == CONN_TYPE_CONTROL) {
     control_connection_t *control_conn = TO_CONTROL_CONN(conn);
+    connection_control_free_spool(control_conn);
     tor_free(control_conn->safecookie_client_hash);
     tor_free(control_conn->incoming_cmd);
     if (control_conn->ephemeral_onion_services) {
@@ -2866,8 +2877,11 @@ connection_bucket_read_limit(connection_t *conn, time_t now)
 
   if (connection_speaks_cells(conn)) {
     or_connection_t *or_conn = TO_OR_CONN(conn);
-    if (conn->state == OR_CONN_STATE_OPEN)
+    if (conn->state == OR_CONN_STATE_OPEN) {
+      connection_or_buckets_refill_lazy(or_conn,
+                               (uint32_t)monotime_coarse_absolute_msec());
       conn_bucket = or_conn->read_bucket;
+    }
     base = get_cell_network_size(or_conn->wide_circ_ids);
   }
 
@@ -2902,10 +2916,13 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
     /* use the per-conn write limit if it's lower, but if it's less
      * than zero just use zero */
     or_connection_t *or_conn = TO_OR_CONN(conn);
-    if (conn->state == OR_CONN_STATE_OPEN)
+    if (conn->state == OR_CONN_STATE_OPEN) {
+      connection_or_buckets_refill_lazy(or_conn,
+                               (uint32_t)monotime_coarse_absolute_msec());
       if (or_conn->write_bucket < conn_bucket)
         conn_bucket = or_conn->write_bucket >= 0 ?
                         or_conn->write_bucket : 0;
+    }
     base = get_cell_network_size(or_conn->wide_circ_ids);
   }
 
@@ -2977,9 +2994,9 @@ record_num_bytes_transferred_impl(connection_t *conn,
   /* Count bytes of answering direct and tunneled directory requests */
   if (conn->type == CONN_TYPE_DIR && conn->purpose == DIR_PURPOSE_SERVER) {
     if (num_read > 0)
-      rep_hist_note_dir_bytes_read(num_read, now);
+      rep_hist_note_dir_bytes_read(num_read);
     if (num_written > 0)
-      rep_hist_note_dir_bytes_written(num_written, now);
+      rep_hist_note_dir_bytes_written(num_written);
   }
 
   if (!connection_is_rate_limited(conn))
@@ -2990,10 +3007,10 @@ record_num_bytes_transferred_impl(connection_t *conn,
                                 num_written, now);
 
   if (num_read > 0) {
-    rep_hist_note_bytes_read(num_read, now);
+    rep_hist_note_bytes_read(num_read);
   }
   if (num_written > 0) {
-    rep_hist_note_bytes_written(num_written, now);
+    rep_hist_note_bytes_written(num_written);
   }
   if (conn->type == CONN_TYPE_EXIT)
     rep_hist_note_exit_bytes(conn->port, num_written, num_read);
@@ -3134,6 +3151,7 @@ connection_consider_empty_read_buckets(connection_t *conn)
 
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
   conn->read_blocked_on_bw = 1;
+  connection_bw_blocked_list_add(conn);
   connection_stop_reading(conn);
 }
 
@@ -3161,6 +3179,7 @@ connection_consider_empty_write_buckets(connection_t *conn)
 
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
   conn->write_blocked_on_bw = 1;
+  connection_bw_blocked_list_add(conn);
   connection_stop_writing(conn);
 }
 
@@ -3215,8 +3234,9 @@ void
 connection_bucket_refill(int milliseconds_elapsed, time_t now)
 {
   const or_options_t *options = get_options();
-  smartlist_t *conns = get_connection_array();
   int bandwidthrate, bandwidthburst, relayrate, relayburst;
+  uint32_t now_msec;
+  int idx;
 
   int prev_global_read = global_read_bucket;
   int prev_global_write = global_write_bucket;
@@ -3284,52 +3304,18 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
                            relay_write_empty_time, milliseconds_elapsed);
   }
 
-  /* refill the per-connection buckets */
-  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
-    if (connection_speaks_cells(conn)) {
-      or_connection_t *or_conn = TO_OR_CONN(conn);
-      int orbandwidthrate = or_conn->bandwidthrate;
-      int orbandwidthburst = or_conn->bandwidthburst;
-
-      int prev_conn_read = or_conn->read_bucket;
-      int prev_conn_write = or_conn->write_bucket;
-
-      if (connection_bucket_should_increase(or_conn->read_bucket, or_conn)) {
-        connection_bucket_refill_helper(&or_conn->read_bucket,
-                                        orbandwidthrate,
-                                        orbandwidthburst,
-                                        milliseconds_elapsed,
-                                        "or_conn->read_bucket");
-      }
-      if (connection_bucket_should_increase(or_conn->write_bucket, or_conn)) {
-        connection_bucket_refill_helper(&or_conn->write_bucket,
-                                        orbandwidthrate,
-                                        orbandwidthburst,
-                                        milliseconds_elapsed,
-                                        "or_conn->write_bucket");
-      }
+  /* Wake up the connections that were waiting for tokens. Nobody else
+   * needs to be visited: per-connection buckets are refilled lazily by
+   * connection_or_buckets_refill_lazy() when they are next used. */
+  if (!bw_blocked_connections)
+    return;
+  now_msec = (uint32_t)monotime_coarse_absolute_msec();
+  idx = 0;
+  while (idx < smartlist_len(bw_blocked_connections)) {
+    connection_t *conn = smartlist_get(bw_blocked_connections, idx);
 
-      /* If buckets were empty before and have now been refilled, tell any
-       * interested controllers. */
-      if (get_options()->TestingEnableTbEmptyEvent) {
-        char *bucket;
-        uint32_t conn_read_empty_time, conn_write_empty_time;
-        tor_asprintf(&bucket, "ORCONN ID="U64_FORMAT,
-                     U64_PRINTF_ARG(or_conn->base_.global_identifier));
-        conn_read_empty_time = bucket_millis_empty(prev_conn_read,
-                               or_conn->read_emptied_time,
-                               or_conn->read_bucket,
-                               milliseconds_elapsed, &tvnow);
-        conn_write_empty_time = bucket_millis_empty(prev_conn_write,
-                                or_conn->write_emptied_time,
-                                or_conn->write_bucket,
-                                milliseconds_elapsed, &tvnow);
-        control_event_tb_empty(bucket, conn_read_empty_time,
-                               conn_write_empty_time,
-                               milliseconds_elapsed);
-        tor_free(bucket);
-      }
-    }
+    if (connection_speaks_cells(conn))
+      connection_or_buckets_refill_lazy(TO_OR_CONN(conn), now_msec);
 
     if (conn->read_blocked_on_bw == 1 /* marked to turn reading back on now */
         && global_read_bucket > 0 /* and we're allowed to read */
@@ -3357,7 +3343,121 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
       conn->write_blocked_on_bw = 0;
       connection_start_writing(conn);
     }
-  } SMARTLIST_FOREACH_END(conn);
+
+    if (!conn->read_blocked_on_bw && !conn->write_blocked_on_bw) {
+      /* This moves the last blocked connection into slot idx. */
+      connection_bw_blocked_list_remove(conn);
+    } else {
+      ++idx;
+    }
+  }
+}
+
+/** Add tokens to the per-connection buckets of <b>or_conn</b> for the time
+ * that has passed between its last refill and <b>now_msec</b>, a monotonic
+ * time in msec. */
+STATIC void
+connection_or_buckets_refill_lazy(or_connection_t *or_conn, uint32_t now_msec)
+{
+  int orbandwidthrate = or_conn->bandwidthrate;
+  int orbandwidthburst = or_conn->bandwidthburst;
+  int prev_conn_read = or_conn->read_bucket;
+  int prev_conn_write = or_conn->write_bucket;
+  uint32_t elapsed = now_msec - or_conn->buckets_refilled_msec;
+  int milliseconds_elapsed;
+
+  if (elapsed > INT32_MAX) {
+    /* <b>now_msec</b> is before our last refill; the clock went backwards.
+     * Start counting again from here rather than handing out a full burst. */
+    or_conn->buckets_refilled_msec = now_msec;
+    return;
+  }
+  milliseconds_elapsed = (int)elapsed;
+  if (milliseconds_elapsed == 0)
+    return;
+  if (((int64_t)orbandwidthrate * milliseconds_elapsed) / 1000 == 0 &&
+      (connection_bucket_should_increase(or_conn->read_bucket, or_conn) ||
+       connection_bucket_should_increase(or_conn->write_bucket, or_conn))) {
+    /* Not even one token yet; don't throw away the time we've waited. */
+    return;
+  }
+  or_conn->buckets_refilled_msec = now_msec;
+
+  if (connection_bucket_should_increase(or_conn->read_bucket, or_conn)) {
+    connection_bucket_refill_helper(&or_conn->read_bucket,
+                                    orbandwidthrate,
+                                    orbandwidthburst,
+                                    milliseconds_elapsed,
+                                    "or_conn->read_bucket");
+  }
+  if (connection_bucket_should_increase(or_conn->write_bucket, or_conn)) {
+    connection_bucket_refill_helper(&or_conn->write_bucket,
+                                    orbandwidthrate,
+                                    orbandwidthburst,
+                                    milliseconds_elapsed,
+                                    "or_conn->write_bucket");
+  }
+
+  /* If buckets were empty before and have now been refilled, tell any
+   * interested controllers. */
+  if (get_options()->TestingEnableTbEmptyEvent &&
+      ((prev_conn_read <= 0 && or_conn->read_bucket > prev_conn_read) ||
+       (prev_conn_write <= 0 && or_conn->write_bucket > prev_conn_write))) {
+    char *bucket;
+    struct timeval tvnow;
+    uint32_t conn_read_empty_time, conn_write_empty_time;
+    tor_gettimeofday_cached(&tvnow);
+    tor_asprintf(&bucket, "ORCONN ID="U64_FORMAT,
+                 U64_PRINTF_ARG(or_conn->base_.global_identifier));
+    conn_read_empty_time = bucket_millis_empty(prev_conn_read,
+                           or_conn->read_emptied_time,
+                           or_conn->read_bucket,
+                           milliseconds_elapsed, &tvnow);
+    conn_write_empty_time = bucket_millis_empty(prev_conn_write,
+                            or_conn->write_emptied_time,
+                            or_conn->write_bucket,
+                            milliseconds_elapsed, &tvnow);
+    control_event_tb_empty(bucket, conn_read_empty_time,
+                           conn_write_empty_time,
+                           milliseconds_elapsed);
+    tor_free(bucket);
+  }
+}
+
+/** Put <b>conn</b>, which has just had read_blocked_on_bw or
+ * write_blocked_on_bw set, on the list of connections to wake up when the
+ * token buckets are next refilled. Does nothing if it is already there. */
+void
+connection_bw_blocked_list_add(connection_t *conn)
+{
+  tor_assert(conn);
+  if (conn->bw_blocked_index >= 0)
+    return;
+  if (!bw_blocked_connections)
+    bw_blocked_connections = smartlist_new();
+  conn->bw_blocked_index = smartlist_len(bw_blocked_connections);
+  smartlist_add(bw_blocked_connections, conn);
+}
+
+/** Remove <b>conn</b> from the list of connections that are blocked on
+ * bandwidth. Calling this function will shift the last connection (if any)
+ * into the position occupied by conn. */
+void
+connection_bw_blocked_list_remove(connection_t *conn)
+{
+  int idx;
+  tor_assert(conn);
+  idx = conn->bw_blocked_index;
+  if (idx < 0)
+    return;
+  tor_assert(bw_blocked_connections);
+  tor_assert(smartlist_get(bw_blocked_connections, idx) == conn);
+  smartlist_del(bw_blocked_connections, idx);
+  if (idx < smartlist_len(bw_blocked_connections)) {
+    connection_t *tmp = smartlist_get(bw_blocked_connections, idx);
+    tmp->bw_blocked_index = idx;
+  }
+  conn->bw_blocked_index = -1;
 }
 
 /** Is the <b>bucket</b> for connection <b>conn</b> low enough that we
@@ -3376,6 +3476,36 @@ connection_bucket_should_increase(int bucket, or_connection_t *conn)
   return 1;
 }
 
+/** There was a read error with <b>socket_error</b> on <b>conn</b>; tell
+ * whoever needs to know, and kill the connection. */
+static void
+connection_read_failed(connection_t *conn, int socket_error)
+{
+  if (conn->type == CONN_TYPE_OR) {
+    connection_or_notify_error(TO_OR_CONN(conn),
+                               socket_error != 0 ?
+                                 errno_to_orconn_end_reason(socket_error) :
+                                 END_OR_CONN_REASON_CONNRESET,
+                               socket_error != 0 ?
+                                 tor_socket_strerror(socket_error) :
+                                 "(unknown, errno was 0)");
+  }
+  if (CONN_IS_EDGE(conn)) {
+    edge_connection_t *edge_conn = TO_EDGE_CONN(conn);
+    connection_edge_end_errno(edge_conn);
+    if (conn->type == CONN_TYPE_AP && TO_ENTRY_CONN(conn)->socks_request) {
+      /* broken, don't send a socks reply back */
+      TO_ENTRY_CONN(conn)->socks_request->has_finished = 1;
+    }
+  }
+  connection_close_immediate(conn); /* Don't flush; connection is dead. */
+  /*
+   * This can bypass normal channel checking since we did
+   * connection_or_notify_error() above.
+   */
+  connection_mark_for_close_internal(conn);
+}
+
 /** Read bytes from conn-\>s and process them.
  *
  * It calls connection_buf_read_from_socket() to bring in any new bytes,
@@ -3422,30 +3552,7 @@ connection_handle_read_impl(connection_t *conn)
 
   before = buf_datalen(conn->inbuf);
   if (connection_buf_read_from_socket(conn, &max_to_read, &socket_error) < 0) {
-    /* There's a read error; kill the connection.*/
-    if (conn->type == CONN_TYPE_OR) {
-      connection_or_notify_error(TO_OR_CONN(conn),
-                                 socket_error != 0 ?
-                                   errno_to_orconn_end_reason(socket_error) :
-                                   END_OR_CONN_REASON_CONNRESET,
-                                 socket_error != 0 ?
-                                   tor_socket_strerror(socket_error) :
-                                   "(unknown, errno was 0)");
-    }
-    if (CONN_IS_EDGE(conn)) {
-      edge_connection_t *edge_conn = TO_EDGE_CONN(conn);
-      connection_edge_end_errno(edge_conn);
-      if (conn->type == CONN_TYPE_AP && TO_ENTRY_CONN(conn)->socks_request) {
-        /* broken, don't send a socks reply back */
-        TO_ENTRY_CONN(conn)->socks_request->has_finished = 1;
-      }
-    }
-    connection_close_immediate(conn); /* Don't flush; connection is dead. */
-    /*
-     * This can bypass normal channel checking since we did
-     * connection_or_notify_error() above.
-     */
-    connection_mark_for_close_internal(conn);
+    connection_read_failed(conn, socket_error);
     return -1;
   }
   n_read += buf_datalen(conn->inbuf) - before;
@@ -3507,6 +3614,56 @@ connection_handle_read(connection_t *conn)
   return res;
 }
 
+/** First half of connection_handle_read() for BatchConnectionIO: pull in
+ * whatever bytes the bandwidth limits allow from the socket of <b>conn</b>,
+ * an OR or edge connection, without processing them yet.
+ *
+ * Mark the connection and return -1 if it failed, else return 0. */
+int
+connection_handle_read_batch_fill(connection_t *conn)
+{
+  ssize_t max_to_read = -1;
+  int socket_error = 0;
+
+  tor_assert(conn->type == CONN_TYPE_OR || CONN_IS_EDGE(conn));
+  tor_assert(!conn->linked);
+
+  if (conn->marked_for_close)
+    return 0; /* do nothing */
+
+  tor_gettimeofday_cache_clear();
+  conn->timestamp_lastread = approx_time();
+
+  if (connection_buf_read_from_socket(conn, &max_to_read, &socket_error) < 0) {
+    connection_read_failed(conn, socket_error);
+    return -1;
+  }
+  return 0;
+}
+
+/** Second half of connection_handle_read() for BatchConnectionIO: process
+ * the bytes that connection_handle_read_batch_fill() put on the inbuf of
+ * <b>conn</b>, packaging partial cells and all.
+ *
+ * Mark the connection and return -1 if you want to close it, else
+ * return 0. */
+int
+connection_handle_read_batch_process(connection_t *conn)
+{
+  if (conn->marked_for_close)
+    return 0;
+
+  if (connection_process_inbuf(conn, 1) < 0)
+    return -1;
+  /* If we hit the EOF, call connection_reached_eof(). */
+  if (!conn->marked_for_close &&
+      conn->inbuf_reached_eof &&
+      connection_reached_eof(conn) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
 /** Pull in new bytes from conn-\>s or conn-\>linked_conn onto conn-\>inbuf,
  * either directly or via TLS. Reduce the token buckets by the number of bytes
  * read.
@@ -3656,23 +3813,7 @@ connection_buf_read_from_socket(connection_t *conn, ssize_t *max_to_read,
 
     /* Update edge_conn->n_read and ocirc->n_read_circ_bw */
     if (conn->type == CONN_TYPE_AP) {
-      edge_connection_t *edge_conn = TO_EDGE_CONN(conn);
-      circuit_t *circ = circuit_get_by_edge_conn(edge_conn);
-      origin_circuit_t *ocirc;
-
-      /* Check for overflow: */
-      if (PREDICT_LIKELY(UINT32_MAX - edge_conn->n_read > n_read))
-        edge_conn->n_read += (int)n_read;
-      else
-        edge_conn->n_read = UINT32_MAX;
-
-      if (circ && CIRCUIT_IS_ORIGIN(circ)) {
-        ocirc = TO_ORIGIN_CIRCUIT(circ);
-        if (PREDICT_LIKELY(UINT32_MAX - ocirc->n_read_circ_bw > n_read))
-          ocirc->n_read_circ_bw += (int)n_read;
-        else
-          ocirc->n_read_circ_bw = UINT32_MAX;
-      }
+      control_note_stream_bandwidth(TO_EDGE_CONN(conn), n_read, 0);
     }
 
     /* If CONN_BW events are enabled, update conn->n_read_conn_bw for
@@ -3904,6 +4045,7 @@ connection_handle_write_impl(connection_t *conn, int force)
         if (!connection_is_reading(conn)) {
           connection_stop_writing(conn);
           conn->write_blocked_on_bw = 1;
+          connection_bw_blocked_list_add(conn);
           /* we'll start reading again when we get more tokens in our
            * read bucket; then we'll start writing again too.
            */
@@ -3947,23 +4089,7 @@ connection_handle_write_impl(connection_t *conn, int force)
   }
 
   if (n_written && conn->type == CONN_TYPE_AP) {
-    edge_connection_t *edge_conn = TO_EDGE_CONN(conn);
-    circuit_t *circ = circuit_get_by_edge_conn(edge_conn);
-    origin_circuit_t *ocirc;
-
-    /* Check for overflow: */
-    if (PREDICT_LIKELY(UINT32_MAX - edge_conn->n_written > n_written))
-      edge_conn->n_written += (int)n_written;
-    else
-      edge_conn->n_written = UINT32_MAX;
-
-    if (circ && CIRCUIT_IS_ORIGIN(circ)) {
-      ocirc = TO_ORIGIN_CIRCUIT(circ);
-      if (PREDICT_LIKELY(UINT32_MAX - ocirc->n_written_circ_bw > n_written))
-        ocirc->n_written_circ_bw += (int)n_written;
-      else
-        ocirc->n_written_circ_bw = UINT32_MAX;
-    }
+    control_note_stream_bandwidth(TO_EDGE_CONN(conn), 0, n_written);
   }
 
   /* If CONN_BW events are enabled, update conn->n_written_conn_bw for
@@ -4538,6 +4664,8 @@ connection_flushed_some(connection_t *conn)
     r = connection_or_flushed_some(TO_OR_CONN(conn));
   } else if (CONN_IS_EDGE(conn)) {
     r = connection_edge_flushed_some(TO_EDGE_CONN(conn));
+  } else if (conn->type == CONN_TYPE_CONTROL) {
+    r = connection_control_flushed_some(TO_CONTROL_CONN(conn));
   }
   conn->in_flushed_some = 0;
   return r;
@@ -4992,8 +5120,10 @@ assert_connection_ok(connection_t *conn, time_t now)
   if (conn->hold_open_until_flushed)
     tor_assert(conn->marked_for_close);
 
-  /* XXXX check: read_blocked_on_bw, write_blocked_on_bw, s, conn_array_index,
-   * marked_for_close. */
+  if (conn->read_blocked_on_bw || conn->write_blocked_on_bw)
+    tor_assert(conn->bw_blocked_index >= 0);
+
+  /* XXXX check: s, conn_array_index, marked_for_close. */
 
   /* buffers */
   if (conn->inbuf)
@@ -5200,6 +5330,9 @@ connection_free_all(void)
 
   SMARTLIST_FOREACH(conns, connection_t *, conn, connection_free_(conn));
 
+  smartlist_free(bw_blocked_connections);
+  bw_blocked_connections = NULL;
+
   if (outgoing_addrs) {
     SMARTLIST_FOREACH(outgoing_addrs, tor_addr_t *, addr, tor_free(addr));
     smartlist_free(outgoing_addrs);
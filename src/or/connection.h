@@ -120,8 +120,12 @@ ssize_t connection_bucket_write_limit(connection_t *conn, time_t now);
 int global_write_bucket_low(connection_t *conn, size_t attempt, int priority);
 void connection_bucket_init(void);
 void connection_bucket_refill(int seconds_elapsed, time_t now);
+void connection_bw_blocked_list_add(connection_t *conn);
+void connection_bw_blocked_list_remove(connection_t *conn);
 
 int connection_handle_read(connection_t *conn);
+int connection_handle_read_batch_fill(connection_t *conn);
+int connection_handle_read_batch_process(connection_t *conn);
 
 int connection_buf_get_bytes(char *string, size_t len, connection_t *conn);
 int connection_buf_get_line(connection_t *conn, char *data,
@@ -276,6 +280,8 @@ void connection_buckets_note_empty_ts(uint32_t *timestamp_var,
                                       int tokens_before,
                                       size_t tokens_removed,
                                       const struct timeval *tvnow);
+STATIC void connection_or_buckets_refill_lazy(or_connection_t *or_conn,
+                                              uint32_t now_msec);
 MOCK_DECL(STATIC int,connection_connect_sockaddr,
                                             (connection_t *conn,
                                              const struct sockaddr *sa,
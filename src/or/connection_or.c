@@ -794,6 +794,7 @@ connection_or_update_token_buckets_helper(or_connection_t *conn, int reset,
   conn->bandwidthburst = burst;
   if (reset) { /* set up the token buckets to be full */
     conn->read_bucket = conn->write_bucket = burst;
+    conn->buckets_refilled_msec = (uint32_t)monotime_coarse_absolute_msec();
     return;
   }
   /* If the new token bucket is smaller, take out the extra tokens.
@@ -818,6 +819,47 @@ connection_or_update_token_buckets(smartlist_t *conns,
   });
 }
 
+/** Return true iff <b>conn</b> has neither read nor written since
+ * <b>cutoff</b>, and has nothing waiting to be flushed. */
+static int
+connection_or_is_idle_since(or_connection_t *or_conn, time_t cutoff)
+{
+  connection_t *conn = TO_CONN(or_conn);
+  return conn->timestamp_lastread < cutoff &&
+    conn->timestamp_lastwritten < cutoff &&
+    !connection_get_outbuf_len(conn);
+}
+
+/** If <b>or_conn</b> is open and has been idle since <b>cutoff</b>, ask its
+ * TLS object to release its buffers. Return roughly how many bytes that
+ * freed. */
+size_t
+connection_or_release_tls_buffers_if_idle(or_connection_t *or_conn,
+                                          time_t cutoff)
+{
+  if (!or_conn->tls || TO_CONN(or_conn)->marked_for_close)
+    return 0;
+  if (!connection_or_is_idle_since(or_conn, cutoff))
+    return 0;
+  return tor_tls_release_buffers(or_conn->tls);
+}
+
+/** Release the TLS buffers of every OR connection that has been idle for at
+ * least OR_CONN_TLS_BUFFER_IDLE_TIME seconds as of <b>now</b>. Return
+ * roughly how many bytes that freed. */
+size_t
+connection_or_release_idle_tls_buffers(time_t now)
+{
+  size_t freed = 0;
+  const time_t cutoff = now - OR_CONN_TLS_BUFFER_IDLE_TIME;
+  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
+    if (conn->type == CONN_TYPE_OR)
+      freed += connection_or_release_tls_buffers_if_idle(TO_OR_CONN(conn),
+                                                          cutoff);
+  } SMARTLIST_FOREACH_END(conn);
+  return freed;
+}
+
 /* Mark <b>or_conn</b> as canonical if <b>is_canonical</b> is set, and
  * non-canonical otherwise. Adjust idle_timeout accordingly.
  */
@@ -833,6 +875,8 @@ connection_or_set_canonical(or_connection_t *or_conn,
   }
 
   or_conn->is_canonical = !! is_canonical; /* force to a 1-bit boolean */
+  if (or_conn->chan)
+    channel_note_extend_preference_changed(TLS_CHAN_TO_BASE(or_conn->chan));
   or_conn->idle_timeout = channelpadding_get_channel_idle_timeout(
           TLS_CHAN_TO_BASE(or_conn->chan), is_canonical);
 
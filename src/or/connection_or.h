@@ -29,6 +29,9 @@ int connection_or_finished_flushing(or_connection_t *conn);
 int connection_or_finished_connecting(or_connection_t *conn);
 void connection_or_about_to_close(or_connection_t *conn);
 int connection_or_digest_is_known_relay(const char *id_digest);
+size_t connection_or_release_tls_buffers_if_idle(or_connection_t *or_conn,
+                                                 time_t cutoff);
+size_t connection_or_release_idle_tls_buffers(time_t now);
 void connection_or_update_token_buckets(smartlist_t *conns,
                                         const or_options_t *options);
 
@@ -107,6 +110,10 @@ var_cell_t *var_cell_new(uint16_t payload_len);
 var_cell_t *var_cell_copy(const var_cell_t *src);
 void var_cell_free(var_cell_t *cell);
 
+/** How long must an OR connection have been idle before we release its TLS
+ * buffers when memory is tight? */
+#define OR_CONN_TLS_BUFFER_IDLE_TIME 10
+
 /* DOCDOC */
 #define MIN_LINK_PROTO_FOR_WIDE_CIRC_IDS 4
 #define MIN_LINK_PROTO_FOR_CHANNEL_PADDING 5
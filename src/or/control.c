@@ -58,6 +58,7 @@
 #include "entrynodes.h"
 #include "geoip.h"
 #include "hibernate.h"
+#include "hs_cache.h"
 #include "hs_common.h"
 #include "main.h"
 #include "microdesc.h"
@@ -217,6 +218,8 @@ static void set_cached_network_liveness(int liveness);
 static void flush_queued_events_cb(evutil_socket_t fd, short what, void *arg);
 
 static char * download_status_to_string(const download_status_t *dl);
+static size_t write_escaped_data_impl(const char *data, size_t len,
+                                      char **out, int add_terminator);
 
 /** Given a control event code for a message event, return the corresponding
  * log severity. */
@@ -247,6 +250,126 @@ log_severity_to_event(int severity)
   }
 }
 
+/** List of edge_connection_t for the AP streams whose n_read or n_written
+ * has become nonzero since we last sent STREAM_BW events.  Only maintained
+ * while some controller wants STREAM_BW events, so that sending them does
+ * not require a walk over every connection. */
+static smartlist_t *stream_bw_changed = NULL;
+
+/** List of origin_circuit_t for the circuits whose n_read_circ_bw or
+ * n_written_circ_bw has become nonzero since we last sent CIRC_BW events.
+ * Only maintained while some controller wants CIRC_BW events. */
+static smartlist_t *circ_bw_changed = NULL;
+
+/** Helper: remember that <b>edge_conn</b> has a STREAM_BW event to send. */
+static void
+stream_bw_note_changed(edge_connection_t *edge_conn)
+{
+  if (edge_conn->on_stream_bw_list)
+    return;
+  if (!stream_bw_changed)
+    stream_bw_changed = smartlist_new();
+  smartlist_add(stream_bw_changed, edge_conn);
+  edge_conn->on_stream_bw_list = 1;
+}
+
+/** Helper: remember that <b>ocirc</b> has a CIRC_BW event to send. */
+static void
+circ_bw_note_changed(origin_circuit_t *ocirc)
+{
+  if (ocirc->on_circ_bw_list)
+    return;
+  if (!circ_bw_changed)
+    circ_bw_changed = smartlist_new();
+  smartlist_add(circ_bw_changed, ocirc);
+  ocirc->on_circ_bw_list = 1;
+}
+
+/** Helper: empty the list of streams with pending STREAM_BW events. */
+static void
+stream_bw_clear_changed(void)
+{
+  if (!stream_bw_changed)
+    return;
+  SMARTLIST_FOREACH(stream_bw_changed, edge_connection_t *, edge_conn,
+                    edge_conn->on_stream_bw_list = 0);
+  smartlist_clear(stream_bw_changed);
+}
+
+/** Helper: empty the list of circuits with pending CIRC_BW events. */
+static void
+circ_bw_clear_changed(void)
+{
+  if (!circ_bw_changed)
+    return;
+  SMARTLIST_FOREACH(circ_bw_changed, origin_circuit_t *, ocirc,
+                    ocirc->on_circ_bw_list = 0);
+  smartlist_clear(circ_bw_changed);
+}
+
+/** Helper: return <b>counter</b> + <b>n</b>, saturating at UINT32_MAX. */
+static inline uint32_t
+bw_counter_add(uint32_t counter, size_t n)
+{
+  if (PREDICT_LIKELY(UINT32_MAX - counter > n))
+    return counter + (uint32_t)n;
+  else
+    return UINT32_MAX;
+}
+
+/** Called when the AP stream <b>edge_conn</b> has read <b>n_read</b> bytes
+ * and written <b>n_written</b> bytes: update the STREAM_BW and CIRC_BW
+ * counters for the stream and its origin circuit, and remember which of
+ * them have events to send. */
+void
+control_note_stream_bandwidth(edge_connection_t *edge_conn,
+                              size_t n_read, size_t n_written)
+{
+  circuit_t *circ;
+
+  if (!n_read && !n_written)
+    return;
+
+  edge_conn->n_read = bw_counter_add(edge_conn->n_read, n_read);
+  edge_conn->n_written = bw_counter_add(edge_conn->n_written, n_written);
+  if (EVENT_IS_INTERESTING(EVENT_STREAM_BANDWIDTH_USED))
+    stream_bw_note_changed(edge_conn);
+
+  circ = circuit_get_by_edge_conn(edge_conn);
+  if (circ && CIRCUIT_IS_ORIGIN(circ)) {
+    origin_circuit_t *ocirc = TO_ORIGIN_CIRCUIT(circ);
+    ocirc->n_read_circ_bw = bw_counter_add(ocirc->n_read_circ_bw, n_read);
+    ocirc->n_written_circ_bw = bw_counter_add(ocirc->n_written_circ_bw,
+                                              n_written);
+    if (EVENT_IS_INTERESTING(EVENT_CIRC_BANDWIDTH_USED))
+      circ_bw_note_changed(ocirc);
+  }
+}
+
+/** Called when <b>edge_conn</b> is about to be freed: make sure we no longer
+ * hold a pointer to it. */
+void
+control_forget_stream_bandwidth(edge_connection_t *edge_conn)
+{
+  if (!edge_conn->on_stream_bw_list)
+    return;
+  if (stream_bw_changed)
+    smartlist_remove(stream_bw_changed, edge_conn);
+  edge_conn->on_stream_bw_list = 0;
+}
+
+/** Called when <b>ocirc</b> is about to be freed: make sure we no longer
+ * hold a pointer to it. */
+void
+control_forget_circ_bandwidth(origin_circuit_t *ocirc)
+{
+  if (!ocirc->on_circ_bw_list)
+    return;
+  if (circ_bw_changed)
+    smartlist_remove(circ_bw_changed, ocirc);
+  ocirc->on_circ_bw_list = 0;
+}
+
 /** Helper: clear bandwidth counters of all origin circuits. */
 static void
 clear_circ_bw_fields(void)
@@ -287,9 +410,10 @@ control_update_global_event_mask(void)
   control_adjust_event_log_severity();
 
   /* ...then, if we've started logging stream or circ bw, clear the
-   * appropriate fields. */
-  if (! (old_mask & EVENT_STREAM_BANDWIDTH_USED) &&
-      (new_mask & EVENT_STREAM_BANDWIDTH_USED)) {
+   * appropriate fields.  If we've stopped, forget which streams and
+   * circuits had events to send. */
+  if (! (old_mask & EVENT_MASK_(EVENT_STREAM_BANDWIDTH_USED)) &&
+      (new_mask & EVENT_MASK_(EVENT_STREAM_BANDWIDTH_USED))) {
     SMARTLIST_FOREACH(conns, connection_t *, conn,
     {
       if (conn->type == CONN_TYPE_AP) {
@@ -298,10 +422,16 @@ control_update_global_event_mask(void)
       }
     });
   }
-  if (! (old_mask & EVENT_CIRC_BANDWIDTH_USED) &&
-      (new_mask & EVENT_CIRC_BANDWIDTH_USED)) {
+  if (! (new_mask & EVENT_MASK_(EVENT_STREAM_BANDWIDTH_USED))) {
+    stream_bw_clear_changed();
+  }
+  if (! (old_mask & EVENT_MASK_(EVENT_CIRC_BANDWIDTH_USED)) &&
+      (new_mask & EVENT_MASK_(EVENT_CIRC_BANDWIDTH_USED))) {
     clear_circ_bw_fields();
   }
+  if (! (new_mask & EVENT_MASK_(EVENT_CIRC_BANDWIDTH_USED))) {
+    circ_bw_clear_changed();
+  }
 }
 
 /** Adjust the log severities that result in control_event_logmsg being called
@@ -369,6 +499,17 @@ connection_write_str_to_buf(const char *s, control_connection_t *conn)
  */
 STATIC size_t
 write_escaped_data(const char *data, size_t len, char **out)
+{
+  return write_escaped_data_impl(data, len, out, 1);
+}
+
+/** Helper for write_escaped_data: as write_escaped_data, but only add the
+ * terminating period-CRLF line if <b>add_terminator</b> is true.  Without
+ * it, the output is one piece of a longer escaped reply, all of whose
+ * pieces must begin at the start of a line. */
+static size_t
+write_escaped_data_impl(const char *data, size_t len, char **out,
+                        int add_terminator)
 {
   tor_assert(len < SIZE_MAX - 9);
   size_t sz_out = len+8+1;
@@ -408,9 +549,11 @@ write_escaped_data(const char *data, size_t len, char **out)
     *outp++ = '\r';
     *outp++ = '\n';
   }
-  *outp++ = '.';
-  *outp++ = '\r';
-  *outp++ = '\n';
+  if (add_terminator) {
+    *outp++ = '.';
+    *outp++ = '\r';
+    *outp++ = '\n';
+  }
   *outp = '\0'; /* NUL-terminate just in case. */
   tor_assert(outp >= *out);
   tor_assert((size_t)(outp - *out) <= sz_out);
@@ -751,6 +894,55 @@ queued_event_free(queued_event_t *ev)
   tor_free(ev);
 }
 
+/** If a controller has more than this many bytes waiting on its outbuf, we
+ * stop sending it droppable events until it catches up. */
+#define CONTROL_EVENT_OUTBUF_HIGHWATER (4*1024*1024)
+
+/** Events that we may decline to send to a controller that has fallen too
+ * far behind: periodic statistics and low-severity log messages, which are
+ * high-volume and whose loss does not leave the controller with a wrong
+ * idea of Tor's state. */
+#define EVENT_MASK_DROPPABLE_ (EVENT_MASK_(EVENT_BANDWIDTH_USED) |         \
+                               EVENT_MASK_(EVENT_STREAM_BANDWIDTH_USED) |  \
+                               EVENT_MASK_(EVENT_CIRC_BANDWIDTH_USED) |    \
+                               EVENT_MASK_(EVENT_CONN_BW) |                \
+                               EVENT_MASK_(EVENT_CELL_STATS) |             \
+                               EVENT_MASK_(EVENT_TB_EMPTY) |               \
+                               EVENT_MASK_(EVENT_DEBUG_MSG) |              \
+                               EVENT_MASK_(EVENT_INFO_MSG))
+
+/** Return true iff we should not send <b>event</b> to <b>conn</b>, because
+ * the event is droppable and <b>conn</b> is not reading its events fast
+ * enough.  Events held back during a spooled GETINFO reply count as
+ * pending output.  Keep a count of the events we drop, and log when a
+ * controller starts and stops falling behind. */
+STATIC int
+control_event_should_drop(control_connection_t *conn, uint16_t event)
+{
+  if (connection_get_outbuf_len(TO_CONN(conn)) + conn->deferred_events_len <
+      CONTROL_EVENT_OUTBUF_HIGHWATER) {
+    if (PREDICT_UNLIKELY(conn->n_events_dropped)) {
+      log_notice(LD_CONTROL, "Controller connection "U64_FORMAT" has caught "
+                 "up; we dropped "U64_FORMAT" events while it was behind.",
+                 U64_PRINTF_ARG(conn->base_.global_identifier),
+                 U64_PRINTF_ARG(conn->n_events_dropped));
+      conn->n_events_dropped = 0;
+    }
+    return 0;
+  }
+
+  if (! (EVENT_MASK_(event) & EVENT_MASK_DROPPABLE_))
+    return 0;
+
+  if (conn->n_events_dropped++ == 0) {
+    log_notice(LD_CONTROL, "Controller connection "U64_FORMAT" is not "
+               "reading its events; dropping bandwidth and low-severity "
+               "log events for it until it catches up.",
+               U64_PRINTF_ARG(conn->base_.global_identifier));
+  }
+  return 1;
+}
+
 /** Send every queued event to every controller that's interested in it,
  * and remove the events from the queue.  If <b>force</b> is true,
  * then make all controllers send their data out immediately, since we
@@ -791,7 +983,17 @@ queued_events_flush_all(int force)
     const size_t msg_len = strlen(ev->msg);
     SMARTLIST_FOREACH_BEGIN(controllers, control_connection_t *,
                             control_conn) {
-      if (control_conn->event_mask & bit) {
+      if (!(control_conn->event_mask & bit) ||
+          control_event_should_drop(control_conn, ev->event))
+        continue;
+      if (PREDICT_UNLIKELY(control_conn->getinfo_spool != NULL)) {
+        /* Don't interleave events with a GETINFO reply in progress. */
+        if (!control_conn->deferred_events)
+          control_conn->deferred_events = smartlist_new();
+        smartlist_add(control_conn->deferred_events,
+                      tor_memdup_nulterm(ev->msg, msg_len));
+        control_conn->deferred_events_len += msg_len;
+      } else {
         connection_buf_add(ev->msg, msg_len, TO_CONN(control_conn));
       }
     } SMARTLIST_FOREACH_END(control_conn);
@@ -1682,6 +1884,12 @@ getinfo_helper_misc(control_connection_t *conn, const char *question,
     *answer = tor_strdup(get_version());
   } else if (!strcmp(question, "bw-event-cache")) {
     *answer = get_bw_samples();
+  } else if (!strcmpstart(question, "bw-history/")) {
+    *answer = rep_hist_get_bw_series(question+strlen("bw-history/"));
+    if (!*answer) {
+      *errmsg = "Unrecognized bandwidth history resolution";
+      return -1;
+    }
   } else if (!strcmp(question, "config-file")) {
     const char *a = get_torrc_fname(0);
     if (a)
@@ -1970,6 +2178,8 @@ getinfo_helper_dir(control_connection_t *control_conn,
     *answer = smartlist_join_strings(sl, "", 0, NULL);
     SMARTLIST_FOREACH(sl, char *, c, tor_free(c));
     smartlist_free(sl);
+  } else if (!strcmp(question, "hs/cache/stats")) {
+    *answer = hs_cache_get_stats_string();
   } else if (!strcmpstart(question, "hs/client/desc/id/")) {
     rend_cache_entry_t *e = NULL;
 
@@ -2019,6 +2229,15 @@ getinfo_helper_dir(control_connection_t *control_conn,
     if (md && md->body) {
       *answer = tor_strndup(md->body, md->bodylen);
     }
+  } else if (!strcmp(question, "md/all")) {
+    smartlist_t *mds = smartlist_new();
+    SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), const node_t *, node) {
+      if (node->md && node->md->body)
+        smartlist_add(mds, tor_strndup(node->md->body, node->md->bodylen));
+    } SMARTLIST_FOREACH_END(node);
+    *answer = smartlist_join_strings(mds, "", 0, NULL);
+    SMARTLIST_FOREACH(mds, char *, cp, tor_free(cp));
+    smartlist_free(mds);
   } else if (!strcmp(question, "md/download-enabled")) {
     int r = we_fetch_microdescriptors(get_options());
     tor_asprintf(answer, "%d", !!r);
@@ -2617,6 +2836,32 @@ circuit_describe_status_for_controller(origin_circuit_t *circ)
   return rv;
 }
 
+/** Return a newly allocated string describing <b>circ</b> as a line of the
+ * GETINFO circuit-status answer, without a line ending. */
+static char *
+circuit_status_line_for_controller(origin_circuit_t *circ)
+{
+  char *circdesc, *line = NULL;
+  const char *state;
+
+  if (circ->base_.state == CIRCUIT_STATE_OPEN)
+    state = "BUILT";
+  else if (circ->base_.state == CIRCUIT_STATE_GUARD_WAIT)
+    state = "GUARD_WAIT";
+  else if (circ->cpath)
+    state = "EXTENDED";
+  else
+    state = "LAUNCHED";
+
+  circdesc = circuit_describe_status_for_controller(circ);
+
+  tor_asprintf(&line, "%lu %s%s%s",
+               (unsigned long)circ->global_identifier,
+               state, *circdesc ? " " : "", circdesc);
+  tor_free(circdesc);
+  return line;
+}
+
 /** Implementation helper for GETINFO: knows how to generate summaries of the
  * current states of things we send events about. */
 static int
@@ -2629,28 +2874,11 @@ getinfo_helper_events(control_connection_t *control_conn,
   if (!strcmp(question, "circuit-status")) {
     smartlist_t *status = smartlist_new();
     SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ_) {
-      origin_circuit_t *circ;
-      char *circdesc;
-      const char *state;
       if (! CIRCUIT_IS_ORIGIN(circ_) || circ_->marked_for_close)
         continue;
-      circ = TO_ORIGIN_CIRCUIT(circ_);
-
-      if (circ->base_.state == CIRCUIT_STATE_OPEN)
-        state = "BUILT";
-      else if (circ->base_.state == CIRCUIT_STATE_GUARD_WAIT)
-        state = "GUARD_WAIT";
-      else if (circ->cpath)
-        state = "EXTENDED";
-      else
-        state = "LAUNCHED";
-
-      circdesc = circuit_describe_status_for_controller(circ);
-
-      smartlist_add_asprintf(status, "%lu %s%s%s",
-                   (unsigned long)circ->global_identifier,
-                   state, *circdesc ? " " : "", circdesc);
-      tor_free(circdesc);
+      smartlist_add(status,
+                    circuit_status_line_for_controller(
+                                               TO_ORIGIN_CIRCUIT(circ_)));
     }
     SMARTLIST_FOREACH_END(circ_);
     *answer = smartlist_join_strings(status, "\r\n", 0, NULL);
@@ -2963,6 +3191,8 @@ typedef struct getinfo_item_t {
 static const getinfo_item_t getinfo_items[] = {
   ITEM("version", misc, "The current version of Tor."),
   ITEM("bw-event-cache", misc, "Cached BW events for a short interval."),
+  PREFIX("bw-history/", misc, "Bytes read and written per interval, at a "
+         "resolution of 100ms, 1s, 15m or 4h."),
   ITEM("config-file", misc, "Current location of the \"torrc\" file."),
   ITEM("config-defaults-file", misc, "Current location of the defaults file."),
   ITEM("config-text", misc,
@@ -3047,11 +3277,14 @@ static const getinfo_item_t getinfo_items[] = {
   ITEM("desc/download-enabled", dir,
        "Do we try to download router descriptors?"),
   ITEM("desc/all-recent-extrainfo-hack", dir, NULL), /* Hack. */
+  ITEM("md/all", dir, "All known microdescriptors."),
   PREFIX("md/id/", dir, "Microdescriptors by ID"),
   PREFIX("md/name/", dir, "Microdescriptors by name"),
   ITEM("md/download-enabled", dir,
        "Do we try to download microdescriptors?"),
   PREFIX("extra-info/digest/", dir, "Extra-info documents by digest."),
+  ITEM("hs/cache/stats", dir,
+       "Size, hits, misses and evictions of the v3 onion service caches."),
   PREFIX("hs/client/desc/id", dir,
          "Hidden Service descriptor in client's cache by onion."),
   PREFIX("hs/service/desc/id/", dir,
@@ -3189,8 +3422,328 @@ handle_getinfo_helper(control_connection_t *control_conn,
   return 0; /* unrecognized */
 }
 
+/** If a control connection's outbuf holds fewer than this many bytes while
+ * we are spooling a GETINFO reply on it, we generate more of the reply. */
+#define CONTROL_SPOOL_BUFFER_MIN 16384
+
+/** How many circuits we look for in each pass over the circuit list when
+ * spooling a circuit-status answer. */
+#define CONTROL_SPOOL_CIRC_BATCH 128
+
+/** Kinds of piece that a spooled GETINFO reply is made of. */
+typedef enum getinfo_spool_type_t {
+  /** A string, already formatted for the control connection. */
+  GETINFO_SPOOL_STRING,
+  /** The entries of an ns/all answer, by identity digest. */
+  GETINFO_SPOOL_NS,
+  /** The entries of an md/all answer, by identity digest. */
+  GETINFO_SPOOL_MD,
+  /** The lines of a circuit-status answer, by global circuit ID. */
+  GETINFO_SPOOL_CIRC,
+} getinfo_spool_type_t;
+
+/** One piece of a GETINFO reply that is waiting to be written to a control
+ * connection.  For answers that can be large, we remember only which
+ * objects to describe, and format each one as the control connection
+ * drains, so that we never hold the whole answer in memory at once.  An
+ * object that goes away before we reach it is left out of the answer. */
+typedef struct getinfo_spool_t {
+  getinfo_spool_type_t type;
+  /** For GETINFO_SPOOL_STRING, the string to write. */
+  char *str;
+  /** For GETINFO_SPOOL_NS and GETINFO_SPOOL_MD, n_elts identity digests,
+   * DIGEST_LEN bytes each. */
+  char *digests;
+  /** For GETINFO_SPOOL_CIRC, n_elts global circuit IDs, in ascending
+   * order. */
+  uint32_t *circ_ids;
+  /** How many objects we will describe in total. */
+  int n_elts;
+  /** Index of the next object to describe. */
+  int next_elt;
+} getinfo_spool_t;
+
+/** Return a new GETINFO_SPOOL_STRING spool, taking ownership of
+ * <b>str</b>. */
+static getinfo_spool_t *
+getinfo_spool_new_string(char *str)
+{
+  getinfo_spool_t *spool = tor_malloc_zero(sizeof(getinfo_spool_t));
+  spool->type = GETINFO_SPOOL_STRING;
+  spool->str = str;
+  return spool;
+}
+
+/** Release all storage held by <b>spool</b>. */
+static void
+getinfo_spool_free(getinfo_spool_t *spool)
+{
+  if (!spool)
+    return;
+  tor_free(spool->str);
+  tor_free(spool->digests);
+  tor_free(spool->circ_ids);
+  tor_free(spool);
+}
+
+/** Helper for qsort: compare two uint32_t values. */
+static int
+compare_uint32s_(const void *a, const void *b)
+{
+  uint32_t ua = *(const uint32_t *)a, ub = *(const uint32_t *)b;
+  return ua < ub ? -1 : (ua > ub ? 1 : 0);
+}
+
+/** If <b>question</b> is a GETINFO key whose answer we generate a piece at
+ * a time, and its answer has more than one entry, return a new spool for
+ * the body of the answer.  Otherwise return NULL, and the question should
+ * be answered all at once by handle_getinfo_helper().
+ *
+ * (Answers with fewer entries may be sent in the single-line form, so we
+ * leave them to the helpers that know how to produce them.) */
+static getinfo_spool_t *
+getinfo_spool_new_for_question(const char *question)
+{
+  getinfo_spool_t *spool = NULL;
+  int n = 0;
+
+  if (!strcmp(question, "ns/all")) {
+    const networkstatus_t *ns = networkstatus_get_latest_consensus();
+    if (!ns || smartlist_len(ns->routerstatus_list) < 2)
+      return NULL;
+    spool = tor_malloc_zero(sizeof(getinfo_spool_t));
+    spool->type = GETINFO_SPOOL_NS;
+    spool->digests = tor_malloc(smartlist_len(ns->routerstatus_list) *
+                                DIGEST_LEN);
+    SMARTLIST_FOREACH(ns->routerstatus_list, const routerstatus_t *, rs,
+      memcpy(spool->digests + DIGEST_LEN*(n++), rs->identity_digest,
+             DIGEST_LEN));
+  } else if (!strcmp(question, "md/all")) {
+    const smartlist_t *nodes = nodelist_get_list();
+    SMARTLIST_FOREACH(nodes, const node_t *, node,
+                      if (node->md && node->md->body) ++n);
+    if (n < 2)
+      return NULL;
+    spool = tor_malloc_zero(sizeof(getinfo_spool_t));
+    spool->type = GETINFO_SPOOL_MD;
+    spool->digests = tor_malloc(n * DIGEST_LEN);
+    n = 0;
+    SMARTLIST_FOREACH(nodes, const node_t *, node,
+      if (node->md && node->md->body)
+        memcpy(spool->digests + DIGEST_LEN*(n++), node->identity,
+               DIGEST_LEN));
+  } else if (!strcmp(question, "circuit-status")) {
+    smartlist_t *circs = circuit_get_global_list();
+    SMARTLIST_FOREACH(circs, const circuit_t *, circ,
+      if (CIRCUIT_IS_ORIGIN(circ) && !circ->marked_for_close) ++n);
+    if (n < 2)
+      return NULL;
+    spool = tor_malloc_zero(sizeof(getinfo_spool_t));
+    spool->type = GETINFO_SPOOL_CIRC;
+    spool->circ_ids = tor_calloc(n, sizeof(uint32_t));
+    n = 0;
+    SMARTLIST_FOREACH(circs, circuit_t *, circ,
+      if (CIRCUIT_IS_ORIGIN(circ) && !circ->marked_for_close)
+        spool->circ_ids[n++] = TO_ORIGIN_CIRCUIT(circ)->global_identifier);
+    qsort(spool->circ_ids, n, sizeof(uint32_t), compare_uint32s_);
+  } else {
+    return NULL;
+  }
+
+  spool->n_elts = n;
+  return spool;
+}
+
+/** Write the <b>len</b> bytes at <b>data</b> to <b>conn</b> as one piece of
+ * an escaped multi-line reply.  <b>data</b> must hold whole lines. */
+static void
+connection_write_escaped_to_buf(const char *data, size_t len,
+                                control_connection_t *conn)
+{
+  char *esc = NULL;
+  size_t esc_len = write_escaped_data_impl(data, len, &esc, 0);
+  connection_buf_add(esc, esc_len, TO_CONN(conn));
+  tor_free(esc);
+}
+
+/** Describe the next batch of circuits from <b>spool</b> on <b>conn</b>,
+ * finding all of them in a single pass over the circuit list. */
+static void
+getinfo_spool_write_circuits(getinfo_spool_t *spool,
+                             control_connection_t *conn)
+{
+  origin_circuit_t *found[CONTROL_SPOOL_CIRC_BATCH];
+  const uint32_t *batch = spool->circ_ids + spool->next_elt;
+  int n = MIN(spool->n_elts - spool->next_elt, CONTROL_SPOOL_CIRC_BATCH);
+  int i;
+
+  memset(found, 0, sizeof(found));
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
+    uint32_t id;
+    int lo = 0, hi = n - 1;
+    if (!CIRCUIT_IS_ORIGIN(circ) || circ->marked_for_close)
+      continue;
+    id = TO_ORIGIN_CIRCUIT(circ)->global_identifier;
+    while (lo <= hi) {
+      int mid = (lo + hi) / 2;
+      if (batch[mid] < id) {
+        lo = mid + 1;
+      } else if (batch[mid] > id) {
+        hi = mid - 1;
+      } else {
+        found[mid] = TO_ORIGIN_CIRCUIT(circ);
+        break;
+      }
+    }
+  } SMARTLIST_FOREACH_END(circ);
+
+  for (i = 0; i < n; ++i) {
+    char *line;
+    if (!found[i])
+      continue;
+    line = circuit_status_line_for_controller(found[i]);
+    connection_write_escaped_to_buf(line, strlen(line), conn);
+    tor_free(line);
+  }
+  spool->next_elt += n;
+}
+
+/** Write some more of <b>spool</b> to <b>conn</b>.  Return 1 if we have
+ * written all of it, and 0 otherwise. */
+static int
+getinfo_spool_write_some(getinfo_spool_t *spool, control_connection_t *conn)
+{
+  const char *digest;
+
+  switch (spool->type) {
+    case GETINFO_SPOOL_STRING:
+      connection_write_str_to_buf(spool->str, conn);
+      return 1;
+    case GETINFO_SPOOL_NS: {
+      const routerstatus_t *rs;
+      digest = spool->digests + DIGEST_LEN*(spool->next_elt++);
+      rs = router_get_consensus_status_by_id(digest);
+      if (rs) {
+        char *entry = networkstatus_getinfo_helper_single(rs);
+        connection_write_escaped_to_buf(entry, strlen(entry), conn);
+        tor_free(entry);
+      }
+      break;
+    }
+    case GETINFO_SPOOL_MD: {
+      const node_t *node;
+      digest = spool->digests + DIGEST_LEN*(spool->next_elt++);
+      node = node_get_by_id(digest);
+      if (node && node->md && node->md->body)
+        connection_write_escaped_to_buf(node->md->body, node->md->bodylen,
+                                        conn);
+      break;
+    }
+    case GETINFO_SPOOL_CIRC:
+      getinfo_spool_write_circuits(spool, conn);
+      break;
+    default:
+      tor_assert_nonfatal_unreached();
+      return 1;
+  }
+  return spool->next_elt >= spool->n_elts;
+}
+
+/** Write more of the GETINFO reply being spooled on <b>conn</b>, until its
+ * outbuf holds CONTROL_SPOOL_BUFFER_MIN bytes or the reply is complete.
+ * Once the reply is complete, send the events that we held back so as not
+ * to interleave them with it.  Return 1 if the reply is complete, and 0
+ * otherwise. */
+static int
+control_getinfo_spool_fill(control_connection_t *conn)
+{
+  tor_assert(conn->getinfo_spool);
+
+  while (smartlist_len(conn->getinfo_spool) &&
+         !TO_CONN(conn)->marked_for_close &&
+         connection_get_outbuf_len(TO_CONN(conn)) <
+           CONTROL_SPOOL_BUFFER_MIN) {
+    getinfo_spool_t *spool = smartlist_get(conn->getinfo_spool, 0);
+    if (getinfo_spool_write_some(spool, conn)) {
+      smartlist_del_keeporder(conn->getinfo_spool, 0);
+      getinfo_spool_free(spool);
+    }
+  }
+  if (smartlist_len(conn->getinfo_spool))
+    return 0;
+
+  smartlist_free(conn->getinfo_spool);
+  conn->getinfo_spool = NULL;
+  if (conn->deferred_events) {
+    SMARTLIST_FOREACH(conn->deferred_events, char *, msg, {
+      connection_write_str_to_buf(msg, conn);
+      tor_free(msg);
+    });
+    smartlist_free(conn->deferred_events);
+    conn->deferred_events = NULL;
+    conn->deferred_events_len = 0;
+  }
+  return 1;
+}
+
+/** Called when we've written some data on <b>conn</b>: if we are spooling a
+ * GETINFO reply on it, write more of the reply, and once it is complete,
+ * handle any commands that arrived in the meantime. */
+int
+connection_control_flushed_some(control_connection_t *conn)
+{
+  if (!conn->getinfo_spool)
+    return 0;
+  if (!control_getinfo_spool_fill(conn))
+    return 0;
+  if (!TO_CONN(conn)->marked_for_close &&
+      connection_get_inbuf_len(TO_CONN(conn)))
+    return connection_control_process_inbuf(conn);
+  return 0;
+}
+
+/** Release the GETINFO reply being spooled on <b>conn</b>, if any, and the
+ * events held back for it. */
+void
+connection_control_free_spool(control_connection_t *conn)
+{
+  if (conn->getinfo_spool) {
+    SMARTLIST_FOREACH(conn->getinfo_spool, getinfo_spool_t *, spool,
+                      getinfo_spool_free(spool));
+    smartlist_free(conn->getinfo_spool);
+    conn->getinfo_spool = NULL;
+  }
+  if (conn->deferred_events) {
+    SMARTLIST_FOREACH(conn->deferred_events, char *, msg, tor_free(msg));
+    smartlist_free(conn->deferred_events);
+    conn->deferred_events = NULL;
+  }
+  conn->deferred_events_len = 0;
+}
+
+/** Return a newly allocated string holding the reply line(s) for GETINFO
+ * key <b>k</b> with answer <b>v</b>. */
+static char *
+getinfo_format_answer(const char *k, const char *v)
+{
+  char *out = NULL;
+  if (!strchr(v, '\n') && !strchr(v, '\r')) {
+    tor_asprintf(&out, "250-%s=%s\r\n", k, v);
+  } else {
+    char *esc = NULL;
+    write_escaped_data(v, strlen(v), &esc);
+    tor_asprintf(&out, "250+%s=\r\n%s", k, esc);
+    tor_free(esc);
+  }
+  return out;
+}
+
 /** Called when we receive a GETINFO command.  Try to fetch all requested
- * information, and reply with information or error message. */
+ * information, and reply with information or error message.
+ *
+ * Answers that can be very large are spooled: we write them to the
+ * connection a piece at a time as it drains, and handle no further
+ * commands on it until the reply is complete. */
 static int
 handle_control_getinfo(control_connection_t *conn, uint32_t len,
                        const char *body)
@@ -3198,6 +3751,7 @@ handle_control_getinfo(control_connection_t *conn, uint32_t len,
   smartlist_t *questions = smartlist_new();
   smartlist_t *answers = smartlist_new();
   smartlist_t *unrecognized = smartlist_new();
+  smartlist_t *spools = smartlist_new();
   char *ans = NULL;
   int i;
   (void) len; /* body is NUL-terminated, so it's safe to ignore the length. */
@@ -3206,6 +3760,14 @@ handle_control_getinfo(control_connection_t *conn, uint32_t len,
                          SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
   SMARTLIST_FOREACH_BEGIN(questions, const char *, q) {
     const char *errmsg = NULL;
+    getinfo_spool_t *spool = getinfo_spool_new_for_question(q);
+    if (spool) {
+      /* A NULL answer means "the next spool in spools". */
+      smartlist_add_strdup(answers, q);
+      smartlist_add(answers, NULL);
+      smartlist_add(spools, spool);
+      continue;
+    }
     if (handle_getinfo_helper(conn, q, &ans, &errmsg) < 0) {
       if (!errmsg)
         errmsg = "Internal error";
@@ -3236,23 +3798,38 @@ handle_control_getinfo(control_connection_t *conn, uint32_t len,
     goto done;
   }
 
-  for (i = 0; i < smartlist_len(answers); i += 2) {
-    char *k = smartlist_get(answers, i);
-    char *v = smartlist_get(answers, i+1);
-    if (!strchr(v, '\n') && !strchr(v, '\r')) {
-      connection_printf_to_buf(conn, "250-%s=", k);
-      connection_write_str_to_buf(v, conn);
-      connection_write_str_to_buf("\r\n", conn);
-    } else {
-      char *esc = NULL;
-      size_t esc_len;
-      esc_len = write_escaped_data(v, strlen(v), &esc);
-      connection_printf_to_buf(conn, "250+%s=\r\n", k);
-      connection_buf_add(esc, esc_len, TO_CONN(conn));
-      tor_free(esc);
+  if (!smartlist_len(spools)) {
+    for (i = 0; i < smartlist_len(answers); i += 2) {
+      char *reply = getinfo_format_answer(smartlist_get(answers, i),
+                                          smartlist_get(answers, i+1));
+      connection_write_str_to_buf(reply, conn);
+      tor_free(reply);
     }
+    connection_write_str_to_buf("250 OK\r\n", conn);
+  } else {
+    int spool_idx = 0;
+    tor_assert(!conn->getinfo_spool);
+    conn->getinfo_spool = smartlist_new();
+    for (i = 0; i < smartlist_len(answers); i += 2) {
+      char *k = smartlist_get(answers, i);
+      char *v = smartlist_get(answers, i+1);
+      char *header = NULL;
+      if (v) {
+        smartlist_add(conn->getinfo_spool,
+                      getinfo_spool_new_string(getinfo_format_answer(k, v)));
+        continue;
+      }
+      tor_asprintf(&header, "250+%s=\r\n", k);
+      smartlist_add(conn->getinfo_spool, getinfo_spool_new_string(header));
+      smartlist_add(conn->getinfo_spool, smartlist_get(spools, spool_idx++));
+      smartlist_add(conn->getinfo_spool,
+                    getinfo_spool_new_string(tor_strdup(".\r\n")));
+    }
+    smartlist_add(conn->getinfo_spool,
+                  getinfo_spool_new_string(tor_strdup("250 OK\r\n")));
+    smartlist_clear(spools);
+    control_getinfo_spool_fill(conn);
   }
-  connection_write_str_to_buf("250 OK\r\n", conn);
 
  done:
   SMARTLIST_FOREACH(answers, char *, cp, tor_free(cp));
@@ -3261,6 +3838,9 @@ handle_control_getinfo(control_connection_t *conn, uint32_t len,
   smartlist_free(questions);
   SMARTLIST_FOREACH(unrecognized, char *, cp, tor_free(cp));
   smartlist_free(unrecognized);
+  SMARTLIST_FOREACH(spools, getinfo_spool_t *, spool,
+                    getinfo_spool_free(spool));
+  smartlist_free(spools);
 
   return 0;
 }
@@ -5013,6 +5593,12 @@ connection_control_process_inbuf(control_connection_t *conn)
   }
 
  again:
+  /* Don't start on another command until we've finished spooling the
+   * reply to the last one; connection_control_flushed_some() will call us
+   * again when we have. */
+  if (conn->getinfo_spool)
+    return 0;
+
   while (1) {
     size_t last_idx;
     int r;
@@ -5607,6 +6193,8 @@ control_event_stream_bandwidth(edge_connection_t *edge_conn)
       ocirc = TO_ORIGIN_CIRCUIT(circ);
       ocirc->n_read_circ_bw += edge_conn->n_read;
       ocirc->n_written_circ_bw += edge_conn->n_written;
+      if (EVENT_IS_INTERESTING(EVENT_CIRC_BANDWIDTH_USED))
+        circ_bw_note_changed(ocirc);
     }
     edge_conn->n_written = edge_conn->n_read = 0;
   }
@@ -5615,60 +6203,63 @@ control_event_stream_bandwidth(edge_connection_t *edge_conn)
 }
 
 /** A second or more has elapsed: tell any interested control
- * connections how much bandwidth streams have used. */
+ * connections how much bandwidth streams have used.  Only the streams
+ * that have moved data since the last call are visited. */
 int
 control_event_stream_bandwidth_used(void)
 {
-  if (EVENT_IS_INTERESTING(EVENT_STREAM_BANDWIDTH_USED)) {
-    smartlist_t *conns = get_connection_array();
-    edge_connection_t *edge_conn;
-    struct timeval now;
-    char tbuf[ISO_TIME_USEC_LEN+1];
+  struct timeval now;
+  char tbuf[ISO_TIME_USEC_LEN+1];
 
-    SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn)
-    {
-        if (conn->type != CONN_TYPE_AP)
-          continue;
-        edge_conn = TO_EDGE_CONN(conn);
-        if (!edge_conn->n_read && !edge_conn->n_written)
-          continue;
+  if (!EVENT_IS_INTERESTING(EVENT_STREAM_BANDWIDTH_USED) ||
+      !stream_bw_changed || !smartlist_len(stream_bw_changed))
+    return 0;
 
-        tor_gettimeofday(&now);
-        format_iso_time_nospace_usec(tbuf, &now);
-        send_control_event(EVENT_STREAM_BANDWIDTH_USED,
-                           "650 STREAM_BW "U64_FORMAT" %lu %lu %s\r\n",
-                           U64_PRINTF_ARG(edge_conn->base_.global_identifier),
-                           (unsigned long)edge_conn->n_read,
-                           (unsigned long)edge_conn->n_written,
-                           tbuf);
+  tor_gettimeofday(&now);
+  format_iso_time_nospace_usec(tbuf, &now);
 
-        edge_conn->n_written = edge_conn->n_read = 0;
-    }
-    SMARTLIST_FOREACH_END(conn);
-  }
+  SMARTLIST_FOREACH_BEGIN(stream_bw_changed, edge_connection_t *,
+                          edge_conn) {
+    edge_conn->on_stream_bw_list = 0;
+    /* The counters may have been flushed by control_event_stream_bandwidth
+     * since this stream was listed. */
+    if (!edge_conn->n_read && !edge_conn->n_written)
+      continue;
+
+    send_control_event(EVENT_STREAM_BANDWIDTH_USED,
+                       "650 STREAM_BW "U64_FORMAT" %lu %lu %s\r\n",
+                       U64_PRINTF_ARG(edge_conn->base_.global_identifier),
+                       (unsigned long)edge_conn->n_read,
+                       (unsigned long)edge_conn->n_written,
+                       tbuf);
+
+    edge_conn->n_written = edge_conn->n_read = 0;
+  } SMARTLIST_FOREACH_END(edge_conn);
+  smartlist_clear(stream_bw_changed);
 
   return 0;
 }
 
 /** A second or more has elapsed: tell any interested control connections
- * how much bandwidth origin circuits have used. */
+ * how much bandwidth origin circuits have used.  Only the circuits that
+ * have moved data since the last call are visited. */
 int
 control_event_circ_bandwidth_used(void)
 {
-  origin_circuit_t *ocirc;
   struct timeval now;
   char tbuf[ISO_TIME_USEC_LEN+1];
-  if (!EVENT_IS_INTERESTING(EVENT_CIRC_BANDWIDTH_USED))
+
+  if (!EVENT_IS_INTERESTING(EVENT_CIRC_BANDWIDTH_USED) ||
+      !circ_bw_changed || !smartlist_len(circ_bw_changed))
     return 0;
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    if (!CIRCUIT_IS_ORIGIN(circ))
-      continue;
-    ocirc = TO_ORIGIN_CIRCUIT(circ);
+  tor_gettimeofday(&now);
+  format_iso_time_nospace_usec(tbuf, &now);
+
+  SMARTLIST_FOREACH_BEGIN(circ_bw_changed, origin_circuit_t *, ocirc) {
+    ocirc->on_circ_bw_list = 0;
     if (!ocirc->n_read_circ_bw && !ocirc->n_written_circ_bw)
       continue;
-    tor_gettimeofday(&now);
-    format_iso_time_nospace_usec(tbuf, &now);
     send_control_event(EVENT_CIRC_BANDWIDTH_USED,
                        "650 CIRC_BW ID=%d READ=%lu WRITTEN=%lu "
                        "TIME=%s\r\n",
@@ -5677,8 +6268,8 @@ control_event_circ_bandwidth_used(void)
                        (unsigned long)ocirc->n_written_circ_bw,
                        tbuf);
     ocirc->n_written_circ_bw = ocirc->n_read_circ_bw = 0;
-  }
-  SMARTLIST_FOREACH_END(circ);
+  } SMARTLIST_FOREACH_END(ocirc);
+  smartlist_clear(circ_bw_changed);
 
   return 0;
 }
@@ -7308,6 +7899,12 @@ control_free_all(void)
     tor_event_free(flush_queued_events_event);
     flush_queued_events_event = NULL;
   }
+  stream_bw_clear_changed();
+  smartlist_free(stream_bw_changed);
+  stream_bw_changed = NULL;
+  circ_bw_clear_changed();
+  smartlist_free(circ_bw_changed);
+  circ_bw_changed = NULL;
 }
 
 #ifdef TOR_UNIT_TESTS
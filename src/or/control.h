@@ -32,6 +32,8 @@ int connection_control_reached_eof(control_connection_t *conn);
 void connection_control_closed(control_connection_t *conn);
 
 int connection_control_process_inbuf(control_connection_t *conn);
+int connection_control_flushed_some(control_connection_t *conn);
+void connection_control_free_spool(control_connection_t *conn);
 
 #define EVENT_NS 0x000F
 int control_event_is_interesting(int event);
@@ -51,6 +53,10 @@ int control_event_or_conn_status(or_connection_t *conn,
 int control_event_bandwidth_used(uint32_t n_read, uint32_t n_written);
 int control_event_stream_bandwidth(edge_connection_t *edge_conn);
 int control_event_stream_bandwidth_used(void);
+void control_note_stream_bandwidth(edge_connection_t *edge_conn,
+                                   size_t n_read, size_t n_written);
+void control_forget_stream_bandwidth(edge_connection_t *edge_conn);
+void control_forget_circ_bandwidth(origin_circuit_t *ocirc);
 int control_event_circ_bandwidth_used(void);
 int control_event_conn_bandwidth(connection_t *conn);
 int control_event_conn_bandwidth_used(void);
@@ -216,6 +222,8 @@ void control_free_all(void);
 /* Used only by control.c and test.c */
 STATIC size_t write_escaped_data(const char *data, size_t len, char **out);
 STATIC size_t read_escaped_data(const char *data, size_t len, char **out);
+STATIC int control_event_should_drop(control_connection_t *conn,
+                                     uint16_t event);
 
 #ifdef TOR_UNIT_TESTS
 MOCK_DECL(STATIC void,
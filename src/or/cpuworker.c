@@ -489,14 +489,18 @@ queue_pending_tasks(void)
   }
 }
 
-/** DOCDOC */
+/** Queue <b>fn</b> to run on <b>arg</b> in a worker thread, and
+ * <b>reply_fn</b> to run on it in the main thread once that's done. Return
+ * the queue entry, or NULL if we couldn't queue the work, for example
+ * because we have no worker threads. */
 MOCK_IMPL(workqueue_entry_t *,
 cpuworker_queue_work,(workqueue_priority_t priority,
                       workqueue_reply_t (*fn)(void *, void *),
                       void (*reply_fn)(void *),
                       void *arg))
 {
-  tor_assert(threadpool);
+  if (!threadpool)
+    return NULL;
 
   return threadpool_queue_work_priority(threadpool,
                                         priority,
@@ -3131,14 +3131,11 @@ handle_response_fetch_hsdesc_v3(dir_connection_t *conn,
 
   switch (status_code) {
   case 200:
-    /* We got something: Try storing it in the cache. */
-    if (hs_cache_store_as_client(body, &conn->hs_ident->identity_pk) < 0) {
-      log_warn(LD_REND, "Failed to store hidden service descriptor");
-    } else {
-      log_info(LD_REND, "Stored hidden service descriptor successfully.");
-      TO_CONN(conn)->purpose = DIR_PURPOSE_HAS_FETCHED_HSDESC;
-      hs_client_desc_has_arrived(conn->hs_ident);
-    }
+    /* We got something: decode it and try storing it in the cache. From
+     * here on, the client code retries the fetch if the descriptor turns
+     * out to be unusable, so this connection needn't. */
+    TO_CONN(conn)->purpose = DIR_PURPOSE_HAS_FETCHED_HSDESC;
+    hs_client_desc_fetched(conn->hs_ident, body);
     break;
   case 404:
     /* Not there. We'll retry when connection_about_to_close_connection()
@@ -5021,46 +5018,93 @@ parse_hs_version_from_post(const char *url, const char *prefix,
   return -1;
 }
 
-/* Handle the POST request for a hidden service descripror. The request is in
- * <b>url</b>, the body of the request is in <b>body</b>. Return 200 on success
- * else return 400 indicating a bad request. */
-STATIC int
-handle_post_hs_descriptor(const char *url, const char *body)
+/* Return the HS descriptor version that the POST request in <b>url</b>
+ * publishes, or -1 if it isn't a publish request for a version we
+ * support. */
+static int
+hs_post_url_get_version(const char *url)
 {
   int version;
   const char *end_pos;
 
-  tor_assert(url);
-  tor_assert(body);
-
   version = parse_hs_version_from_post(url, "/tor/hs/", &end_pos);
   if (version < 0) {
-    goto err;
+    return -1;
   }
 
   /* We have a valid version number, now make sure it's a publish request. Use
    * the end position just after the version and check for the command. */
   if (strcmpstart(end_pos, "/publish")) {
-    goto err;
+    return -1;
   }
 
   switch (version) {
   case HS_VERSION_THREE:
-    if (hs_cache_store_as_dir(body) < 0) {
-      goto err;
-    }
+    return version;
+  default:
+    /* Unsupported version. */
+    return -1;
+  }
+}
+
+/* Write the reply to an HS descriptor POST request on <b>conn</b>:
+ * <b>code</b> is 200 if we stored the descriptor, else 400. */
+static void
+write_post_hs_descriptor_response(dir_connection_t *conn, int code)
+{
+  const char *msg = "HS descriptor stored successfully.";
+
+  if (code != 200) {
+    msg = "Invalid HS descriptor. Rejected.";
+  }
+  write_short_http_response(conn, code, msg);
+}
+
+/* Called once the HS descriptor posted on the directory connection whose
+ * global identifier is in <b>arg</b> has been stored in our cache or
+ * rejected, with <b>status</b> from hs_cache_store_as_dir(). Send the
+ * reply, unless the connection went away while we were decoding. */
+static void
+post_hs_descriptor_stored_cb(int status, void *arg)
+{
+  uint64_t *conn_id = arg;
+  connection_t *conn = connection_get_by_global_id(*conn_id);
+
+  tor_free(conn_id);
+  if (status == 0) {
     log_info(LD_REND, "Publish request for HS descriptor handled "
                       "successfully.");
-    break;
-  default:
-    /* Unsupported version, return a bad request. */
-    goto err;
   }
+  if (!conn || conn->marked_for_close || conn->type != CONN_TYPE_DIR) {
+    log_info(LD_REND, "Directory connection closed before we could reply "
+                      "to its HS descriptor publish request.");
+    return;
+  }
+  write_post_hs_descriptor_response(TO_DIR_CONN(conn),
+                                    status < 0 ? 400 : 200);
+}
 
-  return 200;
- err:
-  /* Bad request. */
-  return 400;
+/* Handle the POST request for a hidden service descriptor on <b>conn</b>.
+ * The request is in <b>url</b>, the body of the request is in <b>body</b>.
+ * The descriptor is decoded in a worker thread, and once that is done we
+ * reply with 200 if we stored it, else 400. Without worker threads, the
+ * reply is written before we return. */
+STATIC void
+handle_post_hs_descriptor_async(dir_connection_t *conn, const char *url,
+                                const char *body)
+{
+  uint64_t *conn_id;
+
+  if (hs_post_url_get_version(url) < 0) {
+    write_post_hs_descriptor_response(conn, 400);
+    return;
+  }
+
+  /* The connection might be gone by the time the descriptor is decoded, so
+   * remember it by identifier. */
+  conn_id = tor_malloc(sizeof(*conn_id));
+  *conn_id = TO_CONN(conn)->global_identifier;
+  hs_cache_store_as_dir_async(body, post_hs_descriptor_stored_cb, conn_id);
 }
 
 /** Helper function: called when a dirserver gets a complete HTTP POST
@@ -5111,14 +5155,8 @@ directory_handle_command_post,(dir_connection_t *conn, const char *headers,
   /* XXX: This should be disabled with a consensus param until we want to
    * the prop224 be deployed and thus use. */
   if (connection_dir_is_encrypted(conn) && !strcmpstart(url, "/tor/hs/")) {
-    const char *msg = "HS descriptor stored successfully.";
-
     /* We most probably have a publish request for an HS descriptor. */
-    int code = handle_post_hs_descriptor(url, body);
-    if (code != 200) {
-      msg = "Invalid HS descriptor. Rejected.";
-    }
-    write_short_http_response(conn, code, msg);
+    handle_post_hs_descriptor_async(conn, url, body);
     goto done;
   }
 
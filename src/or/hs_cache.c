@@ -28,12 +28,62 @@ static int cached_client_descriptor_has_expired(time_t now,
 /* Directory descriptor cache. Map indexed by blinded key. */
 static digest256map_t *hs_cache_v3_dir;
 
+/* Every entry of the directory cache, as a priority queue in the order we
+ * would evict them: oldest first, and biggest first among entries of the
+ * same age. */
+static smartlist_t *hs_cache_v3_dir_pqueue;
+
+/* Total size in bytes of all the entries in the directory cache. */
+static size_t hs_cache_v3_dir_bytes;
+
+/* Lookup and eviction statistics of our v3 caches, for the control port. */
+static struct {
+  uint64_t dir_hits;
+  uint64_t dir_misses;
+  /* Entries removed to respect MaxHSDirCacheSize. */
+  uint64_t dir_evictions;
+  /* Entries removed because they were too old, or by the OOM handler. */
+  uint64_t dir_expirations;
+  uint64_t client_hits;
+  uint64_t client_misses;
+} hs_cache_stats;
+
+/* Helper: Compare two directory cache entries by eviction priority. */
+static int
+compare_dir_desc_eviction_order_(const void *a, const void *b)
+{
+  const hs_cache_dir_descriptor_t *desc_a = a, *desc_b = b;
+  if (desc_a->created_ts != desc_b->created_ts) {
+    return desc_a->created_ts < desc_b->created_ts ? -1 : 1;
+  }
+  if (desc_a->entry_size != desc_b->entry_size) {
+    return desc_a->entry_size > desc_b->entry_size ? -1 : 1;
+  }
+  return 0;
+}
+
+/* Remove a given descriptor from the eviction queue and the byte count of
+ * our cache. It must already be out of the map. */
+static void
+unindex_v3_desc_as_dir(hs_cache_dir_descriptor_t *desc)
+{
+  tor_assert(desc);
+  tor_assert(desc->heap_idx >= 0);
+  smartlist_pqueue_remove(hs_cache_v3_dir_pqueue,
+                          compare_dir_desc_eviction_order_,
+                          offsetof(hs_cache_dir_descriptor_t, heap_idx),
+                          desc);
+  desc->heap_idx = -1;
+  hs_cache_v3_dir_bytes -= desc->entry_size;
+}
+
 /* Remove a given descriptor from our cache. */
 static void
-remove_v3_desc_as_dir(const hs_cache_dir_descriptor_t *desc)
+remove_v3_desc_as_dir(hs_cache_dir_descriptor_t *desc)
 {
   tor_assert(desc);
   digest256map_remove(hs_cache_v3_dir, desc->key);
+  unindex_v3_desc_as_dir(desc);
 }
 
 /* Store a given descriptor in our cache. */
@@ -42,6 +92,11 @@ store_v3_desc_as_dir(hs_cache_dir_descriptor_t *desc)
 {
   tor_assert(desc);
   digest256map_set(hs_cache_v3_dir, desc->key, desc);
+  smartlist_pqueue_add(hs_cache_v3_dir_pqueue,
+                       compare_dir_desc_eviction_order_,
+                       offsetof(hs_cache_dir_descriptor_t, heap_idx),
+                       desc);
+  hs_cache_v3_dir_bytes += desc->entry_size;
 }
 
 /* Query our cache and return the entry or NULL if not found. */
@@ -73,42 +128,122 @@ cache_dir_desc_free_(void *ptr)
   cache_dir_desc_free(desc);
 }
 
-/* Create a new directory cache descriptor object from a encoded descriptor.
- * On success, return the heap-allocated cache object, otherwise return NULL if
- * we can't decode the descriptor. */
+/* Create a new directory cache descriptor object from the encoded
+ * descriptor <b>desc</b> and its already decoded <b>plaintext</b> data,
+ * taking ownership of both. Return the heap-allocated cache object. */
 static hs_cache_dir_descriptor_t *
-cache_dir_desc_new(const char *desc)
+cache_dir_desc_new_from_plaintext(char *desc,
+                                  hs_desc_plaintext_data_t *plaintext)
 {
   hs_cache_dir_descriptor_t *dir_desc;
 
   tor_assert(desc);
+  tor_assert(plaintext);
 
   dir_desc = tor_malloc_zero(sizeof(hs_cache_dir_descriptor_t));
-  dir_desc->plaintext_data =
-    tor_malloc_zero(sizeof(hs_desc_plaintext_data_t));
-  dir_desc->encoded_desc = tor_strdup(desc);
-
-  if (hs_desc_decode_plaintext(desc, dir_desc->plaintext_data) < 0) {
-    log_debug(LD_DIR, "Unable to decode descriptor. Rejecting.");
-    goto err;
-  }
+  dir_desc->plaintext_data = plaintext;
+  dir_desc->encoded_desc = desc;
 
   /* The blinded pubkey is the indexed key. */
   dir_desc->key = dir_desc->plaintext_data->blinded_pubkey.pubkey;
   dir_desc->created_ts = time(NULL);
+  dir_desc->entry_size = sizeof(*dir_desc) +
+    hs_desc_plaintext_obj_size(dir_desc->plaintext_data) +
+    strlen(dir_desc->encoded_desc);
+  dir_desc->heap_idx = -1;
   return dir_desc;
+}
 
- err:
-  cache_dir_desc_free(dir_desc);
-  return NULL;
+/* Create a new directory cache descriptor object from a encoded descriptor.
+ * On success, return the heap-allocated cache object, otherwise return NULL if
+ * we can't decode the descriptor. */
+static hs_cache_dir_descriptor_t *
+cache_dir_desc_new(const char *desc)
+{
+  hs_desc_plaintext_data_t *plaintext;
+
+  tor_assert(desc);
+
+  plaintext = tor_malloc_zero(sizeof(hs_desc_plaintext_data_t));
+  if (hs_desc_decode_plaintext(desc, plaintext) < 0) {
+    log_debug(LD_DIR, "Unable to decode descriptor. Rejecting.");
+    hs_desc_plaintext_data_free(plaintext);
+    return NULL;
+  }
+
+  return cache_dir_desc_new_from_plaintext(tor_strdup(desc), plaintext);
 }
 
 /* Return the size of a cache entry in bytes. */
 static size_t
 cache_get_dir_entry_size(const hs_cache_dir_descriptor_t *entry)
 {
-  return (sizeof(*entry) + hs_desc_plaintext_obj_size(entry->plaintext_data)
-          + strlen(entry->encoded_desc));
+  return entry->entry_size;
+}
+
+/* Log that we're removing the directory cache entry with key <b>key</b>,
+ * for the reason <b>why</b>. */
+static void
+log_v3_desc_removal_as_dir(const uint8_t *key, const char *why)
+{
+  char key_b64[BASE64_DIGEST256_LEN + 1];
+  digest256_to_base64(key_b64, (const char *) key);
+  log_info(LD_REND, "Removing v3 descriptor '%s' from HSDir cache%s",
+           safe_str_client(key_b64), why);
+}
+
+/* Remove the first entry of the eviction queue from our cache and free it.
+ * Return its size in bytes, or 0 if the cache is empty. */
+static size_t
+cache_evict_first_v3_as_dir(const char *why)
+{
+  hs_cache_dir_descriptor_t *entry;
+  size_t entry_size;
+
+  if (smartlist_len(hs_cache_v3_dir_pqueue) == 0) {
+    return 0;
+  }
+  entry = smartlist_get(hs_cache_v3_dir_pqueue, 0);
+  entry_size = cache_get_dir_entry_size(entry);
+  log_v3_desc_removal_as_dir(entry->key, why);
+  remove_v3_desc_as_dir(entry);
+  cache_dir_desc_free(entry);
+  rend_cache_decrement_allocation(entry_size);
+  return entry_size;
+}
+
+/* Return 1 if <b>desc</b> is bigger than MaxHSDirCacheSize allows, in which
+ * case it can never be stored, else return 0. */
+static int
+cache_desc_too_big_v3_as_dir(const hs_cache_dir_descriptor_t *desc)
+{
+  const uint64_t max_bytes = get_options()->MaxHSDirCacheSize;
+
+  if (max_bytes && desc->entry_size > max_bytes) {
+    log_info(LD_REND, "Descriptor of %lu bytes is too big for our HSDir "
+             "cache. Rejecting!", (unsigned long) desc->entry_size);
+    return 1;
+  }
+  return 0;
+}
+
+/* Make room for <b>desc</b> in the directory cache by evicting the oldest
+ * entries, if MaxHSDirCacheSize is set. The caller must have checked that
+ * the descriptor fits at all with cache_desc_too_big_v3_as_dir(). */
+static void
+cache_make_room_v3_as_dir(const hs_cache_dir_descriptor_t *desc)
+{
+  const uint64_t max_bytes = get_options()->MaxHSDirCacheSize;
+
+  if (!max_bytes) {
+    return;
+  }
+  while (hs_cache_v3_dir_bytes + desc->entry_size > max_bytes) {
+    if (!cache_evict_first_v3_as_dir(" to make room for a new one")) {
+      break;
+    }
+    ++hs_cache_stats.dir_evictions;
+  }
 }
 
 /* Try to store a valid version 3 descriptor in the directory cache. Return 0
@@ -122,6 +257,12 @@ cache_store_v3_as_dir(hs_cache_dir_descriptor_t *desc)
 
   tor_assert(desc);
 
+  /* Reject a descriptor that can't fit before touching the cache, so that an
+   * oversized upload never costs us the entry we already have. */
+  if (cache_desc_too_big_v3_as_dir(desc)) {
+    goto err;
+  }
+
   /* Verify if we have an entry in the cache for that key and if yes, check
    * if we should replace it? */
   cache_entry = lookup_v3_desc_as_dir(desc->key);
@@ -144,6 +285,9 @@ cache_store_v3_as_dir(hs_cache_dir_descriptor_t *desc)
     rend_cache_decrement_allocation(cache_get_dir_entry_size(cache_entry));
     cache_dir_desc_free(cache_entry);
   }
+  /* Respect our byte cap, which is done here at insert time so that a flood
+   * of uploads can't grow the cache past it between two cleanups. */
+  cache_make_room_v3_as_dir(desc);
   /* Store the descriptor we just got. We are sure here that either we
    * don't have the entry or we have a newer descriptor and the old one
    * has been removed from the cache. */
@@ -185,9 +329,12 @@ cache_lookup_v3_as_dir(const char *query, const char **desc_out)
   entry = lookup_v3_desc_as_dir(blinded_key.pubkey);
   if (entry != NULL) {
     found = 1;
+    ++hs_cache_stats.dir_hits;
     if (desc_out) {
       *desc_out = entry->encoded_desc;
     }
+  } else {
+    ++hs_cache_stats.dir_misses;
   }
 
   return found;
@@ -212,14 +359,26 @@ cache_clean_v3_as_dir(time_t now, time_t global_cutoff)
     return 0;
   }
 
+  if (global_cutoff) {
+    /* Everything created at or before the cutoff is at the front of the
+     * eviction queue, so we don't need to look at anything else. */
+    while (smartlist_len(hs_cache_v3_dir_pqueue) > 0) {
+      const hs_cache_dir_descriptor_t *first =
+        smartlist_get(hs_cache_v3_dir_pqueue, 0);
+      if (first->created_ts > global_cutoff) {
+        break;
+      }
+      bytes_removed += cache_evict_first_v3_as_dir("");
+      ++hs_cache_stats.dir_expirations;
+    }
+    return bytes_removed;
+  }
+
   DIGEST256MAP_FOREACH_MODIFY(hs_cache_v3_dir, key,
                               hs_cache_dir_descriptor_t *, entry) {
     size_t entry_size;
-    time_t cutoff = global_cutoff;
-    if (!cutoff) {
-      /* Cutoff is the lifetime of the entry found in the descriptor. */
-      cutoff = now - entry->plaintext_data->lifetime_sec;
-    }
+    /* Cutoff is the lifetime of the entry found in the descriptor. */
+    time_t cutoff = now - entry->plaintext_data->lifetime_sec;
 
     /* If the entry has been created _after_ the cutoff, not expired so
      * continue to the next entry in our v3 cache. */
@@ -228,24 +387,44 @@ cache_clean_v3_as_dir(time_t now, time_t global_cutoff)
     }
     /* Here, our entry has expired, remove and free. */
     MAP_DEL_CURRENT(key);
+    unindex_v3_desc_as_dir(entry);
     entry_size = cache_get_dir_entry_size(entry);
     bytes_removed += entry_size;
+    ++hs_cache_stats.dir_expirations;
+    log_v3_desc_removal_as_dir(key, "");
     /* Entry is not in the cache anymore, destroy it. */
     cache_dir_desc_free(entry);
     /* Update our cache entry allocation size for the OOM. */
     rend_cache_decrement_allocation(entry_size);
-    /* Logging. */
-    {
-      char key_b64[BASE64_DIGEST256_LEN + 1];
-      digest256_to_base64(key_b64, (const char *) key);
-      log_info(LD_REND, "Removing v3 descriptor '%s' from HSDir cache",
-               safe_str_client(key_b64));
-    }
   } DIGEST256MAP_FOREACH_END;
 
   return bytes_removed;
 }
 
+/* Store <b>dir_desc</b> in the directory cache depending on which version
+ * it is, taking ownership of it. Return a negative value on error. On
+ * success, 0 is returned. */
+static int
+cache_dir_desc_store(hs_cache_dir_descriptor_t *dir_desc)
+{
+  /* Call the right function against the descriptor version. At this point,
+   * we are sure that the descriptor's version is supported else the
+   * decoding would have failed. */
+  switch (dir_desc->plaintext_data->version) {
+  case HS_VERSION_THREE:
+  default:
+    if (cache_store_v3_as_dir(dir_desc) < 0) {
+      goto err;
+    }
+    break;
+  }
+  return 0;
+
+ err:
+  cache_dir_desc_free(dir_desc);
+  return -1;
+}
+
 /* Given an encoded descriptor, store it in the directory cache depending on
  * which version it is. Return a negative value on error. On success, 0 is
  * returned. */
@@ -260,25 +439,65 @@ hs_cache_store_as_dir(const char *desc)
    * is unparseable which in this case a log message will be triggered. */
   dir_desc = cache_dir_desc_new(desc);
   if (dir_desc == NULL) {
-    goto err;
+    return -1;
   }
 
-  /* Call the right function against the descriptor version. At this point,
-   * we are sure that the descriptor's version is supported else the
-   * decoding would have failed. */
-  switch (dir_desc->plaintext_data->version) {
-  case HS_VERSION_THREE:
-  default:
-    if (cache_store_v3_as_dir(dir_desc) < 0) {
-      goto err;
-    }
-    break;
+  return cache_dir_desc_store(dir_desc);
+}
+
+/* An encoded descriptor whose plaintext is being decoded off the main thread
+ * so that we can store it in the directory cache. */
+typedef struct cache_dir_store_t {
+  /* The encoded descriptor. */
+  char *encoded;
+  /* Who to tell once it has been stored or rejected. */
+  hs_cache_store_cb_t cb;
+  void *cb_arg;
+} cache_dir_store_t;
+
+/* Called from the main thread once the plaintext of the descriptor in
+ * <b>arg</b> has been decoded: store it in the directory cache and report
+ * the result. */
+static void
+cache_dir_store_decoded_cb(int status, hs_desc_plaintext_data_t *plaintext,
+                           void *arg)
+{
+  cache_dir_store_t *store = arg;
+  int ret = -1;
+
+  if (status < 0) {
+    log_debug(LD_DIR, "Unable to decode descriptor. Rejecting.");
+  } else {
+    hs_cache_dir_descriptor_t *dir_desc =
+      cache_dir_desc_new_from_plaintext(store->encoded, plaintext);
+    ret = cache_dir_desc_store(dir_desc);
+    /* The cache entry owns it now, or it's gone with the entry. */
+    store->encoded = NULL;
   }
-  return 0;
 
- err:
-  cache_dir_desc_free(dir_desc);
-  return -1;
+  store->cb(ret, store->cb_arg);
+  tor_free(store->encoded);
+  tor_free(store);
+}
+
+/* Like hs_cache_store_as_dir(), but decode <b>desc</b> in a worker
+ * thread, and call <b>cb</b> with what hs_cache_store_as_dir() would have
+ * returned and <b>arg</b> once the descriptor has been stored or rejected.
+ * If we have no worker threads, <b>cb</b> is called before we return. */
+void
+hs_cache_store_as_dir_async(const char *desc, hs_cache_store_cb_t cb,
+                            void *arg)
+{
+  cache_dir_store_t *store;
+
+  tor_assert(desc);
+  tor_assert(cb);
+
+  store = tor_malloc_zero(sizeof(*store));
+  store->encoded = tor_strdup(desc);
+  store->cb = cb;
+  store->cb_arg = arg;
+  hs_desc_decode_plaintext_async(desc, cache_dir_store_decoded_cb, store);
 }
 
 /* Using the query, lookup in our directory cache the entry. If found, 1 is
@@ -382,6 +601,31 @@ lookup_v3_desc_as_client(const uint8_t *key)
   return cached_desc;
 }
 
+/* Make a new client cache object for the descriptor <b>desc</b>, decoded
+ * from <b>desc_str</b> with <b>service_identity_pk</b>, taking ownership of
+ * <b>desc</b>. Return the heap-allocated cache object. */
+static hs_cache_client_descriptor_t *
+cache_client_desc_new_from_decoded(const char *desc_str,
+                               const ed25519_public_key_t *service_identity_pk,
+                               hs_descriptor_t *desc)
+{
+  hs_cache_client_descriptor_t *client_desc = NULL;
+
+  tor_assert(desc_str);
+  tor_assert(service_identity_pk);
+  tor_assert(desc);
+
+  client_desc = tor_malloc_zero(sizeof(hs_cache_client_descriptor_t));
+  ed25519_pubkey_copy(&client_desc->key, service_identity_pk);
+  /* Set expiration time for this cached descriptor to be the start of the next
+   * time period since that's when clients need to start using the next blinded
+   * pk of the service (and hence will need its next descriptor). */
+  client_desc->expiration_ts = hs_get_start_time_of_next_time_period(0);
+  client_desc->desc = desc;
+  client_desc->encoded_desc = tor_strdup(desc_str);
+  return client_desc;
+}
+
 /* Parse the encoded descriptor in <b>desc_str</b> using
  * <b>service_identity_pk<b> to decrypt it first.
  *
@@ -392,29 +636,19 @@ cache_client_desc_new(const char *desc_str,
                       const ed25519_public_key_t *service_identity_pk)
 {
   hs_descriptor_t *desc = NULL;
-  hs_cache_client_descriptor_t *client_desc = NULL;
 
   tor_assert(desc_str);
   tor_assert(service_identity_pk);
 
   /* Decode the descriptor we just fetched. */
   if (hs_client_decode_descriptor(desc_str, service_identity_pk, &desc) < 0) {
-    goto end;
+    return NULL;
   }
   tor_assert(desc);
 
   /* All is good: make a cache object for this descriptor */
-  client_desc = tor_malloc_zero(sizeof(hs_cache_client_descriptor_t));
-  ed25519_pubkey_copy(&client_desc->key, service_identity_pk);
-  /* Set expiration time for this cached descriptor to be the start of the next
-   * time period since that's when clients need to start using the next blinded
-   * pk of the service (and hence will need its next descriptor). */
-  client_desc->expiration_ts = hs_get_start_time_of_next_time_period(0);
-  client_desc->desc = desc;
-  client_desc->encoded_desc = tor_strdup(desc_str);
-
- end:
-  return client_desc;
+  return cache_client_desc_new_from_decoded(desc_str, service_identity_pk,
+                                            desc);
 }
 
 /** Free memory allocated by <b>desc</b>. */
@@ -717,9 +951,11 @@ hs_cache_lookup_as_client(const ed25519_public_key_t *key)
   cached_desc = lookup_v3_desc_as_client(key->pubkey);
   if (cached_desc) {
     tor_assert(cached_desc->desc);
+    ++hs_cache_stats.client_hits;
     return cached_desc->desc;
   }
 
+  ++hs_cache_stats.client_misses;
   return NULL;
 }
 
@@ -754,6 +990,30 @@ hs_cache_store_as_client(const char *desc_str,
   return -1;
 }
 
+/** Public API: Given a descriptor <b>desc</b> that the client code has
+ *  already decoded and validated from <b>desc_str</b>, store it in the
+ *  client HS cache, taking ownership of <b>desc</b>. Return -1 on error, 0
+ *  on success. */
+int
+hs_cache_store_decoded_as_client(const char *desc_str,
+                                 const ed25519_public_key_t *identity_pk,
+                                 hs_descriptor_t *desc)
+{
+  hs_cache_client_descriptor_t *client_desc;
+
+  tor_assert(desc_str);
+  tor_assert(identity_pk);
+  tor_assert(desc);
+
+  client_desc = cache_client_desc_new_from_decoded(desc_str, identity_pk,
+                                                   desc);
+  if (cache_store_as_client(client_desc) < 0) {
+    cache_client_desc_free(client_desc);
+    return -1;
+  }
+  return 0;
+}
+
 /* Clean all client caches using the current time now. */
 void
 hs_cache_clean_as_client(time_t now)
@@ -872,7 +1132,8 @@ hs_cache_handle_oom(time_t now, size_t min_remove_bytes)
    *      2.1) If the amount of remove bytes has been reached, stop.
    *   3) Set K = K - RendPostPeriod and repeat process until K is < 0.
    *
-   * This ends up being O(Kn).
+   * This ends up being O(Kn) for the v2 cache. The v3 cache is cleaned from
+   * its eviction queue, so it only looks at the entries it removes.
    */
 
   /* Set K to the oldest expected age in seconds which is the maximum
@@ -914,6 +1175,29 @@ hs_cache_get_max_descriptor_size(void)
                                             HS_DESC_MAX_LEN, 1, INT32_MAX);
 }
 
+/* Return a newly allocated string describing the size of our v3 caches and
+ * how they've been used, for the control port. */
+char *
+hs_cache_get_stats_string(void)
+{
+  char *str = NULL;
+  tor_asprintf(&str, "dir-entries=%d dir-bytes="U64_FORMAT" "
+               "dir-hits="U64_FORMAT" dir-misses="U64_FORMAT" "
+               "dir-evictions="U64_FORMAT" dir-expirations="U64_FORMAT" "
+               "client-entries=%d client-hits="U64_FORMAT" "
+               "client-misses="U64_FORMAT,
+               hs_cache_v3_dir ? digest256map_size(hs_cache_v3_dir) : 0,
+               U64_PRINTF_ARG(hs_cache_v3_dir_bytes),
+               U64_PRINTF_ARG(hs_cache_stats.dir_hits),
+               U64_PRINTF_ARG(hs_cache_stats.dir_misses),
+               U64_PRINTF_ARG(hs_cache_stats.dir_evictions),
+               U64_PRINTF_ARG(hs_cache_stats.dir_expirations),
+               hs_cache_v3_client ? digest256map_size(hs_cache_v3_client) : 0,
+               U64_PRINTF_ARG(hs_cache_stats.client_hits),
+               U64_PRINTF_ARG(hs_cache_stats.client_misses));
+  return str;
+}
+
 /* Initialize the hidden service cache subsystem. */
 void
 hs_cache_init(void)
@@ -921,6 +1205,8 @@ hs_cache_init(void)
   /* Calling this twice is very wrong code flow. */
   tor_assert(!hs_cache_v3_dir);
   hs_cache_v3_dir = digest256map_new();
+  hs_cache_v3_dir_pqueue = smartlist_new();
+  hs_cache_v3_dir_bytes = 0;
 
   tor_assert(!hs_cache_v3_client);
   hs_cache_v3_client = digest256map_new();
@@ -935,6 +1221,9 @@ hs_cache_free_all(void)
 {
   digest256map_free(hs_cache_v3_dir, cache_dir_desc_free_);
   hs_cache_v3_dir = NULL;
+  smartlist_free(hs_cache_v3_dir_pqueue);
+  hs_cache_v3_dir_pqueue = NULL;
+  hs_cache_v3_dir_bytes = 0;
 
   digest256map_free(hs_cache_v3_client, cache_client_desc_free_);
   hs_cache_v3_client = NULL;
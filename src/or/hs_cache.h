@@ -61,6 +61,13 @@ typedef struct hs_cache_dir_descriptor_t {
   /* Encoded descriptor which is basically in text form. It's a NUL terminated
    * string thus safe to strlen(). */
   char *encoded_desc;
+
+  /* Size in bytes of this entry, computed once when it's created. */
+  size_t entry_size;
+
+  /* Index of this entry in the eviction priority queue, or -1 if it isn't
+   * in the cache. */
+  int heap_idx;
 } hs_cache_dir_descriptor_t;
 
 /* Public API */
@@ -71,11 +78,17 @@ void hs_cache_clean_as_dir(time_t now);
 size_t hs_cache_handle_oom(time_t now, size_t min_remove_bytes);
 
 unsigned int hs_cache_get_max_descriptor_size(void);
+char *hs_cache_get_stats_string(void);
 
 /* Store and Lookup function. They are version agnostic that is depending on
  * the requested version of the descriptor, it will be re-routed to the
  * right function. */
 int hs_cache_store_as_dir(const char *desc);
+/* Called with the result of hs_cache_store_as_dir_async(): <b>status</b> is
+ * what hs_cache_store_as_dir() would have returned. */
+typedef void (*hs_cache_store_cb_t)(int status, void *arg);
+void hs_cache_store_as_dir_async(const char *desc, hs_cache_store_cb_t cb,
+                                 void *arg);
 int hs_cache_lookup_as_dir(uint32_t version, const char *query,
                            const char **desc_out);
 
@@ -83,6 +96,9 @@ const hs_descriptor_t *
 hs_cache_lookup_as_client(const ed25519_public_key_t *key);
 int hs_cache_store_as_client(const char *desc_str,
                              const ed25519_public_key_t *identity_pk);
+int hs_cache_store_decoded_as_client(const char *desc_str,
+                                     const ed25519_public_key_t *identity_pk,
+                                     hs_descriptor_t *desc);
 void hs_cache_clean_as_client(time_t now);
 void hs_cache_purge_as_client(void);
 
@@ -160,13 +160,75 @@ purge_hid_serv_request(const ed25519_public_key_t *identity_pk)
   hs_purge_hid_serv_from_last_hid_serv_requests(base64_blinded_pk);
 }
 
+/* Services whose fetched descriptor is being decoded, mapped to how many
+ * decodes are in flight for them. Until its decoding is done, a fetch is
+ * still pending. */
+static digest256map_t *desc_decodes_in_flight = NULL;
+/* Bumped whenever we purge our client state, so that we drop the
+ * descriptors that were being decoded at that time. */
+static uint32_t desc_decode_generation = 0;
+
+/* Note that a descriptor for <b>identity_pk</b> is now being decoded. */
+static void
+desc_decode_note_started(const ed25519_public_key_t *identity_pk)
+{
+  void *val;
+  uintptr_t n;
+
+  if (!desc_decodes_in_flight) {
+    desc_decodes_in_flight = digest256map_new();
+  }
+  val = digest256map_get(desc_decodes_in_flight, identity_pk->pubkey);
+  n = (uintptr_t) val;
+  digest256map_set(desc_decodes_in_flight, identity_pk->pubkey,
+                   (void *) (n + 1));
+}
+
+/* Note that a descriptor for <b>identity_pk</b> is done being decoded. */
+static void
+desc_decode_note_done(const ed25519_public_key_t *identity_pk)
+{
+  void *val;
+  uintptr_t n;
+
+  if (BUG(!desc_decodes_in_flight)) {
+    return;
+  }
+  val = digest256map_get(desc_decodes_in_flight, identity_pk->pubkey);
+  n = (uintptr_t) val;
+  if (BUG(n == 0)) {
+    return;
+  }
+  if (n == 1) {
+    digest256map_remove(desc_decodes_in_flight, identity_pk->pubkey);
+  } else {
+    digest256map_set(desc_decodes_in_flight, identity_pk->pubkey,
+                     (void *) (n - 1));
+  }
+}
+
+/* Return true iff a descriptor for <b>identity_pk</b> is being decoded. */
+static int
+desc_decode_is_in_flight(const ed25519_public_key_t *identity_pk)
+{
+  return desc_decodes_in_flight &&
+    digest256map_get(desc_decodes_in_flight, identity_pk->pubkey) != NULL;
+}
+
 /* Return true iff there is at least one pending directory descriptor request
- * for the service identity_pk. */
+ * for the service identity_pk, counting fetched descriptors that are still
+ * being decoded. */
 static int
 directory_request_is_pending(const ed25519_public_key_t *identity_pk)
 {
   int ret = 0;
-  smartlist_t *conns =
+  smartlist_t *conns;
+
+  if (desc_decode_is_in_flight(identity_pk)) {
+    return 1;
+  }
+
+  conns =
     connection_list_by_type_purpose(CONN_TYPE_DIR, DIR_PURPOSE_FETCH_HSDESC);
 
   SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
@@ -343,6 +405,12 @@ directory_launch_v3_desc_fetch(const ed25519_public_key_t *onion_identity_pk,
   directory_initiate_request(req);
   directory_request_free(req);
 
+  /* Relays decode the descriptor in their cpuworkers once it arrives.
+   * Clients have none, so make sure their own decoding threads are up. */
+  if (!server_mode(get_options())) {
+    hs_desc_decode_pool_init();
+  }
+
   log_info(LD_REND, "Descriptor fetch request for service %s with blinded "
                     "key %s to directory %s",
            safe_str_client(ed25519_fmt(onion_identity_pk)),
@@ -1189,6 +1257,51 @@ hs_client_note_connection_attempt_succeeded(const edge_connection_t *conn)
   }
 }
 
+/* Build the blinded key and the subcredential that the current descriptor of
+ * the service with <b>service_identity_pk</b> uses, and put them in
+ * <b>blinded_pubkey_out</b> and <b>subcredential_out</b>. */
+static void
+client_desc_build_keys(const ed25519_public_key_t *service_identity_pk,
+                       ed25519_public_key_t *blinded_pubkey_out,
+                       uint8_t *subcredential_out)
+{
+  uint64_t current_time_period = hs_get_time_period_num(0);
+  hs_build_blinded_pubkey(service_identity_pk, NULL, 0, current_time_period,
+                          blinded_pubkey_out);
+  hs_get_subcredential(service_identity_pk, blinded_pubkey_out,
+                       subcredential_out);
+}
+
+/* Check the result of decoding the descriptor in <b>desc_str</b>: <b>ret</b>
+ * is what the decoding function returned and <b>desc</b> what it decoded,
+ * which must be signed by <b>blinded_pubkey</b>. Return 0 if the descriptor
+ * is usable, else a negative value. */
+static int
+client_desc_check_decoded(int ret, const char *desc_str,
+                          const hs_descriptor_t *desc,
+                          const ed25519_public_key_t *blinded_pubkey)
+{
+  if (ret < 0) {
+    log_warn(LD_GENERAL, "Could not parse received descriptor as client.");
+    if (get_options()->SafeLogging_ == SAFELOG_SCRUB_NONE) {
+      log_warn(LD_GENERAL, "%s", escaped(desc_str));
+    }
+    return -1;
+  }
+
+  /* Make sure the descriptor signing key cross certifies with the computed
+   * blinded key. Without this validation, anyone knowing the subcredential
+   * and onion address can forge a descriptor. */
+  if (tor_cert_checksig(desc->plaintext_data.signing_key_cert,
+                        blinded_pubkey, approx_time()) < 0) {
+    log_warn(LD_GENERAL, "Descriptor signing key certificate signature "
+                         "doesn't validate with computed blinded key.");
+    return -1;
+  }
+
+  return 0;
+}
+
 /* With the given encoded descriptor in desc_str and the service key in
  * service_identity_pk, decode the descriptor and set the desc pointer with a
  * newly allocated descriptor object.
@@ -1208,37 +1321,99 @@ hs_client_decode_descriptor(const char *desc_str,
   tor_assert(desc);
 
   /* Create subcredential for this HS so that we can decrypt */
-  {
-    uint64_t current_time_period = hs_get_time_period_num(0);
-    hs_build_blinded_pubkey(service_identity_pk, NULL, 0, current_time_period,
-                            &blinded_pubkey);
-    hs_get_subcredential(service_identity_pk, &blinded_pubkey, subcredential);
-  }
+  client_desc_build_keys(service_identity_pk, &blinded_pubkey, subcredential);
 
   /* Parse descriptor */
   ret = hs_desc_decode_descriptor(desc_str, subcredential, desc);
   memwipe(subcredential, 0, sizeof(subcredential));
-  if (ret < 0) {
-    log_warn(LD_GENERAL, "Could not parse received descriptor as client.");
-    if (get_options()->SafeLogging_ == SAFELOG_SCRUB_NONE) {
-      log_warn(LD_GENERAL, "%s", escaped(desc_str));
-    }
-    goto err;
+  if (client_desc_check_decoded(ret, desc_str, *desc, &blinded_pubkey) < 0) {
+    hs_descriptor_free(*desc);
+    *desc = NULL;
+    return -1;
   }
 
-  /* Make sure the descriptor signing key cross certifies with the computed
-   * blinded key. Without this validation, anyone knowing the subcredential
-   * and onion address can forge a descriptor. */
-  if (tor_cert_checksig((*desc)->plaintext_data.signing_key_cert,
-                        &blinded_pubkey, approx_time()) < 0) {
-    log_warn(LD_GENERAL, "Descriptor signing key certificate signature "
-                         "doesn't validate with computed blinded key.");
-    goto err;
+  return 0;
+}
+
+/* A descriptor we fetched and are decoding in a worker thread. */
+typedef struct client_desc_decode_t {
+  /* The service and blinded key the descriptor was fetched for. */
+  hs_ident_dir_conn_t ident;
+  /* The blinded key that the descriptor must be signed with. */
+  ed25519_public_key_t blinded_pubkey;
+  /* The encoded descriptor, which the cache keeps a copy of. */
+  char *encoded;
+  /* Value of desc_decode_generation when we started decoding. */
+  uint32_t generation;
+} client_desc_decode_t;
+
+/* Called from the main thread once the descriptor in <b>arg</b> has been
+ * decoded into <b>desc</b> with result <b>status</b>. Store it and attach
+ * the connections waiting for it, or try another HSDir if it's unusable. */
+static void
+client_desc_decoded_cb(int status, hs_descriptor_t *desc, void *arg)
+{
+  client_desc_decode_t *dec = arg;
+  const ed25519_public_key_t *identity_pk = &dec->ident.identity_pk;
+
+  if (dec->generation != desc_decode_generation) {
+    /* Our client state was purged since we fetched this: drop it. */
+    hs_descriptor_free(desc);
+    goto done;
   }
+  desc_decode_note_done(identity_pk);
 
-  return 0;
- err:
-  return -1;
+  if (client_desc_check_decoded(status, dec->encoded, desc,
+                                &dec->blinded_pubkey) < 0) {
+    hs_descriptor_free(desc);
+    goto failed;
+  }
+  if (hs_cache_store_decoded_as_client(dec->encoded, identity_pk, desc) < 0) {
+    goto failed;
+  }
+  log_info(LD_REND, "Stored hidden service descriptor successfully.");
+  hs_client_desc_has_arrived(&dec->ident);
+  goto done;
+
+ failed:
+  log_warn(LD_REND, "Failed to store hidden service descriptor");
+  /* Retry at another HSDir, as we do when a fetch fails outright. */
+  hs_client_refetch_hsdesc(identity_pk);
+ done:
+  tor_free(dec->encoded);
+  tor_free(dec);
+}
+
+/* Called when we have fetched the encoded descriptor <b>desc_str</b> for the
+ * service in <b>ident</b>. Decode it in a worker thread; once that's
+ * done, store it in the cache and attach the connections waiting for it,
+ * or, if it's unusable, retry the fetch at another HSDir. */
+void
+hs_client_desc_fetched(const hs_ident_dir_conn_t *ident,
+                       const char *desc_str)
+{
+  client_desc_decode_t *dec;
+  uint8_t subcredential[DIGEST256_LEN];
+
+  tor_assert(ident);
+  tor_assert(desc_str);
+
+  dec = tor_malloc_zero(sizeof(*dec));
+  memcpy(&dec->ident, ident, sizeof(dec->ident));
+  dec->encoded = tor_strdup(desc_str);
+  dec->generation = desc_decode_generation;
+  client_desc_build_keys(&ident->identity_pk, &dec->blinded_pubkey,
+                         subcredential);
+
+  desc_decode_note_started(&ident->identity_pk);
+  if (BUG(hs_desc_decode_descriptor_async(desc_str, subcredential,
+                                          client_desc_decoded_cb,
+                                          dec) < 0)) {
+    desc_decode_note_done(&ident->identity_pk);
+    tor_free(dec->encoded);
+    tor_free(dec);
+  }
+  memwipe(subcredential, 0, sizeof(subcredential));
 }
 
 /* Return true iff there are at least one usable intro point in the service
@@ -1574,6 +1749,8 @@ hs_client_free_all(void)
 {
   /* Purge the hidden service request cache. */
   hs_purge_last_hid_serv_requests();
+  digest256map_free(desc_decodes_in_flight, NULL);
+  desc_decodes_in_flight = NULL;
 }
 
 /* Purge all potentially remotely-detectable state held in the hidden
@@ -1587,6 +1764,10 @@ hs_client_purge_state(void)
   /* Cancel all descriptor fetches. Do this first so once done we are sure
    * that our descriptor cache won't modified. */
   cancel_descriptor_fetches();
+  /* Forget the descriptors we're still decoding, likewise. */
+  digest256map_free(desc_decodes_in_flight, NULL);
+  desc_decodes_in_flight = NULL;
+  ++desc_decode_generation;
   /* Purge the introduction point state cache. */
   hs_cache_client_intro_state_purge();
   /* Purge the descriptor cache. */
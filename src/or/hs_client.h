@@ -58,6 +58,8 @@ int hs_client_receive_rendezvous2(origin_circuit_t *circ,
                                   const uint8_t *payload,
                                   size_t payload_len);
 
+void hs_client_desc_fetched(const hs_ident_dir_conn_t *ident,
+                            const char *desc_str);
 void hs_client_desc_has_arrived(const hs_ident_dir_conn_t *ident);
 
 extend_info_t *hs_client_get_random_intro_from_edge(
@@ -96,71 +96,6 @@ add_unix_port(smartlist_t *ports, rend_service_port_config_t *p)
 
 #endif /* defined(HAVE_SYS_UN_H) */
 
-/* Helper function: The key is a digest that we compare to a node_t object
- * current hsdir_index. */
-static int
-compare_digest_to_fetch_hsdir_index(const void *_key, const void **_member)
-{
-  const char *key = _key;
-  const node_t *node = *_member;
-  return tor_memcmp(key, node->hsdir_index->fetch, DIGEST256_LEN);
-}
-
-/* Helper function: The key is a digest that we compare to a node_t object
- * next hsdir_index. */
-static int
-compare_digest_to_store_first_hsdir_index(const void *_key,
-                                          const void **_member)
-{
-  const char *key = _key;
-  const node_t *node = *_member;
-  return tor_memcmp(key, node->hsdir_index->store_first, DIGEST256_LEN);
-}
-
-/* Helper function: The key is a digest that we compare to a node_t object
- * next hsdir_index. */
-static int
-compare_digest_to_store_second_hsdir_index(const void *_key,
-                                          const void **_member)
-{
-  const char *key = _key;
-  const node_t *node = *_member;
-  return tor_memcmp(key, node->hsdir_index->store_second, DIGEST256_LEN);
-}
-
-/* Helper function: Compare two node_t objects current hsdir_index. */
-static int
-compare_node_fetch_hsdir_index(const void **a, const void **b)
-{
-  const node_t *node1= *a;
-  const node_t *node2 = *b;
-  return tor_memcmp(node1->hsdir_index->fetch,
-                    node2->hsdir_index->fetch,
-                    DIGEST256_LEN);
-}
-
-/* Helper function: Compare two node_t objects next hsdir_index. */
-static int
-compare_node_store_first_hsdir_index(const void **a, const void **b)
-{
-  const node_t *node1= *a;
-  const node_t *node2 = *b;
-  return tor_memcmp(node1->hsdir_index->store_first,
-                    node2->hsdir_index->store_first,
-                    DIGEST256_LEN);
-}
-
-/* Helper function: Compare two node_t objects next hsdir_index. */
-static int
-compare_node_store_second_hsdir_index(const void **a, const void **b)
-{
-  const node_t *node1= *a;
-  const node_t *node2 = *b;
-  return tor_memcmp(node1->hsdir_index->store_second,
-                    node2->hsdir_index->store_second,
-                    DIGEST256_LEN);
-}
-
 /* Allocate and return a string containing the path to filename in directory.
  * This function will never return NULL. The caller must free this path. */
 char *
@@ -1288,6 +1223,284 @@ node_has_hsdir_index(const node_t *node)
   return 1;
 }
 
+/* The three hash rings HSDirs are placed on, one per hsdir_index_t field. */
+typedef enum {
+  HSDIR_RING_FETCH        = 0,
+  HSDIR_RING_STORE_FIRST  = 1,
+  HSDIR_RING_STORE_SECOND = 2,
+} hsdir_ring_type_t;
+#define HSDIR_RING_N_TYPES 3
+
+/* A position on an HSDir hash ring. The index is copied out of the node_t so
+ * a lookup only touches one contiguous array. */
+typedef struct hsdir_ring_entry_t {
+  uint8_t index[DIGEST256_LEN];
+  const node_t *node;
+} hsdir_ring_entry_t;
+
+/* Every HSDir of the latest consensus, sorted by each of its indices. The
+ * rings are kept up to date one node at a time as nodes join or leave, both
+ * in between consensuses and when a new one is set. They are only rebuilt
+ * from scratch when too many of them changed at once. */
+static struct {
+  /* Consensus the rings are up to date with. */
+  const networkstatus_t *consensus;
+  /* Set when the rings need to be rebuilt from scratch. */
+  int is_dirty;
+  int n_entries;
+  int n_allocated;
+  /* How many nodes were added to or removed from the rings since they were
+   * last built or caught up with a consensus. */
+  int n_changes;
+  hsdir_ring_entry_t *entries[HSDIR_RING_N_TYPES];
+} hsdir_ring = { NULL, 1, 0, 0, 0, { NULL, NULL, NULL } };
+
+/* Each node added to or removed from the rings moves a part of every ring,
+ * so past this many changes, which is typical after the time period or SRV
+ * rolled over, sorting the rings again on the next lookup is cheaper. */
+#define HSDIR_RING_MAX_CHANGES(n_entries) (32 + (n_entries) / 8)
+
+/* Note that a node was added to or removed from the rings, and give up on
+ * updating them in place if there have been too many such changes. */
+static void
+hsdir_ring_note_change(void)
+{
+  if (++hsdir_ring.n_changes > HSDIR_RING_MAX_CHANGES(hsdir_ring.n_entries)) {
+    hs_hsdir_ring_invalidate();
+  }
+}
+
+/* Return the index of <b>node</b> that is used to place it on the ring of
+ * the given <b>type</b>. */
+static const uint8_t *
+hsdir_ring_node_index(const node_t *node, hsdir_ring_type_t type)
+{
+  switch (type) {
+  case HSDIR_RING_FETCH: return node->hsdir_index->fetch;
+  case HSDIR_RING_STORE_FIRST: return node->hsdir_index->store_first;
+  case HSDIR_RING_STORE_SECOND: return node->hsdir_index->store_second;
+  default: tor_assert_unreached(); return NULL;
+  }
+}
+
+/* Helper for qsort(): compare two ring entries by index. */
+static int
+compare_hsdir_ring_entries(const void *a, const void *b)
+{
+  const hsdir_ring_entry_t *e1 = a, *e2 = b;
+  return tor_memcmp(e1->index, e2->index, DIGEST256_LEN);
+}
+
+/* Return the position of the first entry of the ring <b>type</b> whose index
+ * is greater than or equal to <b>key</b>. This is n_entries if there are
+ * none. */
+static int
+hsdir_ring_lower_bound(hsdir_ring_type_t type, const uint8_t *key)
+{
+  const hsdir_ring_entry_t *entries = hsdir_ring.entries[type];
+  int lo = 0, hi = hsdir_ring.n_entries;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (tor_memcmp(entries[mid].index, key, DIGEST256_LEN) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* Return the position of <b>node</b> on the ring <b>type</b> according to
+ * its current index or -1 if it isn't on it. */
+static int
+hsdir_ring_find_node(hsdir_ring_type_t type, const node_t *node)
+{
+  const hsdir_ring_entry_t *entries = hsdir_ring.entries[type];
+  const uint8_t *key = hsdir_ring_node_index(node, type);
+  int idx;
+
+  for (idx = hsdir_ring_lower_bound(type, key); idx < hsdir_ring.n_entries;
+       idx++) {
+    if (tor_memneq(entries[idx].index, key, DIGEST256_LEN)) {
+      break;
+    }
+    if (entries[idx].node == node) {
+      return idx;
+    }
+  }
+  return -1;
+}
+
+/* Return true iff <b>node</b> belongs on the hash rings that is if it is an
+ * HSDir supporting v3 for which we have a computed hsdir index. */
+static int
+hsdir_ring_node_is_eligible(const node_t *node)
+{
+  return node->rs && node->rs->is_hs_dir && node_supports_v3_hsdir(node) &&
+         node_has_descriptor(node) && node->hsdir_index &&
+         !tor_mem_is_zero((const char *) node->hsdir_index->fetch,
+                          DIGEST256_LEN) &&
+         !tor_mem_is_zero((const char *) node->hsdir_index->store_first,
+                          DIGEST256_LEN) &&
+         !tor_mem_is_zero((const char *) node->hsdir_index->store_second,
+                          DIGEST256_LEN);
+}
+
+/* Make room for at least <b>n</b> entries on each ring. */
+static void
+hsdir_ring_reserve(int n)
+{
+  if (n <= hsdir_ring.n_allocated) {
+    return;
+  }
+  n = MAX(n, hsdir_ring.n_allocated * 2);
+  for (int i = 0; i < HSDIR_RING_N_TYPES; i++) {
+    hsdir_ring.entries[i] = tor_reallocarray(hsdir_ring.entries[i], n,
+                                             sizeof(hsdir_ring_entry_t));
+  }
+  hsdir_ring.n_allocated = n;
+}
+
+/* Rebuild every ring from the HSDirs found in <b>consensus</b>. */
+static void
+hsdir_ring_rebuild(const networkstatus_t *consensus)
+{
+  int n = 0;
+
+  hsdir_ring_reserve(smartlist_len(consensus->routerstatus_list));
+
+  /* Add every node_t that support HSDir v3 for which we do have a valid
+   * hsdir_index already computed for them for this consensus. */
+  SMARTLIST_FOREACH_BEGIN(consensus->routerstatus_list,
+                          const routerstatus_t *, rs) {
+    const node_t *node = node_get_by_id(rs->identity_digest);
+    tor_assert(node);
+    if (!node_supports_v3_hsdir(node) || !rs->is_hs_dir) {
+      continue;
+    }
+    if (!node_has_hsdir_index(node)) {
+      log_info(LD_GENERAL, "Node %s was found without hsdir index.",
+               node_describe(node));
+      continue;
+    }
+    for (int i = 0; i < HSDIR_RING_N_TYPES; i++) {
+      hsdir_ring_entry_t *entry = &hsdir_ring.entries[i][n];
+      memcpy(entry->index, hsdir_ring_node_index(node, i),
+             sizeof(entry->index));
+      entry->node = node;
+    }
+    n++;
+  } SMARTLIST_FOREACH_END(rs);
+
+  for (int i = 0; i < HSDIR_RING_N_TYPES; i++) {
+    qsort(hsdir_ring.entries[i], n, sizeof(hsdir_ring_entry_t),
+          compare_hsdir_ring_entries);
+  }
+  hsdir_ring.n_entries = n;
+  hsdir_ring.consensus = consensus;
+  hsdir_ring.n_changes = 0;
+  hsdir_ring.is_dirty = 0;
+}
+
+/* Forget the hash rings so they are rebuilt from scratch on the next
+ * lookup. */
+void
+hs_hsdir_ring_invalidate(void)
+{
+  hsdir_ring.is_dirty = 1;
+  hsdir_ring.consensus = NULL;
+  hsdir_ring.n_entries = 0;
+  hsdir_ring.n_changes = 0;
+}
+
+/* The nodelist is done moving the nodes of the new consensus <b>ns</b> on
+ * and off the hash rings: note that they are up to date with it. */
+void
+hs_hsdir_ring_set_consensus(const networkstatus_t *ns)
+{
+  if (hsdir_ring.is_dirty) {
+    return;
+  }
+  hsdir_ring.consensus = ns;
+  hsdir_ring.n_changes = 0;
+}
+
+/* Take <b>node</b> off the hash rings. Its hsdir index must still be the one
+ * it was placed on the rings with so this must be called before changing
+ * it. */
+void
+hs_hsdir_ring_node_removed(const node_t *node)
+{
+  tor_assert(node);
+
+  if (hsdir_ring.is_dirty || !node->hsdir_index) {
+    return;
+  }
+  for (int i = 0; i < HSDIR_RING_N_TYPES; i++) {
+    hsdir_ring_entry_t *entries = hsdir_ring.entries[i];
+    int idx = hsdir_ring_find_node(i, node);
+    if (idx < 0) {
+      /* A node is either on all the rings or on none of them. */
+      if (BUG(i != 0)) {
+        hs_hsdir_ring_invalidate();
+      }
+      return;
+    }
+    memmove(&entries[idx], &entries[idx + 1],
+            (hsdir_ring.n_entries - idx - 1) * sizeof(hsdir_ring_entry_t));
+  }
+  hsdir_ring.n_entries--;
+  hsdir_ring_note_change();
+}
+
+/* The hsdir index or the HSDir status of <b>node</b> might have changed:
+ * add it to or remove it from the hash rings accordingly. */
+void
+hs_hsdir_ring_node_changed(const node_t *node)
+{
+  int eligible, present;
+
+  tor_assert(node);
+
+  if (hsdir_ring.is_dirty || !node->hsdir_index) {
+    return;
+  }
+
+  eligible = hsdir_ring_node_is_eligible(node);
+  present = hsdir_ring_find_node(HSDIR_RING_FETCH, node) >= 0;
+  if (eligible == present) {
+    return;
+  }
+  if (present) {
+    hs_hsdir_ring_node_removed(node);
+    return;
+  }
+
+  hsdir_ring_reserve(hsdir_ring.n_entries + 1);
+  for (int i = 0; i < HSDIR_RING_N_TYPES; i++) {
+    hsdir_ring_entry_t *entries = hsdir_ring.entries[i];
+    const uint8_t *key = hsdir_ring_node_index(node, i);
+    int idx = hsdir_ring_lower_bound(i, key);
+    memmove(&entries[idx + 1], &entries[idx],
+            (hsdir_ring.n_entries - idx) * sizeof(hsdir_ring_entry_t));
+    memcpy(entries[idx].index, key, sizeof(entries[idx].index));
+    entries[idx].node = node;
+  }
+  hsdir_ring.n_entries++;
+  hsdir_ring_note_change();
+}
+
+/* Release all memory used by the HSDir hash rings. */
+static void
+hsdir_ring_free_all(void)
+{
+  for (int i = 0; i < HSDIR_RING_N_TYPES; i++) {
+    tor_free(hsdir_ring.entries[i]);
+  }
+  hsdir_ring.n_allocated = 0;
+  hs_hsdir_ring_invalidate();
+}
+
 /* For a given blinded key and time period number, get the responsible HSDir
  * and put their routerstatus_t object in the responsible_dirs list. If
  * 'use_second_hsdir_index' is true, use the second hsdir_index of the node_t
@@ -1296,72 +1509,50 @@ node_has_hsdir_index(const node_t *node)
  * can't fail but it is possible that the responsible_dirs list contains fewer
  * nodes than expected.
  *
- * This function goes over the latest consensus routerstatus list and sorts it
- * by their node_t hsdir_index then does a binary search to find the closest
- * node. All of this makes it a bit CPU intensive so use it wisely. */
+ * The HSDirs of the latest consensus are kept sorted by each of their
+ * hsdir_index so this only does a binary search per replica to find the
+ * closest node. The sorting is redone only after a new consensus. */
 void
 hs_get_responsible_hsdirs(const ed25519_public_key_t *blinded_pk,
                           uint64_t time_period_num, int use_second_hsdir_index,
                           int for_fetching, smartlist_t *responsible_dirs)
 {
-  smartlist_t *sorted_nodes;
-  /* The compare function used for the smartlist bsearch. We have two
-   * different depending on is_next_period. */
-  int (*cmp_fct)(const void *, const void **);
+  const networkstatus_t *c;
+  hsdir_ring_type_t type;
+  const hsdir_ring_entry_t *ring;
 
   tor_assert(blinded_pk);
   tor_assert(responsible_dirs);
 
-  sorted_nodes = smartlist_new();
-
-  /* Add every node_t that support HSDir v3 for which we do have a valid
-   * hsdir_index already computed for them for this consensus. */
-  {
-    networkstatus_t *c = networkstatus_get_latest_consensus();
-    if (!c || smartlist_len(c->routerstatus_list) == 0) {
-      log_warn(LD_REND, "No valid consensus so we can't get the responsible "
-                        "hidden service directories.");
-      goto done;
-    }
-    SMARTLIST_FOREACH_BEGIN(c->routerstatus_list, const routerstatus_t *, rs) {
-      /* Even though this node_t object won't be modified and should be const,
-       * we can't add const object in a smartlist_t. */
-      node_t *n = node_get_mutable_by_id(rs->identity_digest);
-      tor_assert(n);
-      if (node_supports_v3_hsdir(n) && rs->is_hs_dir) {
-        if (!node_has_hsdir_index(n)) {
-          log_info(LD_GENERAL, "Node %s was found without hsdir index.",
-                   node_describe(n));
-          continue;
-        }
-        smartlist_add(sorted_nodes, n);
-      }
-    } SMARTLIST_FOREACH_END(rs);
+  c = networkstatus_get_latest_consensus();
+  if (!c || smartlist_len(c->routerstatus_list) == 0) {
+    log_warn(LD_REND, "No valid consensus so we can't get the responsible "
+                      "hidden service directories.");
+    return;
+  }
+  if (hsdir_ring.is_dirty || hsdir_ring.consensus != c) {
+    hsdir_ring_rebuild(c);
   }
-  if (smartlist_len(sorted_nodes) == 0) {
+  if (hsdir_ring.n_entries == 0) {
     log_warn(LD_REND, "No nodes found to be HSDir or supporting v3.");
-    goto done;
+    return;
   }
 
-  /* First thing we have to do is sort all node_t by hsdir_index. The
-   * is_next_period tells us if we want the current or the next one. Set the
-   * bsearch compare function also while we are at it. */
+  /* Pick the ring sorted by the index we are interested in. */
   if (for_fetching) {
-    smartlist_sort(sorted_nodes, compare_node_fetch_hsdir_index);
-    cmp_fct = compare_digest_to_fetch_hsdir_index;
+    type = HSDIR_RING_FETCH;
   } else if (use_second_hsdir_index) {
-    smartlist_sort(sorted_nodes, compare_node_store_second_hsdir_index);
-    cmp_fct = compare_digest_to_store_second_hsdir_index;
+    type = HSDIR_RING_STORE_SECOND;
   } else {
-    smartlist_sort(sorted_nodes, compare_node_store_first_hsdir_index);
-    cmp_fct = compare_digest_to_store_first_hsdir_index;
+    type = HSDIR_RING_STORE_FIRST;
   }
+  ring = hsdir_ring.entries[type];
 
   /* For all replicas, we'll select a set of HSDirs using the consensus
    * parameters and the sorted list. The replica starting at value 1 is
    * defined by the specification. */
   for (int replica = 1; replica <= hs_get_hsdir_n_replicas(); replica++) {
-    int idx, start, found, n_added = 0;
+    int idx, start, n_added = 0;
     uint8_t hs_index[DIGEST256_LEN] = {0};
     /* Number of node to add to the responsible dirs list depends on if we are
      * trying to fetch or store. A client always fetches. */
@@ -1370,23 +1561,21 @@ hs_get_responsible_hsdirs(const ed25519_public_key_t *blinded_pk,
 
     /* Get the index that we should use to select the node. */
     hs_build_hs_index(replica, blinded_pk, time_period_num, hs_index);
-    /* The compare function pointer has been set correctly earlier. */
-    start = idx = smartlist_bsearch_idx(sorted_nodes, hs_index, cmp_fct,
-                                        &found);
+    start = idx = hsdir_ring_lower_bound(type, hs_index);
     /* Getting the length of the list if no member is greater than the key we
      * are looking for so start at the first element. */
-    if (idx == smartlist_len(sorted_nodes)) {
+    if (idx == hsdir_ring.n_entries) {
       start = idx = 0;
     }
     while (n_added < n_to_add) {
-      const node_t *node = smartlist_get(sorted_nodes, idx);
+      const node_t *node = ring[idx].node;
       /* If the node has already been selected which is possible between
        * replicas, the specification says to skip over. */
       if (!smartlist_contains(responsible_dirs, node->rs)) {
         smartlist_add(responsible_dirs, node->rs);
         ++n_added;
       }
-      if (++idx == smartlist_len(sorted_nodes)) {
+      if (++idx == hsdir_ring.n_entries) {
         /* Wrap if we've reached the end of the list. */
         idx = 0;
       }
@@ -1396,9 +1585,6 @@ hs_get_responsible_hsdirs(const ed25519_public_key_t *blinded_pk,
       }
     }
   }
-
- done:
-  smartlist_free(sorted_nodes);
 }
 
 /*********************** HSDir request tracking ***************************/
@@ -1754,6 +1940,8 @@ hs_free_all(void)
   hs_service_free_all();
   hs_cache_free_all();
   hs_client_free_all();
+  hs_desc_decode_pool_free();
+  hsdir_ring_free_all();
 }
 
 /* For the given origin circuit circ, decrement the number of rendezvous
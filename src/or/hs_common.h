@@ -145,6 +145,21 @@ typedef struct rend_service_port_config_t {
   char unix_addr[FLEXIBLE_ARRAY_MEMBER];
 } rend_service_port_config_t;
 
+/* Everything that goes into the computation of a node's hsdir_index_t. This
+ * is compared as a whole with tor_memeq() so it must always be zeroed before
+ * being filled. */
+typedef struct hsdir_index_inputs_t {
+  ed25519_public_key_t identity_pk;
+  uint8_t fetch_srv[DIGEST256_LEN];
+  uint8_t store_first_srv[DIGEST256_LEN];
+  uint8_t store_second_srv[DIGEST256_LEN];
+  uint64_t fetch_tp;
+  uint64_t store_first_tp;
+  uint64_t store_second_tp;
+  /* Were we between a new time period and a new SRV? */
+  int in_new_tp;
+} hsdir_index_inputs_t;
+
 /* Hidden service directory index used in a node_t which is set once we set
  * the consensus. */
 typedef struct hsdir_index_t {
@@ -156,6 +171,11 @@ typedef struct hsdir_index_t {
    * one and uses older TP and SRV values. */
   uint8_t store_first[DIGEST256_LEN];
   uint8_t store_second[DIGEST256_LEN];
+
+  /* Inputs the indices above were computed from. They only change when the
+   * time period or the SRV rolls over so keeping them around lets us skip
+   * the SHA3 computations for every node on each new consensus. */
+  hsdir_index_inputs_t inputs;
 } hsdir_index_t;
 
 void hs_init(void);
@@ -233,6 +253,10 @@ void hs_get_responsible_hsdirs(const ed25519_public_key_t *blinded_pk,
                               uint64_t time_period_num,
                               int use_second_hsdir_index,
                               int for_fetching, smartlist_t *responsible_dirs);
+void hs_hsdir_ring_invalidate(void);
+void hs_hsdir_ring_set_consensus(const networkstatus_t *ns);
+void hs_hsdir_ring_node_changed(const node_t *node);
+void hs_hsdir_ring_node_removed(const node_t *node);
 routerstatus_t *hs_pick_hsdir(smartlist_t *responsible_dirs,
                               const char *req_key_str);
 
@@ -63,8 +63,12 @@
 #include "rendcache.h"
 #include "hs_cache.h"
 #include "hs_config.h"
+#include "cpuworker.h"
+#include "workqueue.h"
 #include "torcert.h" /* tor_cert_encode_ed22519() */
 
+#include <event2/event.h>
+
 /* Constant string value used for the descriptor format. */
 #define str_hs_desc "hs-descriptor"
 #define str_desc_cert "descriptor-signing-key-cert"
@@ -2175,10 +2179,14 @@ static int
 };
 
 /* Fully decode the given descriptor plaintext and store the data in the
- * plaintext data object. Returns 0 on success else a negative value. */
-int
-hs_desc_decode_plaintext(const char *encoded,
-                         hs_desc_plaintext_data_t *plaintext)
+ * plaintext data object, rejecting descriptors of <b>max_len</b> bytes or
+ * more. Returns 0 on success else a negative value.
+ *
+ * This can run in a worker thread: it must not look at the consensus or
+ * the options, which is why the caller passes max_len. */
+static int
+desc_decode_plaintext_impl(const char *encoded, size_t max_len,
+                           hs_desc_plaintext_data_t *plaintext)
 {
   int ok = 0, ret = -1;
   memarea_t *area = NULL;
@@ -2191,7 +2199,7 @@ hs_desc_decode_plaintext(const char *encoded,
 
   /* Check that descriptor is within size limits. */
   encoded_len = strlen(encoded);
-  if (encoded_len >= hs_cache_get_max_descriptor_size()) {
+  if (encoded_len >= max_len) {
     log_warn(LD_REND, "Service descriptor is too big (%lu bytes)",
              (unsigned long) encoded_len);
     goto err;
@@ -2247,15 +2255,26 @@ hs_desc_decode_plaintext(const char *encoded,
   return ret;
 }
 
-/* Fully decode an encoded descriptor and set a newly allocated descriptor
- * object in desc_out. Subcredentials are used if not NULL else it's ignored.
- *
- * Return 0 on success. A negative value is returned on error and desc_out is
- * set to NULL. */
+/* Fully decode the given descriptor plaintext and store the data in the
+ * plaintext data object. Returns 0 on success else a negative value. */
 int
-hs_desc_decode_descriptor(const char *encoded,
-                          const uint8_t *subcredential,
-                          hs_descriptor_t **desc_out)
+hs_desc_decode_plaintext(const char *encoded,
+                         hs_desc_plaintext_data_t *plaintext)
+{
+  return desc_decode_plaintext_impl(encoded,
+                                    hs_cache_get_max_descriptor_size(),
+                                    plaintext);
+}
+
+/* Fully decode an encoded descriptor of less than <b>max_len</b> bytes and
+ * set a newly allocated descriptor object in desc_out, as
+ * hs_desc_decode_descriptor() does. Like desc_decode_plaintext_impl(), this
+ * is safe to call from a worker thread. */
+int
+hs_desc_decode_descriptor_impl(const char *encoded,
+                               const uint8_t *subcredential,
+                               size_t max_len,
+                               hs_descriptor_t **desc_out)
 {
   int ret = -1;
   hs_descriptor_t *desc;
@@ -2272,7 +2291,7 @@ hs_desc_decode_descriptor(const char *encoded,
 
   memcpy(desc->subcredential, subcredential, sizeof(desc->subcredential));
 
-  ret = hs_desc_decode_plaintext(encoded, &desc->plaintext_data);
+  ret = desc_decode_plaintext_impl(encoded, max_len, &desc->plaintext_data);
   if (ret < 0) {
     goto err;
   }
@@ -2299,6 +2318,240 @@ hs_desc_decode_descriptor(const char *encoded,
   return ret;
 }
 
+/* Fully decode an encoded descriptor and set a newly allocated descriptor
+ * object in desc_out. Subcredentials are used if not NULL else it's ignored.
+ *
+ * Return 0 on success. A negative value is returned on error and desc_out is
+ * set to NULL. */
+int
+hs_desc_decode_descriptor(const char *encoded,
+                          const uint8_t *subcredential,
+                          hs_descriptor_t **desc_out)
+{
+  return hs_desc_decode_descriptor_impl(encoded, subcredential,
+                                        hs_cache_get_max_descriptor_size(),
+                                        desc_out);
+}
+
+/* A descriptor to decode in a worker thread, and the result of doing so. */
+typedef struct hs_desc_decode_job_t {
+  /* Inputs, owned by the job. */
+  char *encoded;
+  uint8_t subcredential[DIGEST256_LEN];
+  size_t max_len;
+  /* Set iff we only decode the plaintext part, as an HSDir does. */
+  unsigned int plaintext_only : 1;
+  /* Outputs. On success, plaintext is set if plaintext_only is, else desc. */
+  int status;
+  hs_descriptor_t *desc;
+  hs_desc_plaintext_data_t *plaintext;
+  /* Who to give the result to, on the main thread: plaintext_cb if
+   * plaintext_only is set, else cb. */
+  hs_desc_decode_cb_t cb;
+  hs_desc_decode_plaintext_cb_t plaintext_cb;
+  void *cb_arg;
+} hs_desc_decode_job_t;
+
+/* Worker thread function: decode the descriptor in the job. */
+static workqueue_reply_t
+hs_desc_decode_threadfn(void *state_, void *work_)
+{
+  hs_desc_decode_job_t *job = work_;
+  (void) state_;
+
+  if (job->plaintext_only) {
+    job->plaintext = tor_malloc_zero(sizeof(hs_desc_plaintext_data_t));
+    job->status = desc_decode_plaintext_impl(job->encoded, job->max_len,
+                                             job->plaintext);
+    if (job->status < 0) {
+      hs_desc_plaintext_data_free(job->plaintext);
+      job->plaintext = NULL;
+    }
+  } else {
+    job->status = hs_desc_decode_descriptor_impl(job->encoded,
+                                                 job->subcredential,
+                                                 job->max_len, &job->desc);
+  }
+  return WQ_RPL_REPLY;
+}
+
+/* Main thread function: hand the result of the job to its callback, and
+ * free the job. */
+static void
+hs_desc_decode_replyfn(void *work_)
+{
+  hs_desc_decode_job_t *job = work_;
+
+  if (job->plaintext_only) {
+    job->plaintext_cb(job->status, job->plaintext, job->cb_arg);
+  } else {
+    job->cb(job->status, job->desc, job->cb_arg);
+  }
+  tor_free(job->encoded);
+  memwipe(job->subcredential, 0, sizeof(job->subcredential));
+  tor_free(job);
+}
+
+/* Relays decode descriptors in their cpuworkers. Clients don't have any, so
+ * they get this small pool of threads of their own, started by
+ * hs_desc_decode_pool_init(). */
+static threadpool_t *decode_pool = NULL;
+static replyqueue_t *decode_replyqueue = NULL;
+static struct event *decode_reply_event = NULL;
+
+/* How many threads are in decode_pool. Our threadpool needs two so that it
+ * has both a permissive and a strict thread, and a client rarely has more
+ * than a couple of descriptors to decode at once. */
+#define HS_DESC_DECODE_POOL_THREADS 2
+
+/* Thread state constructor and destructor for decode_pool: decoding needs
+ * no state. */
+static void *
+decode_pool_state_new(void *arg)
+{
+  (void) arg;
+  return NULL;
+}
+static void
+decode_pool_state_free(void *state)
+{
+  (void) state;
+}
+
+/* Libevent callback: run the replies of the decode_pool jobs that are
+ * done. */
+static void
+decode_replyqueue_process_cb(evutil_socket_t sock, short events, void *arg)
+{
+  (void) sock;
+  (void) events;
+  replyqueue_process(arg);
+}
+
+/* Start the threads that decode descriptors for a client, if they aren't
+ * running already. It is OK to call this more than once. */
+void
+hs_desc_decode_pool_init(void)
+{
+  if (decode_pool) {
+    return;
+  }
+  decode_replyqueue = replyqueue_new(0);
+  if (!decode_replyqueue) {
+    log_warn(LD_REND, "Can't make a reply queue to decode onion service "
+                      "descriptors in the background. Decoding them on the "
+                      "main thread.");
+    return;
+  }
+  decode_reply_event = tor_event_new(tor_libevent_get_base(),
+                                     replyqueue_get_socket(decode_replyqueue),
+                                     EV_READ|EV_PERSIST,
+                                     decode_replyqueue_process_cb,
+                                     decode_replyqueue);
+  event_add(decode_reply_event, NULL);
+  decode_pool = threadpool_new(HS_DESC_DECODE_POOL_THREADS,
+                               decode_replyqueue,
+                               decode_pool_state_new,
+                               decode_pool_state_free,
+                               NULL);
+}
+
+/* Release what hs_desc_decode_pool_init() allocated, so that later decode
+ * jobs run on the main thread. Our workqueue can't stop its threads, so the
+ * pool itself stays around idle until we exit. */
+void
+hs_desc_decode_pool_free(void)
+{
+  tor_event_free(decode_reply_event);
+  decode_reply_event = NULL;
+  replyqueue_free(decode_replyqueue);
+  decode_replyqueue = NULL;
+  decode_pool = NULL;
+}
+
+/* Allocate a decode job for <b>encoded</b> that reports to <b>arg</b>. The
+ * caller sets the rest. */
+static hs_desc_decode_job_t *
+hs_desc_decode_job_new(const char *encoded, void *arg)
+{
+  hs_desc_decode_job_t *job = tor_malloc_zero(sizeof(*job));
+  job->encoded = tor_strdup(encoded);
+  /* The consensus lives on the main thread, so look this up here. */
+  job->max_len = hs_cache_get_max_descriptor_size();
+  job->cb_arg = arg;
+  return job;
+}
+
+/* Hand <b>job</b> to a cpuworker thread, or to a thread of our own pool if
+ * we have no cpuworkers, or run it right away if we have neither. */
+static void
+hs_desc_decode_job_queue(hs_desc_decode_job_t *job)
+{
+  if (cpuworker_queue_work(WQ_PRI_LOW, hs_desc_decode_threadfn,
+                           hs_desc_decode_replyfn, job)) {
+    return;
+  }
+  if (decode_pool &&
+      threadpool_queue_work_priority(decode_pool, WQ_PRI_LOW,
+                                     hs_desc_decode_threadfn,
+                                     hs_desc_decode_replyfn, job)) {
+    return;
+  }
+  /* No threads to do it for us. */
+  hs_desc_decode_threadfn(NULL, job);
+  hs_desc_decode_replyfn(job);
+}
+
+/* Decode the encoded descriptor <b>encoded</b> with <b>subcredential</b>
+ * like hs_desc_decode_descriptor() does, but in a worker thread, and call
+ * <b>cb</b> with the result and <b>arg</b> from the main thread once it's
+ * done. Neither argument needs to outlive this call.
+ *
+ * If we have neither cpuworkers nor a pool from hs_desc_decode_pool_init(),
+ * the descriptor is decoded right away and <b>cb</b> is called before we
+ * return. Return 0 if the work was queued or done, and a negative value if
+ * <b>cb</b> won't be called. */
+int
+hs_desc_decode_descriptor_async(const char *encoded,
+                                const uint8_t *subcredential,
+                                hs_desc_decode_cb_t cb, void *arg)
+{
+  hs_desc_decode_job_t *job;
+
+  tor_assert(encoded);
+  tor_assert(cb);
+
+  if (BUG(!subcredential)) {
+    return -1;
+  }
+
+  job = hs_desc_decode_job_new(encoded, arg);
+  memcpy(job->subcredential, subcredential, sizeof(job->subcredential));
+  job->cb = cb;
+  hs_desc_decode_job_queue(job);
+  return 0;
+}
+
+/* Decode the plaintext part of the encoded descriptor <b>encoded</b> like
+ * hs_desc_decode_plaintext() does, but in a worker thread, and call
+ * <b>cb</b> with the result and <b>arg</b> from the main thread once it's
+ * done. As with hs_desc_decode_descriptor_async(), <b>cb</b> is called
+ * before we return if we have no worker threads. */
+void
+hs_desc_decode_plaintext_async(const char *encoded,
+                               hs_desc_decode_plaintext_cb_t cb, void *arg)
+{
+  hs_desc_decode_job_t *job;
+
+  tor_assert(encoded);
+  tor_assert(cb);
+
+  job = hs_desc_decode_job_new(encoded, arg);
+  job->plaintext_only = 1;
+  job->plaintext_cb = cb;
+  hs_desc_decode_job_queue(job);
+}
+
 /* Table of encode function version specific. The functions are indexed by the
  * version number so v3 callback is at index 3 in the array. */
 static int
@@ -225,11 +225,37 @@ MOCK_DECL(int,
 int hs_desc_decode_descriptor(const char *encoded,
                               const uint8_t *subcredential,
                               hs_descriptor_t **desc_out);
+int hs_desc_decode_descriptor_impl(const char *encoded,
+                                   const uint8_t *subcredential,
+                                   size_t max_len,
+                                   hs_descriptor_t **desc_out);
 int hs_desc_decode_plaintext(const char *encoded,
                              hs_desc_plaintext_data_t *plaintext);
 int hs_desc_decode_encrypted(const hs_descriptor_t *desc,
                              hs_desc_encrypted_data_t *desc_out);
 
+/* Called on the main thread with the result of an asynchronous decode:
+ * <b>status</b> is what hs_desc_decode_descriptor() would have returned, and
+ * <b>desc</b> is the decoded descriptor (now owned by the callback) or NULL
+ * on error. */
+typedef void (*hs_desc_decode_cb_t)(int status, hs_descriptor_t *desc,
+                                    void *arg);
+int hs_desc_decode_descriptor_async(const char *encoded,
+                                    const uint8_t *subcredential,
+                                    hs_desc_decode_cb_t cb, void *arg);
+/* Like hs_desc_decode_cb_t, for hs_desc_decode_plaintext_async(): on
+ * success, <b>plaintext</b> is the decoded plaintext data (now owned by the
+ * callback), else it is NULL. */
+typedef void (*hs_desc_decode_plaintext_cb_t)(
+                                         int status,
+                                         hs_desc_plaintext_data_t *plaintext,
+                                         void *arg);
+void hs_desc_decode_plaintext_async(const char *encoded,
+                                    hs_desc_decode_plaintext_cb_t cb,
+                                    void *arg);
+void hs_desc_decode_pool_init(void);
+void hs_desc_decode_pool_free(void);
+
 size_t hs_desc_obj_size(const hs_descriptor_t *data);
 size_t hs_desc_plaintext_obj_size(const hs_desc_plaintext_data_t *data);
 
@@ -79,6 +79,15 @@ static smartlist_t *hs_service_staging_list;
  *  reupload if needed */
 static int consider_republishing_hs_descriptors = 0;
 
+/* Return true iff the scheduled events should look at the given service at
+ * time now. */
+static inline int
+service_is_due(const hs_service_t *service, time_t now)
+{
+  return consider_republishing_hs_descriptors ||
+         service->state.next_event_time <= now;
+}
+
 static void set_descriptor_revision_counter(hs_descriptor_t *hs_desc);
 static void move_descriptors(hs_service_t *src, hs_service_t *dst);
 
@@ -1495,6 +1504,9 @@ STATIC void
 build_all_descriptors(time_t now)
 {
   FOR_EACH_SERVICE_BEGIN(service) {
+    if (!service_is_due(service, now)) {
+      continue;
+    }
 
     /* A service booting up will have both descriptors to NULL. No other cases
      * makes both descriptor non existent. */
@@ -1769,6 +1781,9 @@ STATIC void
 update_all_descriptors(time_t now)
 {
   FOR_EACH_SERVICE_BEGIN(service) {
+    if (!service_is_due(service, now)) {
+      continue;
+    }
     /* We'll try to update each descriptor that is if certain conditions apply
      * in order for the descriptor to be updated. */
     FOR_EACH_DESCRIPTOR_BEGIN(service, desc) {
@@ -1944,6 +1959,9 @@ rotate_all_descriptors(time_t now)
    *     those descriptors are on the same tor instance */
 
   FOR_EACH_SERVICE_BEGIN(service) {
+    if (!service_is_due(service, now)) {
+      continue;
+    }
 
     /* Note for a service booting up: Both descriptors are NULL in that case
      * so this function might return true if we are in the timeframe for a
@@ -1976,6 +1994,9 @@ run_housekeeping_event(time_t now)
    * simply moving things around or removing unneeded elements. */
 
   FOR_EACH_SERVICE_BEGIN(service) {
+    if (!service_is_due(service, now)) {
+      continue;
+    }
 
     /* If the service is starting off, set the rotation time. We can't do that
      * at configure time because the get_options() needs to be set for setting
@@ -2181,6 +2202,9 @@ run_build_circuit_event(time_t now)
 
   /* Run v3+ check. */
   FOR_EACH_SERVICE_BEGIN(service) {
+    if (!service_is_due(service, now)) {
+      continue;
+    }
     /* For introduction circuit, we need to make sure we don't stress too much
      * circuit creation so make sure this service is respecting that limit. */
     if (can_service_launch_intro_circuit(service, now)) {
@@ -2192,38 +2216,24 @@ run_build_circuit_event(time_t now)
   } FOR_EACH_SERVICE_END;
 }
 
-/* Encode and sign the service descriptor desc and upload it to the given
- * hidden service directory.  This does nothing if PublishHidServDescriptors
- * is false. */
+/* Upload the service descriptor desc, already encoded and signed in
+ * encoded_desc, to the given hidden service directory. */
 static void
 upload_descriptor_to_hsdir(const hs_service_t *service,
-                           hs_service_descriptor_t *desc, const node_t *hsdir)
+                           hs_service_descriptor_t *desc,
+                           const char *encoded_desc, const node_t *hsdir)
 {
-  char version_str[4] = {0}, *encoded_desc = NULL;
+  char version_str[4] = {0};
   directory_request_t *dir_req;
   hs_ident_dir_conn_t ident;
 
   tor_assert(service);
   tor_assert(desc);
+  tor_assert(encoded_desc);
   tor_assert(hsdir);
 
   memset(&ident, 0, sizeof(ident));
 
-  /* Let's avoid doing that if tor is configured to not publish. */
-  if (!get_options()->PublishHidServDescriptors) {
-    log_info(LD_REND, "Service %s not publishing descriptor. "
-                      "PublishHidServDescriptors is set to 1.",
-             safe_str_client(service->onion_address));
-    goto end;
-  }
-
-  /* First of all, we'll encode the descriptor. This should NEVER fail but
-   * just in case, let's make sure we have an actual usable descriptor. */
-  if (BUG(hs_desc_encode_descriptor(desc->desc, &desc->signing_kp,
-                                    &encoded_desc) < 0)) {
-    goto end;
-  }
-
   /* Setup the connection identifier. */
   hs_ident_dir_conn_init(&service->keys.identity_pk, &desc->blinded_kp.pubkey,
                          &ident);
@@ -2266,9 +2276,6 @@ upload_descriptor_to_hsdir(const hs_service_t *service,
   }
 
   /* XXX: Inform control port of the upload event (#20699). */
- end:
-  tor_free(encoded_desc);
-  return;
 }
 
 /** Return a newly-allocated string for our state file which contains revision
@@ -2473,6 +2480,7 @@ upload_descriptor_to_all(const hs_service_t *service,
                          hs_service_descriptor_t *desc)
 {
   smartlist_t *responsible_dirs = NULL;
+  char *encoded_desc = NULL;
 
   tor_assert(service);
   tor_assert(desc);
@@ -2495,6 +2503,22 @@ upload_descriptor_to_all(const hs_service_t *service,
    *  list. Let's keep it up to date. */
   service_desc_clear_previous_hsdirs(desc);
 
+  /* Let's avoid doing that if tor is configured to not publish. */
+  if (!get_options()->PublishHidServDescriptors) {
+    log_info(LD_REND, "Service %s not publishing descriptor. "
+                      "PublishHidServDescriptors is set to 1.",
+             safe_str_client(service->onion_address));
+    goto schedule;
+  }
+
+  /* Encode and sign the descriptor once for all the HSDirs: the document is
+   * the same for each of them. This should NEVER fail but just in case,
+   * let's make sure we have an actual usable descriptor. */
+  if (BUG(hs_desc_encode_descriptor(desc->desc, &desc->signing_kp,
+                                    &encoded_desc) < 0)) {
+    goto schedule;
+  }
+
   /* For each responsible HSDir we have, initiate an upload command. */
   SMARTLIST_FOREACH_BEGIN(responsible_dirs, const routerstatus_t *,
                           hsdir_rs) {
@@ -2503,9 +2527,10 @@ upload_descriptor_to_all(const hs_service_t *service,
      * routerstatus_t found in the consensus else we have a problem. */
     tor_assert(hsdir_node);
     /* Upload this descriptor to the chosen directory. */
-    upload_descriptor_to_hsdir(service, desc, hsdir_node);
+    upload_descriptor_to_hsdir(service, desc, encoded_desc, hsdir_node);
   } SMARTLIST_FOREACH_END(hsdir_rs);
 
+ schedule:
   /* Set the next upload time for this descriptor. Even if we are configured
    * to not upload, we still want to follow the right cycle of life for this
    * descriptor. */
@@ -2522,6 +2547,7 @@ upload_descriptor_to_all(const hs_service_t *service,
   /* Update the revision counter of this descriptor */
   increment_descriptor_revision_counter(desc->desc);
 
+  tor_free(encoded_desc);
   smartlist_free(responsible_dirs);
   return;
 }
@@ -2635,6 +2661,9 @@ run_upload_descriptor_event(time_t now)
 
   /* Run v3+ check. */
   FOR_EACH_SERVICE_BEGIN(service) {
+    if (!service_is_due(service, now)) {
+      continue;
+    }
     FOR_EACH_DESCRIPTOR_BEGIN(service, desc) {
       /* If we were asked to re-examine the hash ring, and it changed, then
          schedule an upload */
@@ -2664,9 +2693,45 @@ run_upload_descriptor_event(time_t now)
       upload_descriptor_to_all(service, desc);
     } FOR_EACH_DESCRIPTOR_END;
   } FOR_EACH_SERVICE_END;
+}
 
-  /* We are done considering whether to republish rend descriptors */
-  consider_republishing_hs_descriptors = 0;
+/* Return the time at which the scheduled events need to look at the given
+ * service again. Until all of its introduction circuits are established and
+ * its descriptors uploaded, that's the next run. After that, nothing happens
+ * to a service until one of its descriptors needs to be uploaded again or
+ * one of its intro points expires, unless it's told otherwise by a circuit
+ * event or new directory information. */
+STATIC time_t
+get_service_next_event_time(const hs_service_t *service, time_t now)
+{
+  time_t next = now + HS_SERVICE_MAX_IDLE_EVENT_PERIOD;
+
+  tor_assert(service);
+
+  if (service->state.next_rotation_time == 0 ||
+      service->desc_current == NULL || service->desc_next == NULL) {
+    goto next_run;
+  }
+
+  FOR_EACH_DESCRIPTOR_BEGIN(service, desc) {
+    if (desc->missing_intro_points ||
+        (unsigned int) digest256map_size(desc->intro_points.map) <
+          service->config.num_intro_points) {
+      goto next_run;
+    }
+    DIGEST256MAP_FOREACH(desc->intro_points.map, key,
+                         const hs_service_intro_point_t *, ip) {
+      if (!ip->circuit_established) {
+        goto next_run;
+      }
+      next = MIN(next, ip->time_to_expire);
+    } DIGEST256MAP_FOREACH_END;
+    next = MIN(next, desc->next_upload_time);
+  } FOR_EACH_DESCRIPTOR_END;
+
+  return MAX(next, now + 1);
+ next_run:
+  return now + 1;
 }
 
 /* Called when the introduction point circuit is done building and ready to be
@@ -2711,6 +2776,9 @@ service_intro_circ_has_opened(origin_circuit_t *circ)
   /* We can't have an IP object without a descriptor. */
   tor_assert(desc);
 
+  /* Either way, the service has something to do with this circuit. */
+  service->state.next_event_time = 0;
+
   if (hs_circ_service_intro_has_opened(service, ip, desc, circ)) {
     /* Getting here means that the circuit has been re-purposed because we
      * have enough intro circuit opened. Remove the IP from the service. */
@@ -2815,6 +2883,8 @@ service_handle_intro_established(origin_circuit_t *circ,
    * is what indicates the upload scheduled event if we are ready to build the
    * intro point into the descriptor and upload. */
   ip->circuit_established = 1;
+  /* The descriptor might now be ready for upload. */
+  service->state.next_event_time = 0;
 
   log_info(LD_REND, "Successfully received an INTRO_ESTABLISHED cell "
                     "on circuit %u for service %s",
@@ -2868,6 +2938,10 @@ service_handle_introduce2(origin_circuit_t *circ, const uint8_t *payload,
                                 payload, payload_len) < 0) {
     goto err;
   }
+  /* Replace the intro point as soon as it has seen enough INTRODUCE2. */
+  if (intro_point_should_expire(ip, approx_time())) {
+    service->state.next_event_time = 0;
+  }
 
   return 0;
  err:
@@ -2945,6 +3019,7 @@ hs_service_intro_circ_has_closed(origin_circuit_t *circ)
   /* Circuit disappeared so make sure the intro point is updated. By
    * keeping the object in the descriptor, we'll be able to retry. */
   ip->circuit_established = 0;
+  service->state.next_event_time = 0;
 
   /* We've retried too many times, remember it as a failed intro point so we
    * don't pick it up again. It will be retried in INTRO_CIRC_RETRY_PERIOD
@@ -3071,7 +3146,8 @@ hs_service_lists_fnames_for_sandbox(smartlist_t *file_list,
 /* Called when our internal view of the directory has changed. We might have
  * received a new batch of descriptors which might affect the shape of the
  * HSDir hash ring. Signal that we should reexamine the hash ring and
- * re-upload our HS descriptors if needed. */
+ * re-upload our HS descriptors if needed. This also makes the next scheduled
+ * events look at every service. */
 void
 hs_service_dir_info_changed(void)
 {
@@ -3302,6 +3378,19 @@ hs_service_run_scheduled_events(time_t now)
   run_build_circuit_event(now);
   /* Upload the descriptors if needed/possible. */
   run_upload_descriptor_event(now);
+
+  /* Every service we've just looked at can now be left alone until it needs
+   * attention again. With many services, most of them are idle at any given
+   * time so this is what keeps the cost of this callback down. */
+  FOR_EACH_SERVICE_BEGIN(service) {
+    if (service_is_due(service, now)) {
+      service->state.next_event_time =
+        get_service_next_event_time(service, now);
+    }
+  } FOR_EACH_SERVICE_END;
+
+  /* We are done considering whether to republish rend descriptors */
+  consider_republishing_hs_descriptors = 0;
 }
 
 /* Initialize the service HS subsystem. */
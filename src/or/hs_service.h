@@ -31,6 +31,10 @@
 #define HS_SERVICE_NEXT_UPLOAD_TIME_MIN (60 * 60)
 #define HS_SERVICE_NEXT_UPLOAD_TIME_MAX (120 * 60)
 
+/* Maximum amount of time (in seconds) a service in a stable state is left
+ * alone by the scheduled events before being looked at again. */
+#define HS_SERVICE_MAX_IDLE_EVENT_PERIOD 60
+
 /* Service side introduction point. */
 typedef struct hs_service_intro_point_t {
   /* Top level intropoint "shared" data between client/service. */
@@ -206,6 +210,11 @@ typedef struct hs_service_state_t {
   /* When is the next time we should rotate our descriptors. This is has to be
    * done at the start time of the next SRV protocol run. */
   time_t next_rotation_time;
+
+  /* When should the scheduled events look at this service next. Zero means
+   * at the next run. Anything that can change what the service needs to do,
+   * like one of its introduction circuits opening or closing, resets it. */
+  time_t next_event_time;
 } hs_service_state_t;
 
 /* Representation of a service running on this tor instance. */
@@ -322,6 +331,8 @@ STATIC void rotate_all_descriptors(time_t now);
 STATIC void build_all_descriptors(time_t now);
 STATIC void update_all_descriptors(time_t now);
 STATIC void run_upload_descriptor_event(time_t now);
+STATIC time_t get_service_next_event_time(const hs_service_t *service,
+                                          time_t now);
 
 STATIC char *
 encode_desc_rev_counter_for_state(const hs_service_descriptor_t *desc);
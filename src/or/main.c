@@ -135,6 +135,7 @@ static void dumpmemusage(int severity);
 static void dumpstats(int severity); /* log stats */
 static void conn_read_callback(evutil_socket_t fd, short event, void *_conn);
 static void conn_write_callback(evutil_socket_t fd, short event, void *_conn);
+static void batched_io_callback(evutil_socket_t fd, short event, void *arg);
 static void second_elapsed_callback(periodic_timer_t *timer, void *args);
 static int conn_close_if_marked(int i);
 static void connection_start_reading_from_linked_conn(connection_t *conn);
@@ -193,6 +194,15 @@ static smartlist_t *active_linked_connection_lst = NULL;
  * <b>loop_once</b>. If so, there's no need to trigger a loopexit in order
  * to handle linked connections. */
 static int called_loop_once = 0;
+/** If BatchConnectionIO is set: list of connections whose read events fired
+ * during the current main loop iteration and that we have not handled yet. */
+static smartlist_t *batched_read_connection_lst = NULL;
+/** If BatchConnectionIO is set: list of connections whose write events fired
+ * during the current main loop iteration and that we have not handled yet. */
+static smartlist_t *batched_write_connection_lst = NULL;
+/** Event to handle the batched connections once libevent has run the
+ * callbacks for every socket that was ready. */
+static struct event *batched_io_event = NULL;
 
 /** We set this to 1 when we've opened a circuit, so we can print a log
  * entry to inform the user that Tor is working.  We set it to 0 when
@@ -365,6 +375,18 @@ connection_unlink(connection_t *conn)
   }
   smartlist_remove(closeable_connection_lst, conn);
   smartlist_remove(active_linked_connection_lst, conn);
+  /* A batch may be walking these lists right now, so leave a hole instead
+   * of moving the other connections around. */
+  if (conn->in_read_batch) {
+    int idx = smartlist_pos(batched_read_connection_lst, conn);
+    if (idx >= 0)
+      smartlist_set(batched_read_connection_lst, idx, NULL);
+  }
+  if (conn->in_write_batch) {
+    int idx = smartlist_pos(batched_write_connection_lst, conn);
+    if (idx >= 0)
+      smartlist_set(batched_write_connection_lst, idx, NULL);
+  }
   if (conn->type == CONN_TYPE_EXIT) {
     assert_connection_edge_not_dns_pending(TO_EDGE_CONN(conn));
   }
@@ -398,6 +420,10 @@ init_connection_lists(void)
     closeable_connection_lst = smartlist_new();
   if (!active_linked_connection_lst)
     active_linked_connection_lst = smartlist_new();
+  if (!batched_read_connection_lst)
+    batched_read_connection_lst = smartlist_new();
+  if (!batched_write_connection_lst)
+    batched_write_connection_lst = smartlist_new();
 }
 
 /** Schedule <b>conn</b> to be closed. **/
@@ -723,6 +749,123 @@ connection_count_moribund, (void))
   return moribund;
 }
 
+/** Called when <b>conn</b> has failed in connection_handle_read(): make sure
+ * it is marked for close. */
+static void
+conn_read_failed(connection_t *conn)
+{
+  if (!conn->marked_for_close) {
+#ifndef _WIN32
+    log_warn(LD_BUG,"Unhandled error on read for %s connection "
+             "(fd %d); removing",
+             conn_type_to_string(conn->type), (int)conn->s);
+    tor_fragile_assert();
+#endif /* !defined(_WIN32) */
+    if (CONN_IS_EDGE(conn))
+      connection_edge_end_errno(TO_EDGE_CONN(conn));
+    connection_mark_for_close(conn);
+  }
+}
+
+/** Called when <b>conn</b> has failed in connection_handle_write(): make
+ * sure it is marked for close. */
+static void
+conn_write_failed(connection_t *conn)
+{
+  if (!conn->marked_for_close) {
+    /* this connection is broken. remove it. */
+    log_fn(LOG_WARN,LD_BUG,
+           "unhandled error on write for %s connection (fd %d); removing",
+           conn_type_to_string(conn->type), (int)conn->s);
+    tor_fragile_assert();
+    if (CONN_IS_EDGE(conn)) {
+      /* otherwise we cry wolf about duplicate close */
+      edge_connection_t *edge_conn = TO_EDGE_CONN(conn);
+      if (!edge_conn->end_reason)
+        edge_conn->end_reason = END_STREAM_REASON_INTERNAL;
+      edge_conn->edge_has_sent_end = 1;
+    }
+    connection_close_immediate(conn); /* So we don't try to flush. */
+    connection_mark_for_close(conn);
+  }
+}
+
+/** Return true iff BatchConnectionIO applies to <b>conn</b>: it must be an
+ * OR or edge connection with a real socket. */
+static int
+conn_wants_batched_io(const connection_t *conn)
+{
+  if (!get_options()->BatchConnectionIO)
+    return 0;
+  if (conn->linked || !SOCKET_OK(conn->s))
+    return 0;
+  return conn->type == CONN_TYPE_OR || CONN_IS_EDGE(conn);
+}
+
+/** Make sure that the batched connections get handled once libevent is done
+ * running the callbacks for this loop iteration. */
+static void
+schedule_batched_io(void)
+{
+  if (!batched_io_event) {
+    batched_io_event = tor_event_new(tor_libevent_get_base(),
+                                     -1, EV_READ, batched_io_callback, NULL);
+    tor_assert(batched_io_event);
+  }
+  /* Libevent has already queued every callback for the sockets that were
+   * ready, so this one runs after all of them. */
+  event_active(batched_io_event, EV_READ, 1);
+}
+
+/** Add <b>conn</b>, whose read event just fired, to the connections we
+ * read from in the next batch, unless it is there already. */
+STATIC void
+batched_read_add(connection_t *conn)
+{
+  if (conn->in_read_batch)
+    return;
+  conn->in_read_batch = 1;
+  smartlist_add(batched_read_connection_lst, conn);
+  schedule_batched_io();
+}
+
+/** First pass over the batched reads: pull in bytes from every connection
+ * on the batch that still wants to read. Connections that we skip, or whose
+ * read fails, are taken off the batch. */
+STATIC void
+batched_reads_fill(void)
+{
+  SMARTLIST_FOREACH_BEGIN(batched_read_connection_lst, connection_t *, conn) {
+    if (!conn)
+      continue;
+    /* We may have stopped reading since the event fired. */
+    if (!conn->marked_for_close && connection_is_reading(conn)) {
+      if (connection_handle_read_batch_fill(conn) == 0)
+        continue;
+      conn_read_failed(conn);
+    }
+    conn->in_read_batch = 0;
+    SMARTLIST_REPLACE_CURRENT(batched_read_connection_lst, conn, NULL);
+  } SMARTLIST_FOREACH_END(conn);
+}
+
+/** Second pass over the batched reads: process the bytes that
+ * batched_reads_fill() put on each inbuf, then empty the batch. */
+STATIC void
+batched_reads_process(void)
+{
+  SMARTLIST_FOREACH_BEGIN(batched_read_connection_lst, connection_t *, conn) {
+    /* Skip the holes left by batched_reads_fill() and connection_unlink(). */
+    if (!conn)
+      continue;
+    conn->in_read_batch = 0;
+    if (connection_handle_read_batch_process(conn) < 0)
+      conn_read_failed(conn);
+    assert_connection_ok(conn, time(NULL));
+  } SMARTLIST_FOREACH_END(conn);
+  smartlist_clear(batched_read_connection_lst);
+}
+
 /** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
  * some data to read. */
 static void
@@ -734,21 +877,15 @@ conn_read_callback(evutil_socket_t fd, short event, void *_conn)
 
   log_debug(LD_NET,"socket %d wants to read.",(int)conn->s);
 
+  if (conn_wants_batched_io(conn)) {
+    batched_read_add(conn);
+    return;
+  }
+
   /* assert_connection_ok(conn, time(NULL)); */
 
-  if (connection_handle_read(conn) < 0) {
-    if (!conn->marked_for_close) {
-#ifndef _WIN32
-      log_warn(LD_BUG,"Unhandled error on read for %s connection "
-               "(fd %d); removing",
-               conn_type_to_string(conn->type), (int)conn->s);
-      tor_fragile_assert();
-#endif /* !defined(_WIN32) */
-      if (CONN_IS_EDGE(conn))
-        connection_edge_end_errno(TO_EDGE_CONN(conn));
-      connection_mark_for_close(conn);
-    }
-  }
+  if (connection_handle_read(conn) < 0)
+    conn_read_failed(conn);
   assert_connection_ok(conn, time(NULL));
 
   if (smartlist_len(closeable_connection_lst))
@@ -767,32 +904,59 @@ conn_write_callback(evutil_socket_t fd, short events, void *_conn)
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "socket %d wants to write.",
                      (int)conn->s));
 
-  /* assert_connection_ok(conn, time(NULL)); */
-
-  if (connection_handle_write(conn, 0) < 0) {
-    if (!conn->marked_for_close) {
-      /* this connection is broken. remove it. */
-      log_fn(LOG_WARN,LD_BUG,
-             "unhandled error on write for %s connection (fd %d); removing",
-             conn_type_to_string(conn->type), (int)conn->s);
-      tor_fragile_assert();
-      if (CONN_IS_EDGE(conn)) {
-        /* otherwise we cry wolf about duplicate close */
-        edge_connection_t *edge_conn = TO_EDGE_CONN(conn);
-        if (!edge_conn->end_reason)
-          edge_conn->end_reason = END_STREAM_REASON_INTERNAL;
-        edge_conn->edge_has_sent_end = 1;
-      }
-      connection_close_immediate(conn); /* So we don't try to flush. */
-      connection_mark_for_close(conn);
+  if (conn_wants_batched_io(conn)) {
+    if (!conn->in_write_batch) {
+      conn->in_write_batch = 1;
+      smartlist_add(batched_write_connection_lst, conn);
+      schedule_batched_io();
     }
+    return;
   }
+
+  /* assert_connection_ok(conn, time(NULL)); */
+
+  if (connection_handle_write(conn, 0) < 0)
+    conn_write_failed(conn);
   assert_connection_ok(conn, time(NULL));
 
   if (smartlist_len(closeable_connection_lst))
     close_closeable_connections();
 }
 
+/** Libevent callback: handle every connection whose read or write event
+ * fired during this loop iteration, in three passes. First read from all
+ * the readable sockets; then process everything we read, which queues
+ * cells for the scheduler; then flush all the writable connections. */
+static void
+batched_io_callback(evutil_socket_t fd, short event, void *arg)
+{
+  (void)fd;
+  (void)event;
+  (void)arg;
+
+  log_debug(LD_NET, "Handling %d batched reads and %d batched writes.",
+            smartlist_len(batched_read_connection_lst),
+            smartlist_len(batched_write_connection_lst));
+
+  batched_reads_fill();
+  batched_reads_process();
+
+  SMARTLIST_FOREACH_BEGIN(batched_write_connection_lst, connection_t *, conn) {
+    if (!conn)
+      continue;
+    conn->in_write_batch = 0;
+    if (!connection_is_writing(conn))
+      continue;
+    if (connection_handle_write(conn, 0) < 0)
+      conn_write_failed(conn);
+    assert_connection_ok(conn, time(NULL));
+  } SMARTLIST_FOREACH_END(conn);
+  smartlist_clear(batched_write_connection_lst);
+
+  if (smartlist_len(closeable_connection_lst))
+    close_closeable_connections();
+}
+
 /** If the connection at connection_array[i] is marked for close, then:
  *    - If it has data that it wants to flush, try to flush it.
  *    - If it _still_ has data to flush, and conn->hold_open_until_flushed is
@@ -880,6 +1044,7 @@ conn_close_if_marked(int i)
          */
         if (connection_is_writing(conn)) {
           conn->write_blocked_on_bw = 1;
+          connection_bw_blocked_list_add(conn);
           connection_stop_writing(conn);
         }
         if (connection_is_reading(conn)) {
@@ -890,6 +1055,7 @@ conn_close_if_marked(int i)
            * connection_handle_read_impl, or to just stop reading in
            * mark_and_flush */
           conn->read_blocked_on_bw = 1;
+          connection_bw_blocked_list_add(conn);
           connection_stop_reading(conn);
         }
       }
@@ -1062,6 +1228,13 @@ run_connection_housekeeping(int i, time_t now)
   or_conn = TO_OR_CONN(conn);
   tor_assert(conn->outbuf);
 
+  /* We normally keep TLS buffers around for the life of the connection, but
+   * once memory has been tight, give them back whenever a connection goes
+   * quiet. */
+  if (have_been_under_memory_pressure())
+    connection_or_release_tls_buffers_if_idle(or_conn,
+                                         now - OR_CONN_TLS_BUFFER_IDLE_TIME);
+
   chan = TLS_CHAN_TO_BASE(or_conn->chan);
   tor_assert(chan);
 
@@ -1179,6 +1352,7 @@ CALLBACK(add_entropy);
 CALLBACK(launch_reachability_tests);
 CALLBACK(downrate_stability);
 CALLBACK(save_stability);
+CALLBACK(save_mt_stats);
 CALLBACK(check_authority_cert);
 CALLBACK(check_expired_networkstatus);
 CALLBACK(write_stats_file);
@@ -1215,6 +1389,7 @@ static periodic_event_item_t periodic_events[] = {
   CALLBACK(launch_reachability_tests),
   CALLBACK(downrate_stability),
   CALLBACK(save_stability),
+  CALLBACK(save_mt_stats),
   CALLBACK(check_authority_cert),
   CALLBACK(check_expired_networkstatus),
   CALLBACK(write_stats_file),
@@ -1683,6 +1858,20 @@ save_stability_callback(time_t now, const or_options_t *options)
   return SAVE_STABILITY_INTERVAL;
 }
 
+/**
+ * Periodic callback: checkpoint the moneTor statistics sessions in progress,
+ * so that a restart or a crash doesn't lose them.
+ */
+static int
+save_mt_stats_callback(time_t now, const or_options_t *options)
+{
+  (void)now;
+  (void)options;
+  mt_stats_checkpoint();
+#define SAVE_MT_STATS_INTERVAL (10*60)
+  return SAVE_MT_STATS_INTERVAL;
+}
+
 /**
  * Periodic callback: if we're an authority, check on our authority
  * certificate (the one that authenticates our authority signing key).
@@ -2273,6 +2462,8 @@ refill_callback(periodic_timer_t *timer, void *arg)
   if (milliseconds_elapsed > 0)
     connection_bucket_refill(milliseconds_elapsed, (time_t)now.tv_sec);
 
+  rep_hist_bw_tick(monotime_coarse_absolute_msec(), (time_t)now.tv_sec);
+
   stats_prev_global_read_bucket = global_read_bucket;
   stats_prev_global_write_bucket = global_write_bucket;
 
@@ -3259,6 +3450,7 @@ tor_free_all(int postfork)
   pt_free_all();
   channel_tls_free_all();
   channel_free_all();
+  channelpadding_free_all();
   connection_free_all();
   connection_edge_free_all();
   scheduler_free_all();
@@ -3290,6 +3482,10 @@ tor_free_all(int postfork)
   smartlist_free(connection_array);
   smartlist_free(closeable_connection_lst);
   smartlist_free(active_linked_connection_lst);
+  smartlist_free(batched_read_connection_lst);
+  smartlist_free(batched_write_connection_lst);
+  tor_event_free(batched_io_event);
+  batched_io_event = NULL;
   periodic_timer_free(second_timer);
   teardown_periodic_events();
   periodic_timer_free(refill_timer);
@@ -3337,6 +3533,7 @@ tor_cleanup(void)
     }
     if (authdir_mode_tests_reachability(options))
       rep_hist_record_mtbf_data(now, 0);
+    mt_stats_checkpoint();
     keypin_close_journal();
   }
 
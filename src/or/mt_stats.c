@@ -8,8 +8,11 @@
  * record relevant statistics that will be used for analysis in designing the
  * core moneTor protocols. The statistics collected are on a per-port-group
  * basis and written to the disk whenver a sufficient number of circuits have
- * been recorded for anonymity purposes. The following three types of statistics
- * are collected:
+ * been recorded for anonymity purposes. Circuits that do not exit through us
+ * are grouped by our position (guard or middle) and by purpose (introduction
+ * or rendezvous point) instead of by port; for those we count every relay cell
+ * we pass on, while exit circuits count the data cells of their streams. The
+ * following types of statistics are collected:
  *
  * <ul>
  *   <li> Time Profiles - Number of cells processed in each time interval from
@@ -19,18 +22,44 @@
  *   <li> Time Stdevs - Standard deviation across the time profiles of individual
  *        circuits; aggregated by sorting and taking the mean of fixed-size
  *        nearest neighbor buckets
+ *   <li> Rate Histogram - Mean number of cells per MT_BUCKET_TIME interval of
+ *        each circuit, counted in a fixed-size log-linear histogram
+ *   <li> Burst Histogram - Number of cells in each completed MT_BUCKET_TIME
+ *        interval of each circuit, counted in the same kind of histogram
+ *   <li> Inbound/Outbound Counts - Total number of cells sent towards and away
+ *        from the client by a circuit; aggregated like the total counts
  * </ul>
  *
+ * The histograms use the buckets computed by mt_hist_bucket(), so they take
+ * constant memory no matter how many circuits are recorded, and two of them
+ * are merged by adding their counts bucket by bucket.
+ *
+ * Circuits are sampled when they are created, before we know whether they
+ * will exit through us, at the larger of the MoneTorStatistics (exit) and
+ * MoneTorStatisticsMiddle rates. Exit circuits are thinned down to the exit
+ * rate once their first stream arrives, and other circuits down to the middle
+ * rate when they first pass on a cell, before anything is counted for them,
+ * so that circuits we drop stop paying for collection right away. The
+ * sampling decision uses a weak per-process RNG and a geometric skip
+ * counter, so unsampled circuits only pay a counter decrement.
+ *
  * Tor codebase hooks are located in the following modules:
  *
  * <ul>
  *   <li> <b>mt_stats_init()</b> <--- <b>main.c</b>
  *   <li> <b>mt_stats_circ_create()</b> <--- <b>command.c</b>
  *   <li> <b>mt_stats_circ_port()</b> <--- <b>connection_edge.c</b>
+ *   <li> <b>mt_stats_circ_relay()</b> <--- <b>relay.c</b>
  *   <li> <b>mt_stats_circ_increment()</b> <--- <b>relay.c</b>
  *   <li> <b>mt_stats_circ_record()</b> <--- <b>circuitlist.c</b>
  *   <li> <b>mt_stats_circ_publish()</b> <--- <b>main.c</b>
+ *   <li> <b>mt_stats_checkpoint()</b> <--- <b>main.c</b>
  * </ul>
+ *
+ * The aggregates of the sessions in progress are checkpointed to a binary
+ * file in the DataDirectory from a periodic event, at shutdown, and after
+ * each publication, and are restored by mt_stats_init(). The file is
+ * replaced atomically, so a crash loses at most one checkpoint interval.
  */
 
 #define MT_STATS_PRIVATE
@@ -38,6 +67,7 @@
 #include <math.h>
 
 #include "or.h"
+#include "channel.h"
 #include "crypto.h"
 #include "container.h"
 #include "config.h"
@@ -57,6 +87,10 @@ typedef struct {
   smartlist_t* time_profiles;
   uint32_t total_counts[MT_BUCKET_SIZE * MT_BUCKET_NUM];
   double time_stdevs[MT_BUCKET_SIZE * MT_BUCKET_NUM];
+  uint32_t rate_hist[MT_HIST_NUM_BUCKETS];
+  uint32_t burst_hist[MT_HIST_NUM_BUCKETS];
+  uint32_t inbound_counts[MT_BUCKET_SIZE * MT_BUCKET_NUM];
+  uint32_t outbound_counts[MT_BUCKET_SIZE * MT_BUCKET_NUM];
 } data_t;
 
 // helper functions
@@ -65,23 +99,82 @@ static smartlist_t* bucketize_total_counts(uint32_t (*total_counts)[MT_BUCKET_SI
 static smartlist_t* bucketize_time_stdevs(double (*time_stdevs)[MT_BUCKET_SIZE * MT_BUCKET_NUM]);
 static int uint32_t_comp(const void* a, const void* b);
 static int double_comp(const void* a, const void* b);
+static double get_sample_rate(void);
+static uint64_t draw_sample_skip(double rate);
+static int sample_keep(double probability);
+static void reset_time_profile(mt_stats_t* stats);
+static void stop_collecting(mt_stats_t* stats);
 
 // global data that will eventually be dumped to disk
-static data_t data[MT_NUM_PORT_GROUPS];
+static data_t data[MT_NUM_GROUPS];
 
 // index of the next session of data to be dumped to disk
-static int session_num[MT_NUM_PORT_GROUPS];
+static int session_num[MT_NUM_GROUPS];
 static const char* directory = "mt_stats/published";
 
+// fast RNG for sampling decisions, seeded once per process from the strong RNG
+static tor_weak_rng_t sample_rng;
+
+// rate with which sample_skip was drawn, and the number of circuit creations
+// left to skip before the next sampled one
+static double sample_rate = -1.0;
+static uint64_t sample_skip;
+
+// never skip more circuits than this, so the skip fits in a uint64_t
+#define MAX_SAMPLE_SKIP 1e18
+
+// name of the checkpoint file in the DataDirectory, and the values that open
+// it; the shape constants let us refuse a file written with other parameters
+#define CHECKPOINT_FNAME "mt_stats_checkpoint"
+#define CHECKPOINT_MAGIC 0x4d545343u
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_HEADER_LEN 20
+
+// whether the aggregates changed since the last checkpoint
+static int checkpoint_dirty;
+
 /**
  * Globally initialize the mt_stats module. Should only be called once outside
  * of the module.
  */
 void mt_stats_init(void){
-  memset(data, 0, MT_NUM_PORT_GROUPS*sizeof(data_t));
-  for(int i = 0; i < MT_NUM_PORT_GROUPS; i++){
+  memset(data, 0, MT_NUM_GROUPS*sizeof(data_t));
+  for(int i = 0; i < MT_NUM_GROUPS; i++){
     data[i].time_profiles = smartlist_new();
   }
+  memset(session_num, 0, sizeof(session_num));
+  crypto_seed_weak_rng(&sample_rng);
+  sample_rate = -1.0;
+  sample_skip = 0;
+  checkpoint_dirty = 0;
+
+  // restore the sessions in progress from the last checkpoint, if any
+  const or_options_t* options = get_options();
+  if(!options->DataDirectory)
+    return;
+
+  char* fname = get_datadir_fname(CHECKPOINT_FNAME);
+  struct stat st;
+  char* body = read_file_to_str(fname, RFTS_BIN|RFTS_IGNORE_MISSING, &st);
+  if(body){
+    if(mt_stats_decode_checkpoint(body, (size_t)st.st_size) < 0){
+      log_warn(LD_GENERAL, "MT_STATS: ignoring unreadable checkpoint %s", fname);
+      for(int i = 0; i < MT_NUM_GROUPS; i++){
+        SMARTLIST_FOREACH(data[i].time_profiles, uint32_t*, cp, tor_free(cp));
+        smartlist_free(data[i].time_profiles);
+      }
+      memset(data, 0, MT_NUM_GROUPS*sizeof(data_t));
+      memset(session_num, 0, sizeof(session_num));
+      for(int i = 0; i < MT_NUM_GROUPS; i++){
+        data[i].time_profiles = smartlist_new();
+      }
+    }
+    else {
+      log_info(LD_GENERAL, "MT_STATS: restored sessions in progress from %s", fname);
+    }
+    tor_free(body);
+  }
+  tor_free(fname);
 }
 
 /**
@@ -89,13 +182,30 @@ void mt_stats_init(void){
  */
 void mt_stats_circ_create(circuit_t* circ){
 
+  if(CIRCUIT_IS_ORIGIN(circ))
+    return;
+
+  // redraw the skip counter if the configured rates changed
+  double rate = get_sample_rate();
+  if(rate < sample_rate || rate > sample_rate){
+    sample_rate = rate;
+    sample_skip = draw_sample_skip(rate);
+  }
+
   // exit if circuit does not pass the random filter
-  if(CIRCUIT_IS_ORIGIN(circ) || !(crypto_rand_double() < get_options()->MoneTorStatistics))
+  if(sample_skip > 0){
+    sample_skip--;
     return;
+  }
+  sample_skip = draw_sample_skip(rate);
 
   mt_stats_t* stats = &TO_OR_CIRCUIT(circ)->mt_stats;
 
+  or_circuit_t* or_circ = TO_OR_CIRCUIT(circ);
   stats->collecting = 1;
+  stats->sample_rate = rate;
+  stats->start_time = mt_time();
+  stats->prev_is_client = or_circ->p_chan && channel_is_client(or_circ->p_chan);
   stats->time_profile = smartlist_new();
 }
 
@@ -113,10 +223,22 @@ void mt_stats_circ_port(circuit_t* circ, edge_connection_t* n_stream){
     return;
 
   mt_stats_t* stats = &TO_OR_CIRCUIT(circ)->mt_stats;
+
+  /** The circuit was sampled at the larger of the exit and middle rates; now
+   * that we know it is an exit circuit, thin it down to the exit rate */
+  if (!stats->port_group &&
+      !sample_keep(get_options()->MoneTorStatistics / stats->sample_rate)) {
+    stop_collecting(stats);
+    return;
+  }
+
   /** This should match the timing of the first CONNECTED
-   * cell that this circuit sent back */
-  if (!stats->port_group)
+   * cell that this circuit sent back; drop what we counted while we did not
+   * know this was an exit circuit */
+  if (!stats->port_group) {
     stats->start_time = mt_time();
+    reset_time_profile(stats);
+  }
   /** We consider group instead of port, directly */
   connection_t* curr_stream = TO_CONN(n_stream);
   if (!stats->port_group) {
@@ -136,24 +258,79 @@ void mt_stats_circ_port(circuit_t* circ, edge_connection_t* n_stream){
 }
 
 /**
- * Alert an mt_stats circuit that a single cell has been processed
+ * Returns the group in which a circuit is counted: its port group if it exits
+ * through us, and otherwise a position group based on its purpose and on
+ * whether the previous hop is a client
+ */
+int mt_stats_circ_group(const circuit_t* circ){
+
+  const mt_stats_t* stats = &CONST_TO_OR_CIRCUIT(circ)->mt_stats;
+
+  if(stats->port_group)
+    return stats->port_group;
+
+  switch(circ->purpose){
+    case CIRCUIT_PURPOSE_INTRO_POINT:
+      return MT_POSITION_GROUP_INTRO;
+    case CIRCUIT_PURPOSE_REND_POINT_WAITING:
+    case CIRCUIT_PURPOSE_REND_ESTABLISHED:
+      return MT_POSITION_GROUP_REND;
+    default:
+      return stats->prev_is_client ? MT_POSITION_GROUP_GUARD : MT_POSITION_GROUP_MIDDLE;
+  }
+}
+
+/**
+ * Alert an mt_stats circuit that a single cell that is not for us has been
+ * passed on in the given direction, which shows that the circuit does not exit
+ * through us
+ */
+void mt_stats_circ_relay(circuit_t* circ, cell_direction_t direction){
+
+  // exit if the circuit is not marked for stat collection
+  if(CIRCUIT_IS_ORIGIN(circ) || !TO_OR_CIRCUIT(circ)->mt_stats.collecting)
+    return;
+
+  mt_stats_t* stats = &TO_OR_CIRCUIT(circ)->mt_stats;
+
+  // the circuit was sampled at the larger of the exit and middle rates; now
+  // that we know it does not exit here, thin it down to the middle rate
+  if(!stats->port_group && !stats->position_sampled){
+    if(!sample_keep(get_options()->MoneTorStatisticsMiddle / stats->sample_rate)){
+      stop_collecting(stats);
+      return;
+    }
+    stats->position_sampled = 1;
+    stats->sample_rate = get_options()->MoneTorStatisticsMiddle;
+  }
+
+  mt_stats_circ_increment(circ, direction);
+}
+
+/**
+ * Alert an mt_stats circuit that a single cell has been processed in the
+ * given direction
  */
-void mt_stats_circ_increment(circuit_t* circ){
+void mt_stats_circ_increment(circuit_t* circ, cell_direction_t direction){
 
   // exit if the circuit is not marked for stat collection
-  if(CIRCUIT_IS_ORIGIN(circ) || !TO_OR_CIRCUIT(circ)->mt_stats.collecting ||
-      !TO_OR_CIRCUIT(circ)->mt_stats.port_group)
+  if(CIRCUIT_IS_ORIGIN(circ) || !TO_OR_CIRCUIT(circ)->mt_stats.collecting)
     return;
 
   mt_stats_t* stats = &TO_OR_CIRCUIT(circ)->mt_stats;
 
-  // increment total cell count
+  // increment total and per-direction cell counts
   stats->total_count++;
+  if(direction == CELL_DIRECTION_IN)
+    stats->inbound_count++;
+  else
+    stats->outbound_count++;
 
   // add new time buckets if enough time has passed
   time_t time_diff = mt_time() - stats->start_time;
   int num_buckets = smartlist_len(stats->time_profile);
   int exp_buckets = time_diff / MT_BUCKET_TIME + 1;
+
   for(int i = 0; i < exp_buckets - num_buckets; i++) {
     if (i == 0) {
       log_info(LD_GENERAL, "time_diff: %ld, start_time: %ld",
@@ -180,20 +357,19 @@ int mt_stats_circ_record(circuit_t* circ){
 
   mt_stats_t* stats = &TO_OR_CIRCUIT(circ)->mt_stats;
 
-  // if the port was never set or used then the exit stream was never used
-  if(!stats->port_group || !stats->total_count){
-    stats->collecting = 0;
-    smartlist_free(stats->time_profile);
-    log_info(LD_GENERAL, "MT_STATS: port group %s and total cell count: %u while closed",
-        get_port_group_string(stats->port_group), stats->total_count);
+  // obtain global data for the right group
+  int group = mt_stats_circ_group(circ);
+
+  // if the circuit never carried a cell there is nothing to record
+  if(!stats->total_count){
+    log_info(LD_GENERAL, "MT_STATS: group %s and total cell count: %u while closed",
+        get_port_group_string(group), stats->total_count);
+    stop_collecting(stats);
     return 0;
   }
 
-  log_info(LD_GENERAL, "MT_STATS: recording information for port group %s. Elapsed time %ld",
-      get_port_group_string(stats->port_group), mt_time()-stats->start_time);
-
-  // obtain global data for the right port group
-  int group = stats->port_group;
+  log_info(LD_GENERAL, "MT_STATS: recording information for group %s. Elapsed time %ld",
+      get_port_group_string(group), mt_time()-stats->start_time);
 
   // if circuits exceeded this then something went wrong with dumping
   tor_assert_nonfatal(data[group-1].num_circuits <= MT_BUCKET_SIZE * MT_BUCKET_NUM);
@@ -214,6 +390,8 @@ int mt_stats_circ_record(circuit_t* circ){
   /******************** Record Total Cell Counts *******************/
 
   data[group-1].total_counts[data[group-1].num_circuits] = stats->total_count;
+  data[group-1].inbound_counts[data[group-1].num_circuits] = stats->inbound_count;
+  data[group-1].outbound_counts[data[group-1].num_circuits] = stats->outbound_count;
 
   /************** Record Time Profile Standard Deviations **********/
 
@@ -244,15 +422,25 @@ int mt_stats_circ_record(circuit_t* circ){
 
   data[group-1].time_stdevs[data[group-1].num_circuits] = stdev;
 
+  /********************** Record Rate Histogram ********************/
+
+  data[group-1].rate_hist[mt_hist_bucket(stats->total_count / num_buckets)]++;
+
+  /********************* Record Burst Histogram ********************/
+
+  // as for the standard deviation, only the complete windows count
+  for(int i = 0; i < len; i++){
+    uint32_t cells = *(uint32_t*)smartlist_get(stats->time_profile, i);
+    data[group-1].burst_hist[mt_hist_bucket(cells)]++;
+  }
+
   /*****************************************************************/
 
   data[group-1].num_circuits++;
+  checkpoint_dirty = 1;
 
   // free circ time_profile items and smartlist
-  SMARTLIST_FOREACH_BEGIN(stats->time_profile, uint32_t*, cp) {
-    tor_free(cp);
-  } SMARTLIST_FOREACH_END(cp);
-  smartlist_free(stats->time_profile);
+  stop_collecting(stats);
   return 1;
 }
 
@@ -265,7 +453,7 @@ void mt_stats_publish(void){
   int group = 0;
 
   // loop through port groups and see if one of them is ready for dumping
-  for(int i = 0; i < MT_NUM_PORT_GROUPS; i++){
+  for(int i = 0; i < MT_NUM_GROUPS; i++){
 
     // only one port group should be ready to be dumped at a time
     /*tor_assert(group == 0 || data[i].num_circuits < MT_BUCKET_SIZE * MT_BUCKET_NUM);*/
@@ -301,9 +489,12 @@ void mt_stats_publish(void){
 
   smartlist_t* total_counts_buckets = bucketize_total_counts(&data[group-1].total_counts);
   smartlist_t* time_stdevs_buckets = bucketize_time_stdevs(&data[group-1].time_stdevs);
+  smartlist_t* inbound_counts_buckets = bucketize_total_counts(&data[group-1].inbound_counts);
+  smartlist_t* outbound_counts_buckets = bucketize_total_counts(&data[group-1].outbound_counts);
 
   mt_publish_to_disk((const char*)filename, data[group-1].time_profiles, total_counts_buckets,
-		time_stdevs_buckets);
+		time_stdevs_buckets, data[group-1].rate_hist, data[group-1].burst_hist,
+		inbound_counts_buckets, outbound_counts_buckets);
 
   // free smartlists
   SMARTLIST_FOREACH_BEGIN(data[group-1].time_profiles, uint32_t*, cp) {
@@ -321,9 +512,170 @@ void mt_stats_publish(void){
   } SMARTLIST_FOREACH_END(cp);
   smartlist_free(time_stdevs_buckets);
 
+  SMARTLIST_FOREACH(inbound_counts_buckets, double*, cp, tor_free(cp));
+  smartlist_free(inbound_counts_buckets);
+
+  SMARTLIST_FOREACH(outbound_counts_buckets, double*, cp, tor_free(cp));
+  smartlist_free(outbound_counts_buckets);
+
   // reinitialize global data fields
   data[group-1].time_profiles = smartlist_new();
   data[group-1].num_circuits = 0;
+  memset(data[group-1].rate_hist, 0, sizeof(data[group-1].rate_hist));
+  memset(data[group-1].burst_hist, 0, sizeof(data[group-1].burst_hist));
+
+  // make sure a restart does not publish this session again
+  checkpoint_dirty = 1;
+  mt_stats_checkpoint();
+}
+
+/**
+ * Save the aggregates of the sessions in progress to the checkpoint file in
+ * the DataDirectory, if they changed since the last checkpoint. Returns 0 on
+ * success or if there was nothing to do, -1 on failure
+ */
+int mt_stats_checkpoint(void){
+
+  const or_options_t* options = get_options();
+  if(!checkpoint_dirty || !options->DataDirectory)
+    return 0;
+
+  size_t len;
+  char* body = mt_stats_encode_checkpoint(&len);
+  char* fname = get_datadir_fname(CHECKPOINT_FNAME);
+  int r = write_bytes_to_file(fname, body, len, 1);
+  if(r < 0)
+    log_warn(LD_GENERAL, "MT_STATS: couldn't write checkpoint %s", fname);
+  else
+    checkpoint_dirty = 0;
+
+  tor_free(fname);
+  tor_free(body);
+  return r < 0 ? -1 : 0;
+}
+
+/**
+ * Encode the aggregates of every group in network byte order: a header with
+ * the magic, the version and the shape constants, then for each group its
+ * session number, circuit count and time profile length, followed by the time
+ * profile, the per-circuit arrays and the two histograms
+ */
+STATIC char* mt_stats_encode_checkpoint(size_t* len_out){
+
+  size_t len = CHECKPOINT_HEADER_LEN;
+  for(int i = 0; i < MT_NUM_GROUPS; i++){
+    len += 3 * 4 + smartlist_len(data[i].time_profiles) * 4;
+    len += data[i].num_circuits * (4 + 8 + 4 + 4);
+    len += 2 * MT_HIST_NUM_BUCKETS * 4;
+  }
+
+  char* body = tor_malloc(len);
+  char* cp = body;
+
+#define PUT32(v) STMT_BEGIN set_uint32(cp, htonl((uint32_t)(v))); cp += 4; STMT_END
+
+  PUT32(CHECKPOINT_MAGIC);
+  PUT32(CHECKPOINT_VERSION);
+  PUT32(MT_NUM_GROUPS);
+  PUT32(MT_BUCKET_SIZE * MT_BUCKET_NUM);
+  PUT32(MT_HIST_NUM_BUCKETS);
+
+  for(int i = 0; i < MT_NUM_GROUPS; i++){
+    uint32_t n = data[i].num_circuits;
+    PUT32(session_num[i]);
+    PUT32(n);
+    PUT32(smartlist_len(data[i].time_profiles));
+    SMARTLIST_FOREACH(data[i].time_profiles, uint32_t*, p, PUT32(*p));
+    for(uint32_t j = 0; j < n; j++)
+      PUT32(data[i].total_counts[j]);
+    for(uint32_t j = 0; j < n; j++){
+      uint64_t bits;
+      memcpy(&bits, &data[i].time_stdevs[j], sizeof(bits));
+      set_uint64(cp, tor_htonll(bits));
+      cp += 8;
+    }
+    for(uint32_t j = 0; j < n; j++)
+      PUT32(data[i].inbound_counts[j]);
+    for(uint32_t j = 0; j < n; j++)
+      PUT32(data[i].outbound_counts[j]);
+    for(int j = 0; j < MT_HIST_NUM_BUCKETS; j++)
+      PUT32(data[i].rate_hist[j]);
+    for(int j = 0; j < MT_HIST_NUM_BUCKETS; j++)
+      PUT32(data[i].burst_hist[j]);
+  }
+
+#undef PUT32
+
+  tor_assert(cp == body + len);
+  *len_out = len;
+  return body;
+}
+
+/**
+ * Restore the aggregates of every group from a checkpoint produced by
+ * mt_stats_encode_checkpoint(). Expects freshly initialized data. Returns 0 on
+ * success and -1 if the checkpoint is truncated or has another shape, in which
+ * case the data may be partially restored
+ */
+STATIC int mt_stats_decode_checkpoint(const char* body, size_t len){
+
+  const char* cp = body;
+  const char* end = body + len;
+
+#define GET32(v) STMT_BEGIN                           \
+    if(end - cp < 4)                                  \
+      return -1;                                      \
+    (v) = ntohl(get_uint32(cp));                      \
+    cp += 4;                                          \
+  STMT_END
+
+  uint32_t magic, version, n_groups, max_circuits, n_hist;
+  GET32(magic);
+  GET32(version);
+  GET32(n_groups);
+  GET32(max_circuits);
+  GET32(n_hist);
+  if(magic != CHECKPOINT_MAGIC || version != CHECKPOINT_VERSION ||
+     n_groups != MT_NUM_GROUPS || max_circuits != MT_BUCKET_SIZE * MT_BUCKET_NUM ||
+     n_hist != MT_HIST_NUM_BUCKETS)
+    return -1;
+
+  for(int i = 0; i < MT_NUM_GROUPS; i++){
+    uint32_t session, n, n_profile;
+    GET32(session);
+    GET32(n);
+    GET32(n_profile);
+    if(n > MT_BUCKET_SIZE * MT_BUCKET_NUM || n_profile > (size_t)(end - cp) / 4)
+      return -1;
+    session_num[i] = (int)session;
+    data[i].num_circuits = n;
+    for(uint32_t j = 0; j < n_profile; j++){
+      uint32_t* bucket = tor_malloc(sizeof(uint32_t));
+      smartlist_add(data[i].time_profiles, bucket);
+      GET32(*bucket);
+    }
+    for(uint32_t j = 0; j < n; j++)
+      GET32(data[i].total_counts[j]);
+    for(uint32_t j = 0; j < n; j++){
+      if(end - cp < 8)
+        return -1;
+      uint64_t bits = tor_ntohll(get_uint64(cp));
+      memcpy(&data[i].time_stdevs[j], &bits, sizeof(bits));
+      cp += 8;
+    }
+    for(uint32_t j = 0; j < n; j++)
+      GET32(data[i].inbound_counts[j]);
+    for(uint32_t j = 0; j < n; j++)
+      GET32(data[i].outbound_counts[j]);
+    for(int j = 0; j < MT_HIST_NUM_BUCKETS; j++)
+      GET32(data[i].rate_hist[j]);
+    for(int j = 0; j < MT_HIST_NUM_BUCKETS; j++)
+      GET32(data[i].burst_hist[j]);
+  }
+
+#undef GET32
+
+  return cp == end ? 0 : -1;
 }
 
 /**
@@ -368,6 +720,99 @@ int mt_port_group(uint16_t port){
   return MT_PORT_GROUP_OTHER;
 }
 
+/**
+ * Returns the log-linear histogram bucket in which a value is counted: values
+ * below 2^MT_HIST_SUB_BITS map to themselves, and each larger power of two is
+ * split into 2^MT_HIST_SUB_BITS buckets
+ */
+int mt_hist_bucket(uint32_t value){
+
+  if(value < (1u << MT_HIST_SUB_BITS))
+    return (int)value;
+
+  int shift = tor_log2(value) - MT_HIST_SUB_BITS;
+  return ((shift + 1) << MT_HIST_SUB_BITS) +
+    (int)((value >> shift) & ((1u << MT_HIST_SUB_BITS) - 1));
+}
+
+/**
+ * Returns the smallest value counted in a given histogram bucket
+ */
+uint32_t mt_hist_bucket_min(int bucket){
+
+  tor_assert(bucket >= 0 && bucket < MT_HIST_NUM_BUCKETS);
+
+  if(bucket < (1 << MT_HIST_SUB_BITS))
+    return (uint32_t)bucket;
+
+  int shift = (bucket >> MT_HIST_SUB_BITS) - 1;
+  uint32_t sub = (uint32_t)(bucket & ((1 << MT_HIST_SUB_BITS) - 1));
+  return ((1u << MT_HIST_SUB_BITS) | sub) << shift;
+}
+
+/**
+ * Returns the rate at which we sample newly created circuits: the larger of
+ * the exit and middle rates, since we do not know the circuit type yet
+ */
+static double get_sample_rate(void){
+  const or_options_t* options = get_options();
+  return MAX(options->MoneTorStatistics, options->MoneTorStatisticsMiddle);
+}
+
+/**
+ * Drop the cells counted so far by a circuit
+ */
+static void reset_time_profile(mt_stats_t* stats){
+
+  SMARTLIST_FOREACH(stats->time_profile, uint32_t*, cp, tor_free(cp));
+  smartlist_clear(stats->time_profile);
+  stats->total_count = 0;
+  stats->inbound_count = 0;
+  stats->outbound_count = 0;
+}
+
+/**
+ * Stop collecting statistics for a circuit and free its time profile
+ */
+static void stop_collecting(mt_stats_t* stats){
+
+  SMARTLIST_FOREACH(stats->time_profile, uint32_t*, cp, tor_free(cp));
+  smartlist_free(stats->time_profile);
+  stats->time_profile = NULL;
+  stats->collecting = 0;
+}
+
+/**
+ * Returns how many circuit creations to skip before sampling the next one, so
+ * that each creation is sampled independently with probability rate. The skip
+ * follows a geometric distribution, drawn by inversion from one weak RNG call
+ */
+static uint64_t draw_sample_skip(double rate){
+
+  if(rate >= 1.0)
+    return 0;
+  if(rate <= 0.0)
+    return (uint64_t)MAX_SAMPLE_SKIP;
+
+  // uniform in (0, 1], so that the log is finite
+  double u = (tor_weak_random(&sample_rng) + 1.0) / (TOR_WEAK_RANDOM_MAX + 1.0);
+  double skip = floor(log(u) / log1p(-rate));
+
+  if(skip > MAX_SAMPLE_SKIP)
+    return (uint64_t)MAX_SAMPLE_SKIP;
+  return (uint64_t)skip;
+}
+
+/**
+ * Returns true with the given probability, using the weak sampling RNG
+ */
+static int sample_keep(double probability){
+
+  if(probability >= 1.0)
+    return 1;
+  return tor_weak_random(&sample_rng) < probability * TOR_WEAK_RANDOM_MAX;
+}
+
 /**
  * MOCKABLE time for testing purposes
  */
@@ -376,16 +821,23 @@ MOCK_IMPL(time_t, mt_time, (void)){
 }
 
 /**
- * Publishes the given time profiles, total counts, and time stdevs information to
- * the disk. For testing purposes, this can be mockable to intercept the data
- * for validation instead.
+ * Publishes the given time profiles, total counts, time stdevs, rate histogram,
+ * burst histogram, inbound counts and outbound counts information to the disk.
+ * For testing purposes, this can be mockable to intercept the data for
+ * validation instead.
  */
 MOCK_IMPL(void, mt_publish_to_disk, (const char* filename, smartlist_t* time_profiles_buckets,
-			       smartlist_t* total_counts_buckets, smartlist_t* time_stdevs_buckets)){
+			       smartlist_t* total_counts_buckets, smartlist_t* time_stdevs_buckets,
+			       const uint32_t* rate_hist, const uint32_t* burst_hist,
+			       smartlist_t* inbound_counts_buckets, smartlist_t* outbound_counts_buckets)){
 
   smartlist_t* time_profiles_strings = smartlist_new();
   smartlist_t* total_counts_strings = smartlist_new();
   smartlist_t* time_stdevs_strings = smartlist_new();
+  smartlist_t* rate_hist_strings = smartlist_new();
+  smartlist_t* burst_hist_strings = smartlist_new();
+  smartlist_t* inbound_counts_strings = smartlist_new();
+  smartlist_t* outbound_counts_strings = smartlist_new();
 
   for(int i = 0; i < smartlist_len(time_profiles_buckets); i++){
     uint32_t time_profile = *(uint32_t*)smartlist_get(time_profiles_buckets, i);
@@ -399,17 +851,34 @@ MOCK_IMPL(void, mt_publish_to_disk, (const char* filename, smartlist_t* time_pro
 
     smartlist_add_asprintf(total_counts_strings, "%lf", total_count);
     smartlist_add_asprintf(time_stdevs_strings, "%lf", time_stdev);
+    smartlist_add_asprintf(inbound_counts_strings, "%lf",
+                           *(double*)smartlist_get(inbound_counts_buckets, i));
+    smartlist_add_asprintf(outbound_counts_strings, "%lf",
+                           *(double*)smartlist_get(outbound_counts_buckets, i));
+  }
+
+  for(int i = 0; i < MT_HIST_NUM_BUCKETS; i++){
+    smartlist_add_asprintf(rate_hist_strings, "%u", rate_hist[i]);
+    smartlist_add_asprintf(burst_hist_strings, "%u", burst_hist[i]);
   }
 
   char* time_profiles_string = smartlist_join_strings(time_profiles_strings, ", ", 0, NULL);
   char* total_counts_string = smartlist_join_strings(total_counts_strings, ", ", 0, NULL);
   char* time_stdevs_string = smartlist_join_strings(time_stdevs_strings, ", ", 0, NULL);
+  char* rate_hist_string = smartlist_join_strings(rate_hist_strings, ", ", 0, NULL);
+  char* burst_hist_string = smartlist_join_strings(burst_hist_strings, ", ", 0, NULL);
+  char* inbound_counts_string = smartlist_join_strings(inbound_counts_strings, ", ", 0, NULL);
+  char* outbound_counts_string = smartlist_join_strings(outbound_counts_strings, ", ", 0, NULL);
 
   FILE* fp = fopen(filename, "w");
   if (fp) {
     fprintf(fp, "%s\n", time_profiles_string);
     fprintf(fp, "%s\n", total_counts_string);
     fprintf(fp, "%s\n", time_stdevs_string);
+    fprintf(fp, "%s\n", rate_hist_string);
+    fprintf(fp, "%s\n", burst_hist_string);
+    fprintf(fp, "%s\n", inbound_counts_string);
+    fprintf(fp, "%s\n", outbound_counts_string);
     fclose(fp);
   }
   else {
@@ -431,10 +900,26 @@ MOCK_IMPL(void, mt_publish_to_disk, (const char* filename, smartlist_t* time_pro
   } SMARTLIST_FOREACH_END(cp);
   smartlist_free(time_stdevs_strings);
 
+  SMARTLIST_FOREACH(rate_hist_strings, char*, cp, tor_free(cp));
+  smartlist_free(rate_hist_strings);
+
+  SMARTLIST_FOREACH(burst_hist_strings, char*, cp, tor_free(cp));
+  smartlist_free(burst_hist_strings);
+
+  SMARTLIST_FOREACH(inbound_counts_strings, char*, cp, tor_free(cp));
+  smartlist_free(inbound_counts_strings);
+
+  SMARTLIST_FOREACH(outbound_counts_strings, char*, cp, tor_free(cp));
+  smartlist_free(outbound_counts_strings);
+
   // free strings
   tor_free(time_profiles_string);
   tor_free(total_counts_string);
   tor_free(time_stdevs_string);
+  tor_free(rate_hist_string);
+  tor_free(burst_hist_string);
+  tor_free(inbound_counts_string);
+  tor_free(outbound_counts_string);
 }
 
 /**
@@ -475,6 +960,14 @@ static const char* get_port_group_string(int port_group){
       return "port_group_pgphkp";
     case MT_PORT_GROUP_MUMBLE:
       return "port_group_mumble";
+    case MT_POSITION_GROUP_GUARD:
+      return "position_group_guard";
+    case MT_POSITION_GROUP_MIDDLE:
+      return "position_group_middle";
+    case MT_POSITION_GROUP_INTRO:
+      return "position_group_intro";
+    case MT_POSITION_GROUP_REND:
+      return "position_group_rend";
     default:
       return "port_group_other";
   }
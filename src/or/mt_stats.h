@@ -9,16 +9,25 @@
 void mt_stats_init(void);
 void mt_stats_circ_create(circuit_t* circ);
 void mt_stats_circ_port(circuit_t* circ, edge_connection_t* n_stream);
-void mt_stats_circ_increment(circuit_t* circ);
+void mt_stats_circ_relay(circuit_t* circ, cell_direction_t direction);
+void mt_stats_circ_increment(circuit_t* circ, cell_direction_t direction);
 int mt_stats_circ_record(circuit_t* circ);
 void mt_stats_publish(void);
+int mt_stats_checkpoint(void);
 
 int mt_port_group(uint16_t port);
+int mt_stats_circ_group(const circuit_t* circ);
+int mt_hist_bucket(uint32_t value);
+uint32_t mt_hist_bucket_min(int bucket);
 
 #ifdef MT_STATS_PRIVATE
+STATIC char* mt_stats_encode_checkpoint(size_t* len_out);
+STATIC int mt_stats_decode_checkpoint(const char* body, size_t len);
 MOCK_DECL(time_t, mt_time, (void));
 MOCK_DECL(void, mt_publish_to_disk, (const char* filename, smartlist_t* time_profiles_buckets,
-			       smartlist_t* total_counts_buckets, smartlist_t* time_stdevs_buckets));
+			       smartlist_t* total_counts_buckets, smartlist_t* time_stdevs_buckets,
+			       const uint32_t* rate_hist, const uint32_t* burst_hist,
+			       smartlist_t* inbound_counts_buckets, smartlist_t* outbound_counts_buckets));
 #endif
 
 
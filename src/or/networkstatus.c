@@ -1733,7 +1733,7 @@ networkstatus_set_current_consensus(const char *consensus,
   consensus_waiting_for_certs_t *waiting = NULL;
   time_t current_valid_after = 0;
   int free_consensus = 1; /* Free 'c' at the end of the function */
-  int old_ewma_enabled;
+  const circuitmux_policy_t *old_ewma_policy;
   int checked_protocols_already = 0;
 
   if (flav < 0) {
@@ -1947,15 +1947,13 @@ networkstatus_set_current_consensus(const char *consensus,
     dirvote_recalculate_timing(options, now);
 
     /* Update ewma and adjust policy if needed; first cache the old value */
-    old_ewma_enabled = cell_ewma_enabled();
+    old_ewma_policy = cell_ewma_get_policy();
     /* Change the cell EWMA settings */
     cell_ewma_set_scale_factor(options, c);
-    /* If we just enabled ewma, set the cmux policy on all active channels */
-    if (cell_ewma_enabled() && !old_ewma_enabled) {
-      channel_set_cmux_policy_everywhere(&ewma_policy);
-    } else if (!cell_ewma_enabled() && old_ewma_enabled) {
-      /* Turn it off everywhere */
-      channel_set_cmux_policy_everywhere(NULL);
+    /* If we just enabled, disabled or changed the ewma policy, set the cmux
+     * policy on all active channels */
+    if (cell_ewma_get_policy() != old_ewma_policy) {
+      channel_set_cmux_policy_everywhere(cell_ewma_get_policy());
     }
 
     /* XXXX this call might be unnecessary here: can changing the
@@ -296,6 +296,7 @@ node_set_hsdir_index(node_t *node, const networkstatus_t *ns)
   uint8_t *fetch_srv = NULL, *store_first_srv = NULL, *store_second_srv = NULL;
   uint64_t next_time_period_num, current_time_period_num;
   uint64_t fetch_tp, store_first_tp, store_second_tp;
+  hsdir_index_inputs_t inputs;
 
   tor_assert(node);
   tor_assert(ns);
@@ -340,6 +341,27 @@ node_set_hsdir_index(node_t *node, const networkstatus_t *ns)
   store_first_srv = hs_get_previous_srv(store_first_tp, ns);
   store_second_srv = hs_get_current_srv(store_second_tp, ns);
 
+  /* Unless the time period or the SRVs rolled over, the inputs are the same
+   * as the last time we were called for this node: keep the indices. */
+  memset(&inputs, 0, sizeof(inputs));
+  memcpy(&inputs.identity_pk, node_identity_pk, sizeof(inputs.identity_pk));
+  memcpy(inputs.fetch_srv, fetch_srv, sizeof(inputs.fetch_srv));
+  memcpy(inputs.store_first_srv, store_first_srv,
+         sizeof(inputs.store_first_srv));
+  memcpy(inputs.store_second_srv, store_second_srv,
+         sizeof(inputs.store_second_srv));
+  inputs.fetch_tp = fetch_tp;
+  inputs.store_first_tp = store_first_tp;
+  inputs.store_second_tp = store_second_tp;
+  inputs.in_new_tp = hs_in_period_between_tp_and_srv(ns, now);
+  if (tor_memeq(&inputs, &node->hsdir_index->inputs, sizeof(inputs))) {
+    goto done;
+  }
+  memcpy(&node->hsdir_index->inputs, &inputs, sizeof(inputs));
+
+  /* Take the node off the hash ring while its position is still known. */
+  hs_hsdir_ring_node_removed(node);
+
   /* Build the fetch index. */
   hs_build_hsdir_index(node_identity_pk, fetch_srv, fetch_tp,
                        node->hsdir_index->fetch);
@@ -365,6 +387,8 @@ node_set_hsdir_index(node_t *node, const networkstatus_t *ns)
   }
 
  done:
+  /* Put the node back on the hash ring if it belongs there. */
+  hs_hsdir_ring_node_changed(node);
   tor_free(fetch_srv);
   tor_free(store_first_srv);
   tor_free(store_second_srv);
@@ -531,6 +555,9 @@ nodelist_set_consensus(networkstatus_t *ns)
 
     if (rs->supports_v3_hsdir) {
       node_set_hsdir_index(node, ns);
+    } else {
+      /* It might have been an HSDir in the previous consensus. */
+      hs_hsdir_ring_node_changed(node);
     }
     node_set_country(node);
 
@@ -553,6 +580,12 @@ nodelist_set_consensus(networkstatus_t *ns)
 
   } SMARTLIST_FOREACH_END(rs);
 
+  /* Take the HSDirs that left the consensus off the hash ring: the other
+   * nodes were moved on or off it above, so it's now up to date. */
+  SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
+                    if (!node->rs) hs_hsdir_ring_node_changed(node));
+  hs_hsdir_ring_set_consensus(ns);
+
   nodelist_purge();
 
   if (! authdir) {
@@ -593,6 +626,8 @@ nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md)
     if (! node_get_ed25519_id(node)) {
       node_remove_from_ed25519_map(node);
     }
+    /* Without a descriptor, the node can't be used as an HSDir anymore. */
+    hs_hsdir_ring_node_changed(node);
   }
 }
 
@@ -606,6 +641,8 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
     if (! node_is_usable(node)) {
       nodelist_drop_node(node, 1);
       node_free(node);
+    } else {
+      hs_hsdir_ring_node_changed(node);
     }
   }
 }
@@ -663,6 +700,7 @@ node_free(node_t *node)
   if (node->md)
     node->md->held_by_nodes--;
   tor_assert(node->nodelist_idx == -1);
+  hs_hsdir_ring_node_removed(node);
   tor_free(node->hsdir_index);
   tor_free(node);
 }
@@ -704,6 +742,7 @@ nodelist_free_all(void)
   if (PREDICT_UNLIKELY(the_nodelist == NULL))
     return;
 
+  hs_hsdir_ring_invalidate();
   HT_CLEAR(nodelist_map, &the_nodelist->nodes_by_id);
   HT_CLEAR(nodelist_ed_map, &the_nodelist->nodes_by_ed_id);
   SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
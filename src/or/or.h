@@ -804,6 +804,14 @@ typedef enum {
 #define MT_BUCKET_NUM 80
 #define MT_BUCKET_NUM_STDEV 10
 
+/* Define the shape of the log-linear (HDR-style) histograms of per-circuit
+ * rate and per-bucket burst size. Values below 2^MT_HIST_SUB_BITS get a
+ * bucket each; above that, every power of two is split into
+ * 2^MT_HIST_SUB_BITS equal buckets, so any uint32_t fits in
+ * MT_HIST_NUM_BUCKETS buckets with a relative error under 1/8 */
+#define MT_HIST_SUB_BITS 3
+#define MT_HIST_NUM_BUCKETS ((32 - MT_HIST_SUB_BITS + 1) << MT_HIST_SUB_BITS)
+
 /* Track one set of data for each of these port groups */
 #define MT_NUM_PORT_GROUPS 17
 // Starting at 0 can be dangerous
@@ -825,6 +833,19 @@ typedef enum {
 #define MT_PORT_GROUP_ANDROIDM 16
 #define MT_PORT_GROUP_MUMBLE 17
 
+/* Circuits that do not exit through us are grouped by our position in them
+ * and by their purpose instead; these groups follow the port groups */
+#define MT_POSITION_GROUP_GUARD 18
+#define MT_POSITION_GROUP_MIDDLE 19
+#define MT_POSITION_GROUP_INTRO 20
+#define MT_POSITION_GROUP_REND 21
+#define MT_NUM_GROUPS 21
+
+/* Scheduling priority classes for circuits; see circuitmux_ewma.c */
+#define MT_PRIORITY_CLASS_REGULAR 0
+#define MT_PRIORITY_CLASS_PREMIUM 1
+#define MT_NUM_PRIORITY_CLASSES 2
+
 /* List of processed cell counts in each bucket of time MT_BUCKET_TIME */
 typedef struct {
 
@@ -835,6 +856,11 @@ typedef struct {
   /** total number of cells in a circuit (should be equal to processed_cells */
   uint32_t total_count;
 
+  /** number of those cells that travelled towards the client (inbound) and
+   * away from it (outbound) */
+  uint32_t inbound_count;
+  uint32_t outbound_count;
+
   /** time at the beginning of stat collection */
   time_t start_time;
 
@@ -848,6 +874,17 @@ typedef struct {
    *  handle multiple of our group port */
   unsigned int handle_multiple_group_port : 1;
 
+  /** rate at which this circuit was sampled, before we knew its type */
+  double sample_rate;
+
+  /** Whether the previous hop of this circuit is a client, which makes us
+   *  its guard if it does not exit through us */
+  unsigned int prev_is_client : 1;
+
+  /** Whether this circuit passed on a cell and was kept at the middle rate,
+   *  since it does not exit through us */
+  unsigned int position_sampled : 1;
+
 } mt_stats_t;
 
 /*******************************************************************/
@@ -1369,6 +1406,15 @@ typedef struct connection_t {
    * connection. */
   unsigned int linked_conn_is_closed:1;
 
+  /* For BatchConnectionIO:
+   */
+  /** True iff this connection's read event fired and it is waiting to be
+   * handled in the current batch. */
+  unsigned int in_read_batch:1;
+  /** True iff this connection's write event fired and it is waiting to be
+   * handled in the current batch. */
+  unsigned int in_write_batch:1;
+
   /** CONNECT/SOCKS proxy client handshake state (for outgoing connections). */
   unsigned int proxy_state:4;
 
@@ -1376,6 +1422,9 @@ typedef struct connection_t {
    * or has no socket. */
   tor_socket_t s;
   int conn_array_index; /**< Index into the global connection array. */
+  /** Index into the list of connections waiting for the bandwidth
+   * throttler to let them read or write again, or -1 if we are not on it. */
+  int bw_blocked_index;
 
   struct event *read_event; /**< Libevent event structure. */
   struct event *write_event; /**< Libevent event structure. */
@@ -1678,6 +1727,10 @@ typedef struct or_connection_t {
                     * add 'bandwidthrate' to this, capping it at
                     * bandwidthburst. (OPEN ORs only) */
   int write_bucket; /**< When this hits 0, stop writing. Like read_bucket. */
+  /** Monotonic time in msec at which we last added tokens to read_bucket and
+   * write_bucket. We refill them lazily, based on the time elapsed since
+   * then, whenever we are about to use them. (OPEN ORs only) */
+  uint32_t buckets_refilled_msec;
 
   /** Last emptied read token bucket in msec since midnight; only used if
    * TB_EMPTY events are enabled. */
@@ -1748,6 +1801,9 @@ typedef struct edge_connection_t {
   /** True iff we've blocked reading until the circuit has fewer queued
    * cells. */
   unsigned int edge_blocked_on_circ:1;
+  /** True iff this stream is on the list of streams whose n_read or
+   * n_written has changed since the last STREAM_BW event. */
+  unsigned int on_stream_bw_list:1;
 
   /** Unique ID for directory requests; this used to be in connection_t, but
    * that's going away and being used on channels instead.  We still tag
@@ -1909,6 +1965,20 @@ typedef struct control_connection_t {
    * connection. */
   unsigned int is_owning_control_connection:1;
 
+  /** Number of events we have declined to send on this connection because
+   * its outbuf was too full, since it last caught up. */
+  uint64_t n_events_dropped;
+
+  /** If we are writing a GETINFO reply a piece at a time, the pieces that
+   * remain to be written (getinfo_spool_t, private to control.c);
+   * otherwise NULL. */
+  smartlist_t *getinfo_spool;
+  /** Events that we are holding back until the spooled GETINFO reply is
+   * complete, as strings; or NULL if there are none. */
+  smartlist_t *deferred_events;
+  /** Total length of the strings in deferred_events. */
+  size_t deferred_events_len;
+
   /** List of ephemeral onion services belonging to this connection. */
   smartlist_t *ephemeral_onion_services;
 
@@ -3195,6 +3265,11 @@ typedef struct circuit_t {
    * cleared after being sent to control port. */
   smartlist_t *testing_cell_stats;
 
+  /** Scheduling priority class of this circuit (one of
+   * MT_PRIORITY_CLASS_*), used by ewma_prio_policy.  A change takes effect
+   * the next time the circuit becomes active on a circuitmux. */
+  uint8_t mt_priority_class;
+
   /** If set, points to an HS token that this circuit might be carrying.
    *  Used by the HS circuitmap.  */
   hs_token_t *hs_token;
@@ -3283,6 +3358,11 @@ typedef struct origin_circuit_t {
    * to emit CIRC_BW events. */
   uint32_t n_written_circ_bw;
 
+  /** True iff this circuit is on the list of circuits whose
+   * n_read_circ_bw or n_written_circ_bw has changed since the last CIRC_BW
+   * event. */
+  unsigned int on_circ_bw_list:1;
+
   /** Build state for this circuit. It includes the intended path
    * length, the chosen exit router, rendezvous information, etc.
    */
@@ -3697,6 +3777,10 @@ typedef struct {
                           * each log message occurs? */
   int TruncateLogFile; /**< Boolean: Should we truncate the log file
                             before we start writing? */
+  int AsyncLogging; /**< Boolean: Should a separate thread write our
+                     * messages to log files? */
+  char *AsyncLogOverflow; /**< "drop" or "block": what to do when the log
+                           * writer thread falls behind. */
   char *SyslogIdentityTag; /**< Identity tag to add for syslog logging. */
 
   char *DebugLogFile; /**< Where to send verbose log messages. */
@@ -3799,6 +3883,10 @@ typedef struct {
   /** Above this value, consider ourselves low on RAM. */
   uint64_t MaxMemInQueues_low_threshold;
 
+  /** If nonzero, the most memory we let the v3 onion service descriptors in
+   * our HSDir cache take up. */
+  uint64_t MaxHSDirCacheSize;
+
   /** @name port booleans
    *
    * Derived booleans: For server ports and ControlPort, true iff there is a
@@ -4247,9 +4335,13 @@ typedef struct {
   /** If true, the user wants us to collect cell statistics. */
   int CellStatistics;
 
-  /** If true, the user wants us to collect moneTor statistics. */
+  /** Fraction of exit circuits for which we collect moneTor statistics. */
   double MoneTorStatistics;
 
+  /** Fraction of non-exit circuits for which we collect moneTor
+   * statistics. */
+  double MoneTorStatisticsMiddle;
+
   /** If true, the user wants us to collect padding statistics. */
   int PaddingStatistics;
 
@@ -4510,6 +4602,11 @@ typedef struct {
    */
   double CircuitPriorityHalflife;
 
+  /** If positive, the weight (at most 1.0) by which we multiply the EWMA
+   * cell count of premium circuits before comparing them with regular ones.
+   * If not positive, we use the value from the consensus. */
+  double CircuitPriorityPremiumScale;
+
   /** Set to true if the TestingTorNetwork configuration option is set.
    * This is used so that options_validate() has a chance to realize that
    * the defaults have changed. */
@@ -4688,6 +4785,16 @@ typedef struct {
   /** A multiplier for the KIST per-socket limit calculation. */
   double KISTSockBufSizeFactor;
 
+  /** Bool (default: 0). If set, collect the read and write events of OR and
+   * edge connections during each main loop iteration and handle them
+   * together: read all sockets, then process all inbufs, then flush. */
+  int BatchConnectionIO;
+
+  /** Bool (default: 0). If set, and OpenSSL and the kernel support it, let
+   * the kernel encrypt and decrypt TLS records on OR connections once their
+   * handshake is done. */
+  int KernelTLS;
+
   /** The list of scheduler type string ordered by priority that is first one
    * has to be tried first. Default: KIST,KISTLite,Vanilla */
   smartlist_t *Schedulers;
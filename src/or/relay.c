@@ -153,9 +153,9 @@ relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
 {
   uint32_t received_integrity, calculated_integrity;
   relay_header_t rh;
-  crypto_digest_t *backup_digest=NULL;
+  crypto_digest_checkpoint_t backup_digest;
 
-  backup_digest = crypto_digest_dup(digest);
+  crypto_digest_checkpoint(&backup_digest, digest);
 
   relay_header_unpack(&rh, cell->payload);
   memcpy(&received_integrity, rh.integrity, 4);
@@ -173,14 +173,12 @@ relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
 //    log_fn(LOG_INFO,"Recognized=0 but bad digest. Not recognizing.");
 // (%d vs %d).", received_integrity, calculated_integrity);
     /* restore digest to its old form */
-    crypto_digest_assign(digest, backup_digest);
+    crypto_digest_restore(digest, &backup_digest);
     /* restore the relay header */
     memcpy(rh.integrity, &received_integrity, 4);
     relay_header_pack(cell->payload, &rh);
-    crypto_digest_free(backup_digest);
     return 0;
   }
-  crypto_digest_free(backup_digest);
   return 1;
 }
 
@@ -399,6 +397,7 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
   ++stats_n_relay_cells_relayed; /* XXXX no longer quite accurate {cells}
                                   * we might kill the circ before we relay
                                   * the cells. */
+  mt_stats_circ_relay(circ, cell_direction);
 
   append_cell_to_circuit_queue(circ, chan, cell, cell_direction, 0);
   return 0;
@@ -842,7 +841,7 @@ connection_edge_send_command(edge_connection_t *fromconn,
 #endif /* defined(MEASUREMENTS_21206) */
   if (relay_command == RELAY_COMMAND_DATA && !cpath_layer) {
     /** direction in */
-    mt_stats_circ_increment(circ);
+    mt_stats_circ_increment(circ, CELL_DIRECTION_IN);
   }
 
   return relay_send_command_from_edge(fromconn->stream_id, circ,
@@ -1665,7 +1664,7 @@ connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
       return connection_exit_begin_conn(cell, circ);
     case RELAY_COMMAND_DATA:
       ++stats_n_data_cells_received;
-      mt_stats_circ_increment(circ);
+      mt_stats_circ_increment(circ, CELL_DIRECTION_OUT);
       if (( layer_hint && --layer_hint->deliver_window < 0) ||
           (!layer_hint && --circ->deliver_window < 0)) {
         log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
@@ -2557,6 +2556,9 @@ cell_queues_check_size(void)
   size_t alloc = cell_queues_get_total_allocation();
   alloc += buf_get_total_allocation();
   alloc += tor_compress_get_total_allocation();
+  /* circuits_handle_oom() releases the idle connections' share of this
+   * before it kills anything. */
+  alloc += tor_tls_get_buffer_allocation();
   const size_t rend_cache_total = rend_cache_get_total_allocation();
   alloc += rend_cache_total;
   if (alloc >= get_options()->MaxMemInQueues_low_threshold) {
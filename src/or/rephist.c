@@ -1381,8 +1381,124 @@ static bw_array_t *dir_read_array = NULL;
     directory protocol. */
 static bw_array_t *dir_write_array = NULL;
 
+/** How many resolutions does the bandwidth series keep? */
+#define BW_SERIES_N_LEVELS 4
+
+/** How many slots does each resolution of the bandwidth series keep? A
+ * minute of 100ms slots, fifteen minutes of 1s slots, a day of 15m slots,
+ * and as many 4h slots as the bandwidth history above. */
+#define BW_SERIES_SLOTS_100MS 600
+#define BW_SERIES_SLOTS_1S 900
+#define BW_SERIES_SLOTS_15M 96
+#define BW_SERIES_SLOTS_4H NUM_TOTALS
+
+/** Names, slot lengths and slot counts for each resolution of the bandwidth
+ * series, finest first. The finest resolution is only as good as
+ * TokenBucketRefillInterval, since that's how often rep_hist_bw_tick() is
+ * called. */
+static const struct {
+  const char *name;
+  uint32_t slot_msec;
+  int n_slots;
+} bw_series_resolutions[BW_SERIES_N_LEVELS] = {
+  { "100ms", 100, BW_SERIES_SLOTS_100MS },
+  { "1s", 1000, BW_SERIES_SLOTS_1S },
+  { "15m", 15*60*1000, BW_SERIES_SLOTS_15M },
+  { "4h", NUM_SECS_BW_SUM_INTERVAL*1000, BW_SERIES_SLOTS_4H },
+};
+
+/** Total number of slots over all the resolutions of the bandwidth series.
+ * (derived) */
+#define BW_SERIES_N_SAMPLES \
+  (BW_SERIES_SLOTS_100MS + BW_SERIES_SLOTS_1S + BW_SERIES_SLOTS_15M + \
+   BW_SERIES_SLOTS_4H)
+
+/** Number of bytes read and written during one slot of a bandwidth series.
+ */
+typedef struct bw_sample_t {
+  uint64_t n_read;
+  uint64_t n_written;
+} bw_sample_t;
+
+/** One resolution of the bandwidth series: a circular array of samples. */
+typedef struct bw_series_level_t {
+  /** Which slot number (monotonic msec divided by slot length) does
+   * slots[cur_idx] cover? */
+  uint64_t cur_slot;
+  /** Current position in slots. */
+  int cur_idx;
+  /** How many members of slots hold observations? 0 if we haven't had a
+   * tick yet. */
+  int n_filled;
+  /** Circular array of samples, pointing into bw_series_t.samples. */
+  bw_sample_t *slots;
+} bw_series_level_t;
+
+/** Recent bandwidth history at several resolutions, for controllers. The
+ * rep_hist_note_*bytes_* functions only add to the pending counters here;
+ * rep_hist_bw_tick() moves those into the series and into the bw_arrays.
+ */
+typedef struct bw_series_t {
+  /** Bytes noted since the last tick. */
+  uint64_t pending_read;
+  uint64_t pending_written;
+  uint64_t pending_dir_read;
+  uint64_t pending_dir_written;
+  /** One entry per member of bw_series_resolutions. */
+  bw_series_level_t levels[BW_SERIES_N_LEVELS];
+  /** Storage for the slots of all the levels. */
+  bw_sample_t samples[BW_SERIES_N_SAMPLES];
+} bw_series_t;
+
+/** Our bandwidth series. */
+static bw_series_t bw_series;
+
+/** Forget everything in bw_series, and point its levels at their storage. */
+static void
+bw_series_init(void)
+{
+  int i;
+  bw_sample_t *next = bw_series.samples;
+  memset(&bw_series, 0, sizeof(bw_series));
+  for (i = 0; i < BW_SERIES_N_LEVELS; ++i) {
+    bw_series.levels[i].slots = next;
+    next += bw_series_resolutions[i].n_slots;
+  }
+  tor_assert(next == bw_series.samples + BW_SERIES_N_SAMPLES);
+}
+
+/** Move the current position of level <b>idx</b> of the bandwidth series
+ * forward to <b>slot</b>, clearing every slot we pass. */
+static void
+bw_series_level_advance(int idx, uint64_t slot)
+{
+  bw_series_level_t *l = &bw_series.levels[idx];
+  const int n_slots = bw_series_resolutions[idx].n_slots;
+  uint64_t steps;
+
+  if (!l->n_filled) {
+    l->cur_slot = slot;
+    l->n_filled = 1;
+    return;
+  }
+  if (slot <= l->cur_slot)
+    return;
+
+  steps = slot - l->cur_slot;
+  if (steps > (uint64_t)n_slots)
+    steps = n_slots;
+  while (steps--) {
+    if (++l->cur_idx == n_slots)
+      l->cur_idx = 0;
+    memset(&l->slots[l->cur_idx], 0, sizeof(bw_sample_t));
+    if (l->n_filled < n_slots)
+      ++l->n_filled;
+  }
+  l->cur_slot = slot;
+}
+
 /** Set up [dir-]read_array and [dir-]write_array, freeing them if they
- * already exist. */
+ * already exist. Also clear the bandwidth series. */
 static void
 bw_arrays_init(void)
 {
@@ -1395,55 +1511,117 @@ bw_arrays_init(void)
   write_array = bw_array_new();
   dir_read_array = bw_array_new();
   dir_write_array = bw_array_new();
+
+  bw_series_init();
 }
 
-/** Remember that we read <b>num_bytes</b> bytes in second <b>when</b>.
- *
- * Add num_bytes to the current running total for <b>when</b>.
+/** Remember that we wrote <b>num_bytes</b> bytes.
  *
- * <b>when</b> can go back to time, but it's safe to ignore calls
- * earlier than the latest <b>when</b> you've heard of.
+ * This is called for every write, so all it does is add num_bytes to a
+ * pending total: rep_hist_bw_tick() attributes that total to the right
+ * second and slot later.
  */
 void
-rep_hist_note_bytes_written(size_t num_bytes, time_t when)
+rep_hist_note_bytes_written(size_t num_bytes)
 {
-/* Maybe a circular array for recent seconds, and step to a new point
- * every time a new second shows up. Or simpler is to just to have
- * a normal array and push down each item every second; it's short.
- */
-/* When a new second has rolled over, compute the sum of the bytes we've
- * seen over when-1 to when-1-NUM_SECS_ROLLING_MEASURE, and stick it
- * somewhere. See rep_hist_bandwidth_assess() below.
+  bw_series.pending_written += num_bytes;
+}
+
+/** Remember that we read <b>num_bytes</b> bytes.
+ * (like rep_hist_note_bytes_written() above)
  */
-  add_obs(write_array, when, num_bytes);
+void
+rep_hist_note_bytes_read(size_t num_bytes)
+{
+  bw_series.pending_read += num_bytes;
 }
 
-/** Remember that we wrote <b>num_bytes</b> bytes in second <b>when</b>.
+/** Remember that we wrote <b>num_bytes</b> directory bytes.
  * (like rep_hist_note_bytes_written() above)
  */
 void
-rep_hist_note_bytes_read(size_t num_bytes, time_t when)
+rep_hist_note_dir_bytes_written(size_t num_bytes)
 {
-/* if we're smart, we can make this func and the one above share code */
-  add_obs(read_array, when, num_bytes);
+  bw_series.pending_dir_written += num_bytes;
 }
 
-/** Remember that we wrote <b>num_bytes</b> directory bytes in second
- * <b>when</b>. (like rep_hist_note_bytes_written() above)
+/** Remember that we read <b>num_bytes</b> directory bytes.
+ * (like rep_hist_note_bytes_written() above)
  */
 void
-rep_hist_note_dir_bytes_written(size_t num_bytes, time_t when)
+rep_hist_note_dir_bytes_read(size_t num_bytes)
 {
-  add_obs(dir_write_array, when, num_bytes);
+  bw_series.pending_dir_read += num_bytes;
 }
 
-/** Remember that we read <b>num_bytes</b> directory bytes in second
- * <b>when</b>. (like rep_hist_note_bytes_written() above)
+/** Move all the bytes noted since the last call into the bandwidth history:
+ * the per-second bw_arrays as of second <b>now</b>, and every resolution of
+ * the bandwidth series as of monotonic time <b>now_msec</b>. Called
+ * periodically from the token bucket refill timer.
  */
 void
-rep_hist_note_dir_bytes_read(size_t num_bytes, time_t when)
+rep_hist_bw_tick(uint64_t now_msec, time_t now)
+{
+  int i;
+  const uint64_t n_read = bw_series.pending_read;
+  const uint64_t n_written = bw_series.pending_written;
+
+  /* Empty ticks still move the bw_arrays forward, so that the seconds we
+   * were idle count as zeros. */
+  add_obs(read_array, now, n_read);
+  add_obs(write_array, now, n_written);
+  add_obs(dir_read_array, now, bw_series.pending_dir_read);
+  add_obs(dir_write_array, now, bw_series.pending_dir_written);
+
+  for (i = 0; i < BW_SERIES_N_LEVELS; ++i) {
+    bw_series_level_t *l = &bw_series.levels[i];
+    bw_series_level_advance(i, now_msec / bw_series_resolutions[i].slot_msec);
+    l->slots[l->cur_idx].n_read += n_read;
+    l->slots[l->cur_idx].n_written += n_written;
+  }
+
+  bw_series.pending_read = bw_series.pending_written = 0;
+  bw_series.pending_dir_read = bw_series.pending_dir_written = 0;
+}
+
+/** Return a newly allocated string listing the bytes read and written in
+ * each slot of the bandwidth series with resolution <b>resolution</b> (one
+ * of "100ms", "1s", "15m" or "4h"), oldest first, as space-separated
+ * "read,written" pairs. The last pair is for the current, incomplete slot.
+ * Return NULL if we don't know that resolution. */
+char *
+rep_hist_get_bw_series(const char *resolution)
 {
-  add_obs(dir_read_array, when, num_bytes);
+  int i, j, idx;
+  const bw_series_level_t *l = NULL;
+  smartlist_t *elements;
+  char *result;
+
+  for (i = 0; i < BW_SERIES_N_LEVELS; ++i) {
+    if (!strcmp(resolution, bw_series_resolutions[i].name)) {
+      l = &bw_series.levels[i];
+      break;
+    }
+  }
+  if (!l)
+    return NULL;
+
+  elements = smartlist_new();
+  idx = l->cur_idx - l->n_filled + 1;
+  if (idx < 0)
+    idx += bw_series_resolutions[i].n_slots;
+  for (j = 0; j < l->n_filled; ++j) {
+    smartlist_add_asprintf(elements, U64_FORMAT","U64_FORMAT,
+                           U64_PRINTF_ARG(l->slots[idx].n_read),
+                           U64_PRINTF_ARG(l->slots[idx].n_written));
+    if (++idx == bw_series_resolutions[i].n_slots)
+      idx = 0;
+  }
+
+  result = smartlist_join_strings(elements, " ", 0, NULL);
+  SMARTLIST_FOREACH(elements, char *, cp, tor_free(cp));
+  smartlist_free(elements);
+  return result;
 }
 
 /** Helper: Return the largest value in b->maxima.  (This is equal to the
@@ -21,13 +21,15 @@ void rep_hist_note_extend_succeeded(const char *from_name,
                                     const char *to_name);
 void rep_hist_note_extend_failed(const char *from_name, const char *to_name);
 void rep_hist_dump_stats(time_t now, int severity);
-void rep_hist_note_bytes_read(size_t num_bytes, time_t when);
-void rep_hist_note_bytes_written(size_t num_bytes, time_t when);
+void rep_hist_note_bytes_read(size_t num_bytes);
+void rep_hist_note_bytes_written(size_t num_bytes);
 
 void rep_hist_make_router_pessimal(const char *id, time_t when);
 
-void rep_hist_note_dir_bytes_read(size_t num_bytes, time_t when);
-void rep_hist_note_dir_bytes_written(size_t num_bytes, time_t when);
+void rep_hist_note_dir_bytes_read(size_t num_bytes);
+void rep_hist_note_dir_bytes_written(size_t num_bytes);
+void rep_hist_bw_tick(uint64_t now_msec, time_t now);
+char *rep_hist_get_bw_series(const char *resolution);
 
 int rep_hist_bandwidth_assess(void);
 char *rep_hist_get_bandwidth_lines(void);
@@ -17,6 +17,10 @@
  * malleable.)
  *
  * This module is used from rendservice.c.
+ *
+ * Digests are truncated and kept in small open addressing hash sets, one per
+ * slice of the horizon ("generation").  Scrubbing never looks at individual
+ * entries: it drops the generations that only hold aged out digests.
  */
 
 #define REPLAYCACHE_PRIVATE
@@ -24,6 +28,147 @@
 #include "or.h"
 #include "replaycache.h"
 
+/** Initial number of slots of a replay cache generation. */
+#define REPLAYCACHE_GEN_MIN_SLOTS 64
+
+/** Allocate a new, empty replay cache generation started at <b>started</b>.
+ */
+static replaycache_gen_t *
+replaycache_gen_new(time_t started)
+{
+  replaycache_gen_t *gen = tor_malloc_zero(sizeof(*gen));
+  gen->started = started;
+  gen->last_seen = started;
+  gen->n_slots = REPLAYCACHE_GEN_MIN_SLOTS;
+  gen->slots = tor_calloc(gen->n_slots, sizeof(replaycache_entry_t));
+  return gen;
+}
+
+/** Free the replay cache generation <b>gen</b>. */
+static void
+replaycache_gen_free(replaycache_gen_t *gen)
+{
+  if (!gen)
+    return;
+  tor_free(gen->slots);
+  tor_free(gen);
+}
+
+/** Return the slot of <b>gen</b> holding <b>digest</b> or the empty slot
+ * where it would go if it's not there. The digests come from data we are
+ * sent so the slot index is keyed to make it impossible to aim at a given
+ * slot. */
+static replaycache_entry_t *
+replaycache_gen_lookup(const replaycache_gen_t *gen, const uint8_t *digest)
+{
+  unsigned int mask = gen->n_slots - 1;
+  unsigned int idx = (unsigned int)
+    siphash24g(digest, REPLAYCACHE_DIGEST_LEN) & mask;
+
+  /* There is always at least one empty slot so this terminates. */
+  for (;;) {
+    replaycache_entry_t *slot = &gen->slots[idx];
+    if (tor_mem_is_zero((const char *) slot->digest, REPLAYCACHE_DIGEST_LEN) ||
+        fast_memeq(slot->digest, digest, REPLAYCACHE_DIGEST_LEN)) {
+      return slot;
+    }
+    idx = (idx + 1) & mask;
+  }
+}
+
+/** Double the number of slots of <b>gen</b>. */
+static void
+replaycache_gen_grow(replaycache_gen_t *gen)
+{
+  replaycache_entry_t *old_slots = gen->slots;
+  unsigned int old_n_slots = gen->n_slots;
+
+  gen->n_slots *= 2;
+  gen->slots = tor_calloc(gen->n_slots, sizeof(replaycache_entry_t));
+  for (unsigned int i = 0; i < old_n_slots; i++) {
+    if (tor_mem_is_zero((const char *) old_slots[i].digest,
+                        REPLAYCACHE_DIGEST_LEN)) {
+      continue;
+    }
+    memcpy(replaycache_gen_lookup(gen, old_slots[i].digest), &old_slots[i],
+           sizeof(replaycache_entry_t));
+  }
+  tor_free(old_slots);
+}
+
+/** Return the entry for <b>digest</b> in <b>gen</b>, adding it if needed.
+ * A new entry has a seen time of zero. */
+static replaycache_entry_t *
+replaycache_gen_add(replaycache_gen_t *gen, const uint8_t *digest)
+{
+  replaycache_entry_t *slot = replaycache_gen_lookup(gen, digest);
+
+  if (!tor_mem_is_zero((const char *) slot->digest, REPLAYCACHE_DIGEST_LEN)) {
+    return slot;
+  }
+  /* Keep the load factor under 3/4. */
+  if ((gen->n_entries + 1) * 4 > gen->n_slots * 3) {
+    replaycache_gen_grow(gen);
+    slot = replaycache_gen_lookup(gen, digest);
+  }
+  memcpy(slot->digest, digest, REPLAYCACHE_DIGEST_LEN);
+  slot->seen = 0;
+  gen->n_entries++;
+  return slot;
+}
+
+/** Return the entry for <b>digest</b> in <b>gen</b> or NULL if it's not in
+ * there. */
+static replaycache_entry_t *
+replaycache_gen_find(const replaycache_gen_t *gen, const uint8_t *digest)
+{
+  replaycache_entry_t *slot = replaycache_gen_lookup(gen, digest);
+  if (tor_mem_is_zero((const char *) slot->digest, REPLAYCACHE_DIGEST_LEN)) {
+    return NULL;
+  }
+  return slot;
+}
+
+/** Return <b>t</b> as stored in an entry of <b>r</b>. Times before the time
+ * base of the cache, which only happen if the clock jumps back, are stored
+ * as the time base. */
+static uint32_t
+replaycache_time_to_entry(const replaycache_t *r, time_t t)
+{
+  if (t <= r->time_base) {
+    return 0;
+  }
+  if (t - r->time_base > UINT32_MAX) {
+    return UINT32_MAX;
+  }
+  return (uint32_t) (t - r->time_base);
+}
+
+/** Return the generation of <b>r</b> new digests seen at <b>present</b>
+ * should go in, starting a new one if the current one is old enough. */
+static replaycache_gen_t *
+replaycache_get_current_gen(replaycache_t *r, time_t present)
+{
+  replaycache_gen_t *gen = NULL;
+  int n_gens = smartlist_len(r->generations);
+
+  if (n_gens > 0) {
+    gen = smartlist_get(r->generations, n_gens - 1);
+    /* If we never expire, everything goes in a single generation. */
+    if (r->horizon == 0) {
+      return gen;
+    }
+    time_t span = MAX(r->horizon / REPLAYCACHE_GENERATIONS_PER_HORIZON, 1);
+    if (present < gen->started + span) {
+      return gen;
+    }
+  }
+
+  gen = replaycache_gen_new(present);
+  smartlist_add(r->generations, gen);
+  return gen;
+}
+
 /** Free the replaycache r and all of its entries.
  */
 
@@ -35,7 +180,11 @@ replaycache_free(replaycache_t *r)
     return;
   }
 
-  if (r->digests_seen) digest256map_free(r->digests_seen, tor_free_);
+  if (r->generations) {
+    SMARTLIST_FOREACH(r->generations, replaycache_gen_t *, gen,
+                      replaycache_gen_free(gen));
+    smartlist_free(r->generations);
+  }
 
   tor_free(r);
 }
@@ -66,7 +215,8 @@ replaycache_new(time_t horizon, time_t interval)
   r->scrub_interval = interval;
   r->scrubbed = 0;
   r->horizon = horizon;
-  r->digests_seen = digest256map_new();
+  r->time_base = 0;
+  r->generations = smartlist_new();
 
  err:
   return r;
@@ -81,8 +231,11 @@ replaycache_add_and_test_internal(
     time_t *elapsed)
 {
   int rv = 0;
-  uint8_t digest[DIGEST256_LEN];
-  time_t *access_time;
+  uint8_t full_digest[DIGEST256_LEN];
+  uint8_t digest[REPLAYCACHE_DIGEST_LEN];
+  replaycache_gen_t *current_gen;
+  replaycache_entry_t *entry = NULL;
+  time_t access_time;
 
   /* sanity check */
   if (present <= 0 || !r || !data || len == 0) {
@@ -91,25 +244,53 @@ replaycache_add_and_test_internal(
     goto done;
   }
 
-  /* compute digest */
-  crypto_digest256((char *)digest, (const char *)data, len, DIGEST_SHA256);
+  /* compute digest, keeping only its beginning: a truncated SHA256 is still
+   * far too long to ever collide by chance. */
+  crypto_digest256((char *)full_digest, (const char *)data, len,
+                   DIGEST_SHA256);
+  memcpy(digest, full_digest, sizeof(digest));
+  /* An all zero digest marks an empty slot. */
+  if (tor_mem_is_zero((const char *) digest, sizeof(digest))) {
+    digest[0] = 1;
+  }
 
-  /* check map */
-  access_time = digest256map_get(r->digests_seen, digest);
+  if (r->time_base == 0) {
+    r->time_base = present;
+  }
+  current_gen = replaycache_get_current_gen(r, present);
+
+  /* check generations, newest first: the first match we find is the last
+   * time we saw this digest. */
+  for (int i = smartlist_len(r->generations) - 1; i >= 0; i--) {
+    replaycache_gen_t *gen = smartlist_get(r->generations, i);
+    entry = replaycache_gen_find(gen, digest);
+    if (entry) {
+      /* Keep the entry current if it has to be updated below. */
+      if (gen != current_gen) {
+        time_t seen = r->time_base + entry->seen;
+        if (seen < present) {
+          entry = replaycache_gen_add(current_gen, digest);
+          entry->seen = replaycache_time_to_entry(r, seen);
+        }
+      }
+      break;
+    }
+  }
 
   /* seen before? */
-  if (access_time != NULL) {
+  if (entry != NULL) {
+    access_time = r->time_base + entry->seen;
     /*
      * If it's far enough in the past, no hit.  If the horizon is zero, we
      * never expire.
      */
-    if (*access_time >= present - r->horizon || r->horizon == 0) {
+    if (access_time >= present - r->horizon || r->horizon == 0) {
       /* replay cache hit, return 1 */
       rv = 1;
       /* If we want to output an elapsed time, do so */
       if (elapsed) {
-        if (present >= *access_time) {
-          *elapsed = present - *access_time;
+        if (present >= access_time) {
+          *elapsed = present - access_time;
         } else {
           /* We shouldn't really be seeing hits from the future, but... */
           *elapsed = 0;
@@ -119,14 +300,16 @@ replaycache_add_and_test_internal(
     /*
      * If it's ahead of the cached time, update
      */
-    if (*access_time < present) {
-      *access_time = present;
+    if (access_time < present) {
+      entry->seen = replaycache_time_to_entry(r, present);
     }
   } else {
-    /* No, so no hit and update the digest map with the current time */
-    access_time = tor_malloc(sizeof(*access_time));
-    *access_time = present;
-    digest256map_set(r->digests_seen, digest, access_time);
+    /* No, so no hit and add the digest with the current time */
+    entry = replaycache_gen_add(current_gen, digest);
+    entry->seen = replaycache_time_to_entry(r, present);
+  }
+  if (current_gen->last_seen < present) {
+    current_gen->last_seen = present;
   }
 
   /* now scrub the cache if it's time */
@@ -142,13 +325,8 @@ replaycache_add_and_test_internal(
 STATIC void
 replaycache_scrub_if_needed_internal(time_t present, replaycache_t *r)
 {
-  digest256map_iter_t *itr = NULL;
-  const uint8_t *digest;
-  void *valp;
-  time_t *access_time;
-
   /* sanity check */
-  if (!r || !(r->digests_seen)) {
+  if (!r || !(r->generations)) {
     log_info(LD_BUG, "replaycache_scrub_if_needed_internal() called with"
         " stupid parameters; please fix this.");
     return;
@@ -160,27 +338,31 @@ replaycache_scrub_if_needed_internal(time_t present, replaycache_t *r)
   /* if we're never expiring, don't bother scrubbing */
   if (r->horizon == 0) return;
 
-  /* okay, scrub time */
-  itr = digest256map_iter_init(r->digests_seen);
-  while (!digest256map_iter_done(itr)) {
-    digest256map_iter_get(itr, &digest, &valp);
-    access_time = (time_t *)valp;
-    /* aged out yet? */
-    if (*access_time < present - r->horizon) {
-      /* Advance the iterator and remove this one */
-      itr = digest256map_iter_next_rmv(r->digests_seen, itr);
-      /* Free the value removed */
-      tor_free(access_time);
-    } else {
-      /* Just advance the iterator */
-      itr = digest256map_iter_next(r->digests_seen, itr);
+  /* okay, scrub time: a generation can go as a whole once everything in it
+   * has aged out. */
+  SMARTLIST_FOREACH_BEGIN(r->generations, replaycache_gen_t *, gen) {
+    if (gen->last_seen < present - r->horizon) {
+      SMARTLIST_DEL_CURRENT_KEEPORDER(r->generations, gen);
+      replaycache_gen_free(gen);
     }
-  }
+  } SMARTLIST_FOREACH_END(gen);
 
   /* update scrubbed timestamp */
   if (present > r->scrubbed) r->scrubbed = present;
 }
 
+#ifdef TOR_UNIT_TESTS
+/** Return the number of entries held by <b>r</b>. */
+STATIC unsigned int
+replaycache_get_n_entries(const replaycache_t *r)
+{
+  unsigned int n = 0;
+  SMARTLIST_FOREACH(r->generations, const replaycache_gen_t *, gen,
+                    n += gen->n_entries);
+  return n;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
 /** Test the buffer of length len point to by data against the replay cache r;
  * the digest of the buffer will be added to the cache at the current time,
  * and the function will return 1 if it was already seen within the cache's
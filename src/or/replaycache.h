@@ -13,6 +13,32 @@ typedef struct replaycache_s replaycache_t;
 
 #ifdef REPLAYCACHE_PRIVATE
 
+/* Number of bytes of the SHA256 digest of an item that we keep. */
+#define REPLAYCACHE_DIGEST_LEN 12
+
+/* Number of generations a horizon is split into. */
+#define REPLAYCACHE_GENERATIONS_PER_HORIZON 4
+
+/* A digest in a replay cache generation. */
+typedef struct replaycache_entry_t {
+  /* Truncated digest; all zeroes means the slot is empty. */
+  uint8_t digest[REPLAYCACHE_DIGEST_LEN];
+  /* When it was last seen, in seconds since the cache time base. */
+  uint32_t seen;
+} replaycache_entry_t;
+
+/* The digests seen during a span of time, in an open addressing hash set. */
+typedef struct replaycache_gen_t {
+  /* When this generation was started. */
+  time_t started;
+  /* The latest time any of its digest was seen. */
+  time_t last_seen;
+  /* Number of used slots and total number of slots (a power of two). */
+  unsigned int n_entries;
+  unsigned int n_slots;
+  replaycache_entry_t *slots;
+} replaycache_gen_t;
+
 struct replaycache_s {
   /* Scrub interval */
   time_t scrub_interval;
@@ -23,10 +49,14 @@ struct replaycache_s {
    * (don't return true on digests in the cache but older than this)
    */
   time_t horizon;
+  /* Time the entry times are relative to, set on the first add. */
+  time_t time_base;
   /*
-   * Digest map: keys are digests, values are times the digest was last seen
+   * Generations of replaycache_gen_t, oldest first. A new one is started
+   * every horizon / REPLAYCACHE_GENERATIONS_PER_HORIZON seconds and scrubbing
+   * drops the ones only holding digests older than the horizon.
    */
-  digest256map_t *digests_seen;
+  smartlist_t *generations;
 };
 
 #endif /* defined(REPLAYCACHE_PRIVATE) */
@@ -50,6 +80,9 @@ STATIC int replaycache_add_and_test_internal(
     time_t *elapsed);
 STATIC void replaycache_scrub_if_needed_internal(
     time_t present, replaycache_t *r);
+#ifdef TOR_UNIT_TESTS
+STATIC unsigned int replaycache_get_n_entries(const replaycache_t *r);
+#endif
 
 #endif /* defined(REPLAYCACHE_PRIVATE) */
 
@@ -138,9 +138,12 @@ log_heartbeat(time_t now)
                         overhead_pct > TLS_OVERHEAD_THRESHOLD)
     ? LOG_NOTICE : LOG_INFO;
 
+  char *tls_buf_mem = bytes_to_usage(tor_tls_get_buffer_allocation());
   log_fn(severity, LD_HEARTBEAT,
          "Average packaged cell fullness: %2.3f%%. "
-         "TLS write overhead: %.f%%", fullness_pct, overhead_pct);
+         "TLS write overhead: %.f%%. TLS buffer memory: %s",
+         fullness_pct, overhead_pct, tls_buf_mem);
+  tor_free(tls_buf_mem);
 
   if (public_server_mode(options)) {
     rep_hist_log_circuit_handshake_stats(now);
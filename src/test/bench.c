@@ -24,11 +24,20 @@ const char tor_git_revision[] = "";
 #include <openssl/ecdh.h>
 #include <openssl/obj_mac.h>
 
+#include "buffers.h"
+#include "buffers_tls.h"
+#include "circuitmux.h"
+#include "circuitmux_ewma.h"
 #include "config.h"
 #include "crypto_curve25519.h"
 #include "onion_ntor.h"
 #include "crypto_ed25519.h"
 #include "consdiff.h"
+#include "hs_cache.h"
+#include "hs_common.h"
+#include "hs_descriptor.h"
+#include "torcert.h"
+#include "workqueue.h"
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -112,6 +121,106 @@ bench_aes(void)
   crypto_cipher_free(c);
 }
 
+static void
+bench_rand(void)
+{
+  const int iters = 1<<18;
+  uint8_t buf[1024];
+  uint64_t start, end;
+  size_t len;
+  int i;
+  crypto_fast_rng_t *rng = get_thread_fast_rng();
+  reset_perftime();
+
+  for (len = 4; len <= sizeof(buf); len *= 4) {
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      crypto_rand((char*)buf, len);
+    }
+    end = perftime();
+    printf("crypto_rand, %d bytes: %.2f nsec per call\n", (int)len,
+           NANOCOUNT(start, end, iters));
+
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      crypto_fast_rng_getbytes(rng, buf, len);
+    }
+    end = perftime();
+    printf("crypto_fast_rng_getbytes, %d bytes: %.2f nsec per call\n",
+           (int)len, NANOCOUNT(start, end, iters));
+  }
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    (void) crypto_rand_int(1000);
+  }
+  end = perftime();
+  printf("crypto_rand_int: %.2f nsec per call\n",
+         NANOCOUNT(start, end, iters));
+}
+
+static void
+bench_codecs(void)
+{
+  const size_t lens[] = { 20, 32, 256, 4096 };
+  const int bytes_per_iter = (1<<23);
+  const char *level_names[] = { "scalar", "ssse3", "avx2" };
+  const int best = base_codec_set_max_level(-1);
+  uint8_t *raw = tor_malloc(4096);
+  char *b64 = tor_malloc(base64_encode_size(4096, 0) + 1);
+  char *b16 = tor_malloc(BASE16_BUFSIZE(4096));
+  char *dec = tor_malloc(4096);
+  uint64_t start, end;
+  int level, i;
+  unsigned j;
+
+  crypto_rand((char*)raw, 4096);
+  reset_perftime();
+
+  for (level = BASE_CODEC_SCALAR; level <= best; ++level) {
+    base_codec_set_max_level(level);
+    for (j = 0; j < ARRAY_LENGTH(lens); ++j) {
+      const size_t len = lens[j];
+      const int iters = (int)(bytes_per_iter / len);
+      const size_t b64len = base64_encode_size(len, 0);
+
+      start = perftime();
+      for (i = 0; i < iters; ++i)
+        base64_encode(b64, b64len + 1, (char*)raw, len, 0);
+      end = perftime();
+      printf("%s base64_encode, %d bytes: %.2f nsec per byte\n",
+             level_names[level], (int)len, NANOCOUNT(start, end, iters*len));
+
+      start = perftime();
+      for (i = 0; i < iters; ++i)
+        base64_decode(dec, len, b64, b64len);
+      end = perftime();
+      printf("%s base64_decode, %d bytes: %.2f nsec per byte\n",
+             level_names[level], (int)len, NANOCOUNT(start, end, iters*len));
+
+      start = perftime();
+      for (i = 0; i < iters; ++i)
+        base16_encode(b16, BASE16_BUFSIZE(len), (char*)raw, len);
+      end = perftime();
+      printf("%s base16_encode, %d bytes: %.2f nsec per byte\n",
+             level_names[level], (int)len, NANOCOUNT(start, end, iters*len));
+
+      start = perftime();
+      for (i = 0; i < iters; ++i)
+        base16_decode(dec, len, b16, BASE16_LEN(len));
+      end = perftime();
+      printf("%s base16_decode, %d bytes: %.2f nsec per byte\n",
+             level_names[level], (int)len, NANOCOUNT(start, end, iters*len));
+    }
+  }
+
+  base_codec_set_max_level(-1);
+  tor_free(raw);
+  tor_free(b64);
+  tor_free(b16);
+  tor_free(dec);
+}
+
 static void
 bench_onion_TAP(void)
 {
@@ -486,6 +595,56 @@ bench_digest(void)
              lens[i], NANOCOUNT(start,end,N));
     }
   }
+
+  /* Running digests, updated one relay payload at a time, the way we keep
+   * relay cell digests. */
+  {
+    const digest_algorithm_t running_algs[] = {
+      DIGEST_SHA1, DIGEST_SHA3_256
+    };
+    for (int a = 0; a < 2; ++a) {
+      crypto_digest_t *d = (running_algs[a] == DIGEST_SHA1) ?
+        crypto_digest_new() : crypto_digest256_new(running_algs[a]);
+      reset_perftime();
+      start = perftime();
+      for (int j = 0; j < N; ++j) {
+        crypto_digest_add_bytes(d, buf, RELAY_PAYLOAD_SIZE);
+      }
+      end = perftime();
+      printf("%s running, per %d-byte update: %.2f ns\n",
+             crypto_digest_algorithm_get_name(running_algs[a]),
+             RELAY_PAYLOAD_SIZE, NANOCOUNT(start,end,N));
+      crypto_digest_free(d);
+    }
+  }
+
+  /* One-shot SHA3 over consensus-sized inputs, against the incremental
+   * (always keccak-tiny) implementation. */
+  {
+    const size_t biglen = 1<<20;
+    const int big_N = 50;
+    char *big = tor_malloc(biglen);
+    crypto_rand(big, biglen);
+    reset_perftime();
+    start = perftime();
+    for (int j = 0; j < big_N; ++j) {
+      crypto_digest256(out, big, biglen, DIGEST_SHA3_256);
+    }
+    end = perftime();
+    printf("sha3-256 one-shot(%d): %.2f nsec per byte\n", (int)biglen,
+           NANOCOUNT(start, end, big_N * (double)biglen));
+    start = perftime();
+    for (int j = 0; j < big_N; ++j) {
+      crypto_digest_t *d = crypto_digest256_new(DIGEST_SHA3_256);
+      crypto_digest_add_bytes(d, big, biglen);
+      crypto_digest_get_digest(d, out, DIGEST256_LEN);
+      crypto_digest_free(d);
+    }
+    end = perftime();
+    printf("sha3-256 keccak-tiny(%d): %.2f nsec per byte\n", (int)biglen,
+           NANOCOUNT(start, end, big_N * (double)biglen));
+    tor_free(big);
+  }
 }
 
 static void
@@ -532,6 +691,56 @@ bench_cell_ops(void)
            NANOCOUNT(start,end,iters*CELL_PAYLOAD_SIZE));
   }
 
+  /* Now time cells that are actually for us, so that relay_crypt() has to
+   * check (and keep) the running digest. Generate them ahead of time the
+   * way the other end of the circuit would. */
+  {
+    const int n_cells = 1<<13;
+    cell_t *cells = tor_calloc(n_cells, sizeof(cell_t));
+    crypto_cipher_t *sender_crypto = crypto_cipher_new(key2);
+    crypto_digest_t *sender_digest = crypto_digest_new();
+    int n_recognized = 0;
+
+    crypto_cipher_free(or_circ->n_crypto);
+    crypto_digest_free(or_circ->n_digest);
+    or_circ->n_crypto = crypto_cipher_new(key2);
+    or_circ->n_digest = crypto_digest_new();
+
+    for (i = 0; i < n_cells; ++i) {
+      relay_header_t rh;
+      char integrity[4];
+      crypto_rand((char*)cells[i].payload, CELL_PAYLOAD_SIZE);
+      memset(&rh, 0, sizeof(rh));
+      rh.command = RELAY_COMMAND_DATA;
+      rh.length = RELAY_PAYLOAD_SIZE;
+      relay_header_pack(cells[i].payload, &rh);
+      crypto_digest_add_bytes(sender_digest, (char*)cells[i].payload,
+                              CELL_PAYLOAD_SIZE);
+      crypto_digest_get_digest(sender_digest, integrity, 4);
+      memcpy(rh.integrity, integrity, 4);
+      relay_header_pack(cells[i].payload, &rh);
+      crypto_cipher_crypt_inplace(sender_crypto, (char*)cells[i].payload,
+                                  CELL_PAYLOAD_SIZE);
+    }
+
+    start = perftime();
+    for (i = 0; i < n_cells; ++i) {
+      char recognized = 0;
+      crypt_path_t *layer_hint = NULL;
+      relay_crypt(TO_CIRCUIT(or_circ), &cells[i], CELL_DIRECTION_OUT,
+                  &layer_hint, &recognized);
+      n_recognized += recognized;
+    }
+    end = perftime();
+    tor_assert(n_recognized == n_cells);
+    printf("Recognized outbound cells: %.2f ns per cell.\n",
+           NANOCOUNT(start,end,n_cells));
+
+    crypto_cipher_free(sender_crypto);
+    crypto_digest_free(sender_digest);
+    tor_free(cells);
+  }
+
   crypto_digest_free(or_circ->p_digest);
   crypto_digest_free(or_circ->n_digest);
   crypto_cipher_free(or_circ->p_crypto);
@@ -540,6 +749,68 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+static void
+bench_cmux_prio(void)
+{
+  const int iters = 1<<18;
+  const int n_circs_list[] = { 10, 100, 1000 };
+  or_options_t *options = tor_malloc_zero(sizeof(or_options_t));
+  unsigned k;
+  int i, which;
+
+  options->CircuitPriorityHalflife = 30.0;
+  options->CircuitPriorityPremiumScale = 0.5;
+  cell_ewma_set_scale_factor(options, NULL);
+
+  reset_perftime();
+
+  for (which = 0; which <= 1; ++which) {
+    const circuitmux_policy_t *policy =
+      which ? &ewma_prio_policy : &ewma_policy;
+    for (k = 0; k < ARRAY_LENGTH(n_circs_list); ++k) {
+      const int n_circs = n_circs_list[k];
+      circuitmux_t *cmux = circuitmux_alloc();
+      circuitmux_policy_data_t *pol_data = policy->alloc_cmux_data(cmux);
+      circuitmux_policy_circ_data_t **circ_data =
+        tor_calloc(n_circs, sizeof(circuitmux_policy_circ_data_t *));
+      circuit_t *circs = tor_calloc(n_circs, sizeof(circuit_t));
+      uint64_t start, end;
+
+      for (i = 0; i < n_circs; ++i) {
+        /* One premium circuit in four */
+        circs[i].mt_priority_class = (i % 4 == 0) ?
+          MT_PRIORITY_CLASS_PREMIUM : MT_PRIORITY_CLASS_REGULAR;
+        circ_data[i] = policy->alloc_circ_data(cmux, pol_data, &circs[i],
+                                               CELL_DIRECTION_OUT, 1);
+        policy->notify_circ_active(cmux, pol_data, &circs[i], circ_data[i]);
+      }
+
+      start = perftime();
+      for (i = 0; i < iters; ++i) {
+        circuit_t *circ = policy->pick_active_circuit(cmux, pol_data);
+        policy->notify_xmit_cells(cmux, pol_data, circ,
+                                  circ_data[circ - circs], 1);
+      }
+      end = perftime();
+      printf("%s, %d circuits: %.2f ns per cell\n",
+             which ? "Priority-class EWMA" : "EWMA", n_circs,
+             NANOCOUNT(start, end, iters));
+
+      for (i = 0; i < n_circs; ++i) {
+        policy->notify_circ_inactive(cmux, pol_data, &circs[i],
+                                     circ_data[i]);
+        policy->free_circ_data(cmux, pol_data, &circs[i], circ_data[i]);
+      }
+      policy->free_cmux_data(cmux, pol_data);
+      tor_free(circ_data);
+      tor_free(circs);
+      circuitmux_free(cmux);
+    }
+  }
+
+  tor_free(options);
+}
+
 static void
 bench_dh(void)
 {
@@ -625,6 +896,348 @@ bench_ecdh_p224(void)
   bench_ecdh_impl(NID_secp224r1, "P-224");
 }
 
+/** Helper for bench_tls(): open a TCP connection to ourselves over the
+ * loopback interface, and store its two ends in <b>s_out</b>. Return 0 on
+ * success, -1 on failure. (We can't use a socketpair, since the kernel only
+ * does TLS on TCP sockets.) */
+static int
+bench_tls_loopback_pair(tor_socket_t s_out[2])
+{
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  tor_socket_t listener, client = TOR_INVALID_SOCKET;
+  int r = -1;
+
+  listener = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (!SOCKET_OK(listener))
+    return -1;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(listener, (struct sockaddr*)&sin, sizeof(sin)) < 0 ||
+      listen(listener, 1) < 0 ||
+      getsockname(listener, (struct sockaddr*)&sin, &len) < 0)
+    goto done;
+  client = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (!SOCKET_OK(client) ||
+      connect(client, (struct sockaddr*)&sin, sizeof(sin)) < 0)
+    goto done;
+  s_out[1] = tor_accept_socket(listener, NULL, NULL);
+  if (!SOCKET_OK(s_out[1]))
+    goto done;
+  s_out[0] = client;
+  client = TOR_INVALID_SOCKET;
+  set_socket_nonblocking(s_out[0]);
+  set_socket_nonblocking(s_out[1]);
+  r = 0;
+ done:
+  if (SOCKET_OK(client))
+    tor_close_socket(client);
+  tor_close_socket(listener);
+  return r;
+}
+
+/** Helper for bench_tls(): push <b>n_bytes</b> bytes from a client to a
+ * server over loopback TLS, with kernel TLS <b>use_ktls</b>, and report how
+ * much CPU time it took. */
+static void
+bench_tls_impl(int use_ktls, size_t n_bytes)
+{
+  tor_socket_t s[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  tor_tls_t *client = NULL, *server = NULL;
+  buf_t *outbuf = buf_new(), *inbuf = buf_new();
+  char *chunk = tor_malloc(4096);
+  size_t n_read = 0, flushlen;
+  int c_done = 0, s_done = 0;
+  uint64_t start, end;
+
+  tor_tls_set_ktls_enabled(use_ktls);
+  if (bench_tls_loopback_pair(s) < 0) {
+    puts("Skipping.  (Couldn't open a loopback TCP connection.)");
+    goto done;
+  }
+  client = tor_tls_new(s[0], 0);
+  server = tor_tls_new(s[1], 1);
+  if (!client || !server) {
+    puts("Skipping.  (Couldn't create TLS objects.)");
+    goto done;
+  }
+  while (!c_done || !s_done) {
+    int r;
+    if (!c_done) {
+      r = tor_tls_handshake(client);
+      if (r == TOR_TLS_DONE)
+        c_done = 1;
+      else if (TOR_TLS_IS_ERROR(r))
+        break;
+    }
+    if (!s_done) {
+      r = tor_tls_handshake(server);
+      if (r == TOR_TLS_DONE)
+        s_done = 1;
+      else if (TOR_TLS_IS_ERROR(r))
+        break;
+    }
+  }
+  if (!c_done || !s_done) {
+    puts("Skipping.  (TLS handshake failed.)");
+    goto done;
+  }
+  if (use_ktls && !(tor_tls_get_ktls_flags(client) & TOR_TLS_KTLS_SEND)) {
+    puts("Skipping kTLS.  (The kernel or the cipher doesn't support it.)");
+    goto done;
+  }
+
+  crypto_rand(chunk, 4096);
+  reset_perftime();
+  start = perftime();
+  while (n_read < n_bytes) {
+    int r;
+    while (buf_datalen(outbuf) < (1<<16))
+      buf_add(outbuf, chunk, 4096);
+    flushlen = buf_datalen(outbuf);
+    r = buf_flush_to_tls(outbuf, client, flushlen, &flushlen);
+    if (TOR_TLS_IS_ERROR(r))
+      break;
+    r = buf_read_from_tls(inbuf, server, 1<<16);
+    if (TOR_TLS_IS_ERROR(r) || r == TOR_TLS_CLOSE)
+      break;
+    if (r > 0)
+      n_read += r;
+    buf_clear(inbuf);
+  }
+  end = perftime();
+  printf("TLS over loopback, %s: %.2f ns per byte (%.1f MB/s of CPU)\n",
+         use_ktls ? "kernel TLS (send and receive as available)"
+                  : "userspace TLS",
+         NANOCOUNT(start, end, n_read),
+         n_read / (((double)(end - start)) / 1e9) / (1<<20));
+
+ done:
+  tor_tls_free(client);
+  tor_tls_free(server);
+  if (SOCKET_OK(s[0]))
+    tor_close_socket(s[0]);
+  if (SOCKET_OK(s[1]))
+    tor_close_socket(s[1]);
+  buf_free(outbuf);
+  buf_free(inbuf);
+  tor_free(chunk);
+  tor_tls_set_ktls_enabled(0);
+}
+
+/** Run loopback TLS throughput benchmarks, with and without kernel TLS. */
+static void
+bench_tls(void)
+{
+  crypto_pk_t *identity = crypto_pk_new();
+  const size_t n_bytes = 256<<20;
+
+  if (crypto_pk_generate_key(identity) < 0 ||
+      tor_tls_context_init(TOR_TLS_CTX_IS_PUBLIC_SERVER,
+                           NULL, identity, 86400) < 0) {
+    puts("Skipping.  (Couldn't set up a TLS context.)");
+    crypto_pk_free(identity);
+    return;
+  }
+  bench_tls_impl(0, n_bytes);
+  if (tor_tls_ktls_supported())
+    bench_tls_impl(1, n_bytes);
+  else
+    puts("Skipping kTLS.  (Not supported by this build.)");
+  crypto_pk_free(identity);
+}
+
+/** Helper for bench_hs_desc_decode(): return a new introduction point for a
+ * descriptor signed with <b>signing_kp</b>. */
+static hs_desc_intro_point_t *
+bench_hs_desc_intro_point(const ed25519_keypair_t *signing_kp, time_t now)
+{
+  hs_desc_intro_point_t *ip = hs_desc_intro_point_new();
+  hs_desc_link_specifier_t *ls = tor_malloc_zero(sizeof(*ls));
+  ed25519_keypair_t auth_kp, enc_kp;
+  curve25519_keypair_t curve25519_kp;
+  int signbit;
+
+  ls->type = LS_IPV4;
+  tor_addr_from_ipv4h(&ls->u.ap.addr, 0x01020304);
+  ls->u.ap.port = 9001;
+  smartlist_add(ip->link_specifiers, ls);
+
+  ed25519_keypair_generate(&auth_kp, 0);
+  ip->auth_key_cert = tor_cert_create(signing_kp, CERT_TYPE_AUTH_HS_IP_KEY,
+                                      &auth_kp.pubkey, now,
+                                      HS_DESC_CERT_LIFETIME,
+                                      CERT_FLAG_INCLUDE_SIGNING_KEY);
+  curve25519_keypair_generate(&curve25519_kp, 0);
+  ed25519_keypair_from_curve25519_keypair(&enc_kp, &signbit, &curve25519_kp);
+  ip->enc_key_cert = tor_cert_create(signing_kp, CERT_TYPE_CROSS_HS_IP_KEYS,
+                                     &enc_kp.pubkey, now,
+                                     HS_DESC_CERT_LIFETIME,
+                                     CERT_FLAG_INCLUDE_SIGNING_KEY);
+  return ip;
+}
+
+/** Helper for bench_hs_desc_decode(): encode a v3 descriptor with three
+ * introduction points into <b>encoded_out</b>, and store the subcredential
+ * needed to decrypt it in <b>subcred_out</b>. Return 0 on success. */
+static int
+bench_hs_desc_make(char **encoded_out, uint8_t *subcred_out)
+{
+  time_t now;
+  ed25519_keypair_t signing_kp, blinded_kp;
+  hs_descriptor_t *desc = tor_malloc_zero(sizeof(*desc));
+  int i, r;
+
+  /* Decoding checks certificate lifetimes against approx_time(). */
+  update_approx_time(time(NULL));
+  now = approx_time();
+  ed25519_keypair_generate(&signing_kp, 0);
+  hs_build_blinded_keypair(&signing_kp, NULL, 0,
+                           hs_get_time_period_num(now), &blinded_kp);
+  desc->plaintext_data.version = HS_DESC_SUPPORTED_FORMAT_VERSION_MAX;
+  memcpy(&desc->plaintext_data.signing_pubkey, &signing_kp.pubkey,
+         sizeof(ed25519_public_key_t));
+  memcpy(&desc->plaintext_data.blinded_pubkey, &blinded_kp.pubkey,
+         sizeof(ed25519_public_key_t));
+  desc->plaintext_data.signing_key_cert =
+    tor_cert_create(&blinded_kp, CERT_TYPE_SIGNING_HS_DESC,
+                    &signing_kp.pubkey, now, 3600,
+                    CERT_FLAG_INCLUDE_SIGNING_KEY);
+  desc->plaintext_data.revision_counter = 1;
+  desc->plaintext_data.lifetime_sec = 3 * 60 * 60;
+  hs_get_subcredential(&signing_kp.pubkey, &blinded_kp.pubkey,
+                       desc->subcredential);
+  memcpy(subcred_out, desc->subcredential, DIGEST256_LEN);
+
+  desc->encrypted_data.create2_ntor = 1;
+  desc->encrypted_data.intro_auth_types = smartlist_new();
+  smartlist_add(desc->encrypted_data.intro_auth_types, tor_strdup("ed25519"));
+  desc->encrypted_data.intro_points = smartlist_new();
+  for (i = 0; i < 3; ++i) {
+    smartlist_add(desc->encrypted_data.intro_points,
+                  bench_hs_desc_intro_point(&signing_kp, now));
+  }
+
+  r = hs_desc_encode_descriptor(desc, &signing_kp, encoded_out);
+  hs_descriptor_free(desc);
+  return r;
+}
+
+/** A descriptor for bench_hs_desc_decode() to decode in worker threads. */
+static const char *bench_hs_desc_encoded = NULL;
+static const uint8_t *bench_hs_desc_subcred = NULL;
+/** The size limit to decode it with, looked up on the main thread. */
+static size_t bench_hs_desc_max_len = 0;
+/** How many of the descriptors queued by bench_hs_desc_decode() are done? */
+static int bench_hs_desc_n_done = 0;
+
+static workqueue_reply_t
+bench_hs_desc_decode_threadfn(void *state, void *arg)
+{
+  hs_descriptor_t *desc = NULL;
+  (void)state;
+  (void)arg;
+  hs_desc_decode_descriptor_impl(bench_hs_desc_encoded, bench_hs_desc_subcred,
+                                 bench_hs_desc_max_len, &desc);
+  hs_descriptor_free(desc);
+  return WQ_RPL_REPLY;
+}
+
+static void *
+bench_hs_desc_thread_state_new(void *arg)
+{
+  (void)arg;
+  return NULL;
+}
+
+static void
+bench_hs_desc_thread_state_free(void *state)
+{
+  (void)state;
+}
+
+static void
+bench_hs_desc_decode_replyfn(void *arg)
+{
+  (void)arg;
+  ++bench_hs_desc_n_done;
+}
+
+/** Run benchmarks for decoding v3 onion service descriptors, on the main
+ * thread and spread over a pool of worker threads. */
+static void
+bench_hs_desc_decode(void)
+{
+  const int iters = 500;
+  char *encoded = NULL;
+  uint8_t subcred[DIGEST256_LEN];
+  hs_descriptor_t *desc = NULL;
+  monotime_t start_mono, end_mono;
+  uint64_t start, end;
+  int i, n_threads;
+  replyqueue_t *rq;
+  threadpool_t *pool;
+
+  if (bench_hs_desc_make(&encoded, subcred) < 0) {
+    puts("Skipping.  (Couldn't encode a descriptor.)");
+    return;
+  }
+  printf("Descriptor is %d bytes long.\n", (int) strlen(encoded));
+
+  reset_perftime();
+  start = perftime();
+  monotime_get(&start_mono);
+  for (i = 0; i < iters; ++i) {
+    if (hs_desc_decode_descriptor(encoded, subcred, &desc) < 0) {
+      puts("Decoding failed!");
+      goto done;
+    }
+    hs_descriptor_free(desc);
+  }
+  end = perftime();
+  monotime_get(&end_mono);
+  printf("Decode on the main thread: %.2f usec per descriptor "
+         "(%.2f usec of wall time)\n",
+         MICROCOUNT(start, end, iters),
+         monotime_diff_nsec(&start_mono, &end_mono) / 1e3 / iters);
+
+  n_threads = compute_num_cpus();
+  rq = replyqueue_new(0);
+  pool = threadpool_new(n_threads, rq, bench_hs_desc_thread_state_new,
+                        bench_hs_desc_thread_state_free, NULL);
+  if (!pool) {
+    puts("Skipping threads.  (Couldn't start a threadpool.)");
+    goto done;
+  }
+  bench_hs_desc_encoded = encoded;
+  bench_hs_desc_subcred = subcred;
+  bench_hs_desc_max_len = hs_cache_get_max_descriptor_size();
+  bench_hs_desc_n_done = 0;
+  monotime_get(&start_mono);
+  for (i = 0; i < iters; ++i) {
+    threadpool_queue_work(pool, bench_hs_desc_decode_threadfn,
+                          bench_hs_desc_decode_replyfn, NULL);
+  }
+  while (bench_hs_desc_n_done < iters) {
+    /* Wait for the workers to tell us that they have replies. */
+    tor_socket_t sock = replyqueue_get_socket(rq);
+    struct timeval tv = { 0, 10000 };
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+    select((int)sock + 1, &fds, NULL, NULL, &tv);
+    replyqueue_process(rq);
+  }
+  monotime_get(&end_mono);
+  printf("Decode on %d worker thread(s): %.2f usec of wall time per "
+         "descriptor\n", n_threads,
+         monotime_diff_nsec(&start_mono, &end_mono) / 1e3 / iters);
+
+ done:
+  tor_free(encoded);
+}
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -640,15 +1253,20 @@ static struct benchmark_t benchmarks[] = {
   ENT(siphash),
   ENT(digest),
   ENT(aes),
+  ENT(rand),
+  ENT(codecs),
   ENT(onion_TAP),
   ENT(onion_ntor),
   ENT(ed25519),
 
   ENT(cell_aes),
   ENT(cell_ops),
+  ENT(cmux_prio),
   ENT(dh),
   ENT(ecdh_p256),
   ENT(ecdh_p224),
+  ENT(tls),
+  ENT(hs_desc_decode),
   {NULL,NULL,0}
 };
 
@@ -714,6 +1332,10 @@ main(int argc, const char **argv)
 
   reset_perftime();
 
+  if (crypto_global_init(0, NULL, NULL) < 0) {
+    printf("Couldn't initialize crypto library; exiting.\n");
+    return 1;
+  }
   if (crypto_seed_rng() < 0) {
     printf("Couldn't seed RNG; exiting.\n");
     return 1;
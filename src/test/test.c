@@ -1142,6 +1142,54 @@ test_stats(void *arg)
   tor_free(s);
 }
 
+static void
+test_bw_series(void *arg)
+{
+  char *s = NULL;
+  const uint64_t start_ms = 1000000;
+  time_t now = 1281619650; /* 2010-08-12 13:27:30 UTC */
+  (void) arg;
+
+  rep_hist_init();
+  tt_ptr_op(rep_hist_get_bw_series("10ms"), OP_EQ, NULL);
+  s = rep_hist_get_bw_series("1s");
+  tt_str_op(s, OP_EQ, "");
+  tor_free(s);
+
+  /* Two ticks in the same 100ms slot add up. */
+  rep_hist_note_bytes_read(100);
+  rep_hist_note_bytes_written(10);
+  rep_hist_bw_tick(start_ms, now);
+  rep_hist_note_bytes_read(50);
+  rep_hist_bw_tick(start_ms + 50, now);
+  s = rep_hist_get_bw_series("100ms");
+  tt_str_op(s, OP_EQ, "150,10");
+  tor_free(s);
+
+  /* Skipped slots show up as zeros. */
+  rep_hist_note_bytes_written(7);
+  rep_hist_bw_tick(start_ms + 300, now);
+  s = rep_hist_get_bw_series("100ms");
+  tt_str_op(s, OP_EQ, "150,10 0,0 0,0 0,7");
+  tor_free(s);
+  s = rep_hist_get_bw_series("1s");
+  tt_str_op(s, OP_EQ, "150,17");
+  tor_free(s);
+
+  /* Moving past the whole ring keeps only the last minute. */
+  rep_hist_note_bytes_read(1);
+  rep_hist_bw_tick(start_ms + 3600*1000, now + 3600);
+  s = rep_hist_get_bw_series("100ms");
+  tt_int_op(strlen(s), OP_EQ, 599*4 + 3);
+  tt_str_op(s + strlen(s) - 8, OP_EQ, " 0,0 1,0");
+  tor_free(s);
+  s = rep_hist_get_bw_series("4h");
+  tt_str_op(s, OP_EQ, "151,17");
+
+ done:
+  tor_free(s);
+}
+
 #define ENT(name)                                                       \
   { #name, test_ ## name , 0, NULL, NULL }
 #define FORK(name)                                                      \
@@ -1158,6 +1206,7 @@ static struct testcase_t test_array[] = {
   ENT(geoip),
   FORK(geoip_with_pt),
   FORK(stats),
+  FORK(bw_series),
 
   END_OF_TESTCASES
 };
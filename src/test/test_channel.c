@@ -70,7 +70,9 @@ static void test_channel_incoming(void *arg);
 static void test_channel_lifecycle(void *arg);
 static void test_channel_multi(void *arg);
 static void test_channel_queue_incoming(void *arg);
+static void test_channel_queue_ring(void *arg);
 static void test_channel_queue_size(void *arg);
+static void test_channel_queue_throughput(void *arg);
 static void test_channel_write(void *arg);
 
 static void
@@ -445,9 +447,8 @@ free_fake_channel(channel_t *chan)
   TOR_SIMPLEQ_FOREACH_SAFE(cell, &chan->incoming_queue, next, cell_tmp) {
       cell_queue_entry_free(cell, 0);
   }
-  TOR_SIMPLEQ_FOREACH_SAFE(cell, &chan->outgoing_queue, next, cell_tmp) {
-      cell_queue_entry_free(cell, 0);
-  }
+  channel_outgoing_queue_clear(chan);
+  tor_free(chan->outgoing_ring);
 
   tor_free(chan);
 }
@@ -691,7 +692,7 @@ test_channel_flush(void *arg)
   tt_int_op(test_cells_written, OP_EQ, init_count + 3);
 
  done:
-  tor_free(ch);
+  free_fake_channel(ch);
 
   return;
 }
@@ -736,7 +737,7 @@ test_channel_flushmux(void *arg)
   /* Now try it without accepting to force them into the queue */
   test_chan_accept_cells = 0;
   test_cmux_cells = 1;
-  q_len_before = chan_cell_queue_len(&(ch->outgoing_queue));
+  q_len_before = channel_outgoing_queue_len(ch);
 
   result = channel_flush_some_cells(ch, 1);
 
@@ -746,22 +747,20 @@ test_channel_flushmux(void *arg)
   /* But we should have gotten to the fake cellgen loop */
   tt_int_op(test_cmux_cells, OP_EQ, 0);
   /* ...and we should have a queued cell */
-  q_len_after = chan_cell_queue_len(&(ch->outgoing_queue));
+  q_len_after = channel_outgoing_queue_len(ch);
   tt_int_op(q_len_after, OP_EQ, q_len_before + 1);
 
   /* Now accept cells again and drain the queue */
   test_chan_accept_cells = 1;
   channel_flush_cells(ch);
   tt_int_op(test_cells_written, OP_EQ, old_count + 2);
-  tt_int_op(chan_cell_queue_len(&(ch->outgoing_queue)), OP_EQ, 0);
+  tt_int_op(channel_outgoing_queue_len(ch), OP_EQ, 0);
 
   test_target_cmux = NULL;
   test_cmux_cells = 0;
 
  done:
-  if (ch)
-    circuitmux_free(ch->cmux);
-  tor_free(ch);
+  free_fake_channel(ch);
 
   UNMOCK(channel_flush_from_first_active_circuit);
   UNMOCK(circuitmux_num_cells);
@@ -1300,7 +1299,7 @@ test_channel_queue_impossible(void *arg)
   old_count = test_cells_written;
 
   /* Assert that the queue is initially empty */
-  tt_int_op(chan_cell_queue_len(&(ch->outgoing_queue)), OP_EQ, 0);
+  tt_int_op(channel_outgoing_queue_len(ch), OP_EQ, 0);
 
   /* Get a fresh cell and write it to the channel*/
   cell = tor_malloc_zero(sizeof(cell_t));
@@ -1309,8 +1308,8 @@ test_channel_queue_impossible(void *arg)
   channel_write_cell(ch, cell);
 
   /* Now it should be queued */
-  tt_int_op(chan_cell_queue_len(&(ch->outgoing_queue)), OP_EQ, 1);
-  q = TOR_SIMPLEQ_FIRST(&(ch->outgoing_queue));
+  tt_int_op(channel_outgoing_queue_len(ch), OP_EQ, 1);
+  q = channel_outgoing_queue_first(ch);
   tt_assert(q);
   if (q) {
     tt_int_op(q->type, OP_EQ, CELL_QUEUE_FIXED);
@@ -1327,7 +1326,7 @@ test_channel_queue_impossible(void *arg)
   test_chan_accept_cells = 1;
   channel_change_state_open(ch);
   tt_assert(test_cells_written == old_count);
-  tt_int_op(chan_cell_queue_len(&(ch->outgoing_queue)), OP_EQ, 0);
+  tt_int_op(channel_outgoing_queue_len(ch), OP_EQ, 0);
 
   /* Same thing but for a var_cell */
 
@@ -1339,8 +1338,8 @@ test_channel_queue_impossible(void *arg)
   channel_write_var_cell(ch, var_cell);
 
   /* Check that it's queued */
-  tt_int_op(chan_cell_queue_len(&(ch->outgoing_queue)), OP_EQ, 1);
-  q = TOR_SIMPLEQ_FIRST(&(ch->outgoing_queue));
+  tt_int_op(channel_outgoing_queue_len(ch), OP_EQ, 1);
+  q = channel_outgoing_queue_first(ch);
   tt_assert(q);
   if (q) {
     tt_int_op(q->type, OP_EQ, CELL_QUEUE_VAR);
@@ -1355,7 +1354,7 @@ test_channel_queue_impossible(void *arg)
   test_chan_accept_cells = 1;
   channel_change_state_open(ch);
   tt_assert(test_cells_written == old_count);
-  tt_int_op(chan_cell_queue_len(&(ch->outgoing_queue)), OP_EQ, 0);
+  tt_int_op(channel_outgoing_queue_len(ch), OP_EQ, 0);
 
   /* Same thing with a packed_cell */
 
@@ -1367,8 +1366,8 @@ test_channel_queue_impossible(void *arg)
   channel_write_packed_cell(ch, packed_cell);
 
   /* Check that it's queued */
-  tt_int_op(chan_cell_queue_len(&(ch->outgoing_queue)), OP_EQ, 1);
-  q = TOR_SIMPLEQ_FIRST(&(ch->outgoing_queue));
+  tt_int_op(channel_outgoing_queue_len(ch), OP_EQ, 1);
+  q = channel_outgoing_queue_first(ch);
   tt_assert(q);
   if (q) {
     tt_int_op(q->type, OP_EQ, CELL_QUEUE_PACKED);
@@ -1383,7 +1382,7 @@ test_channel_queue_impossible(void *arg)
   test_chan_accept_cells = 1;
   channel_change_state_open(ch);
   tt_assert(test_cells_written == old_count);
-  tt_int_op(chan_cell_queue_len(&(ch->outgoing_queue)), OP_EQ, 0);
+  tt_int_op(channel_outgoing_queue_len(ch), OP_EQ, 0);
 
   /* Unknown cell type case */
   test_chan_accept_cells = 0;
@@ -1394,8 +1393,8 @@ test_channel_queue_impossible(void *arg)
   channel_write_cell(ch, cell);
 
   /* Check that it's queued */
-  tt_int_op(chan_cell_queue_len(&(ch->outgoing_queue)), OP_EQ, 1);
-  q = TOR_SIMPLEQ_FIRST(&(ch->outgoing_queue));
+  tt_int_op(channel_outgoing_queue_len(ch), OP_EQ, 1);
+  q = channel_outgoing_queue_first(ch);
   tt_assert(q);
   if (q) {
     tt_int_op(q->type, OP_EQ, CELL_QUEUE_FIXED);
@@ -1411,7 +1410,7 @@ test_channel_queue_impossible(void *arg)
   tor_capture_bugs_(1);
   channel_change_state_open(ch);
   tt_assert(test_cells_written == old_count);
-  tt_int_op(chan_cell_queue_len(&(ch->outgoing_queue)), OP_EQ, 0);
+  tt_int_op(channel_outgoing_queue_len(ch), OP_EQ, 0);
 
   tt_int_op(smartlist_len(tor_get_captured_bug_log_()), OP_EQ, 1);
   tor_end_capture_bugs_();
@@ -1537,6 +1536,124 @@ test_channel_queue_incoming(void *arg)
   return;
 }
 
+/**
+ * Check that the outgoing queue keeps cells in order when it spills over
+ * from the per-channel ring into the overflow list, and that the ring is
+ * reused afterwards.
+ */
+
+static void
+test_channel_queue_ring(void *arg)
+{
+  channel_t *ch = NULL;
+  cell_t *cell = NULL;
+  cell_queue_entry_t *q = NULL, *ring = NULL;
+  int i, old_count, n_cells = CHANNEL_OUTGOING_RING_LEN * 2 + 3;
+
+  (void)arg;
+
+  ch = new_fake_channel();
+  tt_assert(ch);
+  tt_ptr_op(ch->outgoing_ring, OP_EQ, NULL);
+
+  /* Queue enough cells to fill the ring and spill over */
+  test_chan_accept_cells = 0;
+  old_count = test_cells_written;
+  for (i = 0; i < n_cells; ++i) {
+    cell = tor_malloc_zero(sizeof(cell_t));
+    make_fake_cell(cell);
+    cell->circ_id = i;
+    channel_write_cell(ch, cell);
+  }
+  tt_int_op(test_cells_written, OP_EQ, old_count);
+  tt_int_op(channel_outgoing_queue_len(ch), OP_EQ, n_cells);
+  tt_int_op(ch->outgoing_ring_len, OP_EQ, CHANNEL_OUTGOING_RING_LEN);
+  tt_int_op(chan_cell_queue_len(&ch->outgoing_queue), OP_EQ,
+            n_cells - CHANNEL_OUTGOING_RING_LEN);
+  ring = ch->outgoing_ring;
+  tt_assert(ring);
+
+  /* Drain part of the ring, then queue more: they must go after the
+   * overflow list, not into the ring slots we just freed. */
+  test_chan_accept_cells = 1;
+  tt_int_op(channel_flush_some_cells(ch, 5), OP_EQ, 5);
+  test_chan_accept_cells = 0;
+  cell = tor_malloc_zero(sizeof(cell_t));
+  make_fake_cell(cell);
+  cell->circ_id = n_cells;
+  channel_write_cell(ch, cell);
+  tt_int_op(ch->outgoing_ring_len, OP_EQ, CHANNEL_OUTGOING_RING_LEN - 5);
+  tt_int_op(channel_outgoing_queue_len(ch), OP_EQ, n_cells - 4);
+
+  /* Everything comes back out in the order it went in */
+  for (i = 5; i <= n_cells; ++i) {
+    q = channel_outgoing_queue_first(ch);
+    tt_assert(q);
+    tt_int_op(q->type, OP_EQ, CELL_QUEUE_FIXED);
+    tt_int_op(q->u.fixed.cell->circ_id, OP_EQ, i);
+    test_chan_accept_cells = 1;
+    tt_int_op(channel_flush_some_cells(ch, 1), OP_EQ, 1);
+    test_chan_accept_cells = 0;
+  }
+  tt_int_op(channel_outgoing_queue_len(ch), OP_EQ, 0);
+  tt_int_op(test_cells_written, OP_EQ, old_count + n_cells + 1);
+
+  /* Once drained, queued cells go back into the same ring */
+  cell = tor_malloc_zero(sizeof(cell_t));
+  make_fake_cell(cell);
+  channel_write_cell(ch, cell);
+  tt_ptr_op(ch->outgoing_ring, OP_EQ, ring);
+  tt_int_op(ch->outgoing_ring_len, OP_EQ, 1);
+  tt_assert(TOR_SIMPLEQ_EMPTY(&ch->outgoing_queue));
+
+ done:
+  test_chan_accept_cells = 0;
+  free_fake_channel(ch);
+}
+
+/**
+ * Measure how fast cells move through a fake channel's outgoing queue
+ * when the lower layer alternately refuses and accepts them.  This is a
+ * benchmark rather than a test, so it's off by default; run it with
+ * "test +channel/queue_throughput".
+ */
+
+static void
+test_channel_queue_throughput(void *arg)
+{
+  channel_t *ch = NULL;
+  packed_cell_t *p_cell = NULL;
+  const int batch = CHANNEL_OUTGOING_RING_LEN / 2, n_batches = 100000;
+  int i, j;
+  uint64_t start, end;
+
+  (void)arg;
+
+  ch = new_fake_channel();
+  tt_assert(ch);
+
+  start = monotime_absolute_nsec();
+  for (i = 0; i < n_batches; ++i) {
+    test_chan_accept_cells = 0;
+    for (j = 0; j < batch; ++j) {
+      p_cell = packed_cell_new();
+      channel_write_packed_cell(ch, p_cell);
+    }
+    test_chan_accept_cells = 1;
+    channel_flush_cells(ch);
+  }
+  end = monotime_absolute_nsec();
+
+  tt_int_op(channel_outgoing_queue_len(ch), OP_EQ, 0);
+  printf("\n%d cells queued and flushed: %.2f nsec/cell ",
+         batch * n_batches,
+         ((double)(end - start)) / (batch * n_batches));
+
+ done:
+  test_chan_accept_cells = 0;
+  free_fake_channel(ch);
+}
+
 static void
 test_channel_queue_size(void *arg)
 {
@@ -1879,6 +1996,140 @@ test_channel_id_map(void *arg)
 #undef N_CHAN
 }
 
+static void
+test_channel_id_map_grow(void *arg)
+{
+  (void)arg;
+#define N_CHAN 300
+  char rsa_id[N_CHAN][DIGEST_LEN];
+  channel_t *chan[N_CHAN];
+  int i;
+
+  memset(chan, 0, sizeof(chan));
+
+  /* Enough identities to make the map grow several times, with a few
+   * sharing an identity so some entries need their overflow list. */
+  for (i = 0; i < N_CHAN; ++i) {
+    if (i % 50 < 4 && i % 50 > 0)
+      memcpy(rsa_id[i], rsa_id[i - 1], DIGEST_LEN);
+    else
+      crypto_rand(rsa_id[i], DIGEST_LEN);
+    chan[i] = new_fake_channel();
+    channel_register(chan[i]);
+    channel_set_identity_digest(chan[i], rsa_id[i], NULL);
+  }
+
+  for (i = 0; i < N_CHAN; ++i) {
+    channel_t *ch = channel_find_by_remote_identity(rsa_id[i], NULL);
+    int n = 0, found = 0;
+    for (; ch; ch = channel_next_with_rsa_identity(ch)) {
+      ++n;
+      if (ch == chan[i])
+        found = 1;
+    }
+    tt_int_op(found, OP_EQ, 1);
+    tt_int_op(n, OP_EQ, (i % 50 < 4) ? 4 : 1);
+  }
+
+  /* Remove every other channel; the rest must still be reachable. */
+  for (i = 0; i < N_CHAN; i += 2) {
+    channel_clear_identity_digest(chan[i]);
+  }
+  for (i = 0; i < N_CHAN; ++i) {
+    channel_t *ch = channel_find_by_remote_identity(rsa_id[i], NULL);
+    int found = 0;
+    for (; ch; ch = channel_next_with_rsa_identity(ch)) {
+      tt_ptr_op(ch, OP_NE, chan[i - (i % 2)]);
+      if (ch == chan[i])
+        found = 1;
+    }
+    tt_int_op(found, OP_EQ, i % 2);
+  }
+
+ done:
+  for (i = 0; i < N_CHAN; ++i) {
+    if (!chan[i])
+      continue;
+    channel_clear_identity_digest(chan[i]);
+    channel_unregister(chan[i]);
+    free_fake_channel(chan[i]);
+  }
+#undef N_CHAN
+}
+
+static void
+test_channel_get_for_extend(void *arg)
+{
+  (void)arg;
+  char rsa_id[DIGEST_LEN];
+  ed25519_public_key_t ed_id;
+  channel_t *a = NULL, *b = NULL;
+  tor_addr_t addr;
+  const char *msg = NULL;
+  int launch = -1;
+
+  crypto_rand(rsa_id, DIGEST_LEN);
+  crypto_rand((char*)ed_id.pubkey, sizeof(ed_id.pubkey));
+  tor_addr_from_ipv4h(&addr, 0x7f000001);
+
+  tt_ptr_op(NULL, OP_EQ,
+            channel_get_for_extend(rsa_id, NULL, &addr, &msg, &launch));
+  tt_int_op(launch, OP_EQ, 1);
+
+  a = new_fake_channel();
+  b = new_fake_channel();
+  a->is_canonical = b->is_canonical = chan_test_is_canonical;
+  channel_register(a);
+  channel_register(b);
+  channel_set_identity_digest(a, rsa_id, NULL);
+  channel_set_identity_digest(b, rsa_id, NULL);
+  a->timestamp_created = time(NULL) - 100;
+  b->timestamp_created = time(NULL) - 50;
+
+  /* The older of two canonical channels wins, and stays picked. */
+  launch = -1;
+  tt_ptr_op(a, OP_EQ,
+            channel_get_for_extend(rsa_id, NULL, &addr, &msg, &launch));
+  tt_int_op(launch, OP_EQ, 0);
+  b->timestamp_created = time(NULL) - 200;
+  tt_ptr_op(a, OP_EQ,
+            channel_get_for_extend(rsa_id, NULL, &addr, &msg, &launch));
+
+  /* ...until something tells the map to choose again. */
+  channel_note_extend_preference_changed(b);
+  tt_ptr_op(b, OP_EQ,
+            channel_get_for_extend(rsa_id, NULL, &addr, &msg, &launch));
+
+  /* Channels that go bad or get an identity change are not used. */
+  channel_mark_bad_for_new_circs(b);
+  tt_ptr_op(a, OP_EQ,
+            channel_get_for_extend(rsa_id, NULL, &addr, &msg, &launch));
+  tt_ptr_op(NULL, OP_EQ,
+            channel_get_for_extend(rsa_id, &ed_id, &addr, &msg, &launch));
+  tt_int_op(launch, OP_EQ, 1);
+  channel_set_identity_digest(a, rsa_id, &ed_id);
+  tt_ptr_op(a, OP_EQ,
+            channel_get_for_extend(rsa_id, &ed_id, &addr, &msg, &launch));
+  tt_int_op(launch, OP_EQ, 0);
+  channel_mark_client(a);
+  launch = -1;
+  tt_ptr_op(NULL, OP_EQ,
+            channel_get_for_extend(rsa_id, NULL, &addr, &msg, &launch));
+  tt_int_op(launch, OP_EQ, 1);
+
+ done:
+  if (a) {
+    channel_clear_identity_digest(a);
+    channel_unregister(a);
+    free_fake_channel(a);
+  }
+  if (b) {
+    channel_clear_identity_digest(b);
+    channel_unregister(b);
+    free_fake_channel(b);
+  }
+}
+
 struct testcase_t channel_tests[] = {
   { "dumpstats", test_channel_dumpstats, TT_FORK, NULL, NULL },
   { "flush", test_channel_flush, TT_FORK, NULL, NULL },
@@ -1889,9 +2140,14 @@ struct testcase_t channel_tests[] = {
   { "multi", test_channel_multi, TT_FORK, NULL, NULL },
   { "queue_impossible", test_channel_queue_impossible, TT_FORK, NULL, NULL },
   { "queue_incoming", test_channel_queue_incoming, TT_FORK, NULL, NULL },
+  { "queue_ring", test_channel_queue_ring, TT_FORK, NULL, NULL },
   { "queue_size", test_channel_queue_size, TT_FORK, NULL, NULL },
+  { "queue_throughput", test_channel_queue_throughput,
+    TT_FORK|TT_OFF_BY_DEFAULT, NULL, NULL },
   { "write", test_channel_write, TT_FORK, NULL, NULL },
   { "id_map", test_channel_id_map, TT_FORK, NULL, NULL },
+  { "id_map_grow", test_channel_id_map_grow, TT_FORK, NULL, NULL },
+  { "get_for_extend", test_channel_get_for_extend, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -160,8 +160,7 @@ free_fake_channeltls(channel_tls_t *chan)
   buf_free(((channel_tls_t*)chan)->conn->base_.outbuf);
   tor_free(((channel_tls_t*)chan)->conn);
 
-  timer_free(chan->base_.padding_timer);
-  channel_handle_free(chan->base_.timer_handle);
+  channelpadding_release_channel(&chan->base_);
   channel_handles_clear(&chan->base_);
 
   free_fake_channel(&chan->base_);
@@ -359,12 +358,31 @@ test_channelpadding_timers(void *arg)
     }
   }
 
+  /* A channel released while waiting on the padding wheel must never get
+   * its padding sent. */
+  tried_to_write_cell = 0;
+  chans[0]->next_padding_time_ms = monotime_coarse_absolute_msec() + 100;
+  chans[1]->next_padding_time_ms = monotime_coarse_absolute_msec() + 100;
+  decision = channelpadding_decide_to_pad_channel(chans[0]);
+  tt_int_op(decision, OP_EQ, CHANNELPADDING_PADDING_SCHEDULED);
+  decision = channelpadding_decide_to_pad_channel(chans[1]);
+  tt_int_op(decision, OP_EQ, CHANNELPADDING_PADDING_SCHEDULED);
+  channelpadding_release_channel(chans[0]);
+  tt_assert(!chans[0]->pending_padding_callback);
+  new_time = (monotime_coarse_absolute_msec()+101)*NSEC_PER_MSEC;
+  monotime_coarse_set_mock_time_nsec(new_time);
+  monotime_set_mock_time_nsec(new_time);
+  timers_run_pending();
+  tt_int_op(tried_to_write_cell, OP_EQ, 1);
+  tt_assert(!chans[1]->pending_padding_callback);
+
  done:
   for (int i = 0; i < CHANNELS_TO_TEST; i++) {
     free_fake_channeltls((channel_tls_t*)chans[i]);
   }
   smartlist_free(connection_array);
 
+  channelpadding_free_all();
   timers_shutdown();
   monotime_disable_test_mocking();
   channel_free_all();
@@ -533,6 +551,7 @@ test_channelpadding_killonehop(void *arg)
   free_mock_network();
   tor_free(relay);
 
+  channelpadding_free_all();
   timers_shutdown();
   monotime_disable_test_mocking();
   channel_free_all();
@@ -752,6 +771,7 @@ test_channelpadding_consensus(void *arg)
   free_fake_channeltls((channel_tls_t*)chan);
   smartlist_free(connection_array);
 
+  channelpadding_free_all();
   timers_shutdown();
   monotime_disable_test_mocking();
   channel_free_all();
@@ -885,6 +905,7 @@ test_channelpadding_negotiation(void *arg)
   free_mock_network();
   free_mock_consensus();
 
+  channelpadding_free_all();
   timers_shutdown();
   monotime_disable_test_mocking();
   channel_free_all();
@@ -1109,6 +1130,7 @@ test_channelpadding_decide_to_pad_channel(void *arg)
 
   teardown_capture_of_logs();
   monotime_disable_test_mocking();
+  channelpadding_free_all();
   timers_shutdown();
   channel_free_all();
 
@@ -4,9 +4,11 @@
 #define TOR_CHANNEL_INTERNAL_
 #define CIRCUITMUX_PRIVATE
 #define RELAY_PRIVATE
+#include <math.h>
 #include "or.h"
 #include "channel.h"
 #include "circuitmux.h"
+#include "circuitmux_ewma.h"
 #include "relay.h"
 #include "scheduler.h"
 #include "test.h"
@@ -77,8 +79,171 @@ test_cmux_destroy_cell_queue(void *arg)
   packed_cell_free(pc);
 }
 
+/** Simulate <b>n_cells</b> bulk cells relayed one at a time, one every
+ * millisecond, through <b>policy</b> from <b>n_regular</b> regular and
+ * <b>n_premium</b> premium circuits that always have cells queued.  Store
+ * the number of cells sent by each circuit in <b>relayed_out</b>: the
+ * regular circuits come first.  This is the C counterpart of
+ * mt_stats/scheduler_test.py, driving the real policy methods. */
+static void
+simulate_cmux_policy(const circuitmux_policy_t *policy,
+                     int n_regular, int n_premium, int n_cells,
+                     uint64_t *relayed_out)
+{
+  const int n_circs = n_regular + n_premium;
+  circuitmux_t *cmux = circuitmux_alloc();
+  circuitmux_policy_data_t *pol_data;
+  circuitmux_policy_circ_data_t **circ_data;
+  circuit_t *circs, *circ;
+  struct timeval now = { 1500000000, 0 };
+  int i;
+
+  update_approx_time(now.tv_sec);
+  tor_gettimeofday_cache_set(&now);
+
+  circs = tor_calloc(n_circs, sizeof(circuit_t));
+  circ_data = tor_calloc(n_circs, sizeof(circuitmux_policy_circ_data_t *));
+  pol_data = policy->alloc_cmux_data(cmux);
+  for (i = 0; i < n_circs; ++i) {
+    circs[i].mt_priority_class = i < n_regular ?
+      MT_PRIORITY_CLASS_REGULAR : MT_PRIORITY_CLASS_PREMIUM;
+    circ_data[i] = policy->alloc_circ_data(cmux, pol_data, &circs[i],
+                                           CELL_DIRECTION_OUT, 1);
+    policy->notify_circ_active(cmux, pol_data, &circs[i], circ_data[i]);
+    relayed_out[i] = 0;
+  }
+
+  for (i = 0; i < n_cells; ++i) {
+    circ = policy->pick_active_circuit(cmux, pol_data);
+    tor_assert(circ);
+    policy->notify_xmit_cells(cmux, pol_data, circ,
+                              circ_data[circ - circs], 1);
+    ++relayed_out[circ - circs];
+
+    now.tv_usec += 1000;
+    if (now.tv_usec >= 1000000) {
+      ++now.tv_sec;
+      now.tv_usec -= 1000000;
+    }
+    tor_gettimeofday_cache_set(&now);
+  }
+
+  for (i = 0; i < n_circs; ++i) {
+    policy->notify_circ_inactive(cmux, pol_data, &circs[i], circ_data[i]);
+    policy->free_circ_data(cmux, pol_data, &circs[i], circ_data[i]);
+  }
+  policy->free_cmux_data(cmux, pol_data);
+  tor_free(circ_data);
+  tor_free(circs);
+  circuitmux_free(cmux);
+}
+
+/** Set the EWMA halflife and premium scale the simulations run with. */
+static void
+set_cmux_ewma_options(double halflife, double premium_scale)
+{
+  or_options_t *options = tor_malloc_zero(sizeof(or_options_t));
+
+  options->CircuitPriorityHalflife = halflife;
+  options->CircuitPriorityPremiumScale = premium_scale;
+  cell_ewma_set_scale_factor(options, NULL);
+  tor_free(options);
+}
+
+/** Return the mean number of cells relayed by circuits <b>from</b> up to
+ * (but not including) <b>to</b>. */
+static double
+mean_relayed(const uint64_t *relayed, int from, int to)
+{
+  uint64_t sum = 0;
+  int i;
+
+  for (i = from; i < to; ++i)
+    sum += relayed[i];
+  return ((double)sum) / (to - from);
+}
+
+/** Test which policy the EWMA settings select. */
+static void
+test_cmux_prio_policy_selection(void *arg)
+{
+  (void) arg;
+
+  set_cmux_ewma_options(0.0, 0.5);
+  tt_ptr_op(cell_ewma_get_policy(), OP_EQ, NULL);
+
+  set_cmux_ewma_options(30.0, -1.0);
+  tt_ptr_op(cell_ewma_get_policy(), OP_EQ, &ewma_policy);
+
+  set_cmux_ewma_options(30.0, 1.0);
+  tt_ptr_op(cell_ewma_get_policy(), OP_EQ, &ewma_policy);
+
+  set_cmux_ewma_options(30.0, 0.5);
+  tt_ptr_op(cell_ewma_get_policy(), OP_EQ, &ewma_prio_policy);
+
+ done:
+  set_cmux_ewma_options(-1.0, -1.0);
+}
+
+/** Run the scheduler_test.py scenarios: bulk regular and premium circuits
+ * sharing one circuitmux under various premium scales. */
+static void
+test_cmux_prio_simulation(void *arg)
+{
+  static const struct {
+    double scale;
+    int n_regular;
+    int n_premium;
+  } scenarios[] = {
+    { 1.0, 10, 10 },
+    { 0.5, 10, 10 },
+    { 0.5, 90, 10 },
+    { 0.25, 50, 5 },
+    { 0.1, 5, 50 },
+  };
+  const int n_cells = 200000;
+  uint64_t *relayed = tor_calloc(200, sizeof(uint64_t));
+  double mean_regular, mean_premium;
+  unsigned i;
+
+  (void) arg;
+
+  for (i = 0; i < ARRAY_LENGTH(scenarios); ++i) {
+    const int n_regular = scenarios[i].n_regular;
+    const int n_premium = scenarios[i].n_premium;
+
+    set_cmux_ewma_options(30.0, scenarios[i].scale);
+    simulate_cmux_policy(&ewma_prio_policy, n_regular, n_premium,
+                         n_cells, relayed);
+    mean_regular = mean_relayed(relayed, 0, n_regular);
+    mean_premium = mean_relayed(relayed, n_regular, n_regular + n_premium);
+
+    /* Every busy circuit's weighted cell count ends up the same, so a
+     * premium circuit sends 1/scale times what a regular one does. */
+    tt_double_op(fabs(mean_premium / mean_regular -
+                      1.0 / scenarios[i].scale) * scenarios[i].scale,
+                 OP_LT, 0.02);
+    tt_double_op(fabs(mean_regular * n_regular + mean_premium * n_premium -
+                      n_cells), OP_LT, 0.5);
+  }
+
+  /* The plain EWMA policy ignores priority classes. */
+  set_cmux_ewma_options(30.0, 0.5);
+  simulate_cmux_policy(&ewma_policy, 10, 10, n_cells, relayed);
+  mean_regular = mean_relayed(relayed, 0, 10);
+  mean_premium = mean_relayed(relayed, 10, 20);
+  tt_double_op(fabs(mean_premium / mean_regular - 1.0), OP_LT, 0.02);
+
+ done:
+  tor_free(relayed);
+  set_cmux_ewma_options(-1.0, -1.0);
+}
+
 struct testcase_t circuitmux_tests[] = {
   { "destroy_cell_queue", test_cmux_destroy_cell_queue, TT_FORK, NULL, NULL },
+  { "prio_policy_selection", test_cmux_prio_policy_selection, TT_FORK,
+    NULL, NULL },
+  { "prio_simulation", test_cmux_prio_simulation, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -3,17 +3,21 @@
 
 #include "orconfig.h"
 
+#define CIRCUITLIST_PRIVATE
 #define CONNECTION_PRIVATE
 #define MAIN_PRIVATE
 
 #include "or.h"
 #include "test.h"
 
+#include "circuitlist.h"
+#include "config.h"
 #include "connection.h"
 #include "hs_common.h"
 #include "main.h"
 #include "microdesc.h"
 #include "networkstatus.h"
+#include "relay.h"
 #include "rendcache.h"
 #include "directory.h"
 
@@ -776,6 +780,283 @@ test_conn_download_status(void *arg)
   /* the teardown function removes all the connections in the global list*/;
 }
 
+static void
+test_conn_bw_blocked_list(void *arg)
+{
+  connection_t *c1 = NULL, *c2 = NULL, *c3 = NULL;
+  (void)arg;
+
+  c1 = connection_new(CONN_TYPE_EXIT, AF_INET);
+  c2 = connection_new(CONN_TYPE_EXIT, AF_INET);
+  c3 = connection_new(CONN_TYPE_EXIT, AF_INET);
+  tt_int_op(c1->bw_blocked_index, OP_EQ, -1);
+
+  /* Adding twice is harmless. */
+  connection_bw_blocked_list_add(c1);
+  connection_bw_blocked_list_add(c1);
+  connection_bw_blocked_list_add(c2);
+  connection_bw_blocked_list_add(c3);
+  tt_int_op(c1->bw_blocked_index, OP_EQ, 0);
+  tt_int_op(c2->bw_blocked_index, OP_EQ, 1);
+  tt_int_op(c3->bw_blocked_index, OP_EQ, 2);
+
+  /* Removing from the middle moves the last one into its place. */
+  connection_bw_blocked_list_remove(c1);
+  tt_int_op(c1->bw_blocked_index, OP_EQ, -1);
+  tt_int_op(c3->bw_blocked_index, OP_EQ, 0);
+  tt_int_op(c2->bw_blocked_index, OP_EQ, 1);
+  connection_bw_blocked_list_remove(c1);
+
+  /* Freeing a blocked connection takes it off the list. */
+  connection_free_(c3);
+  c3 = NULL;
+  tt_int_op(c2->bw_blocked_index, OP_EQ, 0);
+
+ done:
+  connection_free_(c1);
+  connection_free_(c2);
+  connection_free_(c3);
+}
+
+static void
+test_conn_bucket_refill_lazy(void *arg)
+{
+  connection_t *conn = NULL;
+  or_connection_t *or_conn;
+  (void)arg;
+
+  conn = connection_new(CONN_TYPE_OR, AF_INET);
+  or_conn = TO_OR_CONN(conn);
+  conn->state = OR_CONN_STATE_OPEN;
+  or_conn->bandwidthrate = 1000;
+  or_conn->bandwidthburst = 5000;
+  or_conn->read_bucket = 0;
+  or_conn->write_bucket = -200;
+  or_conn->buckets_refilled_msec = 10000;
+
+  /* No time has passed: nothing to add. */
+  connection_or_buckets_refill_lazy(or_conn, 10000);
+  tt_int_op(or_conn->read_bucket, OP_EQ, 0);
+  tt_int_op(or_conn->write_bucket, OP_EQ, -200);
+
+  /* Half a second gives half the rate, even to an overdrawn bucket. */
+  connection_or_buckets_refill_lazy(or_conn, 10500);
+  tt_int_op(or_conn->read_bucket, OP_EQ, 500);
+  tt_int_op(or_conn->write_bucket, OP_EQ, 300);
+  tt_uint_op(or_conn->buckets_refilled_msec, OP_EQ, 10500);
+
+  /* Less time than one token is worth doesn't move the refill time, so
+   * those milliseconds count towards the next refill. */
+  or_conn->bandwidthrate = 300;
+  connection_or_buckets_refill_lazy(or_conn, 10502);
+  tt_int_op(or_conn->read_bucket, OP_EQ, 500);
+  tt_uint_op(or_conn->buckets_refilled_msec, OP_EQ, 10500);
+  connection_or_buckets_refill_lazy(or_conn, 10504);
+  tt_int_op(or_conn->read_bucket, OP_EQ, 501);
+  tt_int_op(or_conn->write_bucket, OP_EQ, 301);
+  tt_uint_op(or_conn->buckets_refilled_msec, OP_EQ, 10504);
+
+  /* A long wait fills the buckets up to the burst, and no further. */
+  or_conn->bandwidthrate = 1000;
+  connection_or_buckets_refill_lazy(or_conn, 10504 + 3600*1000);
+  tt_int_op(or_conn->read_bucket, OP_EQ, 5000);
+  tt_int_op(or_conn->write_bucket, OP_EQ, 5000);
+
+  /* If the clock goes backwards, we add nothing and count from there. */
+  or_conn->read_bucket = 0;
+  or_conn->write_bucket = 0;
+  connection_or_buckets_refill_lazy(or_conn, 10000);
+  tt_int_op(or_conn->read_bucket, OP_EQ, 0);
+  tt_int_op(or_conn->write_bucket, OP_EQ, 0);
+  tt_uint_op(or_conn->buckets_refilled_msec, OP_EQ, 10000);
+  connection_or_buckets_refill_lazy(or_conn, 11000);
+  tt_int_op(or_conn->read_bucket, OP_EQ, 1000);
+  tt_int_op(or_conn->write_bucket, OP_EQ, 1000);
+
+  /* A wrapping msec counter still gives the right elapsed time. */
+  or_conn->read_bucket = 0;
+  or_conn->write_bucket = 0;
+  or_conn->buckets_refilled_msec = UINT32_MAX - 999;
+  connection_or_buckets_refill_lazy(or_conn, 1000);
+  tt_int_op(or_conn->read_bucket, OP_EQ, 2000);
+  tt_int_op(or_conn->write_bucket, OP_EQ, 2000);
+
+  /* Connections that aren't open don't get tokens. */
+  conn->state = OR_CONN_STATE_CONNECTING;
+  or_conn->read_bucket = 0;
+  connection_or_buckets_refill_lazy(or_conn, 5000);
+  tt_int_op(or_conn->read_bucket, OP_EQ, 0);
+
+ done:
+  connection_free_(conn);
+}
+
+static int batched_read_cells = 0;
+static size_t batched_read_bytes = 0;
+
+static int
+mock_relay_send_command_from_edge(streamid_t stream_id, circuit_t *circ,
+                                  uint8_t relay_command, const char *payload,
+                                  size_t payload_len,
+                                  crypt_path_t *cpath_layer,
+                                  const char *filename, int lineno)
+{
+  (void)stream_id;
+  (void)circ;
+  (void)payload;
+  (void)cpath_layer;
+  (void)filename;
+  (void)lineno;
+  if (relay_command == RELAY_COMMAND_DATA) {
+    ++batched_read_cells;
+    batched_read_bytes += payload_len;
+  }
+  return 0;
+}
+
+/* Helper: return a new open exit connection on <b>circ</b>, reading from
+ * one end of a socketpair, and put the other end in *<b>peer_out</b>. */
+static connection_t *
+batched_read_conn_new(or_circuit_t *circ, tor_socket_t *peer_out)
+{
+  edge_connection_t *edge_conn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  connection_t *conn = TO_CONN(edge_conn);
+  tor_socket_t fds[2];
+
+  tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[0]), OP_EQ, 0);
+  conn->s = fds[0];
+  *peer_out = fds[1];
+  conn->state = EXIT_CONN_STATE_OPEN;
+  conn->purpose = EXIT_PURPOSE_CONNECT;
+  /* A public address, so that the bytes count against our buckets. */
+  tor_addr_parse(&conn->addr, "18.0.0.1");
+  conn->address = tor_strdup("18.0.0.1");
+  edge_conn->package_window = STREAMWINDOW_START;
+  /* Keep connection_edge_about_to_close() quiet when we close it. */
+  edge_conn->edge_has_sent_end = 1;
+  edge_conn->end_reason = END_STREAM_REASON_DONE;
+  edge_conn->on_circuit = TO_CIRCUIT(circ);
+  edge_conn->next_stream = circ->n_streams;
+  circ->n_streams = edge_conn;
+
+  tt_int_op(connection_add(conn), OP_EQ, 0);
+  connection_start_reading(conn);
+  return conn;
+ done:
+  connection_free_(conn);
+  return NULL;
+}
+
+static void
+test_conn_batched_read(void *arg)
+{
+  /* One partial cell, exactly one cell, and two cells plus a bit. */
+  const size_t sizes[] = { 100, RELAY_PAYLOAD_SIZE, 2*RELAY_PAYLOAD_SIZE+1 };
+  const int n_conns = (int)ARRAY_LENGTH(sizes);
+  connection_t *unbatched[3] = { NULL, NULL, NULL };
+  connection_t *batched[3] = { NULL, NULL, NULL };
+  tor_socket_t unbatched_peer[3] = {
+    TOR_INVALID_SOCKET, TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  tor_socket_t batched_peer[3] = {
+    TOR_INVALID_SOCKET, TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  or_circuit_t *circ = NULL;
+  char data[3*RELAY_PAYLOAD_SIZE];
+  int i, unbatched_cells;
+  size_t unbatched_bytes;
+  (void)arg;
+
+  MOCK(relay_send_command_from_edge_, mock_relay_send_command_from_edge);
+  get_options_mutable()->TestingEnableConnBwEvent = 1;
+  init_connection_lists();
+  connection_bucket_init();
+  memset(data, 'x', sizeof(data));
+
+  circ = or_circuit_new(0, NULL);
+  for (i = 0; i < n_conns; ++i) {
+    unbatched[i] = batched_read_conn_new(circ, &unbatched_peer[i]);
+    batched[i] = batched_read_conn_new(circ, &batched_peer[i]);
+    tt_assert(unbatched[i]);
+    tt_assert(batched[i]);
+    tt_int_op(write_all(unbatched_peer[i], data, sizes[i], 1), OP_EQ,
+              sizes[i]);
+    tt_int_op(write_all(batched_peer[i], data, sizes[i], 1), OP_EQ,
+              sizes[i]);
+  }
+
+  /* What the unbatched path does with these bytes. */
+  for (i = 0; i < n_conns; ++i)
+    tt_int_op(connection_handle_read(unbatched[i]), OP_EQ, 0);
+  unbatched_cells = batched_read_cells;
+  unbatched_bytes = batched_read_bytes;
+  tt_int_op(unbatched_cells, OP_EQ, 5);
+  tt_uint_op(unbatched_bytes, OP_EQ, sizes[0] + sizes[1] + sizes[2]);
+
+  /* The batched path: filling reads every socket but packages nothing. */
+  batched_read_cells = 0;
+  batched_read_bytes = 0;
+  for (i = 0; i < n_conns; ++i)
+    batched_read_add(batched[i]);
+  batched_read_add(batched[0]);
+  batched_reads_fill();
+  tt_int_op(batched_read_cells, OP_EQ, 0);
+  for (i = 0; i < n_conns; ++i) {
+    tt_uint_op(connection_get_inbuf_len(batched[i]), OP_EQ, sizes[i]);
+    tt_uint_op(batched[i]->n_read_conn_bw, OP_EQ,
+               unbatched[i]->n_read_conn_bw);
+  }
+
+  /* Processing then sends the same cells as the unbatched path. */
+  batched_reads_process();
+  tt_int_op(batched_read_cells, OP_EQ, unbatched_cells);
+  tt_uint_op(batched_read_bytes, OP_EQ, unbatched_bytes);
+  for (i = 0; i < n_conns; ++i) {
+    tt_uint_op(connection_get_inbuf_len(batched[i]), OP_EQ, 0);
+    tt_uint_op(connection_get_inbuf_len(unbatched[i]), OP_EQ, 0);
+    tt_uint_op(batched[i]->n_read_conn_bw, OP_EQ, sizes[i]);
+    tt_uint_op(batched[i]->n_read_conn_bw, OP_EQ,
+               unbatched[i]->n_read_conn_bw);
+    tt_int_op(batched[i]->in_read_batch, OP_EQ, 0);
+    tt_uint_op(TO_EDGE_CONN(batched[i])->package_window, OP_EQ,
+               TO_EDGE_CONN(unbatched[i])->package_window);
+  }
+
+  /* A connection that gets closed and freed between the two passes is left
+   * out of the second one. */
+  batched_read_cells = 0;
+  batched_read_bytes = 0;
+  for (i = 0; i < n_conns; ++i) {
+    tt_int_op(write_all(batched_peer[i], data, RELAY_PAYLOAD_SIZE, 1),
+              OP_EQ, RELAY_PAYLOAD_SIZE);
+    batched_read_add(batched[i]);
+  }
+  batched_reads_fill();
+  connection_mark_for_close(batched[1]);
+  close_closeable_connections();
+  batched[1] = NULL;
+  batched_reads_process();
+  tt_int_op(batched_read_cells, OP_EQ, 2);
+  tt_uint_op(batched_read_bytes, OP_EQ, 2*RELAY_PAYLOAD_SIZE);
+  tt_uint_op(connection_get_inbuf_len(batched[0]), OP_EQ, 0);
+  tt_uint_op(connection_get_inbuf_len(batched[2]), OP_EQ, 0);
+
+ done:
+  for (i = 0; i < n_conns; ++i) {
+    if (unbatched[i])
+      connection_mark_for_close(unbatched[i]);
+    if (batched[i])
+      connection_mark_for_close(batched[i]);
+    if (SOCKET_OK(unbatched_peer[i]))
+      tor_close_socket(unbatched_peer[i]);
+    if (SOCKET_OK(batched_peer[i]))
+      tor_close_socket(batched_peer[i]);
+  }
+  close_closeable_connections();
+  if (circ)
+    circuit_free(TO_CIRCUIT(circ));
+  UNMOCK(relay_send_command_from_edge_);
+}
+
 #define CONNECTION_TESTCASE(name, fork, setup)                           \
   { #name, test_conn_##name, fork, &setup, NULL }
 
@@ -791,6 +1072,10 @@ struct testcase_t connection_tests[] = {
                           test_conn_download_status_st, FLAV_MICRODESC),
   CONNECTION_TESTCASE_ARG(download_status,  TT_FORK,
                           test_conn_download_status_st, FLAV_NS),
+  { "bw_blocked_list", test_conn_bw_blocked_list, TT_FORK, NULL, NULL },
+  { "bucket_refill_lazy", test_conn_bucket_refill_lazy, TT_FORK,
+    NULL, NULL },
+  { "batched_read", test_conn_batched_read, TT_FORK, NULL, NULL },
 //CONNECTION_TESTCASE(func_suffix, TT_FORK, setup_func_pair),
   END_OF_TESTCASES
 };
@@ -1,9 +1,14 @@
 /* Copyright (c) 2015-2017, The Tor Project, Inc. */
 /* See LICENSE for licensing information */
 
+#define CONNECTION_PRIVATE
 #define CONTROL_PRIVATE
+#define CIRCUITLIST_PRIVATE
 #include "or.h"
 #include "bridges.h"
+#include "buffers.h"
+#include "circuitlist.h"
+#include "connection.h"
 #include "control.h"
 #include "entrynodes.h"
 #include "networkstatus.h"
@@ -1369,6 +1374,91 @@ test_download_status_bridge(void *arg)
   return;
 }
 
+/** Helper: move everything on <b>conn</b>'s outbuf onto the end of
+ * <b>chunks</b>. */
+static void
+drain_outbuf(control_connection_t *conn, smartlist_t *chunks)
+{
+  size_t n = buf_datalen(TO_CONN(conn)->outbuf);
+  char *chunk = tor_malloc(n + 1);
+  buf_get_bytes(TO_CONN(conn)->outbuf, chunk, n);
+  chunk[n] = '\0';
+  smartlist_add(chunks, chunk);
+}
+
+static void
+test_getinfo_spooled_circuit_status(void *arg)
+{
+  control_connection_t *conn = NULL;
+  smartlist_t *circs = smartlist_new();
+  smartlist_t *chunks = smartlist_new();
+  smartlist_t *lines = smartlist_new();
+  origin_circuit_t *gone;
+  char *reply = NULL, *body, *end, *expected = NULL;
+  const char cmds[] = "GETINFO circuit-status\r\nGETINFO version\r\n";
+  const int n_circs = 600;
+  int i, n_steps = 0;
+  (void)arg;
+
+  for (i = 0; i < n_circs; ++i) {
+    origin_circuit_t *ocirc = origin_circuit_new();
+    TO_CIRCUIT(ocirc)->purpose = CIRCUIT_PURPOSE_C_GENERAL;
+    ocirc->build_state = tor_malloc_zero(sizeof(cpath_build_state_t));
+    smartlist_add(circs, ocirc);
+  }
+
+  conn = control_connection_new(AF_INET);
+  TO_CONN(conn)->state = CONTROL_CONN_STATE_OPEN;
+  buf_add(TO_CONN(conn)->inbuf, cmds, strlen(cmds));
+  tt_int_op(connection_control_process_inbuf(conn), OP_EQ, 0);
+
+  /* The answer is too big to write at once, so it's spooled, and the
+   * second command waits for it. */
+  tt_assert(conn->getinfo_spool);
+  tt_int_op(buf_datalen(TO_CONN(conn)->inbuf), OP_GT, 0);
+
+  /* A circuit that goes away before we reach it is left out. */
+  gone = smartlist_pop_last(circs);
+  circuit_free(TO_CIRCUIT(gone));
+
+  while (conn->getinfo_spool) {
+    drain_outbuf(conn, chunks);
+    tt_int_op(connection_control_flushed_some(conn), OP_EQ, 0);
+    ++n_steps;
+  }
+  drain_outbuf(conn, chunks);
+  tt_int_op(n_steps, OP_GT, 1);
+  tt_int_op(buf_datalen(TO_CONN(conn)->inbuf), OP_EQ, 0);
+
+  reply = smartlist_join_strings(chunks, "", 0, NULL);
+  tt_assert(!strcmpstart(reply, "250+circuit-status=\r\n"));
+  body = reply + strlen("250+circuit-status=\r\n");
+  end = strstr(body, "\r\n.\r\n250 OK\r\n250-version=");
+  tt_assert(end);
+  *end = '\0';
+  smartlist_split_string(lines, body, "\r\n", 0, 0);
+  tt_int_op(smartlist_len(lines), OP_EQ, n_circs - 1);
+  SMARTLIST_FOREACH_BEGIN(lines, const char *, line) {
+    const origin_circuit_t *ocirc = smartlist_get(circs, line_sl_idx);
+    tor_asprintf(&expected, "%u LAUNCHED ", ocirc->global_identifier);
+    tt_assert(!strcmpstart(line, expected));
+    tor_free(expected);
+  } SMARTLIST_FOREACH_END(line);
+
+ done:
+  tor_free(expected);
+  tor_free(reply);
+  if (conn)
+    connection_free_(TO_CONN(conn));
+  SMARTLIST_FOREACH(circs, origin_circuit_t *, ocirc,
+                    circuit_free(TO_CIRCUIT(ocirc)));
+  smartlist_free(circs);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+}
+
 struct testcase_t controller_tests[] = {
   { "add_onion_helper_keyarg", test_add_onion_helper_keyarg, 0, NULL, NULL },
   { "getinfo_helper_onion", test_getinfo_helper_onion, 0, NULL, NULL },
@@ -1382,6 +1472,8 @@ struct testcase_t controller_tests[] = {
     NULL },
   { "download_status_desc", test_download_status_desc, 0, NULL, NULL },
   { "download_status_bridge", test_download_status_bridge, 0, NULL, NULL },
+  { "getinfo_spooled_circuit_status", test_getinfo_spooled_circuit_status,
+    TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -4,9 +4,12 @@
 #define CONNECTION_PRIVATE
 #define TOR_CHANNEL_INTERNAL_
 #define CONTROL_PRIVATE
+#define CIRCUITLIST_PRIVATE
 #include "or.h"
+#include "buffers.h"
 #include "channel.h"
 #include "channeltls.h"
+#include "circuitlist.h"
 #include "connection.h"
 #include "control.h"
 #include "test.h"
@@ -391,6 +394,158 @@ test_cntev_event_mask(void *arg)
   ;
 }
 
+static smartlist_t *queued_events = NULL;
+
+static void
+mock_queue_control_event_string(uint16_t event, char *msg)
+{
+  (void)event;
+  smartlist_add(queued_events, msg);
+}
+
+static void
+clear_queued_events(void)
+{
+  SMARTLIST_FOREACH(queued_events, char *, cp, tor_free(cp));
+  smartlist_clear(queued_events);
+}
+
+static void
+test_cntev_stream_circ_bw_changed(void *arg)
+{
+  entry_connection_t *entry1 = NULL, *entry2 = NULL, *entry3 = NULL;
+  edge_connection_t *edge1, *edge2, *edge3;
+  origin_circuit_t *ocirc = NULL;
+  char *expected = NULL;
+  (void)arg;
+
+  queued_events = smartlist_new();
+  MOCK(queue_control_event_string, mock_queue_control_event_string);
+  control_testing_set_global_event_mask(
+                                  EVENT_MASK_(EVENT_STREAM_BANDWIDTH_USED) |
+                                  EVENT_MASK_(EVENT_CIRC_BANDWIDTH_USED));
+
+  entry1 = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  entry2 = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  entry3 = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  edge1 = ENTRY_TO_EDGE_CONN(entry1);
+  edge2 = ENTRY_TO_EDGE_CONN(entry2);
+  edge3 = ENTRY_TO_EDGE_CONN(entry3);
+  ocirc = origin_circuit_new();
+  TO_CIRCUIT(ocirc)->purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  edge2->on_circuit = TO_CIRCUIT(ocirc);
+
+  /* Nothing has moved: no events. */
+  control_event_stream_bandwidth_used();
+  control_event_circ_bandwidth_used();
+  tt_int_op(smartlist_len(queued_events), OP_EQ, 0);
+
+  /* Only the streams that moved data get an event; the circuit gets the
+   * bytes of its stream. */
+  control_note_stream_bandwidth(edge1, 100, 0);
+  control_note_stream_bandwidth(edge1, 0, 20);
+  control_note_stream_bandwidth(edge2, 5, 7);
+  control_note_stream_bandwidth(edge3, 0, 0);
+  tt_assert(edge1->on_stream_bw_list);
+  tt_assert(!edge3->on_stream_bw_list);
+  tt_assert(ocirc->on_circ_bw_list);
+
+  control_event_stream_bandwidth_used();
+  tt_int_op(smartlist_len(queued_events), OP_EQ, 2);
+  tor_asprintf(&expected, "650 STREAM_BW "U64_FORMAT" 100 20 ",
+               U64_PRINTF_ARG(TO_CONN(edge1)->global_identifier));
+  tt_assert(!strcmpstart(smartlist_get(queued_events, 0), expected));
+  tor_free(expected);
+  tor_asprintf(&expected, "650 STREAM_BW "U64_FORMAT" 5 7 ",
+               U64_PRINTF_ARG(TO_CONN(edge2)->global_identifier));
+  tt_assert(!strcmpstart(smartlist_get(queued_events, 1), expected));
+  tor_free(expected);
+  tt_int_op(edge1->n_read, OP_EQ, 0);
+  tt_assert(!edge1->on_stream_bw_list);
+  clear_queued_events();
+
+  control_event_circ_bandwidth_used();
+  tt_int_op(smartlist_len(queued_events), OP_EQ, 1);
+  tor_asprintf(&expected, "650 CIRC_BW ID=%d READ=5 WRITTEN=7 TIME=",
+               ocirc->global_identifier);
+  tt_assert(!strcmpstart(smartlist_get(queued_events, 0), expected));
+  tor_free(expected);
+  clear_queued_events();
+
+  /* A second call with no new traffic sends nothing. */
+  control_event_stream_bandwidth_used();
+  control_event_circ_bandwidth_used();
+  tt_int_op(smartlist_len(queued_events), OP_EQ, 0);
+
+  /* Freed streams and circuits drop off the lists. */
+  control_note_stream_bandwidth(edge1, 1, 1);
+  control_note_stream_bandwidth(edge2, 1, 1);
+  connection_free_(TO_CONN(edge1));
+  entry1 = NULL;
+  edge2->on_circuit = NULL;
+  circuit_free(TO_CIRCUIT(ocirc));
+  ocirc = NULL;
+  control_event_stream_bandwidth_used();
+  control_event_circ_bandwidth_used();
+  tt_int_op(smartlist_len(queued_events), OP_EQ, 1);
+  clear_queued_events();
+
+  /* When nobody wants the events, streams are not listed. */
+  control_testing_set_global_event_mask(EVENT_MASK_NONE_);
+  control_note_stream_bandwidth(edge3, 1, 1);
+  tt_assert(!edge3->on_stream_bw_list);
+  tt_int_op(edge3->n_read, OP_EQ, 1);
+
+ done:
+  UNMOCK(queue_control_event_string);
+  control_testing_set_global_event_mask(EVENT_MASK_NONE_);
+  tor_free(expected);
+  if (entry1)
+    connection_free_(TO_CONN(ENTRY_TO_EDGE_CONN(entry1)));
+  if (entry2)
+    connection_free_(TO_CONN(ENTRY_TO_EDGE_CONN(entry2)));
+  if (entry3)
+    connection_free_(TO_CONN(ENTRY_TO_EDGE_CONN(entry3)));
+  if (ocirc)
+    circuit_free(TO_CIRCUIT(ocirc));
+  clear_queued_events();
+  smartlist_free(queued_events);
+}
+
+static void
+test_cntev_drop_when_behind(void *arg)
+{
+  control_connection_t *conn = NULL;
+  char *junk = NULL;
+  const size_t junk_len = 4*1024*1024;
+  (void)arg;
+
+  conn = control_connection_new(AF_INET);
+  tt_assert(!control_event_should_drop(conn, EVENT_BANDWIDTH_USED));
+  tt_assert(!control_event_should_drop(conn, EVENT_CIRCUIT_STATUS));
+
+  /* Once the controller is far enough behind, statistics and low-severity
+   * log events are dropped, but state changes are not. */
+  junk = tor_malloc_zero(junk_len);
+  buf_add(TO_CONN(conn)->outbuf, junk, junk_len);
+  tt_assert(control_event_should_drop(conn, EVENT_BANDWIDTH_USED));
+  tt_assert(control_event_should_drop(conn, EVENT_STREAM_BANDWIDTH_USED));
+  tt_assert(control_event_should_drop(conn, EVENT_DEBUG_MSG));
+  tt_assert(!control_event_should_drop(conn, EVENT_CIRCUIT_STATUS));
+  tt_assert(!control_event_should_drop(conn, EVENT_WARN_MSG));
+  tt_u64_op(conn->n_events_dropped, OP_EQ, 3);
+
+  /* Once it catches up, we send everything again. */
+  buf_clear(TO_CONN(conn)->outbuf);
+  tt_assert(!control_event_should_drop(conn, EVENT_BANDWIDTH_USED));
+  tt_u64_op(conn->n_events_dropped, OP_EQ, 0);
+
+ done:
+  tor_free(junk);
+  if (conn)
+    connection_free_(TO_CONN(conn));
+}
+
 #define TEST(name, flags)                                               \
   { #name, test_cntev_ ## name, flags, 0, NULL }
 
@@ -401,6 +556,8 @@ struct testcase_t controller_event_tests[] = {
   TEST(append_cell_stats, TT_FORK),
   TEST(format_cell_stats, TT_FORK),
   TEST(event_mask, TT_FORK),
+  TEST(stream_circ_bw_changed, TT_FORK),
+  TEST(drop_when_behind, TT_FORK),
   END_OF_TESTCASES
 };
 
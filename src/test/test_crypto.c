@@ -6,6 +6,7 @@
 #include "orconfig.h"
 #define CRYPTO_CURVE25519_PRIVATE
 #define CRYPTO_PRIVATE
+#define CRYPTO_RAND_FAST_PRIVATE
 #include "or.h"
 #include "test.h"
 #include "aes.h"
@@ -15,6 +16,10 @@
 #include "crypto_ed25519.h"
 #include "ed25519_vectors.inc"
 
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
 /** Run unit tests for Diffie-Hellman functionality. */
 static void
 test_crypto_dh(void *arg)
@@ -328,6 +333,116 @@ test_crypto_rng_strongest(void *arg)
 #undef N
 }
 
+/** Run unit tests for the buffered userspace RNG. */
+static void
+test_crypto_rng_fast(void *arg)
+{
+  (void)arg;
+  crypto_fast_rng_t *rng = crypto_fast_rng_new();
+  crypto_fast_rng_t *rng2 = crypto_fast_rng_new();
+  uint8_t a[8192], b[8192];
+  uint8_t combine_and[16], combine_or[16];
+  size_t off, len;
+  int i, j;
+
+  /* Draws of awkward sizes straddle buffer refills correctly, and the
+   * buffer shrinks by exactly the amount we took. */
+  memset(a, 0, sizeof(a));
+  for (off = 0, len = 1; off < sizeof(a); off += len, len = len * 3 + 1) {
+    size_t before = crypto_fast_rng_get_bytes_left_(rng);
+    if (len > sizeof(a) - off)
+      len = sizeof(a) - off;
+    crypto_fast_rng_getbytes(rng, a + off, len);
+    if (len <= before)
+      tt_u64_op(crypto_fast_rng_get_bytes_left_(rng), OP_EQ, before - len);
+  }
+  tt_assert(!tor_mem_is_zero((char*)a + sizeof(a) - 32, 32));
+
+  /* Two independently seeded RNGs don't agree. */
+  crypto_fast_rng_getbytes(rng, a, sizeof(a));
+  crypto_fast_rng_getbytes(rng2, b, sizeof(b));
+  tt_mem_op(a, OP_NE, b, sizeof(a));
+
+  /* Every bit gets set and cleared. */
+  memset(combine_and, 0xff, sizeof(combine_and));
+  memset(combine_or, 0, sizeof(combine_or));
+  for (i = 0; i < 100; ++i) {
+    uint8_t out[16];
+    crypto_fast_rng_getbytes(rng, out, sizeof(out));
+    for (j = 0; j < 16; ++j) {
+      combine_and[j] &= out[j];
+      combine_or[j] |= out[j];
+    }
+  }
+  for (j = 0; j < 16; ++j) {
+    tt_int_op(combine_and[j], OP_EQ, 0);
+    tt_int_op(combine_or[j], OP_EQ, 0xff);
+  }
+
+  /* We eventually reseed, and the reseed counter gets reset when we do. */
+  {
+    int saw_reset = 0;
+    int prev = crypto_fast_rng_get_n_till_reseed_(rng);
+    for (i = 0; i < 100; ++i) {
+      int cur;
+      crypto_fast_rng_getbytes(rng, a, sizeof(a));
+      cur = crypto_fast_rng_get_n_till_reseed_(rng);
+      if (cur > prev)
+        saw_reset = 1;
+      prev = cur;
+    }
+    tt_assert(saw_reset);
+  }
+
+  /* The thread RNG is persistent. */
+  tt_ptr_op(get_thread_fast_rng(), OP_EQ, get_thread_fast_rng());
+
+ done:
+  crypto_fast_rng_free(rng);
+  crypto_fast_rng_free(rng2);
+}
+
+#if defined(HAVE_SYS_WAIT_H) && !defined(_WIN32)
+/** Make sure that a forked child doesn't replay its parent's RNG output. */
+static void
+test_crypto_rng_fast_fork(void *arg)
+{
+  (void)arg;
+  uint8_t parent_out[64], child_out[64];
+  int fds[2] = { -1, -1 };
+  pid_t pid;
+  int status = 0;
+  crypto_fast_rng_t *rng = get_thread_fast_rng();
+
+  /* Make sure there's buffered output to inherit. */
+  crypto_fast_rng_getbytes(rng, parent_out, 1);
+  tt_int_op(pipe(fds), OP_EQ, 0);
+
+  pid = fork();
+  tt_int_op(pid, OP_GE, 0);
+  if (pid == 0) {
+    crypto_fast_rng_getbytes(get_thread_fast_rng(), child_out,
+                             sizeof(child_out));
+    if (write(fds[1], child_out, sizeof(child_out)) !=
+        (ssize_t)sizeof(child_out))
+      _exit(1);
+    _exit(0);
+  }
+  crypto_fast_rng_getbytes(rng, parent_out, sizeof(parent_out));
+  tt_int_op(read(fds[0], child_out, sizeof(child_out)), OP_EQ,
+            sizeof(child_out));
+  tt_int_op(waitpid(pid, &status, 0), OP_EQ, pid);
+  tt_int_op(status, OP_EQ, 0);
+  tt_mem_op(parent_out, OP_NE, child_out, sizeof(parent_out));
+
+ done:
+  if (fds[0] >= 0)
+    close(fds[0]);
+  if (fds[1] >= 0)
+    close(fds[1]);
+}
+#endif /* defined(HAVE_SYS_WAIT_H) && !defined(_WIN32) */
+
 /** Run unit tests for our AES128 functionality */
 static void
 test_crypto_aes128(void *arg)
@@ -1034,6 +1149,106 @@ test_crypto_sha3(void *arg)
   tor_free(mem_op_hex_tmp);
 }
 
+/** Make sure that one-shot SHA3 digests (which may use OpenSSL for long
+ * inputs) agree with incremental ones (which always use keccak-tiny). */
+static void
+test_crypto_sha3_oneshot_vs_running(void *arg)
+{
+  crypto_digest_t *d = NULL;
+  char *msg = NULL;
+  char oneshot[DIGEST512_LEN], running[DIGEST512_LEN];
+  const size_t maxlen = 4096;
+  int i;
+  (void)arg;
+
+  msg = tor_malloc(maxlen);
+  crypto_rand(msg, maxlen);
+
+  for (i = 0; i < 200; ++i) {
+    const int is512 = i & 1;
+    const digest_algorithm_t alg = is512 ? DIGEST_SHA3_512 : DIGEST_SHA3_256;
+    const size_t dlen = is512 ? DIGEST512_LEN : DIGEST256_LEN;
+    size_t len = crypto_rand_int((unsigned)maxlen + 1), off = 0;
+
+    if (is512) {
+      tt_int_op(0, OP_EQ, crypto_digest512(oneshot, msg, len, alg));
+      d = crypto_digest512_new(alg);
+    } else {
+      tt_int_op(0, OP_EQ, crypto_digest256(oneshot, msg, len, alg));
+      d = crypto_digest256_new(alg);
+    }
+    while (off < len) {
+      size_t n = crypto_rand_int(300) + 1;
+      n = MIN(n, len - off);
+      crypto_digest_add_bytes(d, msg + off, n);
+      off += n;
+    }
+    crypto_digest_get_digest(d, running, dlen);
+    crypto_digest_free(d);
+    d = NULL;
+    tt_mem_op(oneshot, OP_EQ, running, dlen);
+  }
+
+ done:
+  crypto_digest_free(d);
+  tor_free(msg);
+}
+
+/** Run unit tests for saving and restoring the state of running digests. */
+static void
+test_crypto_digest_checkpoint(void *arg)
+{
+  crypto_digest_t *d = NULL;
+  crypto_digest_checkpoint_t cp;
+  char d_out1[DIGEST512_LEN], d_out2[DIGEST512_LEN];
+  const digest_algorithm_t algs[] = {
+    DIGEST_SHA1, DIGEST_SHA256, DIGEST_SHA512, DIGEST_SHA3_256,
+    DIGEST_SHA3_512
+  };
+  unsigned i;
+  (void)arg;
+
+  for (i = 0; i < ARRAY_LENGTH(algs); ++i) {
+    const digest_algorithm_t alg = algs[i];
+    const size_t len = crypto_digest_algorithm_get_length(alg);
+    if (alg == DIGEST_SHA1)
+      d = crypto_digest_new();
+    else if (len == DIGEST256_LEN)
+      d = crypto_digest256_new(alg);
+    else
+      d = crypto_digest512_new(alg);
+
+    crypto_digest_add_bytes(d, "abcdef", 6);
+    crypto_digest_checkpoint(&cp, d);
+    /* Add some bytes, then roll them back. */
+    crypto_digest_add_bytes(d, "ghijkl", 6);
+    crypto_digest_get_digest(d, d_out1, len);
+    crypto_digest_restore(d, &cp);
+    crypto_digest_add_bytes(d, "mno", 3);
+    crypto_digest_get_digest(d, d_out1, len);
+
+    if (alg == DIGEST_SHA1)
+      crypto_digest(d_out2, "abcdefmno", 9);
+    else if (len == DIGEST256_LEN)
+      crypto_digest256(d_out2, "abcdefmno", 9, alg);
+    else
+      crypto_digest512(d_out2, "abcdefmno", 9, alg);
+    tt_mem_op(d_out1, OP_EQ, d_out2, len);
+
+    /* A checkpoint can be restored more than once. */
+    crypto_digest_restore(d, &cp);
+    crypto_digest_add_bytes(d, "mno", 3);
+    crypto_digest_get_digest(d, d_out1, len);
+    tt_mem_op(d_out1, OP_EQ, d_out2, len);
+
+    crypto_digest_free(d);
+    d = NULL;
+  }
+
+ done:
+  crypto_digest_free(d);
+}
+
 /** Run unit tests for our XOF. */
 static void
 test_crypto_sha3_xof(void *arg)
@@ -2970,6 +3185,10 @@ struct testcase_t crypto_tests[] = {
   CRYPTO_LEGACY(formats),
   CRYPTO_LEGACY(rng),
   { "rng_range", test_crypto_rng_range, 0, NULL, NULL },
+  { "rng_fast", test_crypto_rng_fast, 0, NULL, NULL },
+#if defined(HAVE_SYS_WAIT_H) && !defined(_WIN32)
+  { "rng_fast_fork", test_crypto_rng_fast_fork, TT_FORK, NULL, NULL },
+#endif
   { "rng_strongest", test_crypto_rng_strongest, TT_FORK, NULL, NULL },
   { "rng_strongest_nosyscall", test_crypto_rng_strongest, TT_FORK,
     &passthrough_setup, (void*)"nosyscall" },
@@ -2992,7 +3211,10 @@ struct testcase_t crypto_tests[] = {
   { "pk_base64", test_crypto_pk_base64, TT_FORK, NULL, NULL },
   CRYPTO_LEGACY(digests),
   { "digest_names", test_crypto_digest_names, 0, NULL, NULL },
+  { "digest_checkpoint", test_crypto_digest_checkpoint, 0, NULL, NULL },
   { "sha3", test_crypto_sha3, TT_FORK, NULL, NULL},
+  { "sha3_oneshot_vs_running", test_crypto_sha3_oneshot_vs_running, 0,
+    NULL, NULL },
   { "sha3_xof", test_crypto_sha3_xof, TT_FORK, NULL, NULL},
   { "mac_sha3", test_crypto_mac_sha3, TT_FORK, NULL, NULL},
   CRYPTO_LEGACY(dh),
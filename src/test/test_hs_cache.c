@@ -13,7 +13,9 @@
 #include "ed25519_cert.h"
 #include "hs_cache.h"
 #include "rendcache.h"
+#include "config.h"
 #include "directory.h"
+#include "main.h"
 #include "networkstatus.h"
 #include "connection.h"
 #include "proto_http.h"
@@ -165,6 +167,63 @@ test_directory(void *arg)
   tor_free(desc1_str);
 }
 
+/* Results of hs_cache_store_as_dir_async(), for test_dir_store_async(). */
+static int n_async_stored = 0;
+static int last_async_status = 1;
+
+static void
+store_async_cb(int status, void *arg)
+{
+  tt_ptr_op(arg, OP_EQ, &n_async_stored);
+  ++n_async_stored;
+  last_async_status = status;
+ done:
+  ;
+}
+
+/* Test that storing a descriptor asynchronously as an HSDir gives the same
+ * results as storing it synchronously. */
+static void
+test_dir_store_async(void *arg)
+{
+  int ret;
+  char *desc_str = NULL;
+  ed25519_keypair_t signing_kp;
+  hs_descriptor_t *desc = NULL;
+
+  (void) arg;
+
+  init_test();
+  ret = ed25519_keypair_generate(&signing_kp, 0);
+  tt_int_op(ret, OP_EQ, 0);
+  desc = hs_helper_build_hs_desc_with_ip(&signing_kp);
+  tt_assert(desc);
+  ret = hs_desc_encode_descriptor(desc, &signing_kp, &desc_str);
+  tt_int_op(ret, OP_EQ, 0);
+
+  /* We have no worker threads, so the callback runs before we return. */
+  hs_cache_store_as_dir_async(desc_str, store_async_cb, &n_async_stored);
+  tt_int_op(n_async_stored, OP_EQ, 1);
+  tt_int_op(last_async_status, OP_EQ, 0);
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc), NULL);
+  tt_int_op(ret, OP_EQ, 1);
+
+  /* We already have it. */
+  hs_cache_store_as_dir_async(desc_str, store_async_cb, &n_async_stored);
+  tt_int_op(n_async_stored, OP_EQ, 2);
+  tt_int_op(last_async_status, OP_EQ, -1);
+
+  /* Garbage doesn't decode. */
+  hs_cache_store_as_dir_async("hs-descriptor 3\nbad", store_async_cb,
+                              &n_async_stored);
+  tt_int_op(n_async_stored, OP_EQ, 3);
+  tt_int_op(last_async_status, OP_EQ, -1);
+
+ done:
+  hs_descriptor_free(desc);
+  tor_free(desc_str);
+}
+
 static void
 test_clean_as_dir(void *arg)
 {
@@ -214,6 +273,85 @@ test_clean_as_dir(void *arg)
   tor_free(desc1_str);
 }
 
+static void
+test_dir_size_cap(void *arg)
+{
+  int ret, i, n_entries, n_found = 0;
+  unsigned long n_bytes;
+  char *stats = NULL;
+  char *desc_str[3] = { NULL, NULL, NULL };
+  hs_descriptor_t *desc[3] = { NULL, NULL, NULL };
+  ed25519_keypair_t signing_kp[3];
+
+  (void) arg;
+
+  init_test();
+
+  for (i = 0; i < 3; i++) {
+    ret = ed25519_keypair_generate(&signing_kp[i], 0);
+    tt_int_op(ret, OP_EQ, 0);
+    desc[i] = hs_helper_build_hs_desc_with_ip(&signing_kp[i]);
+    tt_assert(desc[i]);
+    ret = hs_desc_encode_descriptor(desc[i], &signing_kp[i], &desc_str[i]);
+    tt_int_op(ret, OP_EQ, 0);
+  }
+
+  /* Find out how big one entry is. */
+  ret = hs_cache_store_as_dir(desc_str[0]);
+  tt_int_op(ret, OP_EQ, 0);
+  stats = hs_cache_get_stats_string();
+  tt_int_op(sscanf(stats, "dir-entries=%d dir-bytes=%lu", &n_entries,
+                   &n_bytes), OP_EQ, 2);
+  tt_int_op(n_entries, OP_EQ, 1);
+  tor_free(stats);
+
+  /* Room for two entries, but not three: storing the third one evicts one
+   * of the others. */
+  get_options_mutable()->MaxHSDirCacheSize = n_bytes * 5 / 2;
+  for (i = 1; i < 3; i++) {
+    ret = hs_cache_store_as_dir(desc_str[i]);
+    tt_int_op(ret, OP_EQ, 0);
+  }
+  for (i = 0; i < 3; i++) {
+    ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc[i]), NULL);
+    n_found += ret;
+  }
+  tt_int_op(n_found, OP_EQ, 2);
+  stats = hs_cache_get_stats_string();
+  tt_int_op(sscanf(stats, "dir-entries=%d dir-bytes=%lu", &n_entries,
+                   &n_bytes), OP_EQ, 2);
+  tt_int_op(n_entries, OP_EQ, 2);
+  tt_u64_op(n_bytes, OP_LE, get_options()->MaxHSDirCacheSize);
+  tt_assert(strstr(stats, " dir-hits=2 dir-misses=1 dir-evictions=1 "));
+  tor_free(stats);
+
+  /* A newer revision that can never fit is rejected, and the entry we
+   * already have stays in the cache. */
+  get_options_mutable()->MaxHSDirCacheSize = 100;
+  desc[2]->plaintext_data.revision_counter++;
+  tor_free(desc_str[2]);
+  ret = hs_desc_encode_descriptor(desc[2], &signing_kp[2], &desc_str[2]);
+  tt_int_op(ret, OP_EQ, 0);
+  ret = hs_cache_store_as_dir(desc_str[2]);
+  tt_int_op(ret, OP_EQ, -1);
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc[2]), NULL);
+  tt_int_op(ret, OP_EQ, 1);
+
+  /* A descriptor that can never fit is rejected. */
+  hs_cache_clean_as_dir(time(NULL) + 3*24*60*60);
+  ret = hs_cache_store_as_dir(desc_str[0]);
+  tt_int_op(ret, OP_EQ, -1);
+  stats = hs_cache_get_stats_string();
+  tt_assert(!strcmpstart(stats, "dir-entries=0 dir-bytes=0 "));
+
+ done:
+  tor_free(stats);
+  for (i = 0; i < 3; i++) {
+    hs_descriptor_free(desc[i]);
+    tor_free(desc_str[i]);
+  }
+}
+
 /* Test helper: Fetch an HS descriptor from an HSDir (for the hidden service
    with <b>blinded_key</b>. Return the received descriptor string. */
 static char *
@@ -264,6 +402,44 @@ helper_fetch_desc_from_hsdir(const ed25519_public_key_t *blinded_key)
   return received_desc;
 }
 
+/* Test helper: Post the HS descriptor <b>desc_str</b> to an HSDir, and
+   return the HTTP status code of its reply, or -1 if it didn't reply. */
+static int
+helper_post_desc_to_hsdir(const char *desc_str)
+{
+  int code = -1;
+  char *headers = NULL, *body = NULL;
+  size_t body_used = 0;
+
+  /* The dir conn we are going to simulate */
+  dir_connection_t *conn = NULL;
+
+  /* Without decoding threads, the descriptor is stored and the reply is
+   * written before handle_post_hs_descriptor_async() returns. */
+  hs_desc_decode_pool_free();
+
+  conn = dir_connection_new(AF_INET);
+  tor_addr_from_ipv4h(&conn->base_.addr, 0x7f000001);
+  TO_CONN(conn)->linked = 1;/* Pretend the conn is encrypted :) */
+  /* The reply finds its connection by global identifier. */
+  smartlist_add(get_connection_array(), TO_CONN(conn));
+  handle_post_hs_descriptor_async(conn, "/tor/hs/3/publish", desc_str);
+  smartlist_remove(get_connection_array(), TO_CONN(conn));
+
+  if (fetch_from_buf_http(TO_CONN(conn)->outbuf, &headers, MAX_HEADERS_SIZE,
+                          &body, &body_used, MAX_HEADERS_SIZE, 0) == 1) {
+    tt_int_op(parse_http_response(headers, &code, NULL, NULL, NULL),
+              OP_EQ, 0);
+  }
+
+ done:
+  tor_free(headers);
+  tor_free(body);
+  connection_free_(TO_CONN(conn));
+
+  return code;
+}
+
 /* Publish a descriptor to the HSDir, then fetch it. Check that the received
    descriptor matches the published one. */
 static void
@@ -303,7 +479,7 @@ test_upload_and_download_hs_desc(void *arg)
 
   /* Publish descriptor to the HSDir */
   {
-    retval = handle_post_hs_descriptor("/tor/hs/3/publish",published_desc_str);
+    retval = helper_post_desc_to_hsdir(published_desc_str);
     tt_int_op(retval, OP_EQ, 200);
   }
 
@@ -367,13 +543,13 @@ test_hsdir_revision_counter_check(void *arg)
 
   /* Publish descriptor to the HSDir */
   {
-    retval = handle_post_hs_descriptor("/tor/hs/3/publish",published_desc_str);
+    retval = helper_post_desc_to_hsdir(published_desc_str);
     tt_int_op(retval, OP_EQ, 200);
   }
 
   /* Try publishing again with the same revision counter: Should fail. */
   {
-    retval = handle_post_hs_descriptor("/tor/hs/3/publish",published_desc_str);
+    retval = helper_post_desc_to_hsdir(published_desc_str);
     tt_int_op(retval, OP_EQ, 400);
   }
 
@@ -406,7 +582,7 @@ test_hsdir_revision_counter_check(void *arg)
                                        &published_desc_str);
     tt_int_op(retval, OP_EQ, 0);
 
-    retval = handle_post_hs_descriptor("/tor/hs/3/publish",published_desc_str);
+    retval = helper_post_desc_to_hsdir(published_desc_str);
     tt_int_op(retval, OP_EQ, 200);
   }
 
@@ -547,8 +723,12 @@ struct testcase_t hs_cache[] = {
   /* Encoding tests. */
   { "directory", test_directory, TT_FORK,
     NULL, NULL },
+  { "dir_store_async", test_dir_store_async, TT_FORK,
+    NULL, NULL },
   { "clean_as_dir", test_clean_as_dir, TT_FORK,
     NULL, NULL },
+  { "dir_size_cap", test_dir_size_cap, TT_FORK,
+    NULL, NULL },
   { "hsdir_revision_counter_check", test_hsdir_revision_counter_check, TT_FORK,
     NULL, NULL },
   { "upload_and_download_hs_desc", test_upload_and_download_hs_desc, TT_FORK,
@@ -406,6 +406,136 @@ test_responsible_hsdirs(void *arg)
   cleanup_nodelist();
 }
 
+/* Helper: return true iff looking up the responsible HSDirs of
+ * <b>blinded_pk</b> gives the same result whether the HSDir hash ring was
+ * updated incrementally or rebuilt from scratch. */
+static int
+responsible_hsdirs_match_rebuild(const ed25519_public_key_t *blinded_pk,
+                                 uint64_t time_period_num)
+{
+  int ret = 0;
+  smartlist_t *incremental = smartlist_new();
+  smartlist_t *rebuilt = smartlist_new();
+
+  for (int mode = 0; mode < 3; mode++) {
+    int use_second = (mode == 2), for_fetching = (mode == 0);
+    smartlist_clear(incremental);
+    smartlist_clear(rebuilt);
+    hs_get_responsible_hsdirs(blinded_pk, time_period_num, use_second,
+                              for_fetching, incremental);
+    hs_hsdir_ring_invalidate();
+    hs_get_responsible_hsdirs(blinded_pk, time_period_num, use_second,
+                              for_fetching, rebuilt);
+    if (smartlist_len(incremental) != smartlist_len(rebuilt)) {
+      goto end;
+    }
+    for (int i = 0; i < smartlist_len(rebuilt); i++) {
+      if (smartlist_get(incremental, i) != smartlist_get(rebuilt, i)) {
+        goto end;
+      }
+    }
+  }
+  ret = 1;
+
+ end:
+  smartlist_free(incremental);
+  smartlist_free(rebuilt);
+  return ret;
+}
+
+/** Test that the HSDir hash ring follows node changes without a rebuild. */
+static void
+test_responsible_hsdirs_ring_update(void *arg)
+{
+  time_t now = approx_time();
+  smartlist_t *responsible_dirs = smartlist_new();
+  networkstatus_t *ns = NULL;
+  ed25519_keypair_t kp;
+  node_t *node;
+  routerstatus_t *gone_rs = NULL;
+  microdesc_t *gone_md = NULL;
+  uint64_t time_period_num;
+
+  (void) arg;
+
+  hs_init();
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+
+  ns = networkstatus_get_latest_consensus();
+  for (int i = 1; i <= 20; i++) {
+    helper_add_hsdir_to_networkstatus(ns, i, "hsdir", 1);
+  }
+
+  tt_int_op(ed25519_keypair_generate(&kp, 0), OP_EQ, 0);
+  time_period_num = hs_get_time_period_num(now);
+
+  /* Build the ring. */
+  hs_get_responsible_hsdirs(&kp.pubkey, time_period_num, 0, 1,
+                            responsible_dirs);
+  tt_int_op(smartlist_len(responsible_dirs), OP_EQ, 6);
+  tt_assert(responsible_hsdirs_match_rebuild(&kp.pubkey, time_period_num));
+
+  /* Demote the first responsible HSDir and make sure it is taken off the
+   * ring. */
+  node = node_get_mutable_by_id(
+                 ((routerstatus_t *) smartlist_get(responsible_dirs, 0))
+                   ->identity_digest);
+  tt_assert(node);
+  node->rs->is_hs_dir = 0;
+  hs_hsdir_ring_node_changed(node);
+  smartlist_clear(responsible_dirs);
+  hs_get_responsible_hsdirs(&kp.pubkey, time_period_num, 0, 1,
+                            responsible_dirs);
+  tt_int_op(smartlist_len(responsible_dirs), OP_EQ, 6);
+  tt_assert(!smartlist_contains(responsible_dirs, node->rs));
+
+  /* Promote it back: it must be found at the same place again. */
+  node->rs->is_hs_dir = 1;
+  hs_hsdir_ring_node_changed(node);
+  smartlist_clear(responsible_dirs);
+  hs_get_responsible_hsdirs(&kp.pubkey, time_period_num, 0, 1,
+                            responsible_dirs);
+  tt_ptr_op(smartlist_get(responsible_dirs, 0), OP_EQ, node->rs);
+  tt_assert(responsible_hsdirs_match_rebuild(&kp.pubkey, time_period_num));
+
+  /* New HSDirs get their index computed and inserted in place. */
+  for (int i = 21; i <= 40; i++) {
+    helper_add_hsdir_to_networkstatus(ns, i, "hsdir", 1);
+  }
+  tt_assert(responsible_hsdirs_match_rebuild(&kp.pubkey, time_period_num));
+
+  /* A new consensus without the first responsible HSDir: the ring follows
+   * it. */
+  smartlist_clear(responsible_dirs);
+  hs_get_responsible_hsdirs(&kp.pubkey, time_period_num, 0, 1,
+                            responsible_dirs);
+  gone_rs = smartlist_get(responsible_dirs, 0);
+  node = node_get_mutable_by_id(gone_rs->identity_digest);
+  tt_assert(node);
+  gone_md = node->md;
+  smartlist_remove(ns->routerstatus_list, gone_rs);
+  nodelist_set_consensus(ns);
+  tt_ptr_op(node_get_by_id(gone_rs->identity_digest), OP_EQ, NULL);
+  smartlist_clear(responsible_dirs);
+  hs_get_responsible_hsdirs(&kp.pubkey, time_period_num, 0, 1,
+                            responsible_dirs);
+  tt_int_op(smartlist_len(responsible_dirs), OP_EQ, 6);
+  tt_assert(!smartlist_contains(responsible_dirs, gone_rs));
+  tt_assert(responsible_hsdirs_match_rebuild(&kp.pubkey, time_period_num));
+
+ done:
+  routerstatus_free(gone_rs);
+  tor_free(gone_md);
+  SMARTLIST_FOREACH(ns->routerstatus_list,
+                    routerstatus_t *, rs, routerstatus_free(rs));
+  smartlist_free(responsible_dirs);
+  smartlist_clear(ns->routerstatus_list);
+  networkstatus_vote_free(mock_ns);
+  cleanup_nodelist();
+}
+
 static void
 mock_directory_initiate_request(directory_request_t *req)
 {
@@ -1781,6 +1911,8 @@ struct testcase_t hs_common_tests[] = {
     TT_FORK, NULL, NULL },
   { "responsible_hsdirs", test_responsible_hsdirs, TT_FORK,
     NULL, NULL },
+  { "responsible_hsdirs_ring_update", test_responsible_hsdirs_ring_update,
+    TT_FORK, NULL, NULL },
   { "desc_reupload_logic", test_desc_reupload_logic, TT_FORK,
     NULL, NULL },
   { "disaster_srv", test_disaster_srv, TT_FORK,
@@ -11,6 +11,8 @@
 #include "crypto_ed25519.h"
 #include "ed25519_cert.h"
 #include "or.h"
+#include "cpuworker.h"
+#include "workqueue.h"
 #include "hs_descriptor.h"
 #include "test.h"
 #include "torcert.h"
@@ -357,6 +359,119 @@ test_decode_descriptor(void *arg)
   tor_free(encoded);
 }
 
+/* Results of asynchronous decodes, for test_decode_descriptor_async(). */
+static int n_async_decoded = 0;
+static int n_async_failed = 0;
+static hs_descriptor_t *async_decoded = NULL;
+
+/* Work queued with mock_cpuworker_queue_work(). */
+typedef struct fake_work_queue_ent_t {
+  enum workqueue_reply_t (*fn)(void *, void *);
+  void (*reply_fn)(void *);
+  void *arg;
+} fake_work_queue_ent_t;
+static smartlist_t *fake_cpuworker_queue = NULL;
+
+static struct workqueue_entry_s *
+mock_cpuworker_queue_work(workqueue_priority_t prio,
+                          enum workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  (void) prio;
+
+  if (! fake_cpuworker_queue)
+    fake_cpuworker_queue = smartlist_new();
+
+  fake_work_queue_ent_t *ent = tor_malloc_zero(sizeof(*ent));
+  ent->fn = fn;
+  ent->reply_fn = reply_fn;
+  ent->arg = arg;
+  smartlist_add(fake_cpuworker_queue, ent);
+  return (struct workqueue_entry_s *)ent;
+}
+
+static void
+decode_async_cb(int status, hs_descriptor_t *desc, void *arg)
+{
+  tt_ptr_op(arg, OP_EQ, &n_async_decoded);
+  if (status < 0) {
+    tt_ptr_op(desc, OP_EQ, NULL);
+    ++n_async_failed;
+    return;
+  }
+  tt_assert(desc);
+  ++n_async_decoded;
+  hs_descriptor_free(async_decoded);
+  async_decoded = desc;
+ done:
+  ;
+}
+
+static void
+test_decode_descriptor_async(void *arg)
+{
+  int ret, i;
+  char *encoded = NULL;
+  ed25519_keypair_t signing_kp;
+  hs_descriptor_t *desc = NULL;
+  uint8_t subcredential[DIGEST256_LEN];
+
+  (void) arg;
+
+  ret = ed25519_keypair_generate(&signing_kp, 0);
+  tt_int_op(ret, OP_EQ, 0);
+  desc = hs_helper_build_hs_desc_with_ip(&signing_kp);
+  hs_helper_get_subcred_from_identity_keypair(&signing_kp, subcredential);
+  ret = hs_desc_encode_descriptor(desc, &signing_kp, &encoded);
+  tt_int_op(ret, OP_EQ, 0);
+
+  /* Without worker threads, the callback runs right away. */
+  setup_full_capture_of_logs(LOG_WARN);
+  ret = hs_desc_decode_descriptor_async("hladfjlkjadf", subcredential,
+                                        decode_async_cb, &n_async_decoded);
+  teardown_capture_of_logs();
+  tt_int_op(ret, OP_EQ, 0);
+  tt_int_op(n_async_failed, OP_EQ, 1);
+  ret = hs_desc_decode_descriptor_async(encoded, subcredential,
+                                        decode_async_cb, &n_async_decoded);
+  tt_int_op(ret, OP_EQ, 0);
+  tt_int_op(n_async_decoded, OP_EQ, 1);
+  hs_helper_desc_equal(desc, async_decoded);
+  hs_descriptor_free(async_decoded);
+  async_decoded = NULL;
+
+  /* With worker threads, the callbacks run when the replies come back. */
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  for (i = 0; i < 8; i++) {
+    ret = hs_desc_decode_descriptor_async(encoded, subcredential,
+                                          decode_async_cb, &n_async_decoded);
+    tt_int_op(ret, OP_EQ, 0);
+  }
+  tt_int_op(smartlist_len(fake_cpuworker_queue), OP_EQ, 8);
+  tt_int_op(n_async_decoded, OP_EQ, 1);
+  SMARTLIST_FOREACH(fake_cpuworker_queue, fake_work_queue_ent_t *, ent,
+                    tt_int_op(ent->fn(NULL, ent->arg), OP_EQ, WQ_RPL_REPLY));
+  tt_int_op(n_async_decoded, OP_EQ, 1);
+  SMARTLIST_FOREACH_BEGIN(fake_cpuworker_queue, fake_work_queue_ent_t *, ent) {
+    ent->reply_fn(ent->arg);
+    tor_free(ent);
+    SMARTLIST_DEL_CURRENT(fake_cpuworker_queue, ent);
+  } SMARTLIST_FOREACH_END(ent);
+  tt_int_op(n_async_decoded, OP_EQ, 9);
+  tt_int_op(n_async_failed, OP_EQ, 1);
+  hs_helper_desc_equal(desc, async_decoded);
+
+ done:
+  UNMOCK(cpuworker_queue_work);
+  smartlist_free(fake_cpuworker_queue);
+  fake_cpuworker_queue = NULL;
+  teardown_capture_of_logs();
+  hs_descriptor_free(desc);
+  hs_descriptor_free(async_decoded);
+  tor_free(encoded);
+}
+
 static void
 test_supported_version(void *arg)
 {
@@ -870,6 +985,8 @@ struct testcase_t hs_descriptor[] = {
   /* Decoding tests. */
   { "decode_descriptor", test_decode_descriptor, TT_FORK,
     NULL, NULL },
+  { "decode_descriptor_async", test_decode_descriptor_async, TT_FORK,
+    NULL, NULL },
   { "encrypted_data_len", test_encrypted_data_len, TT_FORK,
     NULL, NULL },
   { "decode_invalid_intro_point", test_decode_invalid_intro_point, TT_FORK,
@@ -1309,6 +1309,106 @@ test_upload_descriptors(void *arg)
   UNMOCK(get_or_state);
 }
 
+/* Helper: Return a newly allocated and registered service in a stable
+ * state: both descriptors have one established intro point and have been
+ * uploaded. */
+static hs_service_t *
+helper_create_idle_service(time_t now)
+{
+  hs_service_t *service = helper_create_service();
+  tt_assert(service);
+  service->desc_next = service_descriptor_new();
+  service->config.num_intro_points = 1;
+  service->state.next_rotation_time = now + 3600;
+
+  for (int i = 0; i < 2; i++) {
+    hs_service_descriptor_t *desc =
+      (i == 0) ? service->desc_current : service->desc_next;
+    hs_service_intro_point_t *ip = helper_create_service_ip();
+    tt_assert(ip);
+    ip->circuit_established = 1;
+    ip->time_to_expire = now + 3600;
+    service_intro_point_add(desc->intro_points.map, ip);
+    desc->next_upload_time = now + 1000;
+  }
+
+ done:
+  return service;
+}
+
+/** Test that the scheduled events only look at the services that need it. */
+static void
+test_scheduled_events_many_services(void *arg)
+{
+  const int n_services = 200;
+  time_t now = time(NULL);
+  hs_service_t *busy = NULL;
+  hs_service_intro_point_t *ip = NULL;
+  smartlist_t *services = smartlist_new();
+
+  (void) arg;
+
+  hs_init();
+
+  for (int i = 0; i < n_services; i++) {
+    hs_service_t *service = helper_create_idle_service(now);
+    tt_assert(service);
+    smartlist_add(services, service);
+  }
+  busy = smartlist_get(services, 0);
+
+  /* A stable service is left alone for the maximum idle period. */
+  tt_i64_op(get_service_next_event_time(busy, now), OP_EQ,
+            now + HS_SERVICE_MAX_IDLE_EVENT_PERIOD);
+  /* ... or until its next upload time. */
+  busy->desc_next->next_upload_time = now + 10;
+  tt_i64_op(get_service_next_event_time(busy, now), OP_EQ, now + 10);
+  /* ... or until the next second if the upload is due. */
+  busy->desc_next->next_upload_time = now;
+  tt_i64_op(get_service_next_event_time(busy, now), OP_EQ, now + 1);
+  busy->desc_next->next_upload_time = now + 1000;
+  /* An intro point without an established circuit needs attention. */
+  DIGEST256MAP_FOREACH(busy->desc_current->intro_points.map, key,
+                       hs_service_intro_point_t *, i) {
+    ip = i;
+  } DIGEST256MAP_FOREACH_END;
+  tt_assert(ip);
+  ip->circuit_established = 0;
+  tt_i64_op(get_service_next_event_time(busy, now), OP_EQ, now + 1);
+  ip->circuit_established = 1;
+
+  SMARTLIST_FOREACH(services, hs_service_t *, service,
+    service->state.next_event_time =
+      get_service_next_event_time(service, now));
+
+  /* The intro circuit of the first service closes: only that service gets
+   * looked at by the housekeeping event which removes its intro points
+   * because their nodes are unknown. */
+  busy->state.next_event_time = 0;
+  run_housekeeping_event(now);
+  tt_int_op(digest256map_size(busy->desc_current->intro_points.map),
+            OP_EQ, 0);
+  SMARTLIST_FOREACH_BEGIN(services, hs_service_t *, service) {
+    if (service == busy) {
+      continue;
+    }
+    tt_int_op(digest256map_size(service->desc_current->intro_points.map),
+              OP_EQ, 1);
+  } SMARTLIST_FOREACH_END(service);
+  tt_i64_op(get_service_next_event_time(busy, now), OP_EQ, now + 1);
+
+  /* New directory information makes every service be looked at. */
+  hs_service_dir_info_changed();
+  run_housekeeping_event(now);
+  SMARTLIST_FOREACH(services, hs_service_t *, service,
+    tt_int_op(digest256map_size(service->desc_current->intro_points.map),
+              OP_EQ, 0));
+
+ done:
+  smartlist_free(services);
+  hs_free_all();
+}
+
 /** Test the functions that save and load HS revision counters to state. */
 static void
 test_revision_counter_state(void *arg)
@@ -1520,6 +1620,8 @@ struct testcase_t hs_service_tests[] = {
     NULL, NULL },
   { "upload_descriptors", test_upload_descriptors, TT_FORK,
     NULL, NULL },
+  { "scheduled_events_many_services", test_scheduled_events_many_services,
+    TT_FORK, NULL, NULL },
   { "revision_counter_state", test_revision_counter_state, TT_FORK,
     NULL, NULL },
   { "rendezvous1_parsing", test_rendezvous1_parsing, TT_FORK,
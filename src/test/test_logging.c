@@ -127,6 +127,75 @@ test_sigsafe_err(void *arg)
   smartlist_free(lines);
 }
 
+/** Helper: log <b>n</b> numbered info messages and one "last" message
+ * through the log writer thread to a new log file, using
+ * <b>overflow_policy</b>, and check what arrives in the file. */
+static void
+check_async_log(int n, int overflow_policy)
+{
+  const char *fn = get_fname("async_log");
+  log_severity_list_t severity;
+  char *content = NULL;
+  smartlist_t *lines = smartlist_new();
+  int i, next = 0, n_dropped = 0;
+
+  set_log_severity_config(LOG_INFO, LOG_ERR, &severity);
+  init_logging(1);
+  mark_logs_temp();
+  tt_int_op(add_file_log(&severity, fn, 1), OP_EQ, 0);
+  close_temp_logs();
+  tt_int_op(log_set_async(1, overflow_policy), OP_EQ, 0);
+
+  for (i = 0; i < n; ++i)
+    log_info(LD_GENERAL, "Message %d", i);
+  log_async_flush();
+  log_info(LD_GENERAL, "Last message");
+  /* Errors are written before we return. */
+  log_err(LD_GENERAL, "Error message");
+  content = read_file_to_str(fn, 0, NULL);
+  tt_ptr_op(content, OP_NE, NULL);
+  tor_split_lines(lines, content, (int)strlen(content));
+
+  /* Every message arrives in order, or is counted as dropped. */
+  SMARTLIST_FOREACH_BEGIN(lines, const char *, line) {
+    const char *cp;
+    if ((cp = strstr(line, "Dropped "))) {
+      n_dropped += atoi(cp + strlen("Dropped "));
+    } else if ((cp = strstr(line, "Message "))) {
+      i = atoi(cp + strlen("Message "));
+      tt_int_op(i, OP_GE, next);
+      n_dropped -= i - next;
+      next = i + 1;
+    }
+  } SMARTLIST_FOREACH_END(line);
+  tt_int_op(n_dropped, OP_EQ, n - next);
+  if (overflow_policy == LOG_ASYNC_OVERFLOW_BLOCK)
+    tt_int_op(next, OP_EQ, n);
+  tt_assert(strstr(smartlist_get(lines, smartlist_len(lines)-2),
+                   "Last message"));
+  tt_assert(strstr(smartlist_get(lines, smartlist_len(lines)-1),
+                   "Error message"));
+
+ done:
+  log_set_async(0, overflow_policy);
+  tor_free(content);
+  smartlist_free(lines);
+}
+
+static void
+test_async_block(void *arg)
+{
+  (void)arg;
+  check_async_log(20000, LOG_ASYNC_OVERFLOW_BLOCK);
+}
+
+static void
+test_async_drop(void *arg)
+{
+  (void)arg;
+  check_async_log(20000, LOG_ASYNC_OVERFLOW_DROP);
+}
+
 static void
 test_ratelim(void *arg)
 {
@@ -168,6 +237,8 @@ struct testcase_t logging_tests[] = {
   { "sigsafe_err_fds", test_get_sigsafe_err_fds, TT_FORK, NULL, NULL },
   { "sigsafe_err", test_sigsafe_err, TT_FORK, NULL, NULL },
   { "ratelim", test_ratelim, 0, NULL, NULL },
+  { "async_block", test_async_block, TT_FORK, NULL, NULL },
+  { "async_drop", test_async_drop, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -9,6 +9,7 @@
 #include "crypto.h"
 #include "config.h"
 #include "test.h"
+#include "log_test_helpers.h"
 #include "mt_stats.h"
 
 #pragma GCC diagnostic ignored "-Wbad-function-cast"
@@ -27,16 +28,27 @@ typedef struct {
   int publish_counts;
   int time_profiles;
   double total_counts;
+  int rate_hist_circuits;
+  int burst_hist_intervals;
+  double inbound_counts;
+  double outbound_counts;
+  char last_filename[128];
 } validation_data_t;
 
 // helper functions
 static time_t mock_time(void);
 static void mock_publish_to_disk(const char* filename, smartlist_t* time_profiles_buckets,
-				 smartlist_t* total_counts_buckets, smartlist_t* time_stdevs_buckets);
+				 smartlist_t* total_counts_buckets, smartlist_t* time_stdevs_buckets,
+				 const uint32_t* rate_hist, const uint32_t* burst_hist,
+				 smartlist_t* inbound_counts_buckets, smartlist_t* outbound_counts_buckets);
 static circuit_t* new_circ(void);
 static uint16_t rand_port(void);
 static int compare_random(const void **a, const void **b);
 static void test_mt_stats(void *arg);
+static void test_mt_stats_hist_bucket(void *arg);
+static void test_mt_stats_sampling(void *arg);
+static void test_mt_stats_positions(void *arg);
+static void test_mt_stats_checkpoint(void *arg);
 
 static smartlist_t* active_circs;
 static time_t current_time;
@@ -86,7 +98,7 @@ static void test_mt_stats(void *arg)
     // loop through active circuits and randomly increment
     SMARTLIST_FOREACH_BEGIN(active_circs, circuit_t*, circ) {
       if((double) rand()/RAND_MAX < SEND_PROB){
-        mt_stats_circ_increment(circ);
+        mt_stats_circ_increment(circ, CELL_DIRECTION_IN);
       }
     } SMARTLIST_FOREACH_END(circ);
 
@@ -138,6 +150,11 @@ static void test_mt_stats(void *arg)
   tt_assert(test_counts_total == validation_data.time_profiles);
   tt_assert(total_counts_diff < EPSILON);
 
+  // every published circuit lands in exactly one rate histogram bucket
+  tt_int_op(validation_data.rate_hist_circuits, OP_EQ,
+            validation_data.publish_counts * MT_BUCKET_SIZE * MT_BUCKET_NUM);
+  tt_int_op(validation_data.burst_hist_intervals, OP_GT, 0);
+
  done:
 
   UNMOCK(mt_time);
@@ -156,10 +173,264 @@ static void test_mt_stats(void *arg)
   }
 }
 
+static void test_mt_stats_hist_bucket(void *arg)
+{
+  (void)arg;
+
+  // small values get a bucket each
+  for(uint32_t v = 0; v < (1u << MT_HIST_SUB_BITS); v++){
+    tt_int_op(mt_hist_bucket(v), OP_EQ, v);
+    tt_uint_op(mt_hist_bucket_min(v), OP_EQ, v);
+  }
+
+  // buckets are contiguous, ordered and cover every uint32_t
+  for(int b = 1; b < MT_HIST_NUM_BUCKETS; b++){
+    uint32_t min = mt_hist_bucket_min(b);
+    tt_uint_op(min, OP_GT, mt_hist_bucket_min(b - 1));
+    tt_int_op(mt_hist_bucket(min), OP_EQ, b);
+    tt_int_op(mt_hist_bucket(min - 1), OP_EQ, b - 1);
+  }
+  tt_int_op(mt_hist_bucket(UINT32_MAX), OP_EQ, MT_HIST_NUM_BUCKETS - 1);
+
+  // relative bucket width is bounded by 2^-MT_HIST_SUB_BITS
+  tt_int_op(mt_hist_bucket(1000), OP_EQ, mt_hist_bucket(1023));
+  tt_int_op(mt_hist_bucket(1023), OP_LT, mt_hist_bucket(1024));
+  tt_uint_op(mt_hist_bucket_min(mt_hist_bucket(1000)), OP_EQ, 960);
+
+ done:
+  ;
+}
+
+/**
+ * Create n circuits, offer each exit circuit a stream and have each other one
+ * pass on a cell, and return how many of them are still collecting
+ */
+static int sample_circuits(int n, int exit){
+
+  or_circuit_t* or_circ = tor_malloc_zero(sizeof(or_circuit_t));
+  edge_connection_t* edge_conn = tor_malloc_zero(sizeof(edge_connection_t));
+  int collecting = 0;
+
+  or_circ->base_.magic = OR_CIRCUIT_MAGIC;
+  TO_CONN(edge_conn)->port = 443;
+
+  for(int i = 0; i < n; i++){
+    memset(&or_circ->mt_stats, 0, sizeof(or_circ->mt_stats));
+    mt_stats_circ_create(TO_CIRCUIT(or_circ));
+    if(exit)
+      mt_stats_circ_port(TO_CIRCUIT(or_circ), edge_conn);
+    else
+      mt_stats_circ_relay(TO_CIRCUIT(or_circ), CELL_DIRECTION_OUT);
+    if(or_circ->mt_stats.collecting){
+      collecting++;
+      SMARTLIST_FOREACH(or_circ->mt_stats.time_profile, uint32_t*, cp, tor_free(cp));
+      smartlist_free(or_circ->mt_stats.time_profile);
+    }
+  }
+
+  tor_free(edge_conn);
+  tor_free(or_circ);
+  return collecting;
+}
+
+static void test_mt_stats_sampling(void *arg)
+{
+  (void)arg;
+
+  const int n = 200000;
+  or_options_t* options = (or_options_t*)get_options();
+  mt_stats_init();
+
+  // nothing is sampled when both rates are zero
+  options->MoneTorStatistics = 0.0;
+  options->MoneTorStatisticsMiddle = 0.0;
+  tt_int_op(sample_circuits(n, 0), OP_EQ, 0);
+
+  // everything is sampled at rate one
+  options->MoneTorStatistics = 1.0;
+  options->MoneTorStatisticsMiddle = 1.0;
+  tt_int_op(sample_circuits(1000, 0), OP_EQ, 1000);
+  tt_int_op(sample_circuits(1000, 1), OP_EQ, 1000);
+
+  // circuits are sampled at the larger rate until we know they are exits
+  options->MoneTorStatistics = 0.02;
+  options->MoneTorStatisticsMiddle = 0.1;
+  tt_int_op(sample_circuits(n, 0), OP_GT, n * 0.1 * 0.95);
+  tt_int_op(sample_circuits(n, 0), OP_LT, n * 0.1 * 1.05);
+  tt_int_op(sample_circuits(n, 1), OP_GT, n * 0.02 * 0.9);
+  tt_int_op(sample_circuits(n, 1), OP_LT, n * 0.02 * 1.1);
+
+  // a higher exit rate applies to all circuits
+  options->MoneTorStatistics = 0.25;
+  options->MoneTorStatisticsMiddle = 0.0;
+  tt_int_op(sample_circuits(n, 1), OP_GT, n * 0.25 * 0.97);
+  tt_int_op(sample_circuits(n, 1), OP_LT, n * 0.25 * 1.03);
+
+  // and circuits that pass on a cell are thinned to the middle rate then
+  options->MoneTorStatisticsMiddle = 0.01;
+  tt_int_op(sample_circuits(n, 0), OP_GT, n * 0.01 * 0.8);
+  tt_int_op(sample_circuits(n, 0), OP_LT, n * 0.01 * 1.2);
+  options->MoneTorStatisticsMiddle = 0.0;
+  tt_int_op(sample_circuits(n, 0), OP_EQ, 0);
+
+ done:
+  options->MoneTorStatistics = 0.0;
+  options->MoneTorStatisticsMiddle = 0.0;
+}
+
+static void test_mt_stats_positions(void *arg)
+{
+  (void)arg;
+
+  or_options_t* options = (or_options_t*)get_options();
+  options->MoneTorStatistics = 0.0;
+  options->MoneTorStatisticsMiddle = 1.0;
+  current_time = 1000;
+  memset(&validation_data, 0, sizeof(validation_data));
+  MOCK(mt_time, mock_time);
+  MOCK(mt_publish_to_disk, mock_publish_to_disk);
+  mt_stats_init();
+
+  // circuits are grouped by position and purpose when they do not exit here
+  circuit_t* circ = TO_CIRCUIT(or_circuit_new(0, NULL));
+  mt_stats_circ_create(circ);
+  tt_int_op(mt_stats_circ_group(circ), OP_EQ, MT_POSITION_GROUP_MIDDLE);
+  TO_OR_CIRCUIT(circ)->mt_stats.prev_is_client = 1;
+  tt_int_op(mt_stats_circ_group(circ), OP_EQ, MT_POSITION_GROUP_GUARD);
+  circ->purpose = CIRCUIT_PURPOSE_INTRO_POINT;
+  tt_int_op(mt_stats_circ_group(circ), OP_EQ, MT_POSITION_GROUP_INTRO);
+  circ->purpose = CIRCUIT_PURPOSE_REND_ESTABLISHED;
+  tt_int_op(mt_stats_circ_group(circ), OP_EQ, MT_POSITION_GROUP_REND);
+  tt_int_op(mt_stats_circ_record(circ), OP_EQ, 0);
+  circuit_free(circ);
+
+  // a circuit that counted a complete window but is dropped before it is
+  // recorded leaves nothing in the burst histogram
+  circ = new_circ();
+  mt_stats_circ_create(circ);
+  mt_stats_circ_increment(circ, CELL_DIRECTION_OUT);
+  current_time += MT_BUCKET_TIME;
+  mt_stats_circ_increment(circ, CELL_DIRECTION_OUT);
+  mt_stats_circ_port(circ, TO_OR_CIRCUIT(circ)->n_streams);
+  tt_int_op(TO_OR_CIRCUIT(circ)->mt_stats.collecting, OP_EQ, 0);
+  circuit_free(circ);
+
+  // a full session of middle circuits gets published with direction counts
+  for(int i = 0; i < MT_BUCKET_SIZE * MT_BUCKET_NUM; i++){
+    circ = TO_CIRCUIT(or_circuit_new(0, NULL));
+    mt_stats_circ_create(circ);
+    for(int j = 0; j < 3; j++)
+      mt_stats_circ_increment(circ, CELL_DIRECTION_OUT);
+    current_time += MT_BUCKET_TIME;
+    mt_stats_circ_increment(circ, CELL_DIRECTION_IN);
+    tt_int_op(mt_stats_circ_record(circ), OP_EQ, 1);
+    mt_stats_publish();
+    circuit_free(circ);
+  }
+
+  tt_int_op(validation_data.publish_counts, OP_EQ, 1);
+  tt_str_op(validation_data.last_filename, OP_EQ,
+            "mt_stats/published/position_group_middle_0");
+  tt_int_op(validation_data.time_profiles, OP_EQ, 4 * MT_BUCKET_SIZE * MT_BUCKET_NUM);
+  tt_double_op(validation_data.inbound_counts, OP_GT, MT_BUCKET_SIZE * MT_BUCKET_NUM - EPSILON);
+  tt_double_op(validation_data.inbound_counts, OP_LT, MT_BUCKET_SIZE * MT_BUCKET_NUM + EPSILON);
+  tt_double_op(validation_data.outbound_counts, OP_GT, 3 * MT_BUCKET_SIZE * MT_BUCKET_NUM - EPSILON);
+  tt_double_op(validation_data.outbound_counts, OP_LT, 3 * MT_BUCKET_SIZE * MT_BUCKET_NUM + EPSILON);
+  tt_int_op(validation_data.burst_hist_intervals, OP_EQ, MT_BUCKET_SIZE * MT_BUCKET_NUM);
+
+  // without a middle rate, such circuits stop collecting as soon as they pass
+  // on a cell, and are not recorded
+  options->MoneTorStatistics = 1.0;
+  options->MoneTorStatisticsMiddle = 0.0;
+  circ = TO_CIRCUIT(or_circuit_new(0, NULL));
+  mt_stats_circ_create(circ);
+  tt_assert(TO_OR_CIRCUIT(circ)->mt_stats.collecting);
+  mt_stats_circ_relay(circ, CELL_DIRECTION_OUT);
+  tt_assert(!TO_OR_CIRCUIT(circ)->mt_stats.collecting);
+  tt_int_op(TO_OR_CIRCUIT(circ)->mt_stats.total_count, OP_EQ, 0);
+  tt_int_op(mt_stats_circ_record(circ), OP_EQ, 0);
+  circuit_free(circ);
+
+ done:
+  UNMOCK(mt_time);
+  UNMOCK(mt_publish_to_disk);
+  options->MoneTorStatistics = 0.0;
+  options->MoneTorStatisticsMiddle = 0.0;
+}
+
+static void test_mt_stats_checkpoint(void *arg)
+{
+  (void)arg;
+
+  char* fname = get_datadir_fname("mt_stats_checkpoint");
+  char* before = NULL;
+  char* after = NULL;
+  size_t before_len, after_len;
+  or_options_t* options = (or_options_t*)get_options();
+  options->MoneTorStatistics = 1.0;
+  options->MoneTorStatisticsMiddle = 1.0;
+  current_time = 1000;
+  MOCK(mt_time, mock_time);
+  unlink(fname);
+  mt_stats_init();
+
+  // nothing is written until a circuit is recorded
+  tt_int_op(mt_stats_checkpoint(), OP_EQ, 0);
+  tt_int_op(file_status(fname), OP_EQ, FN_NOENT);
+
+  // record a few exit and middle circuits over several time buckets
+  for(int i = 0; i < 50; i++){
+    circuit_t* circ = new_circ();
+    mt_stats_circ_create(circ);
+    if(i % 2)
+      mt_stats_circ_port(circ, TO_OR_CIRCUIT(circ)->n_streams);
+    for(int j = 0; j <= i; j++){
+      mt_stats_circ_increment(circ, j % 3 ? CELL_DIRECTION_IN : CELL_DIRECTION_OUT);
+      current_time += 1;
+    }
+    mt_stats_circ_record(circ);
+    circuit_free(circ);
+  }
+
+  before = mt_stats_encode_checkpoint(&before_len);
+  tt_int_op(mt_stats_checkpoint(), OP_EQ, 0);
+  tt_int_op(file_status(fname), OP_EQ, FN_FILE);
+
+  // a restart restores exactly what we had
+  mt_stats_init();
+  after = mt_stats_encode_checkpoint(&after_len);
+  tt_u64_op(after_len, OP_EQ, before_len);
+  tt_mem_op(after, OP_EQ, before, before_len);
+  tor_free(after);
+
+  // a truncated checkpoint is ignored
+  tt_int_op(write_bytes_to_file(fname, before, before_len - 1, 1), OP_EQ, 0);
+  setup_full_capture_of_logs(LOG_WARN);
+  mt_stats_init();
+  expect_single_log_msg_containing("ignoring unreadable checkpoint");
+  teardown_capture_of_logs();
+  after = mt_stats_encode_checkpoint(&after_len);
+  tt_u64_op(after_len, OP_LT, before_len);
+
+ done:
+  teardown_capture_of_logs();
+  UNMOCK(mt_time);
+  unlink(fname);
+  tor_free(fname);
+  tor_free(before);
+  tor_free(after);
+  options->MoneTorStatistics = 0.0;
+  options->MoneTorStatisticsMiddle = 0.0;
+}
+
 struct testcase_t mt_stats_tests[] = {
   /* This test is named 'strdup'. It's implemented by the test_strdup
    * function, it has no flags, and no setup/teardown code. */
   { "mt_stats", test_mt_stats, 0, NULL, NULL },
+  { "hist_bucket", test_mt_stats_hist_bucket, 0, NULL, NULL },
+  { "sampling", test_mt_stats_sampling, TT_FORK, NULL, NULL },
+  { "positions", test_mt_stats_positions, TT_FORK, NULL, NULL },
+  { "checkpoint", test_mt_stats_checkpoint, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -168,8 +439,10 @@ static time_t mock_time(void){
 }
 
 static void mock_publish_to_disk(const char* filename, smartlist_t* time_profiles_buckets,
-				 smartlist_t* total_counts_buckets, smartlist_t* time_stdevs_buckets){
-  (void)filename;
+				 smartlist_t* total_counts_buckets, smartlist_t* time_stdevs_buckets,
+				 const uint32_t* rate_hist, const uint32_t* burst_hist,
+				 smartlist_t* inbound_counts_buckets, smartlist_t* outbound_counts_buckets){
+  strlcpy(validation_data.last_filename, filename, sizeof(validation_data.last_filename));
 
   validation_data.publish_counts++;
 
@@ -183,6 +456,16 @@ static void mock_publish_to_disk(const char* filename, smartlist_t* time_profile
   for(int i = 0; i < smartlist_len(total_counts_buckets); i++){
     validation_data.total_counts += *(double*)smartlist_get(total_counts_buckets, i) * MT_BUCKET_SIZE;
   }
+
+  for(int i = 0; i < MT_HIST_NUM_BUCKETS; i++){
+    validation_data.rate_hist_circuits += rate_hist[i];
+    validation_data.burst_hist_intervals += burst_hist[i];
+  }
+
+  for(int i = 0; i < smartlist_len(inbound_counts_buckets); i++){
+    validation_data.inbound_counts += *(double*)smartlist_get(inbound_counts_buckets, i) * MT_BUCKET_SIZE;
+    validation_data.outbound_counts += *(double*)smartlist_get(outbound_counts_buckets, i) * MT_BUCKET_SIZE;
+  }
 }
 
 static circuit_t* new_circ(void){
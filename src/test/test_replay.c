@@ -277,7 +277,7 @@ test_replaycache_scrub(void *arg)
   /* Make sure we hit the aging-out case too */
   replaycache_scrub_if_needed_internal(1500, r);
   /* Assert that we aged it */
-  tt_int_op(digest256map_size(r->digests_seen),OP_EQ, 0);
+  tt_int_op(replaycache_get_n_entries(r),OP_EQ, 0);
 
  done:
   if (r) replaycache_free(r);
@@ -371,6 +371,59 @@ test_replaycache_realtime(void *arg)
   return;
 }
 
+static void
+test_replaycache_generations(void *arg)
+{
+  replaycache_t *r = NULL;
+  char buf[32];
+  int result;
+  time_t elapsed;
+
+  (void)arg;
+  r = replaycache_new(600, 0);
+  tt_ptr_op(r, OP_NE, NULL);
+
+  /* Enough entries to make the first generation grow a few times. */
+  for (int i = 0; i < 1000; i++) {
+    tor_snprintf(buf, sizeof(buf), "item %d", i);
+    result = replaycache_add_and_test_internal(1000, r, buf, strlen(buf),
+                                               NULL);
+    tt_int_op(result, OP_EQ, 0);
+  }
+  tt_int_op(replaycache_get_n_entries(r), OP_EQ, 1000);
+  tt_int_op(smartlist_len(r->generations), OP_EQ, 1);
+
+  /* Later, they all hit and move to a new generation. */
+  for (int i = 0; i < 1000; i++) {
+    tor_snprintf(buf, sizeof(buf), "item %d", i);
+    result = replaycache_add_and_test_internal(1150 + (i % 2), r, buf,
+                                               strlen(buf), &elapsed);
+    tt_int_op(result, OP_EQ, 1);
+    tt_int_op(elapsed, OP_EQ, 150 + (i % 2));
+  }
+  tt_int_op(smartlist_len(r->generations), OP_EQ, 2);
+
+  /* A generation is dropped as a whole once its last digest has aged out. */
+  replaycache_scrub_if_needed_internal(1600, r);
+  tt_int_op(smartlist_len(r->generations), OP_EQ, 2);
+  replaycache_scrub_if_needed_internal(1601, r);
+  tt_int_op(smartlist_len(r->generations), OP_EQ, 1);
+  tt_int_op(replaycache_get_n_entries(r), OP_EQ, 1000);
+  replaycache_scrub_if_needed_internal(1751, r);
+  tt_int_op(smartlist_len(r->generations), OP_EQ, 1);
+  replaycache_scrub_if_needed_internal(1752, r);
+  tt_int_op(smartlist_len(r->generations), OP_EQ, 0);
+
+  /* Nothing is left to hit. */
+  result = replaycache_add_and_test_internal(1752, r, "item 0", 6, NULL);
+  tt_int_op(result, OP_EQ, 0);
+
+ done:
+  if (r) replaycache_free(r);
+
+  return;
+}
+
 #define REPLAYCACHE_LEGACY(name) \
   { #name, test_replaycache_ ## name , 0, NULL, NULL }
 
@@ -386,6 +439,7 @@ struct testcase_t replaycache_tests[] = {
   REPLAYCACHE_LEGACY(scrub),
   REPLAYCACHE_LEGACY(future),
   REPLAYCACHE_LEGACY(realtime),
+  REPLAYCACHE_LEGACY(generations),
   END_OF_TESTCASES
 };
 
@@ -888,9 +888,10 @@ NS(logv)(int severity, log_domain_mask_t domain, const char *funcname,
       tt_ptr_op(suffix, OP_EQ, NULL);
       tt_str_op(format, OP_EQ,
           "Average packaged cell fullness: %2.3f%%. "
-          "TLS write overhead: %.f%%");
+          "TLS write overhead: %.f%%. TLS buffer memory: %s");
       tt_double_op(fabs(va_arg(ap, double) - 50.0), OP_LE, DBL_EPSILON);
       tt_double_op(fabs(va_arg(ap, double) - 0.0), OP_LE, DBL_EPSILON);
+      tt_str_op(va_arg(ap, char *), OP_EQ, "0 kB");
       break;
     default:
       tt_abort_msg("unexpected call to logv()");  // TODO: prettyprint args
@@ -1037,9 +1038,10 @@ NS(logv)(int severity, log_domain_mask_t domain,
       tt_ptr_op(suffix, OP_EQ, NULL);
       tt_str_op(format, OP_EQ,
           "Average packaged cell fullness: %2.3f%%. "
-          "TLS write overhead: %.f%%");
+          "TLS write overhead: %.f%%. TLS buffer memory: %s");
       tt_int_op(fabs(va_arg(ap, double) - 100.0) <= DBL_EPSILON, OP_EQ, 1);
       tt_double_op(fabs(va_arg(ap, double) - 100.0), OP_LE, DBL_EPSILON);
+      tt_str_op(va_arg(ap, char *), OP_EQ, "0 kB");
       break;
     default:
       tt_abort_msg("unexpected call to logv()");  // TODO: prettyprint args
@@ -1172,6 +1172,82 @@ test_tortls_get_forced_write_size(void *ignored)
   tor_free(tls);
 }
 
+static void
+test_tortls_ktls_write(void *ignored)
+{
+  (void)ignored;
+  int ret;
+  tor_tls_t *tls;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  char buf[16];
+
+  tls = tor_malloc_zero(sizeof(tor_tls_t));
+  tt_int_op(tor_tls_get_ktls_flags(tls), OP_EQ, 0);
+
+  tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), OP_EQ, 0);
+  /* With kernel TLS on, we never touch the SSL object to write. */
+  tls->ssl = (SSL *) tls;
+  tls->socket = fds[0];
+  tls->state = TOR_TLS_ST_OPEN;
+  tls->ktls_send = 1;
+  tt_int_op(tor_tls_get_ktls_flags(tls), OP_EQ, TOR_TLS_KTLS_SEND);
+
+  ret = tor_tls_write(tls, "plaintext!", 10);
+  tt_int_op(ret, OP_EQ, 10);
+  tt_int_op(tls->ktls_write_count, OP_EQ, 10);
+  ret = (int) recv(fds[1], buf, sizeof(buf), 0);
+  tt_int_op(ret, OP_EQ, 10);
+  tt_mem_op(buf, OP_EQ, "plaintext!", 10);
+
+ done:
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  tor_free(tls);
+}
+
+static void
+test_tortls_release_buffers(void *ignored)
+{
+  (void)ignored;
+  SSL_CTX *ctx = NULL;
+  tor_tls_t *tls;
+  size_t before;
+
+  tls = tor_malloc_zero(sizeof(tor_tls_t));
+  ctx = SSL_CTX_new(SSLv23_method());
+  tt_assert(ctx);
+  tls->ssl = SSL_new(ctx);
+  tt_assert(tls->ssl);
+  tls->state = TOR_TLS_ST_OPEN;
+
+  /* Nothing to release until we've used the connection. */
+  tt_int_op(tor_tls_release_buffers(tls), OP_EQ, 0);
+
+  before = tor_tls_get_buffer_allocation();
+  setup_capture_of_logs(LOG_INFO);
+  tor_tls_write(tls, "abc", 3);
+  teardown_capture_of_logs();
+  tt_int_op(tls->holds_buffers, OP_EQ, 1);
+#ifdef HAVE_SSL_FREE_BUFFERS
+  tt_u64_op(tor_tls_get_buffer_allocation(), OP_GT, before);
+  tt_u64_op(tor_tls_release_buffers(tls), OP_GT, 0);
+  tt_int_op(tls->holds_buffers, OP_EQ, 0);
+  tt_u64_op(tor_tls_get_buffer_allocation(), OP_EQ, before);
+#else
+  tt_int_op(tor_tls_release_buffers(tls), OP_EQ, 0);
+#endif /* defined(HAVE_SSL_FREE_BUFFERS) */
+  tt_int_op(tor_tls_release_buffers(tls), OP_EQ, 0);
+
+ done:
+  teardown_capture_of_logs();
+  if (tls)
+    SSL_free(tls->ssl);
+  tor_free(tls);
+  SSL_CTX_free(ctx);
+}
+
 static void
 test_tortls_get_write_overhead_ratio(void *ignored)
 {
@@ -2791,6 +2867,10 @@ struct testcase_t tortls_tests[] = {
   INTRUSIVE_TEST_CASE(check_lifetime, 0),
   INTRUSIVE_TEST_CASE(get_pending_bytes, 0),
   LOCAL_TEST_CASE(get_forced_write_size, 0),
+#ifndef _WIN32
+  LOCAL_TEST_CASE(ktls_write, 0),
+#endif
+  LOCAL_TEST_CASE(release_buffers, TT_FORK),
   LOCAL_TEST_CASE(get_write_overhead_ratio, TT_FORK),
   LOCAL_TEST_CASE(used_v1_handshake, TT_FORK),
   LOCAL_TEST_CASE(get_num_server_handshakes, 0),
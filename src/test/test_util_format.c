@@ -401,6 +401,97 @@ test_util_format_encoded_size(void *arg)
   ;
 }
 
+/** Helper: Replace a random character in the <b>len</b>-byte string at
+ * <b>s</b> with a random byte, about a quarter of the time. Also lowercase
+ * about half of it, for hex. */
+static void
+mangle_encoding(char *s, size_t len, int lowercase)
+{
+  size_t i;
+  if (lowercase) {
+    for (i = crypto_rand_int((unsigned)len + 1); i < len; ++i)
+      s[i] = TOR_TOLOWER(s[i]);
+  }
+  if (len && crypto_rand_int(4) == 0) {
+    char c;
+    crypto_rand(&c, 1);
+    s[crypto_rand_int((unsigned)len)] = c;
+  }
+}
+
+/** Encode and decode random data with every codec implementation that this
+ * CPU supports, and make sure they all agree with the scalar one. */
+static void
+test_util_format_simd_crosscheck(void *arg)
+{
+  const size_t maxlen = 2048;
+  const size_t b64size = base64_encode_size(maxlen, BASE64_ENCODE_MULTILINE)
+    + 1;
+  const size_t b16size = BASE16_BUFSIZE(maxlen);
+  const int best = base_codec_set_max_level(-1);
+  uint8_t *in = tor_malloc(maxlen);
+  char *ref_enc = tor_malloc(b64size + b16size);
+  char *enc = tor_malloc(b64size + b16size);
+  char *ref_dec = tor_malloc(maxlen + 16);
+  char *dec = tor_malloc(maxlen + 16);
+  int i, level;
+  (void)arg;
+
+  for (i = 0; i < 1000; ++i) {
+    const size_t len = crypto_rand_int((unsigned)maxlen + 1);
+    const int flags = (i & 1) ? BASE64_ENCODE_MULTILINE : 0;
+    /* Sometimes leave exactly enough room, sometimes not quite enough. */
+    const size_t declen = len + 2 - crypto_rand_int(4);
+    int ref64_n, ref16_n, r;
+    crypto_rand((char*)in, len);
+
+    base_codec_set_max_level(BASE_CODEC_SCALAR);
+    ref64_n = base64_encode(ref_enc, b64size, (char*)in, len, flags);
+    tt_int_op(ref64_n, OP_GE, 0);
+    base16_encode(ref_enc + b64size, b16size, (char*)in, len);
+
+    for (level = BASE_CODEC_SCALAR + 1; level <= best; ++level) {
+      tt_int_op(base_codec_set_max_level(level), OP_EQ, level);
+      tt_int_op(base64_encode(enc, b64size, (char*)in, len, flags), OP_EQ,
+                ref64_n);
+      base16_encode(enc + b64size, b16size, (char*)in, len);
+      tt_mem_op(enc, OP_EQ, ref_enc, b64size + b16size);
+    }
+
+    /* Now decode, after (perhaps) damaging the encodings. */
+    mangle_encoding(ref_enc, ref64_n, 0);
+    ref16_n = (int)(len * 2);
+    mangle_encoding(ref_enc + b64size, ref16_n, 1);
+
+    base_codec_set_max_level(BASE_CODEC_SCALAR);
+    r = base64_decode(ref_dec, declen, ref_enc, ref64_n);
+    for (level = BASE_CODEC_SCALAR + 1; level <= best; ++level) {
+      base_codec_set_max_level(level);
+      tt_int_op(base64_decode(dec, declen, ref_enc, ref64_n), OP_EQ, r);
+      if (r >= 0)
+        tt_mem_op(dec, OP_EQ, ref_dec, r);
+    }
+
+    base_codec_set_max_level(BASE_CODEC_SCALAR);
+    r = base16_decode(ref_dec, declen, ref_enc + b64size, ref16_n);
+    for (level = BASE_CODEC_SCALAR + 1; level <= best; ++level) {
+      base_codec_set_max_level(level);
+      tt_int_op(base16_decode(dec, declen, ref_enc + b64size, ref16_n),
+                OP_EQ, r);
+      if (r >= 0)
+        tt_mem_op(dec, OP_EQ, ref_dec, r);
+    }
+  }
+
+ done:
+  base_codec_set_max_level(-1);
+  tor_free(in);
+  tor_free(ref_enc);
+  tor_free(enc);
+  tor_free(ref_dec);
+  tor_free(dec);
+}
+
 struct testcase_t util_format_tests[] = {
   { "unaligned_accessors", test_util_format_unaligned_accessors, 0,
     NULL, NULL },
@@ -414,6 +505,7 @@ struct testcase_t util_format_tests[] = {
   { "base32_decode", test_util_format_base32_decode, 0,
     NULL, NULL },
   { "encoded_size", test_util_format_encoded_size, 0, NULL, NULL },
+  { "simd_crosscheck", test_util_format_simd_crosscheck, 0, NULL, NULL },
   END_OF_TESTCASES
 };
 